@@ -1,21 +1,66 @@
 #include "whisper.h"
+#include "common.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstring>
+#include <random>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
 
 // command-line parameters
 struct whisper_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
-    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat
+    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat, 3 - whisper_full
 
     std::string model = "models/ggml-base.en.bin";
 
-    bool use_gpu    = true;
-    bool flash_attn = false;
+    bool use_gpu         = true;
+    bool flash_attn      = false;
+    bool use_extra_bufts = true;
+
+    // end-to-end benchmark (what = 3)
+    // the threads, models and beam sizes can be given as comma-separated lists to sweep over them
+    std::vector<int32_t>     threads = { n_threads };
+    std::vector<std::string> models  = { model };
+    std::vector<int32_t>     beams   = { 1 };
+
+    std::vector<std::string> fname_inp;
+
+    bool    flash_attn_sweep = false;
+    bool    extra_bufts_sweep = false;
+    int32_t n_runs           = 3;
+    float   gen_sec          = 0.0f; // seconds of generated audio to add to the corpus
+
+    std::string fname_json;
 };
 
+template <typename T>
+static std::vector<T> parse_list(const std::string & str, T (*conv)(const std::string &)) {
+    std::vector<T> result;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        result.push_back(conv(item));
+    }
+    return result;
+}
+
+static int32_t      parse_int(const std::string & s) { return std::stoi(s); }
+static std::string  parse_str(const std::string & s) { return s; }
+
 void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
 
 static bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
@@ -26,11 +71,19 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
             whisper_print_usage(argc, argv, params);
             exit(0);
         }
-        else if (arg == "-t"  || arg == "--threads")    { params.n_threads  = std::stoi(argv[++i]); }
-        else if (arg == "-m"  || arg == "--model")      { params.model      = argv[++i]; }
+        else if (arg == "-t"  || arg == "--threads")    { params.threads    = parse_list(argv[++i], parse_int); params.n_threads = params.threads[0]; }
+        else if (arg == "-m"  || arg == "--model")      { params.models     = parse_list(argv[++i], parse_str); params.model     = params.models[0];  }
         else if (arg == "-w"  || arg == "--what")       { params.what       = atoi(argv[++i]); }
         else if (arg == "-ng" || arg == "--no-gpu")     { params.use_gpu    = false; }
         else if (arg == "-fa" || arg == "--flash-attn") { params.flash_attn = true; }
+        else if (arg == "-neb" || arg == "--no-extra-bufts") { params.use_extra_bufts = false; }
+        else if (arg == "-fas"|| arg == "--fa-sweep") { params.flash_attn_sweep = true; }
+        else if (arg == "-ebs"|| arg == "--eb-sweep") { params.extra_bufts_sweep = true; }
+        else if (arg == "-bs" || arg == "--beam-size")  { params.beams      = parse_list(argv[++i], parse_int); }
+        else if (arg == "-f"  || arg == "--file")       { params.fname_inp.emplace_back(argv[++i]); }
+        else if (arg == "-r"  || arg == "--runs")       { params.n_runs     = std::stoi(argv[++i]); }
+        else if (arg == "-gs" || arg == "--gen-sec")    { params.gen_sec    = std::stof(argv[++i]); }
+        else if (arg == "-oj" || arg == "--output-json"){ params.fname_json = argv[++i]; }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params);
@@ -49,12 +102,23 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -h,       --help        [default] show this help message and exit\n");
     fprintf(stderr, "  -t N,     --threads N   [%-7d] number of threads to use during computation\n", params.n_threads);
     fprintf(stderr, "  -m FNAME, --model FNAME [%-7s] model path\n",                                  params.model.c_str());
-    fprintf(stderr, "  -w N,     --what N      [%-7d] what to benchmark:\n",                          params.what);
     fprintf(stderr, "  -ng,      --no-gpu      [%-7s] disable GPU\n",                                 params.use_gpu ? "false" : "true");
     fprintf(stderr, "  -fa,      --flash-attn  [%-7s] enable flash attention\n",                      params.flash_attn ? "true" : "false");
+    fprintf(stderr, "  -neb,     --no-extra-bufts [%-7s] do not repack the weights for the CPU\n",     params.use_extra_bufts ? "false" : "true");
+    fprintf(stderr, "  -w N,     --what N      [%-7d] what to benchmark:\n",                          params.what);
     fprintf(stderr, "                           %-7s  0 - whisper\n",                                 "");
     fprintf(stderr, "                           %-7s  1 - memcpy\n",                                  "");
     fprintf(stderr, "                           %-7s  2 - ggml_mul_mat\n",                            "");
+    fprintf(stderr, "                           %-7s  3 - whisper_full over an audio corpus\n",       "");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "whisper_full options (-w 3), -t and -m accept comma-separated lists:\n");
+    fprintf(stderr, "  -f FNAME, --file FNAME  [%-7s] WAV file to add to the corpus (can be repeated)\n", "");
+    fprintf(stderr, "  -gs N,    --gen-sec N   [%-7.1f] seconds of generated audio to add to the corpus\n", params.gen_sec);
+    fprintf(stderr, "  -bs N,    --beam-size N [%-7d] beam sizes to sweep over (1 - greedy)\n",          params.beams[0]);
+    fprintf(stderr, "  -fas,     --fa-sweep    [%-7s] run with and without flash attention\n",         params.flash_attn_sweep ? "true" : "false");
+    fprintf(stderr, "  -ebs,     --eb-sweep    [%-7s] run with and without repacked CPU weights\n",     params.extra_bufts_sweep ? "true" : "false");
+    fprintf(stderr, "  -r N,     --runs N      [%-7d] number of timed runs per file (after one warm-up run)\n", params.n_runs);
+    fprintf(stderr, "  -oj FNAME, --output-json FNAME  write the results as JSON to FNAME (\"-\" for stdout)\n");
     fprintf(stderr, "\n");
 }
 
@@ -63,8 +127,9 @@ static int whisper_bench_full(const whisper_params & params) {
 
     struct whisper_context_params cparams = whisper_context_default_params();
 
-    cparams.use_gpu    = params.use_gpu;
-    cparams.flash_attn = params.flash_attn;
+    cparams.use_gpu         = params.use_gpu;
+    cparams.flash_attn      = params.flash_attn;
+    cparams.use_extra_bufts = params.use_extra_bufts;
 
     struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
 
@@ -82,11 +147,13 @@ static int whisper_bench_full(const whisper_params & params) {
 
     if (int ret = whisper_set_mel(ctx, nullptr, 0, n_mels)) {
         fprintf(stderr, "error: failed to set mel: %d\n", ret);
+        whisper_free(ctx);
         return 3;
     }
     // heat encoder
     if (int ret = whisper_encode(ctx, 0, params.n_threads) != 0) {
         fprintf(stderr, "error: failed to encode: %d\n", ret);
+        whisper_free(ctx);
         return 4;
     }
 
@@ -96,12 +163,14 @@ static int whisper_bench_full(const whisper_params & params) {
     // prompt heat
     if (int ret = whisper_decode(ctx, tokens, 256, 0, params.n_threads) != 0) {
         fprintf(stderr, "error: failed to decode: %d\n", ret);
+        whisper_free(ctx);
         return 4;
     }
 
     // text-generation heat
     if (int ret = whisper_decode(ctx, tokens, 1, 256, params.n_threads) != 0) {
         fprintf(stderr, "error: failed to decode: %d\n", ret);
+        whisper_free(ctx);
         return 4;
     }
 
@@ -110,6 +179,7 @@ static int whisper_bench_full(const whisper_params & params) {
     // actual run
     if (int ret = whisper_encode(ctx, 0, params.n_threads) != 0) {
         fprintf(stderr, "error: failed to encode: %d\n", ret);
+        whisper_free(ctx);
         return 4;
     }
 
@@ -117,6 +187,7 @@ static int whisper_bench_full(const whisper_params & params) {
     for (int i = 0; i < 256; i++) {
         if (int ret = whisper_decode(ctx, tokens, 1, i, params.n_threads) != 0) {
             fprintf(stderr, "error: failed to decode: %d\n", ret);
+            whisper_free(ctx);
             return 4;
         }
     }
@@ -125,6 +196,7 @@ static int whisper_bench_full(const whisper_params & params) {
     for (int i = 0; i < 64; i++) {
         if (int ret = whisper_decode(ctx, tokens, 5, 0, params.n_threads) != 0) {
             fprintf(stderr, "error: failed to decode: %d\n", ret);
+            whisper_free(ctx);
             return 4;
         }
     }
@@ -133,6 +205,7 @@ static int whisper_bench_full(const whisper_params & params) {
     for (int i = 0; i < 16; i++) {
         if (int ret = whisper_decode(ctx, tokens, 256, 0, params.n_threads) != 0) {
             fprintf(stderr, "error: failed to decode: %d\n", ret);
+            whisper_free(ctx);
             return 4;
         }
     }
@@ -155,6 +228,331 @@ static int whisper_bench_full(const whisper_params & params) {
     return 0;
 }
 
+// reset the peak resident set size of the process to the current one, so that the peak can be attributed to
+// one configuration - only supported on Linux (>= 4.0), elsewhere the peak covers the lifetime of the process
+static bool reset_peak_rss() {
+#if defined(__linux__)
+    FILE * f = fopen("/proc/self/clear_refs", "w");
+    if (f == nullptr) {
+        return false;
+    }
+    const bool ok = fputs("5", f) >= 0;
+    return fclose(f) == 0 && ok;
+#else
+    return false;
+#endif
+}
+
+// peak resident set size of the process in MB
+static double get_peak_rss_mb() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        return pmc.PeakWorkingSetSize/1024.0/1024.0;
+    }
+    return 0.0;
+#else
+#if defined(__linux__)
+    // VmHWM follows reset_peak_rss(), ru_maxrss does not
+    FILE * f = fopen("/proc/self/status", "r");
+    if (f != nullptr) {
+        char line[256];
+        long hwm_kb = -1;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "VmHWM: %ld kB", &hwm_kb) == 1) {
+                break;
+            }
+        }
+        fclose(f);
+        if (hwm_kb >= 0) {
+            return hwm_kb/1024.0;
+        }
+    }
+#endif
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) {
+        return 0.0;
+    }
+#if defined(__APPLE__)
+    return ru.ru_maxrss/1024.0/1024.0; // bytes
+#else
+    return ru.ru_maxrss/1024.0;        // kB
+#endif
+#endif
+}
+
+// speech-like test signal: voiced harmonics with a syllable-rate envelope, pauses and background noise
+static std::vector<float> generate_audio(float sec) {
+    const int n_samples = (int) (sec*WHISPER_SAMPLE_RATE);
+
+    std::vector<float> pcmf32(n_samples);
+
+    std::mt19937 rng(0);
+    std::normal_distribution<float> noise(0.0f, 0.005f);
+
+    const float pi = 3.14159265358979f;
+
+    float phase = 0.0f;
+    for (int i = 0; i < n_samples; ++i) {
+        const float t = (float) i/WHISPER_SAMPLE_RATE;
+
+        // pitch glides between 100 and 200 Hz, 4 syllables per second, a pause every 5 seconds
+        const float f0  = 150.0f + 50.0f*sinf(2.0f*pi*0.3f*t);
+        const float env = std::max(0.0f, sinf(2.0f*pi*2.0f*t))*(fmodf(t, 5.0f) < 4.0f ? 1.0f : 0.0f);
+
+        phase += 2.0f*pi*f0/WHISPER_SAMPLE_RATE;
+
+        float v = 0.0f;
+        for (int h = 1; h <= 8; ++h) {
+            v += sinf(h*phase)/h;
+        }
+
+        pcmf32[i] = 0.1f*env*v + noise(rng);
+    }
+
+    return pcmf32;
+}
+
+struct bench_audio {
+    std::string        name;
+    std::vector<float> pcmf32;
+};
+
+struct bench_result {
+    std::string model;
+    bool        flash_attn;
+    bool        extra_bufts;
+    int32_t     n_threads;
+    int32_t     beam_size;
+
+    double audio_sec  = 0.0;
+    double wall_sec   = 0.0;
+    double load_ms    = 0.0;
+    double rss_peak   = 0.0; // peak RSS during the passes of the configuration
+
+    whisper_timings timings = {};
+
+    std::vector<double> window_ms;
+};
+
+struct bench_window_data {
+    std::vector<int64_t> t_begin_us;
+};
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) {
+        return 0.0;
+    }
+    std::sort(v.begin(), v.end());
+
+    // nearest-rank method
+    const int idx = (int) std::ceil(p/100.0*v.size()) - 1;
+    return v[std::min((int) v.size() - 1, std::max(0, idx))];
+}
+
+static void bench_print_json(FILE * f, const std::vector<bench_result> & results) {
+    fprintf(f, "{\n");
+    fprintf(f, "  \"system_info\": \"%s\",\n", whisper_print_system_info());
+    fprintf(f, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto & r = results[i];
+
+        fprintf(f, "    {\n");
+        fprintf(f, "      \"model\": \"%s\",\n",        r.model.c_str());
+        fprintf(f, "      \"flash_attn\": %s,\n",       r.flash_attn ? "true" : "false");
+        fprintf(f, "      \"extra_bufts\": %s,\n",      r.extra_bufts ? "true" : "false");
+        fprintf(f, "      \"n_threads\": %d,\n",        r.n_threads);
+        fprintf(f, "      \"beam_size\": %d,\n",        r.beam_size);
+        fprintf(f, "      \"audio_sec\": %.3f,\n",      r.audio_sec);
+        fprintf(f, "      \"wall_sec\": %.3f,\n",       r.wall_sec);
+        fprintf(f, "      \"rtf\": %.5f,\n",            r.audio_sec > 0.0 ? r.wall_sec/r.audio_sec : 0.0);
+        fprintf(f, "      \"load_ms\": %.2f,\n",        r.load_ms);
+        fprintf(f, "      \"sample_ms\": %.3f,\n",      r.timings.sample_ms);
+        fprintf(f, "      \"encode_ms\": %.3f,\n",      r.timings.encode_ms);
+        fprintf(f, "      \"decode_ms\": %.3f,\n",      r.timings.decode_ms);
+        fprintf(f, "      \"batchd_ms\": %.3f,\n",      r.timings.batchd_ms);
+        fprintf(f, "      \"prompt_ms\": %.3f,\n",      r.timings.prompt_ms);
+        fprintf(f, "      \"n_windows\": %zu,\n",       r.window_ms.size());
+        fprintf(f, "      \"window_p50_ms\": %.2f,\n",  percentile(r.window_ms, 50.0));
+        fprintf(f, "      \"window_p95_ms\": %.2f,\n",  percentile(r.window_ms, 95.0));
+        fprintf(f, "      \"window_p99_ms\": %.2f,\n",  percentile(r.window_ms, 99.0));
+        fprintf(f, "      \"rss_peak_mb\": %.2f\n",     r.rss_peak);
+        fprintf(f, "    }%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+}
+
+static int whisper_bench_e2e(const whisper_params & params) {
+    std::vector<bench_audio> corpus;
+
+    for (const auto & fname : params.fname_inp) {
+        bench_audio audio = { fname, {} };
+        std::vector<std::vector<float>> pcmf32s;
+
+        if (!::read_wav(fname, audio.pcmf32, pcmf32s, false)) {
+            fprintf(stderr, "error: failed to read WAV file '%s'\n", fname.c_str());
+            return 5;
+        }
+
+        corpus.push_back(std::move(audio));
+    }
+
+    if (params.gen_sec > 0.0f) {
+        corpus.push_back({ "generated", generate_audio(params.gen_sec) });
+    }
+
+    if (corpus.empty()) {
+        fprintf(stderr, "error: no audio - use -f FNAME or -gs N\n");
+        return 5;
+    }
+
+    double audio_sec = 0.0;
+    for (const auto & audio : corpus) {
+        audio_sec += (double) audio.pcmf32.size()/WHISPER_SAMPLE_RATE;
+    }
+
+    fprintf(stderr, "%s: corpus of %zu files, %.2f sec of audio\n", __func__, corpus.size(), audio_sec);
+
+    std::vector<bool> fa_values = { params.flash_attn };
+    if (params.flash_attn_sweep) {
+        fa_values = { false, true };
+    }
+
+    std::vector<bool> eb_values = { params.use_extra_bufts };
+    if (params.extra_bufts_sweep) {
+        eb_values = { false, true };
+    }
+
+    std::vector<bench_result> results;
+
+    if (!reset_peak_rss()) {
+        fprintf(stderr, "%s: warning: cannot reset the peak RSS on this system - it covers all the configurations run so far\n", __func__);
+    }
+
+    for (const auto & model : params.models) {
+        for (const bool flash_attn : fa_values) {
+            for (const bool extra_bufts : eb_values) {
+                struct whisper_context_params cparams = whisper_context_default_params();
+
+                cparams.use_gpu         = params.use_gpu;
+                cparams.flash_attn      = flash_attn;
+                cparams.use_extra_bufts = extra_bufts;
+
+                const int64_t t_load_start_us = ggml_time_us();
+
+                struct whisper_context * ctx = whisper_init_from_file_with_params(model.c_str(), cparams);
+                if (ctx == nullptr) {
+                    fprintf(stderr, "error: failed to initialize whisper context for '%s'\n", model.c_str());
+                    return 2;
+                }
+
+                const double load_ms = (ggml_time_us() - t_load_start_us)/1000.0;
+
+                for (const int32_t n_threads : params.threads) {
+                    for (const int32_t beam_size : params.beams) {
+                        whisper_full_params wparams = whisper_full_default_params(beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+
+                        wparams.n_threads        = n_threads;
+                        wparams.print_progress   = false;
+                        wparams.print_realtime   = false;
+                        wparams.print_timestamps = false;
+                        wparams.beam_search.beam_size = beam_size;
+
+                        // record the start of each 30 s window to measure the per-window latency
+                        bench_window_data wdata;
+
+                        wparams.encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
+                            static_cast<bench_window_data *>(user_data)->t_begin_us.push_back(ggml_time_us());
+                            return true;
+                        };
+                        wparams.encoder_begin_callback_user_data = &wdata;
+
+                        bench_result result;
+
+                        result.model      = model;
+                        result.flash_attn  = flash_attn;
+                        result.extra_bufts = extra_bufts;
+                        result.n_threads  = n_threads;
+                        result.beam_size  = beam_size;
+                        result.load_ms    = load_ms;
+
+                        // the model is resident, the peak covers the compute of this configuration
+                        reset_peak_rss();
+
+                        // warm-up
+                        if (whisper_full(ctx, wparams, corpus[0].pcmf32.data(), corpus[0].pcmf32.size()) != 0) {
+                            fprintf(stderr, "error: failed to process '%s'\n", corpus[0].name.c_str());
+                            whisper_free(ctx);
+                            return 4;
+                        }
+
+                        whisper_reset_timings(ctx);
+
+                        for (int run = 0; run < params.n_runs; ++run) {
+                            for (const auto & audio : corpus) {
+                                wdata.t_begin_us.clear();
+
+                                const int64_t t_start_us = ggml_time_us();
+
+                                if (whisper_full(ctx, wparams, audio.pcmf32.data(), audio.pcmf32.size()) != 0) {
+                                    fprintf(stderr, "error: failed to process '%s'\n", audio.name.c_str());
+                                    whisper_free(ctx);
+                                    return 4;
+                                }
+
+                                const int64_t t_end_us = ggml_time_us();
+
+                                for (size_t i = 0; i < wdata.t_begin_us.size(); ++i) {
+                                    const int64_t t1 = i + 1 < wdata.t_begin_us.size() ? wdata.t_begin_us[i + 1] : t_end_us;
+                                    result.window_ms.push_back((t1 - wdata.t_begin_us[i])/1000.0);
+                                }
+
+                                result.wall_sec  += (t_end_us - t_start_us)/1e6;
+                                result.audio_sec += (double) audio.pcmf32.size()/WHISPER_SAMPLE_RATE;
+                            }
+                        }
+
+                        whisper_timings * timings = whisper_get_timings(ctx);
+                        if (timings) {
+                            result.timings = *timings;
+                            delete timings;
+                        }
+
+                        result.rss_peak = get_peak_rss_mb();
+
+                        fprintf(stderr, "%s: model = %s, fa = %d, eb = %d, threads = %2d, beam = %d: RTF = %.4f, window p50/p95/p99 = %.1f/%.1f/%.1f ms, peak RSS = %.1f MB\n",
+                                __func__, model.c_str(), flash_attn, extra_bufts, n_threads, beam_size,
+                                result.wall_sec/result.audio_sec,
+                                percentile(result.window_ms, 50.0), percentile(result.window_ms, 95.0), percentile(result.window_ms, 99.0),
+                                result.rss_peak);
+
+                        results.push_back(std::move(result));
+                    }
+                }
+
+                whisper_free(ctx);
+            }
+        }
+    }
+
+    if (!params.fname_json.empty()) {
+        FILE * f = params.fname_json == "-" ? stdout : fopen(params.fname_json.c_str(), "w");
+        if (f == nullptr) {
+            fprintf(stderr, "error: failed to open '%s' for writing\n", params.fname_json.c_str());
+            return 6;
+        }
+
+        bench_print_json(f, results);
+
+        if (f != stdout) {
+            fclose(f);
+        }
+    }
+
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     whisper_params params;
 
@@ -168,6 +566,7 @@ int main(int argc, char ** argv) {
         case 0: ret = whisper_bench_full(params);                break;
         case 1: ret = whisper_bench_memcpy(params.n_threads);       break;
         case 2: ret = whisper_bench_ggml_mul_mat(params.n_threads); break;
+        case 3: ret = whisper_bench_e2e(params);                 break;
         default: fprintf(stderr, "error: unknown benchmark: %d\n", params.what); break;
     }
 
@@ -2,10 +2,16 @@
 
 #include "whisper.h"
 #include "grammar-parser.h"
+#include "common-ggml.h"
 
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <cstdio>
+#include <mutex>
 #include <regex>
 #include <string>
 #include <thread>
@@ -35,6 +41,7 @@ static void replace_all(std::string & s, const std::string & search, const std::
 struct whisper_params {
     int32_t n_threads     = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t n_processors  = 1;
+    int32_t n_jobs        = 1;
     int32_t offset_t_ms   = 0;
     int32_t offset_n      = 0;
     int32_t duration_ms   = 0;
@@ -94,6 +101,23 @@ struct whisper_params {
     std::string openvino_encode_device = "CPU";
 
     std::string dtw = "";
+    int32_t     dtw_band = 0;
+
+    std::string cache_type_k = "f16";
+    std::string cache_type_v = "f16";
+
+    // per-op profile (Chrome trace JSON)
+    std::string fname_profile = "";
+
+    // thread placement
+    std::string numa     = "";
+    std::string cpu_mask = "";
+    bool        cpu_strict = false;
+    int32_t     prio       = 0;
+    int32_t     poll       = 50;
+
+    // comma-separated ggml-rpc servers (host:port)
+    std::string rpc_servers = "";
 
     std::vector<std::string> fname_inp = {};
     std::vector<std::string> fname_out = {};
@@ -137,6 +161,7 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         #define ARGV_NEXT (((i + 1) < argc) ? argv[++i] : requires_value_error(arg))
         else if (arg == "-t"    || arg == "--threads")         { params.n_threads       = std::stoi(ARGV_NEXT); }
         else if (arg == "-p"    || arg == "--processors")      { params.n_processors    = std::stoi(ARGV_NEXT); }
+        else if (arg == "-j"    || arg == "--jobs")            { params.n_jobs          = std::stoi(ARGV_NEXT); }
         else if (arg == "-ot"   || arg == "--offset-t")        { params.offset_t_ms     = std::stoi(ARGV_NEXT); }
         else if (arg == "-on"   || arg == "--offset-n")        { params.offset_n        = std::stoi(ARGV_NEXT); }
         else if (arg == "-d"    || arg == "--duration")        { params.duration_ms     = std::stoi(ARGV_NEXT); }
@@ -179,9 +204,19 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-f"    || arg == "--file")            { params.fname_inp.emplace_back(ARGV_NEXT); }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = ARGV_NEXT; }
         else if (arg == "-dtw"  || arg == "--dtw")             { params.dtw             = ARGV_NEXT; }
+        else if (arg == "-dtwb" || arg == "--dtw-band")        { params.dtw_band        = std::stoi(ARGV_NEXT); }
         else if (arg == "-ls"   || arg == "--log-score")       { params.log_score       = true; }
         else if (arg == "-ng"   || arg == "--no-gpu")          { params.use_gpu         = false; }
         else if (arg == "-fa"   || arg == "--flash-attn")      { params.flash_attn      = true; }
+        else if (arg == "-ctk"  || arg == "--cache-type-k")    { params.cache_type_k    = ARGV_NEXT; }
+        else if (arg == "-ctv"  || arg == "--cache-type-v")    { params.cache_type_v    = ARGV_NEXT; }
+        else if (arg == "-prof" || arg == "--profile")         { params.fname_profile   = ARGV_NEXT; }
+        else if (                  arg == "--numa")            { params.numa            = ARGV_NEXT; }
+        else if (arg == "-C"    || arg == "--cpu-mask")        { params.cpu_mask        = ARGV_NEXT; }
+        else if (                  arg == "--cpu-strict")      { params.cpu_strict      = true; }
+        else if (                  arg == "--prio")            { params.prio            = std::stoi(ARGV_NEXT); }
+        else if (                  arg == "--poll")            { params.poll            = std::stoi(ARGV_NEXT); }
+        else if (                  arg == "--rpc")             { params.rpc_servers     = ARGV_NEXT; }
         else if (arg == "-sns"  || arg == "--suppress-nst")    { params.suppress_nst    = true; }
         else if (                  arg == "--suppress-regex")  { params.suppress_regex  = ARGV_NEXT; }
         else if (                  arg == "--grammar")         { params.grammar         = ARGV_NEXT; }
@@ -205,6 +240,7 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "  -h,        --help              [default] show this help message and exit\n");
     fprintf(stderr, "  -t N,      --threads N         [%-7d] number of threads to use during computation\n",    params.n_threads);
     fprintf(stderr, "  -p N,      --processors N      [%-7d] number of processors to use during computation\n", params.n_processors);
+    fprintf(stderr, "  -j N,      --jobs N            [%-7d] number of files to transcribe concurrently, each with -t threads\n", params.n_jobs);
     fprintf(stderr, "  -ot N,     --offset-t N        [%-7d] time offset in milliseconds\n",                    params.offset_t_ms);
     fprintf(stderr, "  -on N,     --offset-n N        [%-7d] segment index offset\n",                           params.offset_n);
     fprintf(stderr, "  -d  N,     --duration N        [%-7d] duration of audio to process in milliseconds\n",   params.duration_ms);
@@ -247,9 +283,19 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "  -f FNAME,  --file FNAME        [%-7s] input WAV file path\n",                            "");
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
     fprintf(stderr, "  -dtw MODEL --dtw MODEL         [%-7s] compute token-level timestamps\n",                 params.dtw.c_str());
+    fprintf(stderr, "  -dtwb N,   --dtw-band N        [%-7d] DTW band around the diagonal in 20 ms frames (0 - full)\n", params.dtw_band);
     fprintf(stderr, "  -ls,       --log-score         [%-7s] log best decoder scores of tokens\n",              params.log_score?"true":"false");
     fprintf(stderr, "  -ng,       --no-gpu            [%-7s] disable GPU\n",                                    params.use_gpu ? "false" : "true");
     fprintf(stderr, "  -fa,       --flash-attn        [%-7s] flash attention\n",                                params.flash_attn ? "true" : "false");
+    fprintf(stderr, "  -ctk TYPE, --cache-type-k TYPE [%-7s] KV cache data type for K (f16, q8_0, q4_0)\n",    params.cache_type_k.c_str());
+    fprintf(stderr, "  -ctv TYPE, --cache-type-v TYPE [%-7s] KV cache data type for V (requires -fa if quantized)\n", params.cache_type_v.c_str());
+    fprintf(stderr, "  -prof FNAME, --profile FNAME   [%-7s] profile each op and write a Chrome trace to FNAME (FNAME.N per job with -j)\n", params.fname_profile.c_str());
+    fprintf(stderr, "  --numa TYPE                    [%-7s] NUMA strategy (distribute, isolate, numactl, mirror)\n", params.numa.c_str());
+    fprintf(stderr, "  -C M,      --cpu-mask M        [%-7s] CPU affinity mask in hex, bit i - CPU i (default: all)\n", params.cpu_mask.c_str());
+    fprintf(stderr, "             --cpu-strict        [%-7s] pin each thread to a single CPU of the mask\n",   params.cpu_strict ? "true" : "false");
+    fprintf(stderr, "             --prio N            [%-7d] thread priority (0 - normal, 1 - medium, 2 - high, 3 - realtime)\n", params.prio);
+    fprintf(stderr, "             --poll N            [%-7d] polling level of idle threads (0 - no polling, 100 - aggressive)\n", params.poll);
+    fprintf(stderr, "  --rpc SERVERS                  [%-7s] comma-separated RPC servers (host:port), one per processor\n", params.rpc_servers.c_str());
     fprintf(stderr, "  -sns,      --suppress-nst      [%-7s] suppress non-speech tokens\n",                     params.suppress_nst ? "true" : "false");
     fprintf(stderr, "  --suppress-regex REGEX         [%-7s] regular expression matching tokens to suppress\n", params.suppress_regex.c_str());
     fprintf(stderr, "  --grammar GRAMMAR              [%-7s] GBNF grammar to guide decoding\n",                 params.grammar.c_str());
@@ -258,27 +304,127 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "\n");
 }
 
+// hex CPU mask, the least significant bit is CPU 0
+static bool parse_cpu_mask(const std::string & mask, bool (&cpumask)[GGML_MAX_N_THREADS]) {
+    size_t start = 0;
+    if (mask.size() >= 2 && mask[0] == '0' && (mask[1] == 'x' || mask[1] == 'X')) {
+        start = 2;
+    }
+
+    if (start == mask.size()) {
+        return false;
+    }
+
+    for (size_t i = mask.size(); i > start; i--) {
+        const char c = mask[i - 1];
+
+        int v = 0;
+        if      (c >= '0' && c <= '9') { v = c - '0'; }
+        else if (c >= 'a' && c <= 'f') { v = c - 'a' + 10; }
+        else if (c >= 'A' && c <= 'F') { v = c - 'A' + 10; }
+        else {
+            return false;
+        }
+
+        const size_t cpu = 4*(mask.size() - i);
+        for (int j = 0; j < 4 && cpu + j < GGML_MAX_N_THREADS; j++) {
+            cpumask[cpu + j] = cpumask[cpu + j] || ((v >> j) & 1);
+        }
+    }
+
+    return true;
+}
+
+// the stereo channels for --diarize, with the prefix sums of their energy over 10 ms blocks - the resolution of
+// the segment timestamps - so that the speaker of a segment is estimated without rescanning its samples
+struct whisper_stereo {
+    static const int64_t n_block = WHISPER_SAMPLE_RATE/100;
+
+    std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
+
+    std::vector<double> energy[2]; // energy[c][b] - sum of fabs() over the first b blocks of channel c
+
+    void build() {
+        if (pcmf32s.size() != 2) {
+            return;
+        }
+
+        const int64_t n_blocks = pcmf32s[0].size()/n_block;
+
+        for (int c = 0; c < 2; ++c) {
+            const float * x = pcmf32s[c].data();
+
+            energy[c].resize(n_blocks + 1);
+            energy[c][0] = 0.0;
+
+            for (int64_t b = 0; b < n_blocks; ++b) {
+                double sum = 0.0;
+                for (int64_t j = b*n_block; j < (b + 1)*n_block; ++j) {
+                    sum += fabs(x[j]);
+                }
+                energy[c][b + 1] = energy[c][b] + sum;
+            }
+        }
+    }
+
+    // sum of fabs() over the samples [is0, is1) of channel c
+    double get_energy(int c, int64_t is0, int64_t is1) const {
+        const float * x = pcmf32s[c].data();
+
+        const int64_t b0 = (is0 + n_block - 1)/n_block;
+        const int64_t b1 = std::max(b0, is1/n_block);
+
+        if (b0*n_block >= is1) {
+            double sum = 0.0;
+            for (int64_t j = is0; j < is1; ++j) {
+                sum += fabs(x[j]);
+            }
+            return sum;
+        }
+
+        // the partial blocks at the edges - only when the segment is clamped to the end of the audio
+        double sum = energy[c][b1] - energy[c][b0];
+        for (int64_t j = is0; j < b0*n_block; ++j) {
+            sum += fabs(x[j]);
+        }
+        for (int64_t j = b1*n_block; j < is1; ++j) {
+            sum += fabs(x[j]);
+        }
+
+        return sum;
+    }
+};
+
+// one input file - read ahead of the transcription by the I/O thread of --jobs
+struct whisper_input {
+    std::string fname_inp;
+    std::string fname_out;
+
+    std::vector<float> pcmf32; // mono-channel F32 PCM
+    whisper_stereo     stereo;
+};
+
+struct whisper_output_files;
+
 struct whisper_print_user_data {
     const whisper_params * params;
 
-    const std::vector<std::vector<float>> * pcmf32s;
+    const whisper_stereo * stereo;
     int progress_prev;
+
+    whisper_output_files * outputs;
+    bool print; // print the segments to stdout as they are decoded
 };
 
-static std::string estimate_diarization_speaker(std::vector<std::vector<float>> pcmf32s, int64_t t0, int64_t t1, bool id_only = false) {
+static std::string estimate_diarization_speaker(const whisper_stereo & stereo, int64_t t0, int64_t t1, bool id_only = false) {
     std::string speaker = "";
-    const int64_t n_samples = pcmf32s[0].size();
+    const int64_t n_samples = stereo.pcmf32s[0].size();
 
     const int64_t is0 = timestamp_to_sample(t0, n_samples, WHISPER_SAMPLE_RATE);
     const int64_t is1 = timestamp_to_sample(t1, n_samples, WHISPER_SAMPLE_RATE);
 
-    double energy0 = 0.0f;
-    double energy1 = 0.0f;
-
-    for (int64_t j = is0; j < is1; j++) {
-        energy0 += fabs(pcmf32s[0][j]);
-        energy1 += fabs(pcmf32s[1][j]);
-    }
+    const double energy0 = is0 < is1 ? stereo.get_energy(0, is0, is1) : 0.0;
+    const double energy1 = is0 < is1 ? stereo.get_energy(1, is0, is1) : 0.0;
 
     if (energy0 > 1.1*energy1) {
         speaker = "0";
@@ -298,6 +444,51 @@ static std::string estimate_diarization_speaker(std::vector<std::vector<float>>
     return speaker;
 }
 
+// the results of a state, or of the default state of the context when state == nullptr (whisper_full_parallel)
+static int full_n_segments(struct whisper_context * ctx, struct whisper_state * state) {
+    return state ? whisper_full_n_segments_from_state(state) : whisper_full_n_segments(ctx);
+}
+
+static int full_lang_id(struct whisper_context * ctx, struct whisper_state * state) {
+    return state ? whisper_full_lang_id_from_state(state) : whisper_full_lang_id(ctx);
+}
+
+static int64_t full_get_segment_t0(struct whisper_context * ctx, struct whisper_state * state, int i_segment) {
+    return state ? whisper_full_get_segment_t0_from_state(state, i_segment) : whisper_full_get_segment_t0(ctx, i_segment);
+}
+
+static int64_t full_get_segment_t1(struct whisper_context * ctx, struct whisper_state * state, int i_segment) {
+    return state ? whisper_full_get_segment_t1_from_state(state, i_segment) : whisper_full_get_segment_t1(ctx, i_segment);
+}
+
+static bool full_get_segment_speaker_turn_next(struct whisper_context * ctx, struct whisper_state * state, int i_segment) {
+    return state ? whisper_full_get_segment_speaker_turn_next_from_state(state, i_segment) : whisper_full_get_segment_speaker_turn_next(ctx, i_segment);
+}
+
+static const char * full_get_segment_text(struct whisper_context * ctx, struct whisper_state * state, int i_segment) {
+    return state ? whisper_full_get_segment_text_from_state(state, i_segment) : whisper_full_get_segment_text(ctx, i_segment);
+}
+
+static int full_n_tokens(struct whisper_context * ctx, struct whisper_state * state, int i_segment) {
+    return state ? whisper_full_n_tokens_from_state(state, i_segment) : whisper_full_n_tokens(ctx, i_segment);
+}
+
+static const char * full_get_token_text(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
+    return state ? whisper_full_get_token_text_from_state(ctx, state, i_segment, i_token) : whisper_full_get_token_text(ctx, i_segment, i_token);
+}
+
+static whisper_token full_get_token_id(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
+    return state ? whisper_full_get_token_id_from_state(state, i_segment, i_token) : whisper_full_get_token_id(ctx, i_segment, i_token);
+}
+
+static whisper_token_data full_get_token_data(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
+    return state ? whisper_full_get_token_data_from_state(state, i_segment, i_token) : whisper_full_get_token_data(ctx, i_segment, i_token);
+}
+
+static float full_get_token_p(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
+    return state ? whisper_full_get_token_p_from_state(state, i_segment, i_token) : whisper_full_get_token_p(ctx, i_segment, i_token);
+}
+
 static void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, int progress, void * user_data) {
     int progress_step = ((whisper_print_user_data *) user_data)->params->progress_step;
     int * progress_prev  = &(((whisper_print_user_data *) user_data)->progress_prev);
@@ -307,11 +498,11 @@ static void whisper_print_progress_callback(struct whisper_context * /*ctx*/, st
     }
 }
 
-static void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
+static void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
-    const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
+    const auto & stereo  = *((whisper_print_user_data *) user_data)->stereo;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = full_n_segments(ctx, state);
 
     std::string speaker = "";
 
@@ -327,42 +518,42 @@ static void whisper_print_segment_callback(struct whisper_context * ctx, struct
 
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = full_get_segment_t0(ctx, state, i);
+            t1 = full_get_segment_t1(ctx, state, i);
         }
 
         if (!params.no_timestamps) {
             printf("[%s --> %s]  ", to_timestamp(t0).c_str(), to_timestamp(t1).c_str());
         }
 
-        if (params.diarize && pcmf32s.size() == 2) {
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+        if (params.diarize && stereo.pcmf32s.size() == 2) {
+            speaker = estimate_diarization_speaker(stereo, t0, t1);
         }
 
         if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < full_n_tokens(ctx, state, i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                    const whisper_token id = full_get_token_id(ctx, state, i, j);
                     if (id >= whisper_token_eot(ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = full_get_token_text(ctx, state, i, j);
+                const float  p    = full_get_token_p(ctx, state, i, j);
 
                 const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
 
                 printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
             }
         } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = full_get_segment_text(ctx, state, i);
 
             printf("%s%s", speaker.c_str(), text);
         }
 
         if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+            if (full_get_segment_speaker_turn_next(ctx, state, i)) {
                 printf("%s", params.tdrz_speaker_turn.c_str());
             }
         }
@@ -376,94 +567,6 @@ static void whisper_print_segment_callback(struct whisper_context * ctx, struct
     }
 }
 
-static bool output_txt(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
-    if (!fout.is_open()) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
-        return false;
-    }
-
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
-
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        std::string speaker = "";
-
-        if (params.diarize && pcmf32s.size() == 2)
-        {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
-        }
-
-        fout << speaker << text << "\n";
-    }
-
-    return true;
-}
-
-static bool output_vtt(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
-    if (!fout.is_open()) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
-        return false;
-    }
-
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
-
-    fout << "WEBVTT\n\n";
-
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-        std::string speaker = "";
-
-        if (params.diarize && pcmf32s.size() == 2)
-        {
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1, true);
-            speaker.insert(0, "<v Speaker");
-            speaker.append(">");
-        }
-
-        fout << to_timestamp(t0) << " --> " << to_timestamp(t1) << "\n";
-        fout << speaker << text << "\n\n";
-    }
-
-    return true;
-}
-
-static bool output_srt(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
-    if (!fout.is_open()) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
-        return false;
-    }
-
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
-
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-        std::string speaker = "";
-
-        if (params.diarize && pcmf32s.size() == 2)
-        {
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
-        }
-
-        fout << i + 1 + params.offset_n << "\n";
-        fout << to_timestamp(t0, true) << " --> " << to_timestamp(t1, true) << "\n";
-        fout << speaker << text << "\n\n";
-    }
-
-    return true;
-}
-
 static char * escape_double_quotes_and_backslashes(const char * str) {
     if (str == NULL) {
         return NULL;
@@ -527,86 +630,28 @@ static char * escape_double_quotes_in_csv(const char * str) {
     return escaped;
 }
 
-static bool output_csv(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
-    if (!fout.is_open()) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
-        return false;
-    }
-
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
-
-    const int n_segments = whisper_full_n_segments(ctx);
-    fout << "start,end,";
-    if (params.diarize && pcmf32s.size() == 2)
-    {
-        fout << "speaker,";
-    }
-    fout << "text\n";
-
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-        char * text_escaped = escape_double_quotes_in_csv(text);
-
-        //need to multiply times returned from whisper_full_get_segment_t{0,1}() by 10 to get milliseconds.
-        fout << 10 * t0 << "," << 10 * t1 << ",";
-        if (params.diarize && pcmf32s.size() == 2)
-        {
-            fout << estimate_diarization_speaker(pcmf32s, t0, t1, true) << ",";
-        }
-        fout << "\"" << text_escaped << "\"\n";
-    }
-
-    return true;
-}
-
-static bool output_score(struct whisper_context * ctx, const char * fname, const whisper_params & /*params*/, std::vector<std::vector<float>> /*pcmf32s*/) {
-    std::ofstream fout(fname);
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
-
-    const int n_segments = whisper_full_n_segments(ctx);
-    // fprintf(stderr,"segments: %d\n",n_segments);
-    for (int i = 0; i < n_segments; ++i) {
-        const int n_tokens = whisper_full_n_tokens(ctx, i);
-        // fprintf(stderr,"tokens: %d\n",n_tokens);
-        for (int j = 0; j < n_tokens; j++) {
-            auto token = whisper_full_get_token_text(ctx, i, j);
-            auto probability = whisper_full_get_token_p(ctx, i, j);
-            fout << token << '\t' << probability << std::endl;
-            // fprintf(stderr,"token: %s %f\n",token,probability);
-	    }
-    }
-    return true;
-}
-
-static bool output_json(
-             struct whisper_context * ctx,
-                         const char * fname,
-               const whisper_params & params,
-    std::vector<std::vector<float>>   pcmf32s,
-                               bool   full) {
-    std::ofstream fout(fname);
+// the indentation is kept across the streamed segments
+struct json_writer {
+    std::ofstream fout;
     int indent = 0;
 
-    auto doindent = [&]() {
+    void doindent() {
         for (int i = 0; i < indent; i++) fout << "\t";
-    };
+    }
 
-    auto start_arr = [&](const char *name) {
+    void start_arr(const char * name) {
         doindent();
         fout << "\"" << name << "\": [\n";
         indent++;
-    };
+    }
 
-    auto end_arr = [&](bool end) {
+    void end_arr(bool end) {
         indent--;
         doindent();
         fout << (end ? "]\n" : "],\n");
-    };
+    }
 
-    auto start_obj = [&](const char *name) {
+    void start_obj(const char * name) {
         doindent();
         if (name) {
             fout << "\"" << name << "\": {\n";
@@ -614,49 +659,56 @@ static bool output_json(
             fout << "{\n";
         }
         indent++;
-    };
+    }
 
-    auto end_obj = [&](bool end) {
+    void end_obj(bool end) {
         indent--;
         doindent();
         fout << (end ? "}\n" : "},\n");
-    };
+    }
 
-    auto start_value = [&](const char *name) {
+    // array element - the separator is written before the next element, or the newline at the end of the array
+    void end_elem() {
+        indent--;
+        doindent();
+        fout << "}";
+    }
+
+    void start_value(const char * name) {
         doindent();
         fout << "\"" << name << "\": ";
-    };
+    }
+
+    void end_value(bool end) {
+        fout << (end ? "\n" : ",\n");
+    }
 
-    auto value_s = [&](const char *name, const char *val, bool end) {
+    void value_s(const char * name, const char * val, bool end) {
         start_value(name);
         char * val_escaped = escape_double_quotes_and_backslashes(val);
         fout << "\"" << val_escaped << (end ? "\"\n" : "\",\n");
         free(val_escaped);
-    };
-
-    auto end_value = [&](bool end) {
-        fout << (end ? "\n" : ",\n");
-    };
+    }
 
-    auto value_i = [&](const char *name, const int64_t val, bool end) {
+    void value_i(const char * name, const int64_t val, bool end) {
         start_value(name);
         fout << val;
         end_value(end);
-    };
+    }
 
-    auto value_f = [&](const char *name, const float val, bool end) {
+    void value_f(const char * name, const float val, bool end) {
         start_value(name);
         fout << val;
         end_value(end);
-    };
+    }
 
-    auto value_b = [&](const char *name, const bool val, bool end) {
+    void value_b(const char * name, const bool val, bool end) {
         start_value(name);
         fout << (val ? "true" : "false");
         end_value(end);
-    };
+    }
 
-    auto times_o = [&](int64_t t0, int64_t t1, bool end) {
+    void times_o(int64_t t0, int64_t t1, bool end) {
         start_obj("timestamps");
         value_s("from", to_timestamp(t0, true).c_str(), false);
         value_s("to", to_timestamp(t1, true).c_str(), true);
@@ -665,99 +717,222 @@ static bool output_json(
         value_i("from", t0 * 10, false);
         value_i("to", t1 * 10, true);
         end_obj(end);
-    };
+    }
+};
+
+// the output files are opened before the transcription and appended to from the new_segment_callback,
+// so nothing is serialized from the whole result at the end
+struct whisper_output_files {
+    std::ofstream txt;
+    std::ofstream vtt;
+    std::ofstream srt;
+    std::ofstream wts;
+    std::ofstream csv;
+    json_writer   jsn;
+    std::ofstream lrc;
+    std::ofstream score;
+
+    std::string fname_inp; // for the karaoke script
+    std::string fname_wts;
+    std::string font;
+    float       t_sec = 0.0f;
+
+    bool started    = false; // headers written
+    int  n_segments = 0;     // segments written so far
+};
 
+static bool output_open(std::ofstream & fout, const std::string & fname, const char * func) {
+    fout.open(fname);
     if (!fout.is_open()) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", func, fname.c_str());
         return false;
     }
 
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
-    start_obj(nullptr);
-        value_s("systeminfo", whisper_print_system_info(), false);
-        start_obj("model");
-            value_s("type", whisper_model_type_readable(ctx), false);
-            value_b("multilingual", whisper_is_multilingual(ctx), false);
-            value_i("vocab", whisper_model_n_vocab(ctx), false);
-            start_obj("audio");
-                value_i("ctx", whisper_model_n_audio_ctx(ctx), false);
-                value_i("state", whisper_model_n_audio_state(ctx), false);
-                value_i("head", whisper_model_n_audio_head(ctx), false);
-                value_i("layer", whisper_model_n_audio_layer(ctx), true);
-            end_obj(false);
-            start_obj("text");
-                value_i("ctx", whisper_model_n_text_ctx(ctx), false);
-                value_i("state", whisper_model_n_text_state(ctx), false);
-                value_i("head", whisper_model_n_text_head(ctx), false);
-                value_i("layer", whisper_model_n_text_layer(ctx), true);
-            end_obj(false);
-            value_i("mels", whisper_model_n_mels(ctx), false);
-            value_i("ftype", whisper_model_ftype(ctx), true);
-        end_obj(false);
-        start_obj("params");
-            value_s("model", params.model.c_str(), false);
-            value_s("language", params.language.c_str(), false);
-            value_b("translate", params.translate, true);
-        end_obj(false);
-        start_obj("result");
-            value_s("language", whisper_lang_str(whisper_full_lang_id(ctx)), true);
-        end_obj(false);
-        start_arr("transcription");
-
-            const int n_segments = whisper_full_n_segments(ctx);
-            for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-
-                start_obj(nullptr);
-                    times_o(t0, t1, false);
-                    value_s("text", text, !params.diarize && !params.tinydiarize && !full);
-
-                    if (full) {
-                        start_arr("tokens");
-                        const int n = whisper_full_n_tokens(ctx, i);
-                        for (int j = 0; j < n; ++j) {
-                            auto token = whisper_full_get_token_data(ctx, i, j);
-                            start_obj(nullptr);
-                                value_s("text", whisper_token_to_str(ctx, token.id), false);
-                                if(token.t0 > -1 && token.t1 > -1) {
-                                    // If we have per-token timestamps, write them out
-                                    times_o(token.t0, token.t1, false);
-                                }
-                                value_i("id", token.id, false);
-                                value_f("p", token.p, false);
-                                value_f("t_dtw", token.t_dtw, true);
-                            end_obj(j == (n - 1));
-                        }
-                        end_arr(!params.diarize && !params.tinydiarize);
-                    }
+    fprintf(stderr, "%s: saving output to '%s'\n", func, fname.c_str());
 
-                    if (params.diarize && pcmf32s.size() == 2) {
-                        value_s("speaker", estimate_diarization_speaker(pcmf32s, t0, t1, true).c_str(), true);
-                    }
+    return true;
+}
+
+static void output_txt(struct whisper_context * ctx, struct whisper_state * state, std::ofstream & fout, const whisper_params & params, const whisper_stereo & stereo, int i) {
+    const char * text = full_get_segment_text(ctx, state, i);
+    std::string speaker = "";
+
+    if (params.diarize && stereo.pcmf32s.size() == 2)
+    {
+        const int64_t t0 = full_get_segment_t0(ctx, state, i);
+        const int64_t t1 = full_get_segment_t1(ctx, state, i);
+        speaker = estimate_diarization_speaker(stereo, t0, t1);
+    }
+
+    fout << speaker << text << "\n";
+}
 
-                    if (params.tinydiarize) {
-                        value_b("speaker_turn_next", whisper_full_get_segment_speaker_turn_next(ctx, i), true);
+static void output_vtt(struct whisper_context * ctx, struct whisper_state * state, std::ofstream & fout, const whisper_params & params, const whisper_stereo & stereo, int i) {
+    const char * text = full_get_segment_text(ctx, state, i);
+    const int64_t t0 = full_get_segment_t0(ctx, state, i);
+    const int64_t t1 = full_get_segment_t1(ctx, state, i);
+    std::string speaker = "";
+
+    if (params.diarize && stereo.pcmf32s.size() == 2)
+    {
+        speaker = estimate_diarization_speaker(stereo, t0, t1, true);
+        speaker.insert(0, "<v Speaker");
+        speaker.append(">");
+    }
+
+    fout << to_timestamp(t0) << " --> " << to_timestamp(t1) << "\n";
+    fout << speaker << text << "\n\n";
+}
+
+static void output_srt(struct whisper_context * ctx, struct whisper_state * state, std::ofstream & fout, const whisper_params & params, const whisper_stereo & stereo, int i) {
+    const char * text = full_get_segment_text(ctx, state, i);
+    const int64_t t0 = full_get_segment_t0(ctx, state, i);
+    const int64_t t1 = full_get_segment_t1(ctx, state, i);
+    std::string speaker = "";
+
+    if (params.diarize && stereo.pcmf32s.size() == 2)
+    {
+        speaker = estimate_diarization_speaker(stereo, t0, t1);
+    }
+
+    fout << i + 1 + params.offset_n << "\n";
+    fout << to_timestamp(t0, true) << " --> " << to_timestamp(t1, true) << "\n";
+    fout << speaker << text << "\n\n";
+}
+
+static void output_csv_header(std::ofstream & fout, const whisper_params & params, const whisper_stereo & stereo) {
+    fout << "start,end,";
+    if (params.diarize && stereo.pcmf32s.size() == 2)
+    {
+        fout << "speaker,";
+    }
+    fout << "text\n";
+}
+
+static void output_csv(struct whisper_context * ctx, struct whisper_state * state, std::ofstream & fout, const whisper_params & params, const whisper_stereo & stereo, int i) {
+    const char * text = full_get_segment_text(ctx, state, i);
+    const int64_t t0 = full_get_segment_t0(ctx, state, i);
+    const int64_t t1 = full_get_segment_t1(ctx, state, i);
+    char * text_escaped = escape_double_quotes_in_csv(text);
+
+    //need to multiply times returned from whisper_full_get_segment_t{0,1}() by 10 to get milliseconds.
+    fout << 10 * t0 << "," << 10 * t1 << ",";
+    if (params.diarize && stereo.pcmf32s.size() == 2)
+    {
+        fout << estimate_diarization_speaker(stereo, t0, t1, true) << ",";
+    }
+    fout << "\"" << text_escaped << "\"\n";
+
+    free(text_escaped);
+}
+
+static void output_score(struct whisper_context * ctx, struct whisper_state * state, std::ofstream & fout, const whisper_params & /*params*/, const whisper_stereo & /*stereo*/, int i) {
+    const int n_tokens = full_n_tokens(ctx, state, i);
+    // fprintf(stderr,"tokens: %d\n",n_tokens);
+    for (int j = 0; j < n_tokens; j++) {
+        auto token = full_get_token_text(ctx, state, i, j);
+        auto probability = full_get_token_p(ctx, state, i, j);
+        fout << token << '\t' << probability << '\n';
+        // fprintf(stderr,"token: %s %f\n",token,probability);
+    }
+}
+
+static void output_json_header(struct whisper_context * ctx, struct whisper_state * state, json_writer & jw, const whisper_params & params) {
+    jw.start_obj(nullptr);
+        jw.value_s("systeminfo", whisper_print_system_info(), false);
+        jw.start_obj("model");
+            jw.value_s("type", whisper_model_type_readable(ctx), false);
+            jw.value_b("multilingual", whisper_is_multilingual(ctx), false);
+            jw.value_i("vocab", whisper_model_n_vocab(ctx), false);
+            jw.start_obj("audio");
+                jw.value_i("ctx", whisper_model_n_audio_ctx(ctx), false);
+                jw.value_i("state", whisper_model_n_audio_state(ctx), false);
+                jw.value_i("head", whisper_model_n_audio_head(ctx), false);
+                jw.value_i("layer", whisper_model_n_audio_layer(ctx), true);
+            jw.end_obj(false);
+            jw.start_obj("text");
+                jw.value_i("ctx", whisper_model_n_text_ctx(ctx), false);
+                jw.value_i("state", whisper_model_n_text_state(ctx), false);
+                jw.value_i("head", whisper_model_n_text_head(ctx), false);
+                jw.value_i("layer", whisper_model_n_text_layer(ctx), true);
+            jw.end_obj(false);
+            jw.value_i("mels", whisper_model_n_mels(ctx), false);
+            jw.value_i("ftype", whisper_model_ftype(ctx), true);
+        jw.end_obj(false);
+        jw.start_obj("params");
+            jw.value_s("model", params.model.c_str(), false);
+            jw.value_s("language", params.language.c_str(), false);
+            jw.value_b("translate", params.translate, true);
+        jw.end_obj(false);
+        jw.start_obj("result");
+            jw.value_s("language", whisper_lang_str(full_lang_id(ctx, state)), true);
+        jw.end_obj(false);
+        jw.start_arr("transcription");
+}
+
+static void output_json(
+             struct whisper_context * ctx,
+               struct whisper_state * state,
+                        json_writer & jw,
+               const whisper_params & params,
+               const whisper_stereo & stereo,
+                               bool   full,
+                                int   i) {
+    const char * text = full_get_segment_text(ctx, state, i);
+
+    const int64_t t0 = full_get_segment_t0(ctx, state, i);
+    const int64_t t1 = full_get_segment_t1(ctx, state, i);
+
+    if (i > 0) {
+        jw.fout << ",\n";
+    }
+
+    jw.start_obj(nullptr);
+        jw.times_o(t0, t1, false);
+        jw.value_s("text", text, !params.diarize && !params.tinydiarize && !full);
+
+        if (full) {
+            jw.start_arr("tokens");
+            const int n = full_n_tokens(ctx, state, i);
+            for (int j = 0; j < n; ++j) {
+                auto token = full_get_token_data(ctx, state, i, j);
+                jw.start_obj(nullptr);
+                    jw.value_s("text", whisper_token_to_str(ctx, token.id), false);
+                    if(token.t0 > -1 && token.t1 > -1) {
+                        // If we have per-token timestamps, write them out
+                        jw.times_o(token.t0, token.t1, false);
                     }
-                end_obj(i == (n_segments - 1));
+                    jw.value_i("id", token.id, false);
+                    jw.value_f("p", token.p, false);
+                    jw.value_f("t_dtw", token.t_dtw, true);
+                jw.end_obj(j == (n - 1));
             }
+            jw.end_arr(!params.diarize && !params.tinydiarize);
+        }
 
-        end_arr(true);
-    end_obj(true);
-    return true;
+        if (params.diarize && stereo.pcmf32s.size() == 2) {
+            jw.value_s("speaker", estimate_diarization_speaker(stereo, t0, t1, true).c_str(), true);
+        }
+
+        if (params.tinydiarize) {
+            jw.value_b("speaker_turn_next", full_get_segment_speaker_turn_next(ctx, state, i), true);
+        }
+    jw.end_elem();
+}
+
+static void output_json_footer(json_writer & jw, int n_segments) {
+        if (n_segments > 0) {
+            jw.fout << "\n";
+        }
+        jw.end_arr(true);
+    jw.end_obj(true);
 }
 
 // karaoke video generation
 // outputs a bash script that uses ffmpeg to generate a video with the subtitles
 // TODO: font parameter adjustments
-static bool output_wts(struct whisper_context * ctx, const char * fname, const char * fname_inp, const whisper_params & params, float t_sec, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
-
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
-
-    static const char * font = params.font_path.c_str();
+static bool output_wts_header(std::ofstream & fout, const whisper_output_files & outputs) {
+    const char * font = outputs.font.c_str();
 
     std::ifstream fin(font);
     if (!fin.is_open()) {
@@ -768,100 +943,104 @@ static bool output_wts(struct whisper_context * ctx, const char * fname, const c
     fout << "#!/bin/bash" << "\n";
     fout << "\n";
 
-    fout << "ffmpeg -i " << fname_inp << " -f lavfi -i color=size=1200x120:duration=" << t_sec << ":rate=25:color=black -vf \"";
+    fout << "ffmpeg -i " << outputs.fname_inp << " -f lavfi -i color=size=1200x120:duration=" << outputs.t_sec << ":rate=25:color=black -vf \"";
 
-    for (int i = 0; i < whisper_full_n_segments(ctx); i++) {
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+    return true;
+}
 
-        const int n = whisper_full_n_tokens(ctx, i);
+static void output_wts(struct whisper_context * ctx, struct whisper_state * state, std::ofstream & fout, const whisper_params & params, const whisper_stereo & stereo, const char * font, int i) {
+    const int64_t t0 = full_get_segment_t0(ctx, state, i);
+    const int64_t t1 = full_get_segment_t1(ctx, state, i);
 
-        std::vector<whisper_token_data> tokens(n);
-        for (int j = 0; j < n; ++j) {
-            tokens[j] = whisper_full_get_token_data(ctx, i, j);
-        }
+    const int n = full_n_tokens(ctx, state, i);
 
-        if (i > 0) {
-            fout << ",";
-        }
+    std::vector<whisper_token_data> tokens(n);
+    for (int j = 0; j < n; ++j) {
+        tokens[j] = full_get_token_data(ctx, state, i, j);
+    }
 
-        // background text
-        fout << "drawtext=fontfile='" << font << "':fontsize=24:fontcolor=gray:x=(w-text_w)/2:y=h/2:text='':enable='between(t," << t0/100.0 << "," << t0/100.0 << ")'";
+    if (i > 0) {
+        fout << ",";
+    }
 
-        bool is_first = true;
-        std::string speaker = "";
+    // background text
+    fout << "drawtext=fontfile='" << font << "':fontsize=24:fontcolor=gray:x=(w-text_w)/2:y=h/2:text='':enable='between(t," << t0/100.0 << "," << t0/100.0 << ")'";
 
-        if (params.diarize && pcmf32s.size() == 2) {
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
-        }
+    bool is_first = true;
+    std::string speaker = "";
 
-        for (int j = 0; j < n; ++j) {
-            const auto & token = tokens[j];
+    if (params.diarize && stereo.pcmf32s.size() == 2) {
+        speaker = estimate_diarization_speaker(stereo, t0, t1);
+    }
 
-            if (tokens[j].id >= whisper_token_eot(ctx)) {
-                continue;
-            }
+    for (int j = 0; j < n; ++j) {
+        const auto & token = tokens[j];
 
-            std::string txt_bg = "";
-            std::string txt_fg = ""; // highlight token
-            std::string txt_ul = ""; // underline
+        if (tokens[j].id >= whisper_token_eot(ctx)) {
+            continue;
+        }
 
-            if (params.diarize && pcmf32s.size() == 2) {
-                txt_bg = speaker;
-                txt_fg = speaker;
-                txt_ul = "\\ \\ \\ \\ \\ \\ \\ \\ \\ \\ \\ ";
-            }
+        std::string txt_bg = "";
+        std::string txt_fg = ""; // highlight token
+        std::string txt_ul = ""; // underline
 
-            txt_bg.append("> ");
-            txt_fg.append("> ");
-            txt_ul.append("\\ \\ ");
+        if (params.diarize && stereo.pcmf32s.size() == 2) {
+            txt_bg = speaker;
+            txt_fg = speaker;
+            txt_ul = "\\ \\ \\ \\ \\ \\ \\ \\ \\ \\ \\ ";
+        }
 
-            {
-                for (int k = 0; k < n; ++k) {
-                    const auto & token2 = tokens[k];
+        txt_bg.append("> ");
+        txt_fg.append("> ");
+        txt_ul.append("\\ \\ ");
 
-                    if (tokens[k].id >= whisper_token_eot(ctx)) {
-                        continue;
-                    }
+        {
+            for (int k = 0; k < n; ++k) {
+                const auto & token2 = tokens[k];
 
-                    const std::string txt = whisper_token_to_str(ctx, token2.id);
-
-                    txt_bg += txt;
-
-                    if (k == j) {
-                        for (int l = 0; l < (int) txt.size(); ++l) {
-                            txt_fg += txt[l];
-                            txt_ul += "_";
-                        }
-                        txt_fg += "|";
-                    } else {
-                        for (int l = 0; l < (int) txt.size(); ++l) {
-                            txt_fg += "\\ ";
-                            txt_ul += "\\ ";
-                        }
-                    }
+                if (tokens[k].id >= whisper_token_eot(ctx)) {
+                    continue;
                 }
 
-                ::replace_all(txt_bg, "'", "\u2019");
-                ::replace_all(txt_bg, "\"", "\\\"");
-                ::replace_all(txt_fg, "'", "\u2019");
-                ::replace_all(txt_fg, "\"", "\\\"");
-            }
+                const std::string txt = whisper_token_to_str(ctx, token2.id);
 
-            if (is_first) {
-                // background text
-                fout << ",drawtext=fontfile='" << font << "':fontsize=24:fontcolor=gray:x=(w-text_w)/2:y=h/2:text='" << txt_bg << "':enable='between(t," << t0/100.0 << "," << t1/100.0 << ")'";
-                is_first = false;
+                txt_bg += txt;
+
+                if (k == j) {
+                    for (int l = 0; l < (int) txt.size(); ++l) {
+                        txt_fg += txt[l];
+                        txt_ul += "_";
+                    }
+                    txt_fg += "|";
+                } else {
+                    for (int l = 0; l < (int) txt.size(); ++l) {
+                        txt_fg += "\\ ";
+                        txt_ul += "\\ ";
+                    }
+                }
             }
 
-            // foreground text
-            fout << ",drawtext=fontfile='" << font << "':fontsize=24:fontcolor=lightgreen:x=(w-text_w)/2+8:y=h/2:text='" << txt_fg << "':enable='between(t," << token.t0/100.0 << "," << token.t1/100.0 << ")'";
+            ::replace_all(txt_bg, "'", "\u2019");
+            ::replace_all(txt_bg, "\"", "\\\"");
+            ::replace_all(txt_fg, "'", "\u2019");
+            ::replace_all(txt_fg, "\"", "\\\"");
+        }
 
-            // underline
-            fout << ",drawtext=fontfile='" << font << "':fontsize=24:fontcolor=lightgreen:x=(w-text_w)/2+8:y=h/2+16:text='" << txt_ul << "':enable='between(t," << token.t0/100.0 << "," << token.t1/100.0 << ")'";
+        if (is_first) {
+            // background text
+            fout << ",drawtext=fontfile='" << font << "':fontsize=24:fontcolor=gray:x=(w-text_w)/2:y=h/2:text='" << txt_bg << "':enable='between(t," << t0/100.0 << "," << t1/100.0 << ")'";
+            is_first = false;
         }
+
+        // foreground text
+        fout << ",drawtext=fontfile='" << font << "':fontsize=24:fontcolor=lightgreen:x=(w-text_w)/2+8:y=h/2:text='" << txt_fg << "':enable='between(t," << token.t0/100.0 << "," << token.t1/100.0 << ")'";
+
+        // underline
+        fout << ",drawtext=fontfile='" << font << "':fontsize=24:fontcolor=lightgreen:x=(w-text_w)/2+8:y=h/2+16:text='" << txt_ul << "':enable='between(t," << token.t0/100.0 << "," << token.t1/100.0 << ")'";
     }
+}
 
+static void output_wts_footer(std::ofstream & fout, const char * fname_inp) {
     fout << "\" -c:v libx264 -pix_fmt yuv420p -y " << fname_inp << ".mp4" << "\n";
 
     fout << "\n\n";
@@ -869,56 +1048,418 @@ static bool output_wts(struct whisper_context * ctx, const char * fname, const c
     fout << "\n";
     fout << "echo \"  ffplay " << fname_inp << ".mp4\"\n";
     fout << "\n";
+}
 
-    fout.close();
+static void output_lrc(struct whisper_context * ctx, struct whisper_state * state, std::ofstream & fout, const whisper_params & params, const whisper_stereo & stereo, int i) {
+    const char * text = full_get_segment_text(ctx, state, i);
+    const int64_t t = full_get_segment_t0(ctx, state, i);
 
-    fprintf(stderr, "%s: run 'source %s' to generate karaoke video\n", __func__, fname);
+    int64_t msec = t * 10;
+    int64_t min = msec / (1000 * 60);
+    msec = msec - min * (1000 * 60);
+    int64_t sec = msec / 1000;
+    msec = msec - sec * 1000;
 
-    return true;
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%02d:%02d.%02d", (int) min, (int) sec, (int) ( msec / 10));
+    std::string timestamp_lrc = std::string(buf);
+    std::string speaker = "";
+
+    if (params.diarize && stereo.pcmf32s.size() == 2)
+    {
+        const int64_t t0 = full_get_segment_t0(ctx, state, i);
+        const int64_t t1 = full_get_segment_t1(ctx, state, i);
+        speaker = estimate_diarization_speaker(stereo, t0, t1);
+    }
+
+    fout <<  '[' << timestamp_lrc << ']' << speaker << text << "\n";
 }
 
-static bool output_lrc(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
-    if (!fout.is_open()) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
+// open the requested output files - the headers are written with the first segment,
+// once the language of the result is known
+static void output_open_all(whisper_output_files & outputs, const whisper_params & params, const whisper_input & input) {
+    outputs.fname_inp = input.fname_inp;
+    outputs.fname_wts = input.fname_out + ".wts";
+    outputs.font      = params.font_path;
+    outputs.t_sec     = float(input.pcmf32.size() + 1000)/WHISPER_SAMPLE_RATE;
+
+    const std::string & fname_out = input.fname_out;
+
+    if (params.output_txt) output_open(outputs.txt,      fname_out + ".txt",       "output_txt");
+    if (params.output_vtt) output_open(outputs.vtt,      fname_out + ".vtt",       "output_vtt");
+    if (params.output_srt) output_open(outputs.srt,      fname_out + ".srt",       "output_srt");
+    if (params.output_wts) output_open(outputs.wts,      outputs.fname_wts,        "output_wts");
+    if (params.output_csv) output_open(outputs.csv,      fname_out + ".csv",       "output_csv");
+    if (params.output_jsn) output_open(outputs.jsn.fout, fname_out + ".json",      "output_json");
+    if (params.output_lrc) output_open(outputs.lrc,      fname_out + ".lrc",       "output_lrc");
+    if (params.log_score)  output_open(outputs.score,    fname_out + ".score.txt", "output_score");
+}
+
+static void output_headers(struct whisper_context * ctx, struct whisper_state * state, whisper_output_files & outputs, const whisper_params & params, const whisper_stereo & stereo) {
+    if (outputs.started) {
+        return;
+    }
+    outputs.started = true;
+
+    if (outputs.vtt.is_open()) {
+        outputs.vtt << "WEBVTT\n\n";
+    }
+    if (outputs.wts.is_open() && !output_wts_header(outputs.wts, outputs)) {
+        outputs.wts.close();
+    }
+    if (outputs.csv.is_open()) {
+        output_csv_header(outputs.csv, params, stereo);
+    }
+    if (outputs.jsn.fout.is_open()) {
+        output_json_header(ctx, state, outputs.jsn, params);
+    }
+    if (outputs.lrc.is_open()) {
+        outputs.lrc << "[by:whisper.cpp]\n";
+    }
+}
+
+// append the segments decoded since the last call
+static void output_segments(struct whisper_context * ctx, struct whisper_state * state, whisper_output_files & outputs, const whisper_params & params, const whisper_stereo & stereo) {
+    output_headers(ctx, state, outputs, params, stereo);
+
+    const int n_segments = full_n_segments(ctx, state);
+    for (int i = outputs.n_segments; i < n_segments; ++i) {
+        if (outputs.txt.is_open())      output_txt  (ctx, state, outputs.txt,   params, stereo, i);
+        if (outputs.vtt.is_open())      output_vtt  (ctx, state, outputs.vtt,   params, stereo, i);
+        if (outputs.srt.is_open())      output_srt  (ctx, state, outputs.srt,   params, stereo, i);
+        if (outputs.wts.is_open())      output_wts  (ctx, state, outputs.wts,   params, stereo, outputs.font.c_str(), i);
+        if (outputs.csv.is_open())      output_csv  (ctx, state, outputs.csv,   params, stereo, i);
+        if (outputs.jsn.fout.is_open()) output_json (ctx, state, outputs.jsn,   params, stereo, params.output_jsn_full, i);
+        if (outputs.lrc.is_open())      output_lrc  (ctx, state, outputs.lrc,   params, stereo, i);
+        if (outputs.score.is_open())    output_score(ctx, state, outputs.score, params, stereo, i);
+    }
+
+    outputs.n_segments = n_segments;
+}
+
+// write the footers and close the files
+static void output_close_all(struct whisper_context * ctx, struct whisper_state * state, whisper_output_files & outputs, const whisper_params & params, const whisper_stereo & stereo) {
+    output_segments(ctx, state, outputs, params, stereo);
+
+    if (outputs.jsn.fout.is_open()) {
+        output_json_footer(outputs.jsn, outputs.n_segments);
+    }
+    if (outputs.wts.is_open()) {
+        output_wts_footer(outputs.wts, outputs.fname_inp.c_str());
+        outputs.wts.close();
+
+        fprintf(stderr, "%s: run 'source %s' to generate karaoke video\n", "output_wts", outputs.fname_wts.c_str());
+    }
+}
+
+// streams the new segments to the output files and, unless the transcript is printed at the end, to stdout
+static void whisper_output_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
+    const auto * data = (whisper_print_user_data *) user_data;
+
+    output_segments(ctx, state, *data->outputs, *data->params, *data->stereo);
+
+    if (data->print) {
+        whisper_print_segment_callback(ctx, state, n_new, user_data);
+    }
+}
+
+
+static void cb_log_disable(enum ggml_log_level , const char * , void * ) { }
+
+static bool read_input(const whisper_params & params, int f, whisper_input & input) {
+    input.fname_inp = params.fname_inp[f];
+    input.fname_out = f < (int) params.fname_out.size() && !params.fname_out[f].empty() ? params.fname_out[f] : params.fname_inp[f];
+
+    if (!::read_wav(input.fname_inp, input.pcmf32, input.stereo.pcmf32s, params.diarize)) {
+        fprintf(stderr, "error: failed to read WAV file '%s'\n", input.fname_inp.c_str());
         return false;
     }
 
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
+    if (params.diarize) {
+        input.stereo.build();
+    }
+
+    return true;
+}
 
-    fout << "[by:whisper.cpp]\n";
+// transcribe one file and write the outputs
+// state == nullptr: use the default state of the context, split across params.n_processors
+// print_mtx != nullptr: print the whole transcript under the lock when done instead of segment by segment
+static bool process_input(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+          const whisper_params & params,
+   const ggml_threadpool_params & tpp,
+           const whisper_input & input,
+                    std::mutex * print_mtx) {
+    const auto & pcmf32 = input.pcmf32;
 
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t = whisper_full_get_segment_t0(ctx, i);
+    // run the inference
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
 
-        int64_t msec = t * 10;
-        int64_t min = msec / (1000 * 60);
-        msec = msec - min * (1000 * 60);
-        int64_t sec = msec / 1000;
-        msec = msec - sec * 1000;
+    const bool use_grammar = (!params.grammar_parsed.rules.empty() && !params.grammar_rule.empty());
+    wparams.strategy = (params.beam_size > 1 || use_grammar) ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
 
-        char buf[16];
-        snprintf(buf, sizeof(buf), "%02d:%02d.%02d", (int) min, (int) sec, (int) ( msec / 10));
-        std::string timestamp_lrc = std::string(buf);
-        std::string speaker = "";
+    wparams.print_realtime   = false;
+    wparams.print_progress   = params.print_progress;
+    wparams.print_timestamps = !params.no_timestamps;
+    wparams.print_special    = params.print_special;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.detect_language  = params.detect_language;
+    wparams.n_threads        = params.n_threads;
+    wparams.threadpool_params = &tpp;
+    wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
+    wparams.offset_ms        = params.offset_t_ms;
+    wparams.duration_ms      = params.duration_ms;
 
-        if (params.diarize && pcmf32s.size() == 2)
-        {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+    wparams.token_timestamps = params.output_wts || params.output_jsn_full || params.max_len > 0;
+    wparams.thold_pt         = params.word_thold;
+    wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
+    wparams.split_on_word    = params.split_on_word;
+    wparams.audio_ctx        = params.audio_ctx;
+
+    wparams.debug_mode       = params.debug_mode;
+
+    wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+
+    wparams.suppress_regex   = params.suppress_regex.empty() ? nullptr : params.suppress_regex.c_str();
+
+    wparams.initial_prompt   = params.prompt.c_str();
+
+    wparams.greedy.best_of        = params.best_of;
+    wparams.beam_search.beam_size = params.beam_size;
+
+    wparams.temperature_inc  = params.no_fallback ? 0.0f : params.temperature_inc;
+    wparams.temperature      = params.temperature;
+
+    wparams.entropy_thold    = params.entropy_thold;
+    wparams.logprob_thold    = params.logprob_thold;
+    wparams.no_speech_thold  = params.no_speech_thold;
+
+    wparams.no_timestamps    = params.no_timestamps;
+
+    wparams.suppress_nst     = params.suppress_nst;
+
+    whisper_output_files outputs;
+    output_open_all(outputs, params, input);
+
+    whisper_print_user_data user_data = { &params, &input.stereo, 0, &outputs, print_mtx == nullptr };
+
+    const auto & grammar_parsed = params.grammar_parsed;
+    auto grammar_rules = grammar_parsed.c_rules();
+
+    if (use_grammar) {
+        if (grammar_parsed.symbol_ids.find(params.grammar_rule) == grammar_parsed.symbol_ids.end()) {
+            fprintf(stderr, "%s: warning: grammar rule '%s' not found - skipping grammar sampling\n", __func__, params.grammar_rule.c_str());
+        } else {
+            wparams.grammar_rules = grammar_rules.data();
+            wparams.n_grammar_rules = grammar_rules.size();
+            wparams.i_start_rule = grammar_parsed.symbol_ids.at(params.grammar_rule);
+            wparams.grammar_penalty = params.grammar_penalty;
         }
+    }
+
+    // this callback is called on each new segment - the concurrent jobs print each transcript at the end
+    wparams.new_segment_callback           = whisper_output_segment_callback;
+    wparams.new_segment_callback_user_data = &user_data;
 
-        fout <<  '[' << timestamp_lrc << ']' << speaker << text << "\n";
+    if (wparams.print_progress) {
+        wparams.progress_callback           = whisper_print_progress_callback;
+        wparams.progress_callback_user_data = &user_data;
     }
 
+    // examples for abort mechanism
+    // in examples below, we do not abort the processing, but we could if the flag is set to true
+
+    // the callback is called before every encoder run - if it returns false, the processing is aborted
+    {
+        static bool is_aborted = false; // NOTE: this should be atomic to avoid data race
+
+        wparams.encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
+            bool is_aborted = *(bool*)user_data;
+            return !is_aborted;
+        };
+        wparams.encoder_begin_callback_user_data = &is_aborted;
+    }
+
+    // the callback is called before every computation - if it returns true, the computation is aborted
+    {
+        static bool is_aborted = false; // NOTE: this should be atomic to avoid data race
+
+        wparams.abort_callback = [](void * user_data) {
+            bool is_aborted = *(bool*)user_data;
+            return is_aborted;
+        };
+        wparams.abort_callback_user_data = &is_aborted;
+    }
+
+    const int ret = state ?
+        whisper_full_with_state(ctx, state, wparams, pcmf32.data(), pcmf32.size()) :
+        whisper_full_parallel  (ctx,        wparams, pcmf32.data(), pcmf32.size(), params.n_processors);
+
+    if (ret != 0) {
+        fprintf(stderr, "%s: failed to process audio '%s'\n", __func__, input.fname_inp.c_str());
+        return false;
+    }
+
+    if (print_mtx) {
+        std::lock_guard<std::mutex> lock(*print_mtx);
+
+        printf("\n%s:", input.fname_inp.c_str());
+        whisper_print_segment_callback(ctx, state, full_n_segments(ctx, state), &user_data);
+        printf("\n");
+    } else {
+        printf("\n");
+    }
+
+    // output stuff
+
+    output_close_all(ctx, state, outputs, params, input.stereo);
+
     return true;
 }
 
+// the timings of all jobs, summed - the times are busy times of the jobs, which overlap in wall time
+static void print_timings_jobs(const std::vector<whisper_state *> & states) {
+    whisper_stats total = {};
+    for (whisper_state * state : states) {
+        const whisper_stats stats = whisper_get_stats_from_state(state);
+
+        total.t_mel_us    += stats.t_mel_us;
+        total.t_sample_us += stats.t_sample_us;
+        total.t_encode_us += stats.t_encode_us;
+        total.t_decode_us += stats.t_decode_us;
+        total.t_batchd_us += stats.t_batchd_us;
+        total.t_prompt_us += stats.t_prompt_us;
+        total.n_sample    += stats.n_sample;
+        total.n_encode    += stats.n_encode;
+        total.n_decode    += stats.n_decode;
+        total.n_batchd    += stats.n_batchd;
+        total.n_prompt    += stats.n_prompt;
+        total.n_fail_p    += stats.n_fail_p;
+        total.n_fail_h    += stats.n_fail_h;
+    }
 
-static void cb_log_disable(enum ggml_log_level , const char * , void * ) { }
+    const int32_t n_sample = std::max(1, total.n_sample);
+    const int32_t n_encode = std::max(1, total.n_encode);
+    const int32_t n_decode = std::max(1, total.n_decode);
+    const int32_t n_batchd = std::max(1, total.n_batchd);
+    const int32_t n_prompt = std::max(1, total.n_prompt);
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: %d jobs, summed:\n", __func__, (int) states.size());
+    fprintf(stderr, "%s:     fallbacks = %3d p / %3d h\n", __func__, total.n_fail_p, total.n_fail_h);
+    fprintf(stderr, "%s:      mel time = %8.2f ms\n", __func__, 1e-3f*total.t_mel_us);
+    fprintf(stderr, "%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*total.t_sample_us, n_sample, 1e-3f*total.t_sample_us/n_sample);
+    fprintf(stderr, "%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*total.t_encode_us, n_encode, 1e-3f*total.t_encode_us/n_encode);
+    fprintf(stderr, "%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*total.t_decode_us, n_decode, 1e-3f*total.t_decode_us/n_decode);
+    fprintf(stderr, "%s:   batchd time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*total.t_batchd_us, n_batchd, 1e-3f*total.t_batchd_us/n_batchd);
+    fprintf(stderr, "%s:   prompt time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*total.t_prompt_us, n_prompt, 1e-3f*total.t_prompt_us/n_prompt);
+}
+
+// --jobs: an I/O thread reads the files ahead of the transcription, while the workers transcribe them
+// concurrently with their own state of the shared context and write the outputs as each file finishes
+// the context is created without a default state, every job creates its own
+static int process_jobs(struct whisper_context * ctx, const whisper_params & params, const ggml_threadpool_params & tpp) {
+    const int n_jobs = std::min(params.n_jobs, (int) params.fname_inp.size());
+
+    std::vector<whisper_state *> states;
+    for (int i = 0; i < n_jobs; ++i) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            fprintf(stderr, "error: failed to initialize the state of job %d\n", i);
+            break;
+        }
+
+        whisper_ctx_init_openvino_encoder_with_state(ctx, state, nullptr, params.openvino_encode_device.c_str(), nullptr);
+
+        if (!params.fname_profile.empty()) {
+            whisper_profile_enable_with_state(ctx, state, true);
+        }
+
+        states.push_back(state);
+    }
+
+    if (states.empty()) {
+        return 3;
+    }
+
+    // files read ahead - at most one per job, so the I/O stays just ahead of the transcription
+    std::deque<whisper_input> queue;
+    bool queue_done = false;
+
+    std::mutex              queue_mtx;
+    std::condition_variable queue_cv;
+
+    std::mutex       print_mtx;
+    std::atomic<int> n_failed(0);
+
+    std::thread reader([&]() {
+        for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
+            whisper_input input;
+            if (!read_input(params, f, input)) {
+                n_failed++;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(queue_mtx);
+            queue_cv.wait(lock, [&]() { return queue.size() < states.size(); });
+            queue.push_back(std::move(input));
+            queue_cv.notify_all();
+        }
+
+        std::lock_guard<std::mutex> lock(queue_mtx);
+        queue_done = true;
+        queue_cv.notify_all();
+    });
+
+    std::vector<std::thread> workers;
+    for (whisper_state * state : states) {
+        workers.emplace_back([&, state]() {
+            while (true) {
+                whisper_input input;
+                {
+                    std::unique_lock<std::mutex> lock(queue_mtx);
+                    queue_cv.wait(lock, [&]() { return !queue.empty() || queue_done; });
+                    if (queue.empty()) {
+                        return;
+                    }
+                    input = std::move(queue.front());
+                    queue.pop_front();
+                    queue_cv.notify_all();
+                }
+
+                if (!process_input(ctx, state, params, tpp, input, &print_mtx)) {
+                    n_failed++;
+                }
+            }
+        });
+    }
+
+    reader.join();
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    if (!params.no_prints) {
+        print_timings_jobs(states);
+    }
+
+    // one trace per job - FNAME.0, FNAME.1, ...
+    if (!params.fname_profile.empty()) {
+        for (size_t i = 0; i < states.size(); ++i) {
+            whisper_profile_print_with_state(states[i]);
+            whisper_profile_dump_trace_with_state(states[i], (params.fname_profile + "." + std::to_string(i)).c_str());
+        }
+    }
+
+    for (whisper_state * state : states) {
+        whisper_free_state(state);
+    }
+
+    return n_failed > 0 ? 10 : 0;
+}
 
 int main(int argc, char ** argv) {
 #if defined(_WIN32)
@@ -1005,10 +1546,41 @@ int main(int argc, char ** argv) {
 
     cparams.use_gpu    = params.use_gpu;
     cparams.flash_attn = params.flash_attn;
+    cparams.type_k     = ggml_parse_type(params.cache_type_k.c_str());
+    cparams.type_v     = ggml_parse_type(params.cache_type_v.c_str());
+
+    if (cparams.type_k == GGML_TYPE_COUNT || cparams.type_v == GGML_TYPE_COUNT) {
+        fprintf(stderr, "error: unknown KV cache type '%s' / '%s'\n", params.cache_type_k.c_str(), params.cache_type_v.c_str());
+        return 3;
+    }
+
+    if      (params.numa == "")           { cparams.numa = GGML_NUMA_STRATEGY_DISABLED;   }
+    else if (params.numa == "distribute") { cparams.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
+    else if (params.numa == "isolate")    { cparams.numa = GGML_NUMA_STRATEGY_ISOLATE;    }
+    else if (params.numa == "numactl")    { cparams.numa = GGML_NUMA_STRATEGY_NUMACTL;    }
+    else if (params.numa == "mirror")     { cparams.numa = GGML_NUMA_STRATEGY_MIRROR;     }
+    else {
+        fprintf(stderr, "error: unknown NUMA strategy '%s'\n", params.numa.c_str());
+        return 3;
+    }
+
+    cparams.rpc_servers = params.rpc_servers.c_str();
+
+    struct ggml_threadpool_params tpp = ggml_threadpool_params_default(params.n_threads);
+
+    tpp.prio       = (enum ggml_sched_priority) std::max(0, std::min(3, params.prio));
+    tpp.poll       = std::max(0, std::min(100, params.poll));
+    tpp.strict_cpu = params.cpu_strict;
+
+    if (!params.cpu_mask.empty() && !parse_cpu_mask(params.cpu_mask, tpp.cpumask)) {
+        fprintf(stderr, "error: invalid CPU mask '%s'\n", params.cpu_mask.c_str());
+        return 3;
+    }
 
     if (!params.dtw.empty()) {
         cparams.dtw_token_timestamps = true;
         cparams.dtw_aheads_preset = WHISPER_AHEADS_NONE;
+        cparams.dtw_band = params.dtw_band;
 
         if (params.dtw == "tiny")      cparams.dtw_aheads_preset = WHISPER_AHEADS_TINY;
         if (params.dtw == "tiny.en")   cparams.dtw_aheads_preset = WHISPER_AHEADS_TINY_EN;
@@ -1029,15 +1601,26 @@ int main(int argc, char ** argv) {
         }
     }
 
-    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    // --jobs: the states are created by process_jobs()
+    const bool use_jobs = params.n_jobs > 1 && params.fname_inp.size() > 1;
+
+    struct whisper_context * ctx = use_jobs ?
+        whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams) :
+        whisper_init_from_file_with_params         (params.model.c_str(), cparams);
 
     if (ctx == nullptr) {
         fprintf(stderr, "error: failed to initialize whisper context\n");
         return 3;
     }
 
-    // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-    whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+    if (!use_jobs) {
+        // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
+        whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+
+        if (!params.fname_profile.empty()) {
+            whisper_profile_enable(ctx, true);
+        }
+    }
 
     if (!params.grammar.empty()) {
         auto & grammar = params.grammar_parsed;
@@ -1062,210 +1645,92 @@ int main(int argc, char ** argv) {
         }
     }
 
-    for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
-        const auto fname_inp = params.fname_inp[f];
-		const auto fname_out = f < (int) params.fname_out.size() && !params.fname_out[f].empty() ? params.fname_out[f] : params.fname_inp[f];
-
-        std::vector<float> pcmf32;               // mono-channel F32 PCM
-        std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
-
-        if (!::read_wav(fname_inp, pcmf32, pcmf32s, params.diarize)) {
-            fprintf(stderr, "error: failed to read WAV file '%s'\n", fname_inp.c_str());
-            continue;
+    if (!whisper_is_multilingual(ctx)) {
+        if (params.language != "en" || params.translate) {
+            params.language = "en";
+            params.translate = false;
+            fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
         }
+    }
+    if (params.detect_language) {
+        params.language = "auto";
+    }
 
-        if (!whisper_is_multilingual(ctx)) {
-            if (params.language != "en" || params.translate) {
-                params.language = "en";
-                params.translate = false;
-                fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
-            }
-        }
-        if (params.detect_language) {
-            params.language = "auto";
+    if (use_jobs) {
+        if (params.n_processors > 1) {
+            fprintf(stderr, "%s: WARNING: --processors is ignored with --jobs\n", __func__);
         }
 
         if (!params.no_prints) {
-            // print system information
             fprintf(stderr, "\n");
             fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
-                    params.n_threads*params.n_processors, std::thread::hardware_concurrency(), whisper_print_system_info());
+                    params.n_threads*params.n_jobs, std::thread::hardware_concurrency(), whisper_print_system_info());
 
-            // print some info about the processing
             fprintf(stderr, "\n");
-            fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, %d processors, %d beams + best of %d, lang = %s, task = %s, %stimestamps = %d ...\n",
-                    __func__, fname_inp.c_str(), int(pcmf32.size()), float(pcmf32.size())/WHISPER_SAMPLE_RATE,
-                    params.n_threads, params.n_processors, params.beam_size, params.best_of,
+            fprintf(stderr, "%s: processing %d files, %d jobs, %d threads, %d beams + best of %d, lang = %s, task = %s, %stimestamps = %d ...\n",
+                    __func__, (int) params.fname_inp.size(), params.n_jobs, params.n_threads, params.beam_size, params.best_of,
                     params.language.c_str(),
                     params.translate ? "translate" : "transcribe",
                     params.tinydiarize ? "tdrz = 1, " : "",
                     params.no_timestamps ? 0 : 1);
-
-            fprintf(stderr, "\n");
         }
 
-        // run the inference
-        {
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-
-            const bool use_grammar = (!params.grammar_parsed.rules.empty() && !params.grammar_rule.empty());
-            wparams.strategy = (params.beam_size > 1 || use_grammar) ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
-
-            wparams.print_realtime   = false;
-            wparams.print_progress   = params.print_progress;
-            wparams.print_timestamps = !params.no_timestamps;
-            wparams.print_special    = params.print_special;
-            wparams.translate        = params.translate;
-            wparams.language         = params.language.c_str();
-            wparams.detect_language  = params.detect_language;
-            wparams.n_threads        = params.n_threads;
-            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
-            wparams.offset_ms        = params.offset_t_ms;
-            wparams.duration_ms      = params.duration_ms;
-
-            wparams.token_timestamps = params.output_wts || params.output_jsn_full || params.max_len > 0;
-            wparams.thold_pt         = params.word_thold;
-            wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
-            wparams.split_on_word    = params.split_on_word;
-            wparams.audio_ctx        = params.audio_ctx;
-
-            wparams.debug_mode       = params.debug_mode;
+        const auto t_start = std::chrono::steady_clock::now();
 
-            wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+        const int ret = process_jobs(ctx, params, tpp);
 
-            wparams.suppress_regex   = params.suppress_regex.empty() ? nullptr : params.suppress_regex.c_str();
-
-            wparams.initial_prompt   = params.prompt.c_str();
-
-            wparams.greedy.best_of        = params.best_of;
-            wparams.beam_search.beam_size = params.beam_size;
-
-            wparams.temperature_inc  = params.no_fallback ? 0.0f : params.temperature_inc;
-            wparams.temperature      = params.temperature;
-
-            wparams.entropy_thold    = params.entropy_thold;
-            wparams.logprob_thold    = params.logprob_thold;
-            wparams.no_speech_thold  = params.no_speech_thold;
-
-            wparams.no_timestamps    = params.no_timestamps;
-
-            wparams.suppress_nst     = params.suppress_nst;
-
-            whisper_print_user_data user_data = { &params, &pcmf32s, 0 };
-
-            const auto & grammar_parsed = params.grammar_parsed;
-            auto grammar_rules = grammar_parsed.c_rules();
-
-            if (use_grammar) {
-                if (grammar_parsed.symbol_ids.find(params.grammar_rule) == grammar_parsed.symbol_ids.end()) {
-                    fprintf(stderr, "%s: warning: grammar rule '%s' not found - skipping grammar sampling\n", __func__, params.grammar_rule.c_str());
-                } else {
-                    wparams.grammar_rules = grammar_rules.data();
-                    wparams.n_grammar_rules = grammar_rules.size();
-                    wparams.i_start_rule = grammar_parsed.symbol_ids.at(params.grammar_rule);
-                    wparams.grammar_penalty = params.grammar_penalty;
-                }
-            }
-
-            // this callback is called on each new segment
-            if (!wparams.print_realtime) {
-                wparams.new_segment_callback           = whisper_print_segment_callback;
-                wparams.new_segment_callback_user_data = &user_data;
-            }
-
-            if (wparams.print_progress) {
-                wparams.progress_callback           = whisper_print_progress_callback;
-                wparams.progress_callback_user_data = &user_data;
-            }
-
-            // examples for abort mechanism
-            // in examples below, we do not abort the processing, but we could if the flag is set to true
-
-            // the callback is called before every encoder run - if it returns false, the processing is aborted
-            {
-                static bool is_aborted = false; // NOTE: this should be atomic to avoid data race
-
-                wparams.encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
-                    bool is_aborted = *(bool*)user_data;
-                    return !is_aborted;
-                };
-                wparams.encoder_begin_callback_user_data = &is_aborted;
-            }
-
-            // the callback is called before every computation - if it returns true, the computation is aborted
-            {
-                static bool is_aborted = false; // NOTE: this should be atomic to avoid data race
-
-                wparams.abort_callback = [](void * user_data) {
-                    bool is_aborted = *(bool*)user_data;
-                    return is_aborted;
-                };
-                wparams.abort_callback_user_data = &is_aborted;
-            }
+        if (!params.no_prints) {
+            const double t_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+            fprintf(stderr, "\n%s: processed %d files in %.2f s with %d jobs\n", __func__, (int) params.fname_inp.size(), t_sec, params.n_jobs);
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
-                fprintf(stderr, "%s: failed to process audio\n", argv[0]);
-                return 10;
-            }
+            whisper_print_timings(ctx);
         }
 
-        // output stuff
-        {
-            printf("\n");
+        whisper_free(ctx);
 
-            // output to text file
-            if (params.output_txt) {
-                const auto fname_txt = fname_out + ".txt";
-                output_txt(ctx, fname_txt.c_str(), params, pcmf32s);
-            }
-
-            // output to VTT file
-            if (params.output_vtt) {
-                const auto fname_vtt = fname_out + ".vtt";
-                output_vtt(ctx, fname_vtt.c_str(), params, pcmf32s);
-            }
-
-            // output to SRT file
-            if (params.output_srt) {
-                const auto fname_srt = fname_out + ".srt";
-                output_srt(ctx, fname_srt.c_str(), params, pcmf32s);
-            }
+        return ret;
+    }
 
-            // output to WTS file
-            if (params.output_wts) {
-                const auto fname_wts = fname_out + ".wts";
-                output_wts(ctx, fname_wts.c_str(), fname_inp.c_str(), params, float(pcmf32.size() + 1000)/WHISPER_SAMPLE_RATE, pcmf32s);
-            }
+    for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
+        whisper_input input;
+        if (!read_input(params, f, input)) {
+            continue;
+        }
 
-            // output to CSV file
-            if (params.output_csv) {
-                const auto fname_csv = fname_out + ".csv";
-                output_csv(ctx, fname_csv.c_str(), params, pcmf32s);
-            }
+        if (!params.no_prints) {
+            // print system information
+            fprintf(stderr, "\n");
+            fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
+                    params.n_threads*params.n_processors, std::thread::hardware_concurrency(), whisper_print_system_info());
 
-            // output to JSON file
-            if (params.output_jsn) {
-                const auto fname_jsn = fname_out + ".json";
-                output_json(ctx, fname_jsn.c_str(), params, pcmf32s, params.output_jsn_full);
-            }
+            // print some info about the processing
+            fprintf(stderr, "\n");
+            fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, %d processors, %d beams + best of %d, lang = %s, task = %s, %stimestamps = %d ...\n",
+                    __func__, input.fname_inp.c_str(), int(input.pcmf32.size()), float(input.pcmf32.size())/WHISPER_SAMPLE_RATE,
+                    params.n_threads, params.n_processors, params.beam_size, params.best_of,
+                    params.language.c_str(),
+                    params.translate ? "translate" : "transcribe",
+                    params.tinydiarize ? "tdrz = 1, " : "",
+                    params.no_timestamps ? 0 : 1);
 
-            // output to LRC file
-            if (params.output_lrc) {
-                const auto fname_lrc = fname_out + ".lrc";
-                output_lrc(ctx, fname_lrc.c_str(), params, pcmf32s);
-            }
+            fprintf(stderr, "\n");
+        }
 
-            // output to score file
-            if (params.log_score) {
-                const auto fname_score = fname_out + ".score.txt";
-                output_score(ctx, fname_score.c_str(), params, pcmf32s);
-            }
+        if (!process_input(ctx, nullptr, params, tpp, input, nullptr)) {
+            fprintf(stderr, "%s: failed to process audio\n", argv[0]);
+            return 10;
         }
     }
 
     if (!params.no_prints) {
         whisper_print_timings(ctx);
     }
+
+    if (!params.fname_profile.empty()) {
+        whisper_profile_print(ctx);
+        whisper_profile_dump_trace(ctx, params.fname_profile.c_str());
+    }
+
     whisper_free(ctx);
 
     return 0;
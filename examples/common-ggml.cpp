@@ -2,6 +2,9 @@
 
 #include <regex>
 #include <map>
+#include <cmath>
+#include <cstring>
+#include <sstream>
 
 static const std::map<std::string, enum ggml_ftype> GGML_FTYPE_MAP = {
     {"q4_0", GGML_FTYPE_MOSTLY_Q4_0},
@@ -38,6 +41,18 @@ enum ggml_ftype ggml_parse_ftype(const char * str) {
     return ftype;
 }
 
+enum ggml_type ggml_parse_type(const char * str) {
+    for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+        const char * name = ggml_type_name((enum ggml_type) i);
+        if (name && strcmp(name, str) == 0) {
+            return (enum ggml_type) i;
+        }
+    }
+
+    fprintf(stderr, "%s: unknown type '%s'\n", __func__, str);
+    return GGML_TYPE_COUNT;
+}
+
 bool ggml_common_quantize_0(
         std::ifstream & finp,
         std::ofstream & fout,
@@ -236,3 +251,248 @@ bool ggml_common_quantize_0(
 
     return true;
 }
+
+bool ggml_parse_quantize_rules(const std::string & fname, std::vector<ggml_quantize_rule> & rules) {
+    std::ifstream fin(fname);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    std::string line;
+    int n_line = 0;
+    while (std::getline(fin, line)) {
+        n_line++;
+
+        std::istringstream iss(line);
+
+        std::string pattern;
+        std::string type;
+        if (!(iss >> pattern) || pattern[0] == '#') {
+            continue;
+        }
+
+        if (!(iss >> type)) {
+            fprintf(stderr, "%s: %s:%d: missing type for '%s'\n", __func__, fname.c_str(), n_line, pattern.c_str());
+            return false;
+        }
+
+        ggml_quantize_rule rule = { pattern, GGML_TYPE_COUNT };
+        if (type != "skip") {
+            rule.type = ggml_parse_type(type.c_str());
+            if (rule.type == GGML_TYPE_COUNT) {
+                fprintf(stderr, "%s: %s:%d: unknown type '%s'\n", __func__, fname.c_str(), n_line, type.c_str());
+                return false;
+            }
+        }
+
+        rules.push_back(rule);
+    }
+
+    return true;
+}
+
+// read the header of the next tensor in a legacy ggml model file
+static bool ggml_common_read_tensor_header(std::ifstream & finp, int32_t & n_dims, int32_t & ttype, int32_t ne[4], std::string & name) {
+    int32_t length;
+
+    finp.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
+    finp.read(reinterpret_cast<char *>(&length), sizeof(length));
+    finp.read(reinterpret_cast<char *>(&ttype),  sizeof(ttype));
+
+    if (finp.eof()) {
+        return false;
+    }
+
+    ne[0] = ne[1] = ne[2] = ne[3] = 1;
+    for (int i = 0; i < n_dims; ++i) {
+        finp.read(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
+    }
+
+    name.resize(length);
+    finp.read(&name[0], length);
+
+    return true;
+}
+
+bool ggml_common_quantize_plan(
+        std::ifstream & finp,
+        const std::vector<ggml_quantize_rule> & rules,
+        const ggml_type type_default,
+        const std::vector<std::string> & to_skip,
+        std::vector<std::pair<std::string, ggml_type>> & plan) {
+    const auto pos = finp.tellg();
+
+    std::vector<std::regex> rules_re;
+    for (const auto & rule : rules) {
+        rules_re.emplace_back(rule.pattern);
+    }
+
+    plan.clear();
+
+    int32_t n_dims;
+    int32_t ttype;
+    int32_t ne[4];
+    std::string name;
+
+    while (ggml_common_read_tensor_header(finp, n_dims, ttype, ne, name)) {
+        const int64_t nelements = (int64_t) ne[0]*ne[1]*ne[2]*ne[3];
+
+        ggml_type type = type_default;
+
+        for (size_t i = 0; i < rules.size(); ++i) {
+            if (std::regex_match(name, rules_re[i])) {
+                type = rules[i].type;
+                break;
+            }
+        }
+
+        for (const auto & s : to_skip) {
+            if (std::regex_match(name, std::regex(s))) {
+                type = GGML_TYPE_COUNT;
+                break;
+            }
+        }
+
+        // k-quants need rows that are a multiple of 256 - fall back to a 32-element block type of similar size
+        if (type != GGML_TYPE_COUNT && ne[0] % ggml_blck_size(type) != 0) {
+            switch (type) {
+                case GGML_TYPE_Q2_K:
+                case GGML_TYPE_Q3_K:
+                case GGML_TYPE_Q4_K: type = GGML_TYPE_Q4_0; break;
+                case GGML_TYPE_Q5_K: type = GGML_TYPE_Q5_0; break;
+                case GGML_TYPE_Q6_K: type = GGML_TYPE_Q8_0; break;
+                default: break;
+            }
+        }
+
+        // only 2D float tensors with a row size that is a multiple of the block size can be converted
+        if (type == GGML_TYPE_COUNT || n_dims != 2 || ne[0] % ggml_blck_size(type) != 0 ||
+            (ttype != GGML_TYPE_F32 && ttype != GGML_TYPE_F16)) {
+            type = (ggml_type) ttype;
+        }
+
+        plan.emplace_back(name, type);
+
+        finp.seekg(ggml_row_size((ggml_type) ttype, ne[0])*(nelements/ne[0]), std::ios::cur);
+    }
+
+    finp.clear();
+    finp.seekg(pos);
+
+    return true;
+}
+
+bool ggml_common_quantize_1(
+        std::ifstream & finp,
+        std::ofstream & fout,
+        const std::vector<std::pair<std::string, ggml_type>> & plan,
+        bool print_error) {
+    size_t total_size_org = 0;
+    size_t total_size_new = 0;
+
+    std::vector<uint8_t>     work;
+    std::vector<uint8_t>     data_u8;
+    std::vector<ggml_fp16_t> data_f16;
+    std::vector<float>       data_f32;
+    std::vector<float>       data_deq;
+
+    std::map<ggml_type, int> n_per_type;
+
+    int32_t n_dims;
+    int32_t ttype;
+    int32_t ne[4];
+    std::string name;
+
+    for (size_t it = 0; ggml_common_read_tensor_header(finp, n_dims, ttype, ne, name); ++it) {
+        if (it >= plan.size() || plan[it].first != name) {
+            fprintf(stderr, "%s: tensor '%s' does not match the quantization plan\n", __func__, name.c_str());
+            return false;
+        }
+
+        const int64_t nelements = (int64_t) ne[0]*ne[1]*ne[2]*ne[3];
+        const int64_t nrows     = nelements/ne[0];
+
+        const ggml_type type_src = (ggml_type) ttype;
+        const ggml_type type_dst = plan[it].second;
+
+        printf("%64s - [%5d, %5d, %5d], type = %6s -> %6s ", name.data(), ne[0], ne[1], ne[2], ggml_type_name(type_src), ggml_type_name(type_dst));
+
+        const size_t size_src = ggml_row_size(type_src, ne[0])*nrows;
+
+        data_u8.resize(size_src);
+        finp.read(reinterpret_cast<char *>(data_u8.data()), size_src);
+
+        const int32_t length = name.size();
+
+        fout.write(reinterpret_cast<const char *>(&n_dims),   sizeof(n_dims));
+        fout.write(reinterpret_cast<const char *>(&length),   sizeof(length));
+        fout.write(reinterpret_cast<const char *>(&type_dst), sizeof(int32_t));
+        for (int i = 0; i < n_dims; ++i) {
+            fout.write(reinterpret_cast<const char *>(&ne[i]), sizeof(ne[i]));
+        }
+        fout.write(&name[0], length);
+
+        n_per_type[type_dst]++;
+
+        if (type_dst == type_src) {
+            printf("size = %8.3f MB\n", size_src/1024.0/1024.0);
+            fout.write(reinterpret_cast<const char *>(data_u8.data()), size_src);
+            total_size_new += size_src;
+            total_size_org += size_src;
+            continue;
+        }
+
+        data_f32.resize(nelements);
+        if (type_src == GGML_TYPE_F16) {
+            data_f16.resize(nelements);
+            memcpy(data_f16.data(), data_u8.data(), size_src);
+            for (int64_t i = 0; i < nelements; ++i) {
+                data_f32[i] = ggml_fp16_to_fp32(data_f16[i]);
+            }
+        } else {
+            memcpy(data_f32.data(), data_u8.data(), size_src);
+        }
+
+        work.resize(ggml_row_size(type_dst, ne[0])*nrows);
+
+        const size_t cur_size = ggml_quantize_chunk(type_dst, data_f32.data(), work.data(), 0, nrows, ne[0], nullptr);
+
+        fout.write(reinterpret_cast<const char *>(work.data()), cur_size);
+        total_size_new += cur_size;
+        total_size_org += size_src;
+
+        printf("size = %8.2f MB -> %8.2f MB", size_src/1024.0/1024.0, cur_size/1024.0/1024.0);
+
+        const auto * traits = ggml_get_type_traits(type_dst);
+        if (print_error && traits->to_float) {
+            data_deq.resize(nelements);
+            traits->to_float(work.data(), data_deq.data(), nelements);
+
+            double sum_err2 = 0.0;
+            double sum_ref2 = 0.0;
+            double max_err  = 0.0;
+            for (int64_t i = 0; i < nelements; ++i) {
+                const double err = data_deq[i] - data_f32[i];
+                sum_err2 += err*err;
+                sum_ref2 += (double) data_f32[i]*data_f32[i];
+                max_err   = std::max(max_err, std::fabs(err));
+            }
+
+            const double rmse = std::sqrt(sum_err2/nelements);
+            const double rel  = sum_ref2 > 0.0 ? std::sqrt(sum_err2/sum_ref2) : 0.0;
+
+            printf(" | rmse = %.6f, rel = %.4f%%, max = %.6f", rmse, 100.0*rel, max_err);
+        }
+
+        printf("\n");
+    }
+
+    printf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
+    printf("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
+    for (const auto & kv : n_per_type) {
+        printf("%s: %6s tensors = %d\n", __func__, ggml_type_name(kv.first), kv.second);
+    }
+
+    return true;
+}
@@ -10,9 +10,40 @@ enum ggml_ftype ggml_parse_ftype(const char * str);
 
 void ggml_print_ftypes(FILE * fp = stderr);
 
+// parse a ggml type name (e.g. "f16", "q8_0") - returns GGML_TYPE_COUNT if unknown
+enum ggml_type ggml_parse_type(const char * str);
+
 bool ggml_common_quantize_0(
         std::ifstream & finp,
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
         const std::vector<std::string> & to_skip);
+
+// per-tensor quantization rule: tensors with a name matching the regex are stored with the given type
+struct ggml_quantize_rule {
+    std::string pattern;
+    ggml_type   type;
+};
+
+// parse rules from a text file with one "regex type" pair per line (lines starting with '#' are ignored)
+// the type "skip" keeps the matching tensors in their source type (stored as GGML_TYPE_COUNT)
+bool ggml_parse_quantize_rules(const std::string & fname, std::vector<ggml_quantize_rule> & rules);
+
+// scan the tensors in finp and compute the type that each of them will be stored with
+// the first matching rule wins; tensors that match no rule use type_default
+// the stream position is restored after the scan
+bool ggml_common_quantize_plan(
+        std::ifstream & finp,
+        const std::vector<ggml_quantize_rule> & rules,
+        const ggml_type type_default,
+        const std::vector<std::string> & to_skip,
+        std::vector<std::pair<std::string, ggml_type>> & plan);
+
+// quantize each tensor in finp to the type given by the plan (in file order)
+// if print_error is set, the RMSE and max abs error of each converted tensor is measured against the source data
+bool ggml_common_quantize_1(
+        std::ifstream & finp,
+        std::ofstream & fout,
+        const std::vector<std::pair<std::string, ggml_type>> & plan,
+        bool print_error);
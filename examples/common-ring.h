@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+//
+// Lock-free single-producer / single-consumer audio ring buffer
+//
+// The producer (e.g. an audio callback) never blocks - when the buffer is full, the oldest samples
+// are overwritten. Samples are addressed by their absolute position since the buffer was created,
+// so the consumer can keep a cursor and read only what is new since the last read.
+//
+// Reads return zero-copy views into the buffer. A view stays intact until the producer has written
+// capacity() - view.size() more samples; check overrun() after using the data if that can happen.
+//
+
+class audio_ring {
+public:
+    // [pos, pos + size()) split in two parts at the wrap point of the buffer
+    struct view {
+        const float * p0 = nullptr;
+        const float * p1 = nullptr;
+
+        size_t n0 = 0;
+        size_t n1 = 0;
+
+        uint64_t pos = 0; // absolute position of the first sample
+
+        size_t   size() const { return n0 + n1; }
+        uint64_t end()  const { return pos + size(); }
+
+        float operator[](size_t i) const { return i < n0 ? p0[i] : p1[i - n0]; }
+
+        void copy_to(std::vector<float> & dst) const {
+            dst.resize(size());
+            if (n0 > 0) {
+                memcpy(dst.data(), p0, n0*sizeof(float));
+            }
+            if (n1 > 0) {
+                memcpy(dst.data() + n0, p1, n1*sizeof(float));
+            }
+        }
+    };
+
+    audio_ring() = default;
+    explicit audio_ring(size_t capacity) { resize(capacity); }
+
+    // not thread-safe - call before the producer starts
+    void resize(size_t capacity) {
+        m_data.assign(capacity, 0.0f);
+        m_head.store(0);
+        m_reserve.store(0);
+    }
+
+    size_t capacity() const { return m_data.size(); }
+
+    //
+    // producer
+    //
+
+    void write(const float * samples, size_t n) {
+        const size_t cap = m_data.size();
+        if (cap == 0 || n == 0) {
+            return;
+        }
+
+        const uint64_t head = m_head.load(std::memory_order_relaxed);
+
+        // announce the positions about to be overwritten before touching the data
+        m_reserve.store(head + n, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        // only the newest capacity() samples can be kept
+        uint64_t pos = head;
+        if (n > cap) {
+            samples += n - cap;
+            pos     += n - cap;
+            n        = cap;
+        }
+
+        const size_t i0 = pos % cap;
+        const size_t n0 = std::min(n, cap - i0);
+
+        memcpy(m_data.data() + i0, samples,      n0      *sizeof(float));
+        memcpy(m_data.data(),      samples + n0, (n - n0)*sizeof(float));
+
+        m_head.store(pos + n, std::memory_order_release);
+    }
+
+    //
+    // consumer
+    //
+
+    // total number of samples written so far
+    uint64_t head() const { return m_head.load(std::memory_order_acquire); }
+
+    // samples [begin, end), clamped to what is still in the buffer
+    view read(uint64_t begin, uint64_t end) const {
+        const uint64_t head = this->head();
+        const uint64_t tail = head - std::min<uint64_t>(head, capacity());
+
+        end   = std::min(std::max(end,   tail), head);
+        begin = std::min(std::max(begin, tail), end);
+
+        return make_view(begin, end);
+    }
+
+    // the newest n samples, or fewer if not available
+    view read_last(size_t n) const {
+        const uint64_t head = this->head();
+        return read(head - std::min<uint64_t>(n, head), head);
+    }
+
+    // all available samples at or after cursor
+    view read_since(uint64_t cursor) const {
+        return read(cursor, UINT64_MAX);
+    }
+
+    // true if the producer may have overwritten some of the samples of the view
+    bool overrun(const view & v) const {
+        return n_overrun(v) > 0;
+    }
+
+    // number of leading samples of the view that may have been overwritten
+    size_t n_overrun(const view & v) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t reserve = m_reserve.load(std::memory_order_relaxed);
+        return (size_t) std::min<uint64_t>(v.size(), reserve > v.pos + capacity() ? reserve - v.pos - capacity() : 0);
+    }
+
+private:
+    view make_view(uint64_t pos, uint64_t end) const {
+        view v;
+        v.pos = pos;
+
+        const size_t cap = m_data.size();
+        const size_t n   = end - pos;
+        if (n == 0) {
+            return v;
+        }
+
+        const size_t i0 = pos % cap;
+
+        v.p0 = m_data.data() + i0;
+        v.n0 = std::min(n, cap - i0);
+        v.p1 = m_data.data();
+        v.n1 = n - v.n0;
+
+        return v;
+    }
+
+    std::vector<float> m_data;
+
+    std::atomic<uint64_t> m_head    { 0 }; // published samples
+    std::atomic<uint64_t> m_reserve { 0 }; // samples being written
+};
@@ -73,7 +73,9 @@ bool audio_async::init(int capture_id, int sample_rate) {
 
     m_sample_rate = capture_spec_obtained.freq;
 
-    m_audio.resize((m_sample_rate*m_len_ms)/1000);
+    // twice the requested length, so that views of len_ms are not overwritten while in use
+    m_ring.resize((2*m_sample_rate*m_len_ms)/1000);
+    m_clear = 0;
 
     return true;
 }
@@ -125,12 +127,7 @@ bool audio_async::clear() {
         return false;
     }
 
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
-
-        m_audio_pos = 0;
-        m_audio_len = 0;
-    }
+    m_clear = m_ring.head();
 
     return true;
 }
@@ -141,76 +138,55 @@ void audio_async::callback(uint8_t * stream, int len) {
         return;
     }
 
-    size_t n_samples = len / sizeof(float);
-
-    if (n_samples > m_audio.size()) {
-        n_samples = m_audio.size();
+    m_ring.write((const float *) stream, len / sizeof(float));
+}
 
-        stream += (len - (n_samples * sizeof(float)));
+audio_ring::view audio_async::get_view(int ms) {
+    if (!m_dev_id_in) {
+        fprintf(stderr, "%s: no audio device to get audio from!\n", __func__);
+        return {};
     }
 
-    //fprintf(stderr, "%s: %zu samples, pos %zu, len %zu\n", __func__, n_samples, m_audio_pos, m_audio_len);
-
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
-
-        if (m_audio_pos + n_samples > m_audio.size()) {
-            const size_t n0 = m_audio.size() - m_audio_pos;
+    if (!m_running) {
+        fprintf(stderr, "%s: not running!\n", __func__);
+        return {};
+    }
 
-            memcpy(&m_audio[m_audio_pos], stream, n0 * sizeof(float));
-            memcpy(&m_audio[0], stream + n0 * sizeof(float), (n_samples - n0) * sizeof(float));
+    if (ms <= 0 || ms > m_len_ms) {
+        ms = m_len_ms;
+    }
 
-            m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
-            m_audio_len = m_audio.size();
-        } else {
-            memcpy(&m_audio[m_audio_pos], stream, n_samples * sizeof(float));
+    const uint64_t head = m_ring.head();
+    const uint64_t n    = (uint64_t(m_sample_rate) * ms) / 1000;
 
-            m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
-            m_audio_len = std::min(m_audio_len + n_samples, m_audio.size());
-        }
-    }
+    return m_ring.read(std::max(m_clear, head - std::min(n, head)), head);
 }
 
-void audio_async::get(int ms, std::vector<float> & result) {
+audio_ring::view audio_async::get_since(uint64_t cursor) {
     if (!m_dev_id_in) {
         fprintf(stderr, "%s: no audio device to get audio from!\n", __func__);
-        return;
+        return {};
     }
 
     if (!m_running) {
         fprintf(stderr, "%s: not running!\n", __func__);
-        return;
+        return {};
     }
 
-    result.clear();
-
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
-
-        if (ms <= 0) {
-            ms = m_len_ms;
-        }
-
-        size_t n_samples = (m_sample_rate * ms) / 1000;
-        if (n_samples > m_audio_len) {
-            n_samples = m_audio_len;
-        }
+    return m_ring.read_since(std::max(cursor, m_clear));
+}
 
-        result.resize(n_samples);
+void audio_async::get(int ms, std::vector<float> & result) {
+    result.clear();
 
-        int s0 = m_audio_pos - n_samples;
-        if (s0 < 0) {
-            s0 += m_audio.size();
-        }
+    const audio_ring::view view = get_view(ms);
 
-        if (s0 + n_samples > m_audio.size()) {
-            const size_t n0 = m_audio.size() - s0;
+    view.copy_to(result);
 
-            memcpy(result.data(), &m_audio[s0], n0 * sizeof(float));
-            memcpy(&result[n0], &m_audio[0], (n_samples - n0) * sizeof(float));
-        } else {
-            memcpy(result.data(), &m_audio[s0], n_samples * sizeof(float));
-        }
+    // drop the oldest samples if the callback has caught up with them while copying
+    const size_t n_overrun = m_ring.n_overrun(view);
+    if (n_overrun > 0) {
+        result.erase(result.begin(), result.begin() + n_overrun);
     }
 }
 
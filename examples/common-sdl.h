@@ -1,12 +1,13 @@
 #pragma once
 
+#include "common-ring.h"
+
 #include <SDL.h>
 #include <SDL_audio.h>
 
 #include <atomic>
 #include <cstdint>
 #include <vector>
-#include <mutex>
 
 //
 // SDL Audio capture
@@ -20,7 +21,7 @@ public:
     bool init(int capture_id, int sample_rate);
 
     // start capturing audio via the provided SDL callback
-    // keep last len_ms seconds of audio in a circular buffer
+    // keep last len_ms seconds of audio in a lock-free ring buffer
     bool resume();
     bool pause();
     bool clear();
@@ -28,9 +29,16 @@ public:
     // callback to be called by SDL
     void callback(uint8_t * stream, int len);
 
-    // get audio data from the circular buffer
+    // copy the last ms milliseconds of audio captured since the last clear() (0 - all)
     void get(int ms, std::vector<float> & audio);
 
+    // zero-copy variants - the views stay valid for len_ms of further capture
+    audio_ring::view get_view (int ms);
+    audio_ring::view get_since(uint64_t cursor); // audio at or after cursor, use view.end() as the next cursor
+
+    // absolute position of the newest captured sample
+    uint64_t position() const { return m_ring.head(); }
+
 private:
     SDL_AudioDeviceID m_dev_id_in = 0;
 
@@ -38,11 +46,12 @@ private:
     int m_sample_rate = 0;
 
     std::atomic_bool m_running;
-    std::mutex       m_mutex;
 
-    std::vector<float> m_audio;
-    size_t             m_audio_pos = 0;
-    size_t             m_audio_len = 0;
+    // written by the SDL callback, read by the main thread
+    audio_ring m_ring;
+
+    // position of the last clear() - only touched by the consumer
+    uint64_t m_clear = 0;
 };
 
 // Return false if need to quit
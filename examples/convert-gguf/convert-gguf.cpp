@@ -0,0 +1,96 @@
+#include "whisper.h"
+
+#include <cstdio>
+#include <map>
+#include <string>
+
+static const std::map<std::string, whisper_alignment_heads_preset> g_presets = {
+    { "tiny",           WHISPER_AHEADS_TINY           },
+    { "tiny.en",        WHISPER_AHEADS_TINY_EN        },
+    { "base",           WHISPER_AHEADS_BASE           },
+    { "base.en",        WHISPER_AHEADS_BASE_EN        },
+    { "small",          WHISPER_AHEADS_SMALL          },
+    { "small.en",       WHISPER_AHEADS_SMALL_EN       },
+    { "medium",         WHISPER_AHEADS_MEDIUM         },
+    { "medium.en",      WHISPER_AHEADS_MEDIUM_EN      },
+    { "large.v1",       WHISPER_AHEADS_LARGE_V1       },
+    { "large.v2",       WHISPER_AHEADS_LARGE_V2       },
+    { "large.v3",       WHISPER_AHEADS_LARGE_V3       },
+    { "large.v3.turbo", WHISPER_AHEADS_LARGE_V3_TURBO },
+};
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s [options] model.bin model.gguf\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "convert a whisper model from the ggml format to GGUF\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,       --help          show this help message and exit\n");
+    fprintf(stderr, "  -dtw NAME --dtw NAME      alignment heads preset to store in the model (default: derived from the model)\n");
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char ** argv) {
+    std::string fname_inp;
+    std::string fname_out;
+    std::string dtw;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else if ((arg == "-dtw" || arg == "--dtw") && i + 1 < argc) {
+            dtw = argv[++i];
+        } else if (arg[0] == '-') {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argv[0]);
+            return 1;
+        } else if (fname_inp.empty()) {
+            fname_inp = arg;
+        } else if (fname_out.empty()) {
+            fname_out = arg;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (fname_inp.empty() || fname_out.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    struct whisper_context_params cparams = whisper_context_default_params();
+
+    // the tensors are read back from host memory when writing the file, in their original layout
+    cparams.use_gpu         = false;
+    cparams.use_extra_bufts = false;
+
+    if (!dtw.empty()) {
+        const auto it = g_presets.find(dtw);
+        if (it == g_presets.end()) {
+            fprintf(stderr, "error: unknown DTW preset '%s'\n", dtw.c_str());
+            return 1;
+        }
+        cparams.dtw_aheads_preset = it->second;
+    }
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(fname_inp.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to load model '%s'\n", fname_inp.c_str());
+        return 2;
+    }
+
+    const int ret = whisper_model_save_gguf(ctx, fname_out.c_str());
+
+    whisper_free(ctx);
+
+    if (ret != 0) {
+        fprintf(stderr, "error: failed to write '%s'\n", fname_out.c_str());
+        return 3;
+    }
+
+    return 0;
+}
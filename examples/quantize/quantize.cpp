@@ -1,4 +1,5 @@
 #include "ggml.h"
+#include "whisper.h"
 
 #include "common.h"
 #include "common-ggml.h"
@@ -36,7 +37,15 @@ struct whisper_filters {
 };
 
 // quantize a model
-static bool whisper_model_quantize(const std::string & fname_inp, const std::string & fname_out, ggml_ftype ftype) {
+static bool whisper_model_quantize(
+        const std::string & fname_inp,
+        const std::string & fname_out,
+        ggml_ftype ftype,
+        const std::vector<ggml_quantize_rule> & rules,
+        bool print_error) {
+    // only the rules can give tensors a type other than the ftype - --stats alone keeps the uniform format
+    const bool mixed = !rules.empty();
+
     gpt_vocab vocab;
 
     printf("%s: loading model from '%s'\n", __func__, fname_inp.c_str());
@@ -82,7 +91,7 @@ static bool whisper_model_quantize(const std::string & fname_inp, const std::str
         finp.read((char *) &hparams.ftype,         sizeof(hparams.ftype));
 
         const int32_t qntvr_src =    hparams.ftype / GGML_QNT_VERSION_FACTOR;
-        const int32_t ftype_dst = GGML_QNT_VERSION * GGML_QNT_VERSION_FACTOR + ftype;
+        const int32_t ftype_dst = GGML_QNT_VERSION * GGML_QNT_VERSION_FACTOR + (mixed ? WHISPER_FTYPE_MIXED : ftype);
 
         fprintf(stderr, "%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
         fprintf(stderr, "%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
@@ -164,9 +173,54 @@ static bool whisper_model_quantize(const std::string & fname_inp, const std::str
         "decoder.positional_embedding",
     };
 
-    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip)) {
-        fprintf(stderr, "%s: failed to quantize model '%s'\n", __func__, fname_inp.c_str());
-        return false;
+    if (!mixed && !print_error) {
+        if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip)) {
+            fprintf(stderr, "%s: failed to quantize model '%s'\n", __func__, fname_inp.c_str());
+            return false;
+        }
+    } else {
+        std::vector<std::pair<std::string, ggml_type>> plan;
+
+        if (!ggml_common_quantize_plan(finp, rules, ggml_ftype_to_ggml_type(ftype), to_skip, plan)) {
+            fprintf(stderr, "%s: failed to scan tensors of model '%s'\n", __func__, fname_inp.c_str());
+            return false;
+        }
+
+        if (!mixed) {
+            // a uniform model has no type table - every converted tensor must have the type of the ftype
+            const ggml_type type_base = ggml_ftype_to_ggml_type(ftype);
+
+            for (const auto & entry : plan) {
+                if (entry.second != type_base && entry.second != GGML_TYPE_F32 && entry.second != GGML_TYPE_F16) {
+                    fprintf(stderr, "%s: tensor '%s' cannot be stored as %s - use --rule to choose its type\n",
+                            __func__, entry.first.c_str(), ggml_type_name(type_base));
+                    return false;
+                }
+            }
+        }
+
+        // write the per-tensor type table
+        if (mixed) {
+            const int32_t ftype_base = ftype;
+            const int32_t n_tensors  = plan.size();
+
+            fout.write((const char *) &ftype_base, sizeof(ftype_base));
+            fout.write((const char *) &n_tensors,  sizeof(n_tensors));
+
+            for (const auto & entry : plan) {
+                const int32_t len   = entry.first.size();
+                const int32_t ttype = entry.second;
+
+                fout.write((const char *) &len, sizeof(len));
+                fout.write(entry.first.data(),  len);
+                fout.write((const char *) &ttype, sizeof(ttype));
+            }
+        }
+
+        if (!ggml_common_quantize_1(finp, fout, plan, print_error)) {
+            fprintf(stderr, "%s: failed to quantize model '%s'\n", __func__, fname_inp.c_str());
+            return false;
+        }
     }
 
     finp.close();
@@ -175,10 +229,68 @@ static bool whisper_model_quantize(const std::string & fname_inp, const std::str
     return true;
 }
 
+static void whisper_print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s [options] model-f32.bin model-quant.bin type\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  --recipe FNAME     file with per-tensor rules, one \"regex type\" pair per line\n");
+    fprintf(stderr, "  --rule REGEX=TYPE  per-tensor rule (can be repeated, takes precedence over --recipe)\n");
+    fprintf(stderr, "                     TYPE is a ggml type name (e.g. q8_0, q4_K, f16) or \"skip\"\n");
+    fprintf(stderr, "  --stats            print the quantization error of each tensor\n");
+    fprintf(stderr, "\n");
+    ggml_print_ftypes(stderr);
+}
+
 int main(int argc, char ** argv) {
-    if (argc != 4) {
-        fprintf(stderr, "usage: %s model-f32.bin model-quant.bin type\n", argv[0]);
-        ggml_print_ftypes(stderr);
+    std::vector<ggml_quantize_rule> rules;
+    std::vector<ggml_quantize_rule> rules_recipe;
+    std::vector<std::string> positional;
+
+    bool print_error = false;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+
+        if (arg == "--recipe" && i + 1 < argc) {
+            if (!ggml_parse_quantize_rules(argv[++i], rules_recipe)) {
+                return 1;
+            }
+        } else if (arg == "--rule" && i + 1 < argc) {
+            const std::string rule = argv[++i];
+            const size_t pos = rule.rfind('=');
+            if (pos == std::string::npos) {
+                fprintf(stderr, "error: invalid rule '%s', expected REGEX=TYPE\n", rule.c_str());
+                return 1;
+            }
+
+            const std::string type = rule.substr(pos + 1);
+
+            ggml_quantize_rule r = { rule.substr(0, pos), GGML_TYPE_COUNT };
+            if (type != "skip") {
+                r.type = ggml_parse_type(type.c_str());
+                if (r.type == GGML_TYPE_COUNT) {
+                    return 1;
+                }
+            }
+            rules.push_back(r);
+        } else if (arg == "--stats") {
+            print_error = true;
+        } else if (arg == "-h" || arg == "--help") {
+            whisper_print_usage(argv[0]);
+            return 0;
+        } else if (arg.size() > 1 && arg[0] == '-' && arg[1] == '-') {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            whisper_print_usage(argv[0]);
+            return 1;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    rules.insert(rules.end(), rules_recipe.begin(), rules_recipe.end());
+
+    if (positional.size() != 3) {
+        whisper_print_usage(argv[0]);
         return 1;
     }
 
@@ -189,10 +301,10 @@ int main(int argc, char ** argv) {
         ggml_free(ctx);
     }
 
-    const std::string fname_inp = argv[1];
-    const std::string fname_out = argv[2];
+    const std::string fname_inp = positional[0];
+    const std::string fname_out = positional[1];
 
-    const ggml_ftype ftype = ggml_parse_ftype(argv[3]);
+    const ggml_ftype ftype = ggml_parse_ftype(positional[2].c_str());
 
     const int64_t t_main_start_us = ggml_time_us();
 
@@ -202,7 +314,7 @@ int main(int argc, char ** argv) {
     {
         const int64_t t_start_us = ggml_time_us();
 
-        if (!whisper_model_quantize(fname_inp, fname_out, ggml_ftype(ftype))) {
+        if (!whisper_model_quantize(fname_inp, fname_out, ggml_ftype(ftype), rules, print_error)) {
             fprintf(stderr, "%s: failed to quantize model from '%s'\n", __func__, fname_inp.c_str());
             return 1;
         }
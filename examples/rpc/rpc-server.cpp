@@ -0,0 +1,131 @@
+// ggml-rpc server for distributed inference
+//
+// Exposes the CPU backend of this machine to whisper contexts created with rpc_servers
+// (whisper-cli --rpc host:port). Only run it on trusted networks - the protocol has no
+// authentication.
+//
+#include "ggml.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+#include "ggml-rpc.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+// command-line parameters
+struct rpc_server_params {
+    std::string host = "127.0.0.1";
+    int32_t     port = 50052;
+
+    int32_t n_threads = std::max(1, (int32_t) std::thread::hardware_concurrency()/2);
+    size_t  mem_mb    = 0; // memory reported to the clients (0 - free system memory)
+
+    std::string cache_dir = ""; // tensor data cache (empty - disabled)
+};
+
+static void rpc_server_print_usage(int /*argc*/, char ** argv, const rpc_server_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,       --help        [default] show this help message and exit\n");
+    fprintf(stderr, "  -H HOST,  --host HOST   [%-7s] host to bind to\n",                             params.host.c_str());
+    fprintf(stderr, "  -p PORT,  --port PORT   [%-7d] port to bind to\n",                             params.port);
+    fprintf(stderr, "  -t N,     --threads N   [%-7d] number of threads of the CPU backend\n",        params.n_threads);
+    fprintf(stderr, "  -m MB,    --mem MB      [%-7zu] memory to report to the clients (0 - free)\n", params.mem_mb);
+    fprintf(stderr, "  -c DIR,   --cache DIR   [%-7s] cache the uploaded weights in DIR, addressed by hash\n", params.cache_dir.c_str());
+    fprintf(stderr, "\n");
+}
+
+static bool rpc_server_params_parse(int argc, char ** argv, rpc_server_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            rpc_server_print_usage(argc, argv, params);
+            exit(0);
+        }
+
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: argument %s requires value\n", arg.c_str());
+            return false;
+        }
+
+        if      (arg == "-H" || arg == "--host")    { params.host      = argv[++i]; }
+        else if (arg == "-p" || arg == "--port")    { params.port      = std::stoi(argv[++i]); }
+        else if (arg == "-t" || arg == "--threads") { params.n_threads = std::stoi(argv[++i]); }
+        else if (arg == "-m" || arg == "--mem")     { params.mem_mb    = std::stoul(argv[++i]); }
+        else if (arg == "-c" || arg == "--cache")   { params.cache_dir = argv[++i]; }
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            rpc_server_print_usage(argc, argv, params);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    rpc_server_params params;
+
+    if (!rpc_server_params_parse(argc, argv, params)) {
+        return 1;
+    }
+
+    if (params.port <= 0 || params.port > 65535) {
+        fprintf(stderr, "error: invalid port %d\n", params.port);
+        return 1;
+    }
+
+    if (params.host != "127.0.0.1" && params.host != "localhost") {
+        fprintf(stderr, "warning: the RPC server is exposed on %s - never run it on an open network\n", params.host.c_str());
+    }
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    if (!backend) {
+        fprintf(stderr, "error: failed to initialize the CPU backend\n");
+        return 1;
+    }
+
+    ggml_backend_cpu_set_n_threads(backend, params.n_threads);
+
+    size_t free_mem  = 0;
+    size_t total_mem = 0;
+
+    ggml_backend_dev_memory(ggml_backend_get_device(backend), &free_mem, &total_mem);
+
+#if defined(_SC_AVPHYS_PAGES) && defined(_SC_PHYS_PAGES)
+    // the CPU device does not report its memory
+    if (total_mem == 0) {
+        free_mem  = (size_t) sysconf(_SC_AVPHYS_PAGES)*sysconf(_SC_PAGESIZE);
+        total_mem = (size_t) sysconf(_SC_PHYS_PAGES)  *sysconf(_SC_PAGESIZE);
+    }
+#endif
+
+    if (params.mem_mb > 0) {
+        free_mem  = params.mem_mb*1024*1024;
+        total_mem = free_mem;
+    }
+
+    const std::string endpoint = params.host + ":" + std::to_string(params.port);
+
+    fprintf(stderr, "%s: listening on %s, %d threads, %zu MB free / %zu MB total\n", __func__,
+            endpoint.c_str(), params.n_threads, free_mem/1024/1024, total_mem/1024/1024);
+
+    if (!params.cache_dir.empty()) {
+        fprintf(stderr, "%s: caching the weights in %s\n", __func__, params.cache_dir.c_str());
+    }
+
+    ggml_backend_rpc_start_server(backend, endpoint.c_str(), params.cache_dir.empty() ? nullptr : params.cache_dir.c_str(), free_mem, total_mem);
+
+    ggml_backend_free(backend);
+
+    return 0;
+}
@@ -4,9 +4,20 @@
 #include "httplib.h"
 #include "json.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
 #include <string>
 #include <thread>
 #include <vector>
@@ -40,6 +51,17 @@ struct server_params
     int32_t read_timeout  = 600;
     int32_t write_timeout = 600;
 
+    int32_t stream_slots   = 4;  // max number of concurrent streaming sessions
+    int32_t stream_timeout = 60; // seconds after which an idle session can be closed
+
+    int32_t model_budget_mb = 0; // max total memory of the resident models (0 - unlimited)
+
+    int32_t group_size     = 4;  // max number of requests for the same model dispatched to a worker together
+    int32_t group_delay_ms = 10; // how long a request waits for others to join its group
+    int32_t n_workers      = 2;  // max number of groups processed at the same time
+
+    std::vector<std::pair<std::string, std::string>> extra_models; // name, path
+
     bool ffmpeg_converter = false;
 };
 
@@ -137,6 +159,13 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  --request-path PATH,           [%-7s] Request path for all requests\n", sparams.request_path.c_str());
     fprintf(stderr, "  --inference-path PATH,         [%-7s] Inference path for all requests\n", sparams.inference_path.c_str());
     fprintf(stderr, "  --convert,                     [%-7s] Convert audio to WAV, requires ffmpeg on the server\n", sparams.ffmpeg_converter ? "true" : "false");
+    fprintf(stderr, "  --stream-slots N,              [%-7d] Max number of concurrent /stream sessions\n", sparams.stream_slots);
+    fprintf(stderr, "  --stream-timeout N,            [%-7d] Idle /stream sessions are closed after N seconds\n", sparams.stream_timeout);
+    fprintf(stderr, "  --extra-model NAME=PATH,       [%-7s] Load an additional model that requests can select by name\n", "");
+    fprintf(stderr, "  --model-budget N,              [%-7d] Max total memory of the resident models in MB (0 - unlimited)\n", sparams.model_budget_mb);
+    fprintf(stderr, "  --group-size N,                [%-7d] Max number of inference requests run concurrently by one worker\n", sparams.group_size);
+    fprintf(stderr, "  --group-delay MS,              [%-7d] Time a request waits for others to join its group\n", sparams.group_delay_ms);
+    fprintf(stderr, "  --workers N,                   [%-7d] Max number of request groups processed at the same time\n", sparams.n_workers);
     fprintf(stderr, "  -sns,      --suppress-nst      [%-7s] suppress non-speech tokens\n", params.suppress_nst ? "true" : "false");
     fprintf(stderr, "  -nth N,    --no-speech-thold N [%-7.2f] no speech threshold\n",   params.no_speech_thold);
     fprintf(stderr, "\n");
@@ -193,6 +222,21 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params, serve
         else if (                  arg == "--request-path")    { sparams.request_path = argv[++i]; }
         else if (                  arg == "--inference-path")  { sparams.inference_path = argv[++i]; }
         else if (                  arg == "--convert")         { sparams.ffmpeg_converter     = true; }
+        else if (                  arg == "--stream-slots")    { sparams.stream_slots   = std::stoi(argv[++i]); }
+        else if (                  arg == "--stream-timeout")  { sparams.stream_timeout = std::stoi(argv[++i]); }
+        else if (                  arg == "--model-budget")    { sparams.model_budget_mb = std::stoi(argv[++i]); }
+        else if (                  arg == "--group-size")      { sparams.group_size     = std::max(1, std::stoi(argv[++i])); }
+        else if (                  arg == "--group-delay")     { sparams.group_delay_ms = std::max(0, std::stoi(argv[++i])); }
+        else if (                  arg == "--workers")         { sparams.n_workers      = std::max(1, std::stoi(argv[++i])); }
+        else if (                  arg == "--extra-model")     {
+            const std::string value = argv[++i];
+            const size_t pos = value.find('=');
+            if (pos == std::string::npos || pos == 0) {
+                fprintf(stderr, "error: expected NAME=PATH for --extra-model, got '%s'\n", value.c_str());
+                exit(0);
+            }
+            sparams.extra_models.emplace_back(value.substr(0, pos), value.substr(pos + 1));
+        }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params, sparams);
@@ -309,11 +353,11 @@ void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct wh
     }
 }
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
 
     std::string speaker = "";
 
@@ -329,8 +373,8 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
 
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = whisper_full_get_segment_t0_from_state(state, i);
+            t1 = whisper_full_get_segment_t1_from_state(state, i);
         }
 
         if (!params.no_timestamps) {
@@ -342,29 +386,29 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
         }
 
         if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                    const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                     if (id >= whisper_token_eot(ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                const float  p    = whisper_full_get_token_p_from_state(state, i, j);
 
                 const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
 
                 printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
             }
         } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
 
             printf("%s%s", speaker.c_str(), text);
         }
 
         if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+            if (whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                 printf("%s", params.tdrz_speaker_turn.c_str());
             }
         }
@@ -377,23 +421,81 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
     }
 }
 
-std::string output_str(struct whisper_context * ctx, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::stringstream result;
-    const int n_segments = whisper_full_n_segments(ctx);
+// results of an inference, copied out of the state so that the state can serve the next request right away
+struct server_token {
+    whisper_token_data data;
+    std::string        text;
+};
+
+struct server_segment {
+    int64_t t0;
+    int64_t t1;
+
+    std::string text;
+
+    bool  speaker_turn_next;
+    float no_speech_prob;
+
+    std::vector<server_token> tokens;
+};
+
+struct server_result {
+    int lang_id = -1;
+
+    std::vector<server_segment> segments;
+
+    int n_tokens() const {
+        int n = 0;
+        for (const auto & segment : segments) {
+            n += segment.tokens.size();
+        }
+        return n;
+    }
+};
+
+// state == nullptr reads the default state of the context
+server_result collect_result(struct whisper_context * ctx, struct whisper_state * state) {
+    server_result result;
+
+    result.lang_id = state ? whisper_full_lang_id_from_state(state) : whisper_full_lang_id(ctx);
+
+    const int n_segments = state ? whisper_full_n_segments_from_state(state) : whisper_full_n_segments(ctx);
+
+    result.segments.resize(n_segments);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
+        server_segment & segment = result.segments[i];
+
+        segment.t0                = state ? whisper_full_get_segment_t0_from_state(state, i)                : whisper_full_get_segment_t0(ctx, i);
+        segment.t1                = state ? whisper_full_get_segment_t1_from_state(state, i)                : whisper_full_get_segment_t1(ctx, i);
+        segment.text              = state ? whisper_full_get_segment_text_from_state(state, i)              : whisper_full_get_segment_text(ctx, i);
+        segment.speaker_turn_next = state ? whisper_full_get_segment_speaker_turn_next_from_state(state, i) : whisper_full_get_segment_speaker_turn_next(ctx, i);
+        segment.no_speech_prob    = state ? whisper_full_get_segment_no_speech_prob_from_state(state, i)    : whisper_full_get_segment_no_speech_prob(ctx, i);
+
+        const int n_tokens = state ? whisper_full_n_tokens_from_state(state, i) : whisper_full_n_tokens(ctx, i);
+
+        segment.tokens.resize(n_tokens);
+        for (int j = 0; j < n_tokens; ++j) {
+            segment.tokens[j].data = state ? whisper_full_get_token_data_from_state(state, i, j)      : whisper_full_get_token_data(ctx, i, j);
+            segment.tokens[j].text = state ? whisper_full_get_token_text_from_state(ctx, state, i, j) : whisper_full_get_token_text(ctx, i, j);
+        }
+    }
+
+    return result;
+}
+
+std::string output_str(const server_result & result, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+    std::stringstream ss;
+    for (const auto & segment : result.segments) {
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
         {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+            speaker = estimate_diarization_speaker(pcmf32s, segment.t0, segment.t1);
         }
 
-        result << speaker << text << "\n";
+        ss << speaker << segment.text << "\n";
     }
-    return result.str();
+    return ss.str();
 }
 
 bool parse_str_to_bool(const std::string & s) {
@@ -507,14 +609,736 @@ void get_req_parameters(const Request & req, whisper_params & params)
     }
 }
 
+//
+// metrics
+//
+// Requests record their counters and histograms with relaxed atomics only, so they never wait for
+// each other or for a scrape. GET /metrics renders them in the Prometheus text format.
+//
+
+void atomic_add(std::atomic<double> & a, double v) {
+    double cur = a.load(std::memory_order_relaxed);
+    while (!a.compare_exchange_weak(cur, cur + v, std::memory_order_relaxed)) {
+    }
+}
+
+struct metrics_histogram {
+    const std::vector<double> bounds;
+
+    std::vector<std::atomic<uint64_t>> counts; // per bucket (not cumulative), the last one is +Inf
+
+    std::atomic<uint64_t> count{0};
+    std::atomic<double>   sum{0.0};
+
+    explicit metrics_histogram(std::vector<double> bounds) : bounds(std::move(bounds)), counts(this->bounds.size() + 1) {}
+
+    void observe(double v) {
+        const size_t i = std::lower_bound(bounds.begin(), bounds.end(), v) - bounds.begin();
+
+        counts[i].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        atomic_add(sum, v);
+    }
+};
+
+const std::vector<double> k_metrics_seconds = { 0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0 };
+
+// one instance per endpoint (/inference, /stream)
+struct endpoint_metrics {
+    std::atomic<uint64_t> n_requests{0};
+    std::atomic<uint64_t> n_failures{0};
+    std::atomic<uint64_t> n_tokens{0};
+    std::atomic<uint64_t> n_fail_p{0};
+    std::atomic<uint64_t> n_fail_h{0};
+
+    std::atomic<double> audio_seconds{0.0};
+
+    metrics_histogram rtf               {{ 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.0, 5.0 }};
+    metrics_histogram queue_wait        {k_metrics_seconds};
+    metrics_histogram mel               {k_metrics_seconds};
+    metrics_histogram encode            {k_metrics_seconds};
+    metrics_histogram decode            {k_metrics_seconds};
+    metrics_histogram sample            {k_metrics_seconds};
+    metrics_histogram tokens_per_second {{ 1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500 }};
+};
+
+struct server_metrics {
+    endpoint_metrics inference;
+    endpoint_metrics stream;
+};
+
+// the counters of a state accumulated between two snapshots
+whisper_stats metrics_diff(const whisper_stats & before, const whisper_stats & after) {
+    whisper_stats d = after;
+
+    d.t_mel_us    -= before.t_mel_us;
+    d.t_sample_us -= before.t_sample_us;
+    d.t_encode_us -= before.t_encode_us;
+    d.t_decode_us -= before.t_decode_us;
+    d.t_batchd_us -= before.t_batchd_us;
+    d.t_prompt_us -= before.t_prompt_us;
+
+    d.n_sample -= before.n_sample;
+    d.n_encode -= before.n_encode;
+    d.n_decode -= before.n_decode;
+    d.n_batchd -= before.n_batchd;
+    d.n_prompt -= before.n_prompt;
+    d.n_fail_p -= before.n_fail_p;
+    d.n_fail_h -= before.n_fail_h;
+
+    return d;
+}
+
+// n_tokens  - transcribed tokens (stream: newly committed tokens)
+// t_wait_us - time in the queue, < 0 if the request was not queued
+void metrics_record(endpoint_metrics & m, int64_t n_samples, int n_tokens, int64_t t_wait_us, int64_t t_process_us, const whisper_stats & d) {
+    const double t_audio   = double(n_samples)/WHISPER_SAMPLE_RATE;
+    const double t_process = 1e-6*t_process_us;
+
+    m.n_requests.fetch_add(1, std::memory_order_relaxed);
+    m.n_tokens  .fetch_add(std::max(0, n_tokens),   std::memory_order_relaxed);
+    m.n_fail_p  .fetch_add(std::max(0, d.n_fail_p), std::memory_order_relaxed);
+    m.n_fail_h  .fetch_add(std::max(0, d.n_fail_h), std::memory_order_relaxed);
+
+    atomic_add(m.audio_seconds, t_audio);
+
+    if (t_audio > 0) {
+        m.rtf.observe(t_process/t_audio);
+    }
+    if (t_wait_us >= 0) {
+        m.queue_wait.observe(1e-6*t_wait_us);
+    }
+
+    m.mel   .observe(1e-6*d.t_mel_us);
+    m.encode.observe(1e-6*d.t_encode_us);
+    m.decode.observe(1e-6*(d.t_decode_us + d.t_batchd_us + d.t_prompt_us));
+    m.sample.observe(1e-6*d.t_sample_us);
+
+    if (t_process > 0 && n_tokens > 0) {
+        m.tokens_per_second.observe(n_tokens/t_process);
+    }
+}
+
+void metrics_header(std::stringstream & ss, const char * name, const char * type, const char * help) {
+    ss << "# HELP " << name << " " << help << "\n";
+    ss << "# TYPE " << name << " " << type << "\n";
+}
+
+// sums at full precision - the default stream precision (6 digits) rounds large values to e.g. 1.23457e+06
+std::string metrics_format(double v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.17g", v);
+    return buf;
+}
+
+void metrics_histogram_render(std::stringstream & ss, const char * name, const char * labels, const metrics_histogram & h) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < h.counts.size(); ++i) {
+        n += h.counts[i].load(std::memory_order_relaxed);
+
+        ss << name << "_bucket{" << labels << ",le=\"";
+        if (i < h.bounds.size()) {
+            ss << h.bounds[i];
+        } else {
+            ss << "+Inf";
+        }
+        ss << "\"} " << n << "\n";
+    }
+
+    ss << name << "_sum{"   << labels << "} " << metrics_format(h.sum.load(std::memory_order_relaxed)) << "\n";
+    ss << name << "_count{" << labels << "} " << n << "\n";
+}
+
+//
+// resident models
+//
+
+struct server_model {
+    std::string name;
+    std::string path;
+
+    size_t size = 0; // size of the weight buffers
+
+    struct whisper_context * ctx = nullptr;
+
+    // serializes the requests that use the default state of the context
+    std::mutex mutex;
+
+    // idle states for streaming sessions and concurrent requests
+    std::mutex                   pool_mutex;
+    std::vector<whisper_state *> pool;
+
+    std::atomic<int64_t> t_last_used{0};
+
+    // memory of the default state and all pooled states
+    std::atomic<size_t> mem_kv{0};
+    std::atomic<size_t> mem_compute{0};
+
+    // counted against the memory budget
+    size_t mem_total() const {
+        return size + mem_kv + mem_compute;
+    }
+
+    // called when the last request or session using the model is done
+    ~server_model() {
+        for (auto * state : pool) {
+            whisper_free_state(state);
+        }
+        whisper_free(ctx);
+    }
+};
+
+struct model_registry {
+    std::mutex mutex;
+
+    std::map<std::string, std::shared_ptr<server_model>> models;
+    std::set<std::string>                                loading;
+
+    std::string name_default = "default"; // used when a request does not name a model, never evicted
+
+    size_t budget = 0; // max total memory of the resident models (0 - unlimited)
+
+    std::vector<std::thread>     loaders;
+    std::vector<std::thread::id> loaders_done; // finished, but not joined yet
+};
+
+// join the background loads that have finished - the caller holds the registry lock
+void model_loaders_reap(model_registry & reg) {
+    for (const auto & id : reg.loaders_done) {
+        for (auto it = reg.loaders.begin(); it != reg.loaders.end(); ++it) {
+            if (it->get_id() == id) {
+                it->join();
+                reg.loaders.erase(it);
+                break;
+            }
+        }
+    }
+    reg.loaders_done.clear();
+}
+
+// returns null if no model with this name is resident
+std::shared_ptr<server_model> model_acquire(model_registry & reg, const std::string & name) {
+    std::lock_guard<std::mutex> lock(reg.mutex);
+
+    auto it = reg.models.find(name.empty() ? reg.name_default : name);
+    if (it == reg.models.end()) {
+        return nullptr;
+    }
+
+    it->second->t_last_used = ggml_time_us();
+
+    return it->second;
+}
+
+std::shared_ptr<server_model> model_load(const std::string & name, const std::string & path, const whisper_context_params & cparams, const std::string & ov_device) {
+    struct whisper_context * ctx = whisper_init_from_file_with_params(path.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to load model '%s' from '%s'\n", name.c_str(), path.c_str());
+        return nullptr;
+    }
+
+    // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
+    whisper_ctx_init_openvino_encoder(ctx, nullptr, ov_device.c_str(), nullptr);
+
+    auto model = std::make_shared<server_model>();
+
+    model->name = name;
+    model->path = path;
+    model->ctx  = ctx;
+
+    const whisper_stats stats = whisper_get_stats(ctx);
+
+    model->mem_kv      = stats.mem_kv;
+    model->mem_compute = stats.mem_compute;
+
+    model->size = whisper_model_size(ctx);
+
+    return model;
+}
+
+// make the model resident under its name and evict the least recently used models over the budget
+// the replaced and evicted models are freed when their last request completes
+void model_insert(model_registry & reg, const std::shared_ptr<server_model> & model) {
+    std::lock_guard<std::mutex> lock(reg.mutex);
+
+    model->t_last_used = ggml_time_us();
+
+    reg.models[model->name] = model;
+
+    printf("Model '%s' is resident (%.1f MB)\n", model->name.c_str(), model->mem_total()/1024.0/1024.0);
+
+    while (reg.budget > 0) {
+        size_t size_total = 0;
+        for (const auto & it : reg.models) {
+            size_total += it.second->mem_total();
+        }
+
+        if (size_total <= reg.budget) {
+            break;
+        }
+
+        auto lru = reg.models.end();
+        for (auto it = reg.models.begin(); it != reg.models.end(); ++it) {
+            if (it->first == reg.name_default || it->second == model) {
+                continue;
+            }
+            if (lru == reg.models.end() || it->second->t_last_used < lru->second->t_last_used) {
+                lru = it;
+            }
+        }
+
+        if (lru == reg.models.end()) {
+            fprintf(stderr, "warning: resident models exceed the memory budget (%.1f MB > %.1f MB)\n", size_total/1024.0/1024.0, reg.budget/1024.0/1024.0);
+            break;
+        }
+
+        printf("Evicting model '%s'\n", lru->first.c_str());
+        reg.models.erase(lru);
+    }
+}
+
+// take an idle state from the pool of the model, or create a new one
+whisper_state * model_state_acquire(server_model & model) {
+    {
+        std::lock_guard<std::mutex> lock(model.pool_mutex);
+        if (!model.pool.empty()) {
+            whisper_state * state = model.pool.back();
+            model.pool.pop_back();
+            return state;
+        }
+    }
+
+    whisper_state * state = whisper_init_state(model.ctx);
+    if (state) {
+        const whisper_stats stats = whisper_get_stats_from_state(state);
+
+        model.mem_kv      += stats.mem_kv;
+        model.mem_compute += stats.mem_compute;
+    }
+
+    return state;
+}
+
+void model_state_release(server_model & model, whisper_state * state) {
+    std::lock_guard<std::mutex> lock(model.pool_mutex);
+    model.pool.push_back(state);
+}
+
+//
+// concurrent worker pool for inference requests
+//
+// Requests for the same model that arrive within --group-delay of each other are grouped, up to
+// --group-size, and run concurrently, each with its own whisper_full_with_state() call on a pooled
+// state - there is no batched encode or decode across requests. Groups are run by a pool of --workers
+// threads, so a long group does not hold up the requests queued behind it. The threads are split
+// between the running groups and the requests of each group, so a burst of short requests keeps all
+// cores busy instead of queueing behind one another.
+//
+
+struct inference_job {
+    // keeps the model resident until the job is done
+    std::shared_ptr<server_model> model;
+
+    whisper_full_params wparams;
+
+    const std::vector<float> * pcmf32 = nullptr;
+
+    std::chrono::steady_clock::time_point t_queued;
+
+    // set by the worker
+    int           ret          = 0;
+    int64_t       t_wait_us    = 0; // time spent in the queue
+    int64_t       t_process_us = 0;
+    whisper_stats stats        = {}; // work done for this job
+    server_result result;
+
+    bool                    done = false;
+    std::mutex              mutex;
+    std::condition_variable cv;
+};
+
+struct worker_pool {
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::deque<std::shared_ptr<inference_job>> queue;
+
+    int32_t max_group    = 4;
+    int32_t max_delay_ms = 10;
+    int32_t n_threads    = 4; // split between the running groups and the jobs of each group
+    int32_t n_workers    = 2;
+
+    int32_t n_running = 0; // groups being processed
+
+    bool running = false;
+
+    std::vector<std::thread> workers;
+};
+
+void pool_process(struct inference_job & job, int n_threads) {
+    server_model & model = *job.model;
+
+    whisper_state * state = model_state_acquire(model);
+    if (state == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper state\n");
+        job.ret = -1;
+        return;
+    }
+
+    job.wparams.n_threads = n_threads;
+
+    const whisper_stats stats = whisper_get_stats_from_state(state);
+    const int64_t t_start_us  = ggml_time_us();
+
+    job.ret = whisper_full_with_state(model.ctx, state, job.wparams, job.pcmf32->data(), job.pcmf32->size());
+
+    job.t_process_us = ggml_time_us() - t_start_us;
+    job.stats        = metrics_diff(stats, whisper_get_stats_from_state(state));
+
+    if (job.ret == 0) {
+        job.result = collect_result(model.ctx, state);
+    }
+
+    model_state_release(model, state);
+}
+
+void pool_run_group(std::vector<std::shared_ptr<inference_job>> & group, int n_threads_group) {
+    const int n_threads = std::max(1, n_threads_group/(int) group.size());
+
+    const auto t_start = std::chrono::steady_clock::now();
+
+    for (auto & job : group) {
+        job->t_wait_us = std::chrono::duration_cast<std::chrono::microseconds>(t_start - job->t_queued).count();
+    }
+
+    // the last job runs on the worker thread
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i + 1 < group.size(); ++i) {
+        workers.emplace_back(pool_process, std::ref(*group[i]), n_threads);
+    }
+    pool_process(*group.back(), n_threads);
+
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    for (auto & job : group) {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->done = true;
+        job->cv.notify_one();
+    }
+}
+
+void pool_loop(worker_pool & pool) {
+    std::unique_lock<std::mutex> lock(pool.mutex);
+
+    while (true) {
+        pool.cv.wait(lock, [&] { return !pool.running || !pool.queue.empty(); });
+
+        if (pool.queue.empty()) {
+            break;
+        }
+
+        // give other requests a chance to join the group of the oldest one
+        const auto t_deadline = pool.queue.front()->t_queued + std::chrono::milliseconds(pool.max_delay_ms);
+        pool.cv.wait_until(lock, t_deadline, [&] { return !pool.running || (int) pool.queue.size() >= pool.max_group; });
+
+        // another worker took the jobs while waiting
+        if (pool.queue.empty()) {
+            continue;
+        }
+
+        // the jobs of a group share the model of the oldest one
+        const auto model = pool.queue.front()->model;
+
+        std::vector<std::shared_ptr<inference_job>> group;
+        for (auto it = pool.queue.begin(); it != pool.queue.end() && (int) group.size() < pool.max_group; ) {
+            if ((*it)->model == model) {
+                group.push_back(*it);
+                it = pool.queue.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        // the groups that start while this one runs get a share of the threads as well
+        pool.n_running++;
+        const int n_threads = std::max(1, pool.n_threads/pool.n_running);
+
+        // wake up another worker for the remaining jobs
+        if (!pool.queue.empty()) {
+            pool.cv.notify_one();
+        }
+
+        lock.unlock();
+        pool_run_group(group, n_threads);
+        lock.lock();
+
+        pool.n_running--;
+    }
+}
+
+void pool_start(worker_pool & pool) {
+    pool.running = true;
+    for (int i = 0; i < pool.n_workers; ++i) {
+        pool.workers.emplace_back(pool_loop, std::ref(pool));
+    }
+}
+
+// finishes the queued jobs before returning
+void pool_stop(worker_pool & pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.running = false;
+    }
+    pool.cv.notify_all();
+
+    for (auto & worker : pool.workers) {
+        worker.join();
+    }
+    pool.workers.clear();
+}
+
+// queue the job and wait for it to be processed
+void pool_submit(worker_pool & pool, const std::shared_ptr<inference_job> & job) {
+    job->t_queued = std::chrono::steady_clock::now();
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.queue.push_back(job);
+    }
+    pool.cv.notify_one();
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->cv.wait(lock, [&] { return job->done; });
+}
+
+//
+// streaming sessions
+//
+
+struct stream_session {
+    std::mutex mutex;
+
+    // keeps the model resident for the lifetime of the session
+    std::shared_ptr<server_model> model;
+
+    // both are null once the session has been closed
+    whisper_stream * stream = nullptr;
+    whisper_state  * state  = nullptr;
+
+    int     n_reported   = 0; // committed tokens already sent to the client
+    int64_t n_samples    = 0; // audio received so far
+    int64_t t_process_us = 0; // total time spent in whisper_stream_process
+
+    std::vector<uint8_t> partial; // incomplete sample left over from the previous chunk
+
+    std::chrono::steady_clock::time_point t_last;
+};
+
+struct stream_manager {
+    std::mutex mutex;
+
+    std::map<std::string, std::shared_ptr<stream_session>> sessions;
+};
+
+std::string stream_generate_id() {
+    static std::mt19937_64 rng{std::random_device{}()};
+
+    std::stringstream ss;
+    ss << std::hex << rng() << rng();
+
+    return ss.str();
+}
+
+// close the session and return its state to the pool of the model - the caller holds the session lock
+void stream_close(stream_session & session) {
+    whisper_stream_free(session.stream);
+    session.stream = nullptr;
+
+    if (session.state) {
+        model_state_release(*session.model, session.state);
+        session.state = nullptr;
+    }
+
+    session.model.reset();
+}
+
+// the caller holds the manager lock
+void stream_close_all(stream_manager & mgr) {
+    for (auto & it : mgr.sessions) {
+        std::lock_guard<std::mutex> lock(it.second->mutex);
+        stream_close(*it.second);
+    }
+    mgr.sessions.clear();
+}
+
+// append raw PCM (s16le or f32le) to the stream, keeping incomplete samples for the next chunk
+void stream_push_pcm(stream_session & session, const char * data, size_t size, bool is_f32) {
+    const size_t n_bytes = is_f32 ? sizeof(float) : sizeof(int16_t);
+
+    std::vector<float> pcmf32;
+
+    session.partial.insert(session.partial.end(), data, data + size);
+
+    const size_t n = session.partial.size()/n_bytes;
+
+    pcmf32.resize(n);
+    if (is_f32) {
+        memcpy(pcmf32.data(), session.partial.data(), n*sizeof(float));
+    } else {
+        for (size_t i = 0; i < n; ++i) {
+            int16_t v;
+            memcpy(&v, session.partial.data() + i*sizeof(int16_t), sizeof(int16_t));
+            pcmf32[i] = float(v)/32768.0f;
+        }
+    }
+
+    session.partial.erase(session.partial.begin(), session.partial.begin() + n*n_bytes);
+
+    whisper_stream_push(session.stream, pcmf32.data(), pcmf32.size());
+
+    session.n_samples += n;
+}
+
+// newly committed words and the current tentative text, with latency stats
+json stream_result(stream_session & session, int64_t t_pass_us) {
+    json jres = json{
+        {"committed", ""},
+        {"words", json::array()},
+    };
+
+    const int n_committed = whisper_stream_n_committed(session.stream);
+
+    jres["committed"] = whisper_stream_get_committed_text(session.stream, session.n_reported);
+
+    int64_t t_committed = 0;
+    for (int i = session.n_reported; i < n_committed; ++i) {
+        const whisper_token_data token = whisper_stream_get_committed(session.stream, i);
+
+        jres["words"].push_back(json{
+            {"word",        whisper_token_to_str(session.model->ctx, token.id)},
+            {"start",       token.t0 * 0.01},
+            {"end",         token.t1 * 0.01},
+            {"probability", token.p},
+        });
+    }
+    if (n_committed > 0) {
+        t_committed = whisper_stream_get_committed(session.stream, n_committed - 1).t1;
+    }
+
+    session.n_reported = n_committed;
+
+    jres["tentative"] = whisper_stream_get_tentative_text(session.stream);
+
+    const double audio_ms = 1e3*session.n_samples/WHISPER_SAMPLE_RATE;
+
+    jres["audio_ms"] = audio_ms;
+    jres["latency"] = json{
+        {"process_ms",    t_pass_us*1e-3},
+        {"total_ms",      session.t_process_us*1e-3},
+        {"commit_lag_ms", std::max(0.0, audio_ms - 10.0*t_committed)},
+        {"rtf",           audio_ms > 0 ? session.t_process_us*1e-3/audio_ms : 0.0},
+    };
+
+    return jres;
+}
+
+std::string metrics_render(server_metrics & metrics, model_registry & models, worker_pool & pool, stream_manager & streams) {
+    std::stringstream ss;
+
+    const std::pair<const char *, endpoint_metrics *> endpoints[] = {
+        { "endpoint=\"inference\"", &metrics.inference },
+        { "endpoint=\"stream\"",    &metrics.stream    },
+    };
+
+    const auto counter = [&](const char * name, const char * help, std::function<uint64_t(const endpoint_metrics &)> get) {
+        metrics_header(ss, name, "counter", help);
+        for (const auto & e : endpoints) {
+            ss << name << "{" << e.first << "} " << get(*e.second) << "\n";
+        }
+    };
+
+    const auto counter_sum = [&](const char * name, const char * help, std::function<double(const endpoint_metrics &)> get) {
+        metrics_header(ss, name, "counter", help);
+        for (const auto & e : endpoints) {
+            ss << name << "{" << e.first << "} " << metrics_format(get(*e.second)) << "\n";
+        }
+    };
+
+    const auto histogram = [&](const char * name, const char * help, std::function<const metrics_histogram &(const endpoint_metrics &)> get) {
+        metrics_header(ss, name, "histogram", help);
+        for (const auto & e : endpoints) {
+            metrics_histogram_render(ss, name, e.first, get(*e.second));
+        }
+    };
+
+    counter("whisper_requests_total", "Processed requests (stream: audio chunks)",
+            [](const endpoint_metrics & m) { return m.n_requests.load(std::memory_order_relaxed); });
+    counter("whisper_request_failures_total", "Requests that failed to process the audio",
+            [](const endpoint_metrics & m) { return m.n_failures.load(std::memory_order_relaxed); });
+    counter_sum("whisper_audio_seconds_total", "Seconds of audio processed",
+            [](const endpoint_metrics & m) { return m.audio_seconds.load(std::memory_order_relaxed); });
+    counter("whisper_tokens_total", "Transcribed tokens (stream: committed tokens)",
+            [](const endpoint_metrics & m) { return m.n_tokens.load(std::memory_order_relaxed); });
+    counter("whisper_fallbacks_logprob_total", "Temperature fallbacks due to the logprob threshold",
+            [](const endpoint_metrics & m) { return m.n_fail_p.load(std::memory_order_relaxed); });
+    counter("whisper_fallbacks_entropy_total", "Temperature fallbacks due to the entropy threshold",
+            [](const endpoint_metrics & m) { return m.n_fail_h.load(std::memory_order_relaxed); });
+
+    histogram("whisper_rtf", "Real-time factor (processing time / audio duration)",
+            [](const endpoint_metrics & m) -> const metrics_histogram & { return m.rtf; });
+    histogram("whisper_queue_wait_seconds", "Time a request waited before processing started",
+            [](const endpoint_metrics & m) -> const metrics_histogram & { return m.queue_wait; });
+    histogram("whisper_mel_seconds", "Time spent computing the mel spectrogram per request",
+            [](const endpoint_metrics & m) -> const metrics_histogram & { return m.mel; });
+    histogram("whisper_encode_seconds", "Time spent in the encoder per request",
+            [](const endpoint_metrics & m) -> const metrics_histogram & { return m.encode; });
+    histogram("whisper_decode_seconds", "Time spent in the decoder per request",
+            [](const endpoint_metrics & m) -> const metrics_histogram & { return m.decode; });
+    histogram("whisper_sample_seconds", "Time spent sampling tokens per request",
+            [](const endpoint_metrics & m) -> const metrics_histogram & { return m.sample; });
+    histogram("whisper_tokens_per_second", "Transcribed tokens per second of processing time",
+            [](const endpoint_metrics & m) -> const metrics_histogram & { return m.tokens_per_second; });
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        metrics_header(ss, "whisper_queue_depth", "gauge", "Inference requests waiting for a worker");
+        ss << "whisper_queue_depth " << pool.queue.size() << "\n";
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(streams.mutex);
+        metrics_header(ss, "whisper_stream_sessions", "gauge", "Open /stream sessions");
+        ss << "whisper_stream_sessions " << streams.sessions.size() << "\n";
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(models.mutex);
+
+        metrics_header(ss, "whisper_model_bytes", "gauge", "Size of the weight buffers of the resident models");
+        for (const auto & it : models.models) {
+            ss << "whisper_model_bytes{model=\"" << it.first << "\"} " << it.second->size << "\n";
+        }
+        metrics_header(ss, "whisper_kv_cache_bytes", "gauge", "KV cache memory of all states of the model");
+        for (const auto & it : models.models) {
+            ss << "whisper_kv_cache_bytes{model=\"" << it.first << "\"} " << it.second->mem_kv.load() << "\n";
+        }
+        metrics_header(ss, "whisper_compute_buffer_bytes", "gauge", "Compute buffer memory of all states of the model");
+        for (const auto & it : models.models) {
+            ss << "whisper_compute_buffer_bytes{model=\"" << it.first << "\"} " << it.second->mem_compute.load() << "\n";
+        }
+    }
+
+    return ss.str();
+}
+
 }  // namespace
 
 int main(int argc, char ** argv) {
     whisper_params params;
     server_params sparams;
 
-    std::mutex whisper_mutex;
-
     if (whisper_params_parse(argc, argv, params, sparams) == false) {
         whisper_print_usage(argc, argv, params, sparams);
         return 1;
@@ -585,15 +1409,37 @@ int main(int argc, char ** argv) {
         }
     }
 
-    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    model_registry models;
 
-    if (ctx == nullptr) {
-        fprintf(stderr, "error: failed to initialize whisper context\n");
-        return 3;
+    models.budget = (size_t) sparams.model_budget_mb*1024*1024;
+
+    {
+        auto model = model_load(models.name_default, params.model, cparams, params.openvino_encode_device);
+        if (model == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper context\n");
+            return 3;
+        }
+
+        model_insert(models, model);
     }
 
-    // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-    whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+    for (const auto & extra : sparams.extra_models) {
+        auto model = model_load(extra.first, extra.second, cparams, params.openvino_encode_device);
+        if (model == nullptr) {
+            return 3;
+        }
+
+        model_insert(models, model);
+    }
+
+    server_metrics metrics;
+
+    worker_pool pool;
+
+    pool.max_group    = sparams.group_size;
+    pool.max_delay_ms = sparams.group_delay_ms;
+    pool.n_threads    = params.n_threads;
+    pool.n_workers    = sparams.n_workers;
 
     Server svr;
     svr.set_default_headers({{"Server", "whisper.cpp"},
@@ -636,14 +1482,21 @@ int main(int argc, char ** argv) {
     -F file="@&lt;file-path&gt;" \
     -F temperature="0.0" \
     -F temperature_inc="0.2" \
-    -F response_format="json"
+    -F response_format="json" \
+    -F model="default"
         </pre>
 
         <h2>/load</h2>
         <pre>
     curl 127.0.0.1:)" + std::to_string(sparams.port) + R"(/load \
     -H "Content-Type: multipart/form-data" \
-    -F model="&lt;path-to-model-file&gt;"
+    -F model="&lt;path-to-model-file&gt;" \
+    -F name="default"
+        </pre>
+
+        <h2>/models</h2>
+        <pre>
+    curl 127.0.0.1:)" + std::to_string(sparams.port) + R"(/models
         </pre>
 
         <div>
@@ -684,8 +1537,21 @@ int main(int argc, char ** argv) {
     });
 
     svr.Post(sparams.request_path + sparams.inference_path, [&](const Request &req, Response &res){
-        // acquire whisper model mutex lock
-        std::lock_guard<std::mutex> lock(whisper_mutex);
+        // each request works on its own copy of the parameters, so that requests for different models can run concurrently
+        whisper_params params = default_params;
+
+        const std::string model_name = req.has_file("model") ? req.get_file_value("model").content : "";
+
+        // the model stays resident until the request completes, even if it is replaced or evicted in the meantime
+        const auto model = model_acquire(models, model_name);
+        if (model == nullptr) {
+            fprintf(stderr, "error: model '%s' is not loaded\n", model_name.c_str());
+            const std::string error_resp = "{\"error\":\"model not loaded\"}";
+            res.set_content(error_resp, "application/json");
+            return;
+        }
+
+        struct whisper_context * ctx = model->ctx;
 
         // first check user requested fields of the request
         if (!req.has_file("file"))
@@ -776,6 +1642,8 @@ int main(int argc, char ** argv) {
             fprintf(stderr, "\n");
         }
 
+        server_result result;
+
         // run the inference
         {
             printf("Running whisper.cpp inference on %s\n", filename.c_str());
@@ -858,7 +1726,43 @@ int main(int argc, char ** argv) {
                 wparams.abort_callback_user_data = &is_aborted;
             }
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
+            int ret = 0;
+
+            if (params.n_processors > 1) {
+                const int64_t t_queued_us = ggml_time_us();
+
+                // the default state of the context is used by one request at a time
+                std::lock_guard<std::mutex> lock(model->mutex);
+
+                const whisper_stats stats = whisper_get_stats(ctx);
+                const int64_t t_start_us  = ggml_time_us();
+
+                ret = whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors);
+                if (ret == 0) {
+                    result = collect_result(ctx, nullptr);
+
+                    metrics_record(metrics.inference, pcmf32.size(), result.n_tokens(), t_start_us - t_queued_us, ggml_time_us() - t_start_us, metrics_diff(stats, whisper_get_stats(ctx)));
+                }
+            } else {
+                auto job = std::make_shared<inference_job>();
+
+                job->model   = model;
+                job->wparams = wparams;
+                job->pcmf32  = &pcmf32;
+
+                pool_submit(pool, job);
+
+                ret    = job->ret;
+                result = std::move(job->result);
+
+                if (ret == 0) {
+                    metrics_record(metrics.inference, pcmf32.size(), result.n_tokens(), job->t_wait_us, job->t_process_us, job->stats);
+                }
+            }
+
+            if (ret != 0) {
+                metrics.inference.n_failures.fetch_add(1, std::memory_order_relaxed);
+
                 fprintf(stderr, "%s: failed to process audio\n", argv[0]);
                 const std::string error_resp = "{\"error\":\"failed to process audio\"}";
                 res.set_content(error_resp, "application/json");
@@ -869,17 +1773,17 @@ int main(int argc, char ** argv) {
         // return results to user
         if (params.response_format == text_format)
         {
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(result, params, pcmf32s);
             res.set_content(results.c_str(), "text/html; charset=utf-8");
         }
         else if (params.response_format == srt_format)
         {
             std::stringstream ss;
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = result.segments.size();
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const char * text = result.segments[i].text.c_str();
+                const int64_t t0 = result.segments[i].t0;
+                const int64_t t1 = result.segments[i].t1;
                 std::string speaker = "";
 
                 if (params.diarize && pcmf32s.size() == 2)
@@ -897,11 +1801,11 @@ int main(int argc, char ** argv) {
 
             ss << "WEBVTT\n\n";
 
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = result.segments.size();
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const char * text = result.segments[i].text.c_str();
+                const int64_t t0 = result.segments[i].t0;
+                const int64_t t1 = result.segments[i].t1;
                 std::string speaker = "";
 
                 if (params.diarize && pcmf32s.size() == 2)
@@ -917,37 +1821,37 @@ int main(int argc, char ** argv) {
             res.set_content(ss.str(), "text/vtt");
         } else if (params.response_format == vjson_format) {
             /* try to match openai/whisper's Python format */
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(result, params, pcmf32s);
             json jres = json{
                 {"task", params.translate ? "translate" : "transcribe"},
-                {"language", whisper_lang_str_full(whisper_full_lang_id(ctx))},
+                {"language", whisper_lang_str_full(result.lang_id)},
                 {"duration", float(pcmf32.size())/WHISPER_SAMPLE_RATE},
                 {"text", results},
                 {"segments", json::array()}
             };
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = result.segments.size();
             for (int i = 0; i < n_segments; ++i)
             {
                 json segment = json{
                     {"id", i},
-                    {"text", whisper_full_get_segment_text(ctx, i)},
+                    {"text", result.segments[i].text},
                 };
 
                 if (!params.no_timestamps) {
-                    segment["start"] = whisper_full_get_segment_t0(ctx, i) * 0.01;
-                    segment["end"] = whisper_full_get_segment_t1(ctx, i) * 0.01;
+                    segment["start"] = result.segments[i].t0 * 0.01;
+                    segment["end"] = result.segments[i].t1 * 0.01;
                 }
 
                 float total_logprob = 0;
-                const int n_tokens = whisper_full_n_tokens(ctx, i);
+                const int n_tokens = result.segments[i].tokens.size();
                 for (int j = 0; j < n_tokens; ++j) {
-                    whisper_token_data token = whisper_full_get_token_data(ctx, i, j);
+                    whisper_token_data token = result.segments[i].tokens[j].data;
                     if (token.id >= whisper_token_eot(ctx)) {
                         continue;
                     }
 
                     segment["tokens"].push_back(token.id);
-                    json word = json{{"word", whisper_full_get_token_text(ctx, i, j)}};
+                    json word = json{{"word", result.segments[i].tokens[j].text}};
                     if (!params.no_timestamps) {
                         word["start"] = token.t0 * 0.01;
                         word["end"] = token.t1 * 0.01;
@@ -963,7 +1867,7 @@ int main(int argc, char ** argv) {
 
                 // TODO compression_ratio and no_speech_prob are not implemented yet
                 // segment["compression_ratio"] = 0;
-                segment["no_speech_prob"] = whisper_full_get_segment_no_speech_prob(ctx, i);
+                segment["no_speech_prob"] = result.segments[i].no_speech_prob;
 
                 jres["segments"].push_back(segment);
             }
@@ -973,19 +1877,240 @@ int main(int argc, char ** argv) {
         // TODO add more output formats
         else
         {
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(result, params, pcmf32s);
             json jres = json{
                 {"text", results}
             };
             res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace),
                             "application/json");
         }
+    });
+    // streaming: POST /stream opens a session, raw PCM chunks are POSTed to /stream/<id>
+    // and POST /stream/<id>/end commits the rest of the audio and closes the session
+    stream_manager streams;
+
+    svr.Post(sparams.request_path + "/stream", [&](const Request &req, Response &res){
+        std::lock_guard<std::mutex> lock(streams.mutex);
+
+        const auto t_now = std::chrono::steady_clock::now();
+
+        // close the sessions that have been idle for too long
+        for (auto it = streams.sessions.begin(); it != streams.sessions.end(); ) {
+            std::unique_lock<std::mutex> lock_session(it->second->mutex, std::try_to_lock);
+            if (lock_session.owns_lock() && t_now - it->second->t_last > std::chrono::seconds(sparams.stream_timeout)) {
+                stream_close(*it->second);
+                lock_session.unlock();
+                it = streams.sessions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        if ((int) streams.sessions.size() >= sparams.stream_slots) {
+            fprintf(stderr, "error: all %d stream slots are in use\n", sparams.stream_slots);
+            const std::string error_resp = "{\"error\":\"all stream slots are in use\"}";
+            res.set_content(error_resp, "application/json");
+            return;
+        }
+
+        whisper_params sp = default_params;
+
+        if (req.has_param("language")) {
+            sp.language = req.get_param_value("language");
+        }
+        if (req.has_param("translate")) {
+            sp.translate = parse_str_to_bool(req.get_param_value("translate"));
+        }
+
+        const std::string model_name = req.get_param_value("model");
+
+        const auto model = model_acquire(models, model_name);
+        if (model == nullptr) {
+            fprintf(stderr, "error: model '%s' is not loaded\n", model_name.c_str());
+            const std::string error_resp = "{\"error\":\"model not loaded\"}";
+            res.set_content(error_resp, "application/json");
+            return;
+        }
+
+        struct whisper_context * ctx = model->ctx;
+
+        if (sp.language != "auto" && whisper_lang_id(sp.language.c_str()) == -1) {
+            fprintf(stderr, "error: unknown language '%s'\n", sp.language.c_str());
+            const std::string error_resp = "{\"error\":\"unknown language\"}";
+            res.set_content(error_resp, "application/json");
+            return;
+        }
+
+        if (!whisper_is_multilingual(ctx)) {
+            sp.language  = "en";
+            sp.translate = false;
+        }
+
+        whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+        wparams.print_realtime   = false;
+        wparams.print_progress   = false;
+        wparams.print_timestamps = false;
+        wparams.print_special    = false;
+        wparams.translate        = sp.translate;
+        // the stream keeps the params for its lifetime - point to a static string
+        wparams.language         = sp.language == "auto" ? "auto" : whisper_lang_str(whisper_lang_id(sp.language.c_str()));
+        wparams.n_threads        = sp.n_threads;
+        wparams.audio_ctx        = sp.audio_ctx;
+
+        wparams.temperature      = sp.temperature;
+        wparams.temperature_inc  = sp.no_fallback ? 0.0f : sp.temperature_inc;
+        wparams.entropy_thold    = sp.entropy_thold;
+        wparams.logprob_thold    = sp.logprob_thold;
+        wparams.no_speech_thold  = sp.no_speech_thold;
+        wparams.suppress_nst     = sp.suppress_nst;
+
+        whisper_state * state = model_state_acquire(*model);
+        if (state == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper state\n");
+            const std::string error_resp = "{\"error\":\"failed to initialize whisper state\"}";
+            res.set_content(error_resp, "application/json");
+            return;
+        }
+
+        auto session = std::make_shared<stream_session>();
+
+        session->model  = model;
+        session->state  = state;
+        session->stream = whisper_stream_init_with_state(ctx, state, whisper_stream_default_params(), wparams);
+        session->t_last = t_now;
+
+        const std::string id = stream_generate_id();
+
+        streams.sessions[id] = session;
+
+        printf("Opened stream session %s (%d active)\n", id.c_str(), (int) streams.sessions.size());
+
+        json jres = json{
+            {"session",     id},
+            {"sample_rate", WHISPER_SAMPLE_RATE},
+        };
+        res.set_content(jres.dump(), "application/json");
+    });
+
+    svr.Post(sparams.request_path + "/stream/([0-9a-f]+)", [&](const Request &req, Response &res, const ContentReader &content_reader){
+        std::shared_ptr<stream_session> session;
+        {
+            std::lock_guard<std::mutex> lock(streams.mutex);
+            auto it = streams.sessions.find(req.matches[1].str());
+            if (it != streams.sessions.end()) {
+                session = it->second;
+            }
+        }
+
+        if (session) {
+            std::lock_guard<std::mutex> lock(session->mutex);
+
+            if (session->stream) {
+                const bool is_f32 = req.get_param_value("format") == "f32";
+
+                const int64_t n_samples_prev = session->n_samples;
+
+                // the body may be sent with chunked transfer encoding - push the audio as it arrives
+                content_reader([&](const char * data, size_t size) {
+                    stream_push_pcm(*session, data, size, is_f32);
+                    return true;
+                });
+
+                const int64_t n_samples = session->n_samples - n_samples_prev;
+
+                const whisper_stats stats = whisper_get_stats_from_state(session->state);
+                const int64_t t_start_us  = ggml_time_us();
+
+                const int n_committed = whisper_stream_process(session->stream);
+                if (n_committed < 0) {
+                    metrics.stream.n_failures.fetch_add(1, std::memory_order_relaxed);
+                    fprintf(stderr, "error: failed to process stream audio\n");
+                    const std::string error_resp = "{\"error\":\"failed to process audio\"}";
+                    res.set_content(error_resp, "application/json");
+                    return;
+                }
+
+                const int64_t t_pass_us = ggml_time_us() - t_start_us;
+
+                session->t_process_us += t_pass_us;
+                session->t_last = std::chrono::steady_clock::now();
+
+                metrics_record(metrics.stream, n_samples, n_committed, -1, t_pass_us, metrics_diff(stats, whisper_get_stats_from_state(session->state)));
+
+                json jres = stream_result(*session, t_pass_us);
+                jres["final"] = false;
+
+                res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace), "application/json");
+                return;
+            }
+        }
+
+        const std::string error_resp = "{\"error\":\"unknown stream session\"}";
+        res.set_content(error_resp, "application/json");
+    });
+
+    svr.Post(sparams.request_path + "/stream/([0-9a-f]+)/end", [&](const Request &req, Response &res){
+        const std::string id = req.matches[1].str();
+
+        std::shared_ptr<stream_session> session;
+        {
+            std::lock_guard<std::mutex> lock(streams.mutex);
+            auto it = streams.sessions.find(id);
+            if (it != streams.sessions.end()) {
+                session = it->second;
+            }
+        }
+
+        json jres;
+
+        if (session) {
+            std::lock_guard<std::mutex> lock(session->mutex);
+
+            if (session->stream) {
+                const whisper_stats stats = whisper_get_stats_from_state(session->state);
+                const int64_t t_start_us  = ggml_time_us();
+
+                const int ret = whisper_stream_flush(session->stream);
+
+                const int64_t t_pass_us = ggml_time_us() - t_start_us;
+
+                session->t_process_us += t_pass_us;
+
+                if (ret < 0) {
+                    metrics.stream.n_failures.fetch_add(1, std::memory_order_relaxed);
+                    fprintf(stderr, "error: failed to process stream audio\n");
+                    jres = json{{"error", "failed to process audio"}};
+                } else {
+                    metrics_record(metrics.stream, 0, ret, -1, t_pass_us, metrics_diff(stats, whisper_get_stats_from_state(session->state)));
+
+                    jres = stream_result(*session, t_pass_us);
+                    jres["final"] = true;
+                    jres["text"]  = whisper_stream_get_committed_text(session->stream, 0);
+                }
+            }
+        }
+
+        if (jres.is_null()) {
+            const std::string error_resp = "{\"error\":\"unknown stream session\"}";
+            res.set_content(error_resp, "application/json");
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(streams.mutex);
+            std::lock_guard<std::mutex> lock_session(session->mutex);
+
+            stream_close(*session);
+            streams.sessions.erase(id);
+
+            printf("Closed stream session %s (%d active)\n", id.c_str(), (int) streams.sessions.size());
+        }
 
-        // reset params to their defaults
-        params = default_params;
+        res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace), "application/json");
     });
+
     svr.Post(sparams.request_path + "/load", [&](const Request &req, Response &res){
-        std::lock_guard<std::mutex> lock(whisper_mutex);
         if (!req.has_file("model"))
         {
             fprintf(stderr, "error: no 'model' field in the request\n");
@@ -993,34 +2118,96 @@ int main(int argc, char ** argv) {
             res.set_content(error_resp, "application/json");
             return;
         }
-        std::string model = req.get_file_value("model").content;
-        if (!is_file_exist(model.c_str()))
+        const std::string path = req.get_file_value("model").content;
+        if (!is_file_exist(path.c_str()))
         {
-            fprintf(stderr, "error: 'model': %s not found!\n", model.c_str());
+            fprintf(stderr, "error: 'model': %s not found!\n", path.c_str());
             const std::string error_resp = "{\"error\":\"model not found!\"}";
             res.set_content(error_resp, "application/json");
             return;
         }
 
-        // clean up
-        whisper_free(ctx);
+        // without a name, the default model is replaced
+        const std::string name = req.has_file("name") ? req.get_file_value("name").content : models.name_default;
 
-        // whisper init
-        ctx = whisper_init_from_file_with_params(model.c_str(), cparams);
+        const bool is_async = req.has_file("async") && parse_str_to_bool(req.get_file_value("async").content);
 
-        // TODO perhaps load prior model here instead of exit
-        if (ctx == nullptr) {
-            fprintf(stderr, "error: model init  failed, no model loaded must exit\n");
-            exit(1);
+        {
+            std::lock_guard<std::mutex> lock(models.mutex);
+            if (!models.loading.insert(name).second) {
+                fprintf(stderr, "error: model '%s' is already being loaded\n", name.c_str());
+                const std::string error_resp = "{\"error\":\"model is already being loaded\"}";
+                res.set_content(error_resp, "application/json");
+                return;
+            }
         }
 
-        // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-        whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+        // the model is loaded without holding any lock - requests keep running on the resident models
+        // and switch to the new one once it is swapped in
+        auto load = [&models, &cparams, &params, name, path]() {
+            auto model = model_load(name, path, cparams, params.openvino_encode_device);
+            if (model) {
+                model_insert(models, model);
+            }
+
+            std::lock_guard<std::mutex> lock(models.mutex);
+            models.loading.erase(name);
+
+            return model != nullptr;
+        };
+
+        if (is_async) {
+            std::lock_guard<std::mutex> lock(models.mutex);
+            model_loaders_reap(models);
+            models.loaders.emplace_back([&models, load]() {
+                load();
+
+                std::lock_guard<std::mutex> lock(models.mutex);
+                models.loaders_done.push_back(std::this_thread::get_id());
+            });
+
+            res.set_content("{\"status\":\"loading\"}", "application/json");
+            return;
+        }
+
+        if (!load()) {
+            const std::string error_resp = "{\"error\":\"failed to load model\"}";
+            res.set_content(error_resp, "application/json");
+            return;
+        }
 
         const std::string success = "Load was successful!";
         res.set_content(success, "application/text");
+    });
+
+    svr.Get(sparams.request_path + "/models", [&](const Request &, Response &res){
+        json jres = json{
+            {"default", models.name_default},
+            {"budget",  models.budget},
+            {"models",  json::array()},
+            {"loading", json::array()},
+        };
+
+        std::lock_guard<std::mutex> lock(models.mutex);
+
+        for (const auto & it : models.models) {
+            jres["models"].push_back(json{
+                {"name",   it.first},
+                {"path",   it.second->path},
+                {"size",   it.second->size},
+                {"memory", it.second->mem_total()},
+                {"in_use", it.second.use_count() - 1},
+            });
+        }
+        for (const auto & name : models.loading) {
+            jres["loading"].push_back(name);
+        }
+
+        res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace), "application/json");
+    });
 
-        // check if the model is in the file system
+    svr.Get(sparams.request_path + "/metrics", [&](const Request &, Response &res){
+        res.set_content(metrics_render(metrics, models, pool, streams), "text/plain; version=0.0.4");
     });
 
     svr.set_exception_handler([](const Request &, Response &res, std::exception_ptr ep) {
@@ -1063,13 +2250,39 @@ int main(int argc, char ** argv) {
     // to make it ctrl+clickable:
     printf("\nwhisper server listening at http://%s:%d\n\n", sparams.hostname.c_str(), sparams.port);
 
+    pool_start(pool);
+
     if (!svr.listen_after_bind())
     {
+        pool_stop(pool);
         return 1;
     }
 
-    whisper_print_timings(ctx);
-    whisper_free(ctx);
+    pool_stop(pool);
+
+    {
+        std::lock_guard<std::mutex> lock(streams.mutex);
+        stream_close_all(streams);
+    }
+
+    // wait for the background loads before releasing the models
+    std::vector<std::thread> loaders;
+    {
+        std::lock_guard<std::mutex> lock(models.mutex);
+        loaders.swap(models.loaders);
+    }
+    for (auto & loader : loaders) {
+        loader.join();
+    }
+
+    {
+        const auto model = model_acquire(models, "");
+        if (model) {
+            whisper_print_timings(model->ctx);
+        }
+    }
+
+    models.models.clear();
 
     return 0;
 }
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+#
+# Test client for the whisper-server /stream endpoints
+#
+# Sends a 16 kHz mono 16-bit WAV file to the server in real time (or as fast as possible)
+# and prints the committed text and the tentative tail after every chunk.
+#
+# usage:
+#
+#   ./build/bin/whisper-server -m models/ggml-base.en.bin
+#   python3 examples/server/stream_client.py samples/jfk.wav
+#
+
+import argparse
+import json
+import sys
+import time
+import urllib.request
+import wave
+
+
+def post(url, data=None, headers=None):
+    req = urllib.request.Request(url, data=data, headers=headers or {}, method="POST")
+    with urllib.request.urlopen(req) as res:
+        return json.loads(res.read().decode("utf-8"))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="whisper-server streaming test client")
+    parser.add_argument("file", help="16 kHz mono 16-bit WAV file")
+    parser.add_argument("--url", default="http://127.0.0.1:8080", help="server URL")
+    parser.add_argument("--chunk-ms", type=int, default=1000, help="audio per request in milliseconds")
+    parser.add_argument("--language", default=None, help="spoken language")
+    parser.add_argument("--fast", action="store_true", help="do not wait between chunks")
+    parser.add_argument("--chunked", action="store_true", help="upload each chunk with chunked transfer encoding")
+    args = parser.parse_args()
+
+    with wave.open(args.file, "rb") as w:
+        if w.getframerate() != 16000 or w.getnchannels() != 1 or w.getsampwidth() != 2:
+            print("error: expected a 16 kHz mono 16-bit WAV file", file=sys.stderr)
+            return 1
+        pcm = w.readframes(w.getnframes())
+
+    query = "?language=" + args.language if args.language else ""
+    session = post(args.url + "/stream" + query)["session"]
+    print("session: %s" % session, file=sys.stderr)
+
+    chunk_bytes = 2*16*args.chunk_ms
+    t_start = time.time()
+    latencies = []
+
+    committed = ""
+    for i in range(0, len(pcm), chunk_bytes):
+        chunk = pcm[i:i + chunk_bytes]
+
+        if not args.fast:
+            # wait until the chunk would have been captured in real time
+            t_wait = t_start + (i + len(chunk))/32000.0 - time.time()
+            if t_wait > 0:
+                time.sleep(t_wait)
+
+        # an iterable body without Content-Length is sent with chunked transfer encoding
+        data = iter([chunk[:len(chunk)//2], chunk[len(chunk)//2:]]) if args.chunked else chunk
+
+        t0 = time.time()
+        res = post(args.url + "/stream/" + session, data, {"Content-Type": "application/octet-stream"})
+        latencies.append(1e3*(time.time() - t0))
+
+        committed += res["committed"]
+        print("\33[2K\r%s\33[90m%s\33[0m" % (committed, res["tentative"]), end="", flush=True)
+
+    res = post(args.url + "/stream/" + session + "/end")
+    print("\33[2K\r%s" % res["text"])
+
+    latencies.sort()
+    print("requests: %d, latency p50 = %.1f ms, p90 = %.1f ms, rtf = %.3f, commit lag = %.1f ms" % (
+        len(latencies), latencies[len(latencies)//2], latencies[(9*len(latencies))//10],
+        res["latency"]["rtf"], res["latency"]["commit_lag_ms"]), file=sys.stderr)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
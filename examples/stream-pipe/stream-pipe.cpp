@@ -6,6 +6,7 @@
 #include <chrono>
 #include <iostream>
 #include <fstream>
+#include <cstring>
 
 #define BUFFER_DURATION_SEC 10
 #define BUFFER_SIZE (WHISPER_SAMPLE_RATE * BUFFER_DURATION_SEC)
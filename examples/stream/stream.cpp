@@ -37,6 +37,7 @@ struct whisper_params {
     bool save_audio    = false; // save audio to wav file
     bool use_gpu       = true;
     bool flash_attn    = false;
+    bool local_agreement = false;
 
     std::string language  = "en";
     std::string model     = "models/ggml-base.en.bin";
@@ -74,6 +75,7 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-sa"   || arg == "--save-audio")    { params.save_audio    = true; }
         else if (arg == "-ng"   || arg == "--no-gpu")        { params.use_gpu       = false; }
         else if (arg == "-fa"   || arg == "--flash-attn")    { params.flash_attn    = true; }
+        else if (arg == "-la"   || arg == "--local-agreement") { params.local_agreement = true; }
 
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
@@ -112,9 +114,115 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -sa,      --save-audio    [%-7s] save the recorded audio to a file\n",              params.save_audio ? "true" : "false");
     fprintf(stderr, "  -ng,      --no-gpu        [%-7s] disable GPU inference\n",                          params.use_gpu ? "false" : "true");
     fprintf(stderr, "  -fa,      --flash-attn    [%-7s] flash attention during inference\n",               params.flash_attn ? "true" : "false");
+    fprintf(stderr, "  -la,      --local-agreement [%-7s] commit the text on which consecutive steps agree\n", params.local_agreement ? "true" : "false");
     fprintf(stderr, "\n");
 }
 
+// incremental transcription with stable-prefix commit
+// committed text is printed once, the tentative tail is redrawn on every step
+static int run_local_agreement(struct whisper_context * ctx, audio_async & audio, const whisper_params & params, std::ofstream & fout, wav_writer & wavWriter) {
+    whisper_full_params wparams = whisper_full_default_params(params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+
+    wparams.print_progress   = false;
+    wparams.print_special    = params.print_special;
+    wparams.print_realtime   = false;
+    wparams.print_timestamps = false;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.n_threads        = params.n_threads;
+    wparams.beam_search.beam_size = params.beam_size;
+    wparams.audio_ctx        = params.audio_ctx;
+    wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
+
+    whisper_stream_params sparams = whisper_stream_default_params();
+
+    sparams.max_buffer_ms = params.length_ms;
+
+    struct whisper_stream * stream = whisper_stream_init(ctx, sparams, wparams);
+    if (stream == nullptr) {
+        fprintf(stderr, "%s: failed to initialize the stream\n", __func__);
+        return 1;
+    }
+
+    const size_t n_samples_step = (1e-3*params.step_ms  )*WHISPER_SAMPLE_RATE;
+    const size_t n_samples_len  = (1e-3*params.length_ms)*WHISPER_SAMPLE_RATE;
+
+    uint64_t cursor = audio.position();
+
+    std::string line; // committed text of the current output line
+
+    int n_printed = 0;
+
+    bool is_running = true;
+
+    while (is_running) {
+        // handle Ctrl + C
+        is_running = sdl_poll_events();
+
+        if (!is_running) {
+            break;
+        }
+
+        audio_ring::view view = audio.get_since(cursor);
+
+        if (view.size() < n_samples_step) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        if (view.size() > n_samples_len) {
+            fprintf(stderr, "\n\n%s: WARNING: cannot process audio fast enough, dropping audio ...\n\n", __func__);
+            view = audio.get_since(view.end() - n_samples_len);
+        }
+
+        cursor = view.end();
+
+        if (params.save_audio) {
+            wavWriter.write(view.p0, view.n0);
+            wavWriter.write(view.p1, view.n1);
+        }
+
+        whisper_stream_push(stream, view.p0, view.n0);
+        whisper_stream_push(stream, view.p1, view.n1);
+
+        if (whisper_stream_process(stream) < 0) {
+            fprintf(stderr, "%s: failed to process audio\n", __func__);
+            whisper_stream_free(stream);
+            return 6;
+        }
+
+        const std::string text = whisper_stream_get_committed_text(stream, n_printed);
+        n_printed = whisper_stream_n_committed(stream);
+
+        line += text;
+        if (params.fname_out.length() > 0) {
+            fout << text;
+        }
+
+        printf("\33[2K\r%s\33[90m%s\33[0m", line.c_str(), whisper_stream_get_tentative_text(stream));
+
+        if (line.size() > 80) {
+            printf("\33[2K\r%s\n", line.c_str());
+            line.clear();
+        }
+
+        fflush(stdout);
+    }
+
+    if (whisper_stream_flush(stream) >= 0) {
+        const std::string text = whisper_stream_get_committed_text(stream, n_printed);
+
+        printf("\33[2K\r%s%s\n", line.c_str(), text.c_str());
+        if (params.fname_out.length() > 0) {
+            fout << text << std::endl;
+        }
+    }
+
+    whisper_stream_free(stream);
+
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     whisper_params params;
 
@@ -132,6 +240,11 @@ int main(int argc, char ** argv) {
 
     const bool use_vad = n_samples_step <= 0; // sliding window mode uses VAD
 
+    if (use_vad && params.local_agreement) {
+        fprintf(stderr, "error: --local-agreement requires --step > 0\n");
+        return 1;
+    }
+
     const int n_new_line = !use_vad ? std::max(1, params.length_ms / params.step_ms - 1) : 1; // number of steps to print new line
 
     params.no_timestamps  = !use_vad;
@@ -225,9 +338,22 @@ int main(int argc, char ** argv) {
     printf("[Start speaking]\n");
     fflush(stdout);
 
+    if (params.local_agreement) {
+        const int ret = run_local_agreement(ctx, audio, params, fout, wavWriter);
+
+        audio.pause();
+
+        whisper_print_timings(ctx);
+        whisper_free(ctx);
+
+        return ret;
+    }
+
     auto t_last  = std::chrono::high_resolution_clock::now();
     const auto t_start = t_last;
 
+    uint64_t cursor = audio.position();
+
     // main audio loop
     while (is_running) {
         if (params.save_audio) {
@@ -243,17 +369,19 @@ int main(int argc, char ** argv) {
         // process new audio
 
         if (!use_vad) {
+            // wait for a full step of new audio without copying the buffer on every poll
             while (true) {
-                audio.get(params.step_ms, pcmf32_new);
+                const audio_ring::view view = audio.get_since(cursor);
 
-                if ((int) pcmf32_new.size() > 2*n_samples_step) {
+                if ((int) view.size() > 2*n_samples_step) {
                     fprintf(stderr, "\n\n%s: WARNING: cannot process audio fast enough, dropping audio ...\n\n", __func__);
-                    audio.clear();
+                    cursor = view.end();
                     continue;
                 }
 
-                if ((int) pcmf32_new.size() >= n_samples_step) {
-                    audio.clear();
+                if ((int) view.size() >= n_samples_step) {
+                    view.copy_to(pcmf32_new);
+                    cursor = view.end();
                     break;
                 }
 
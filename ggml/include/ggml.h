@@ -520,6 +520,8 @@ extern "C" {
         GGML_OP_CROSS_ENTROPY_LOSS_BACK,
         GGML_OP_OPT_STEP_ADAMW,
 
+        GGML_OP_CONV_1D,
+
         GGML_OP_COUNT,
     };
 
@@ -1589,6 +1591,21 @@ extern "C" {
             int                   s,  // stride
             int                   d); // dilation
 
+    // direct conv_1d without the im2col buffer, with an optional bias and GELU applied to the output
+    // a:    [OC, IC, K] F16 or F32
+    // b:    [N,  IC, L] F32
+    // bias: [OC, 1] F32 or NULL
+    // result: [N, OC, OL]
+    GGML_API struct ggml_tensor * ggml_conv_1d_direct(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,    // convolution kernel
+            struct ggml_tensor  * b,    // data
+            struct ggml_tensor  * bias, // optional
+            int                   s0,   // stride
+            int                   p0,   // padding
+            int                   d0,   // dilation
+            bool                  gelu);
+
     // depthwise
     // TODO: this is very likely wrong for some cases! - needs more testing
     GGML_API struct ggml_tensor * ggml_conv_1d_dw(
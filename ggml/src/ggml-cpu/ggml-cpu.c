@@ -245,6 +245,10 @@ typedef pthread_t ggml_thread_t;
 
 static const size_t CACHE_LINE_SIZE_F32 = CACHE_LINE_SIZE/sizeof(float);
 
+// query rows x key rows processed at once by the tiled flash attention kernel
+#define GGML_FA_TILE_Q 16
+#define GGML_FA_TILE_K 64
+
 
 static void ggml_vec_dot_f32(int n, float * restrict s, size_t bs, const float * restrict x, size_t bx, const float * restrict y, size_t by, int nrc);
 static void ggml_vec_dot_f16(int n, float * restrict s, size_t bs, ggml_fp16_t * restrict x, size_t bx, ggml_fp16_t * restrict y, size_t by, int nrc);
@@ -1588,6 +1592,46 @@ inline static void ggml_vec_mad_f32(const int n, float * restrict y, const float
 #endif
 }
 
+// y[i] += sum_k x[k*ldx + i]*v[k] - keeps the partial sums of y in registers across the m rows of x
+inline static void ggml_vec_mad_rows_f32(const int n, const int m, float * restrict y, const float * restrict x, const int ldx, const float * restrict v) {
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_STEP - 1));
+
+    GGML_F32_VEC ay[GGML_F32_ARR];
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ay[j] = GGML_F32_VEC_LOAD(y + i + j*GGML_F32_EPR);
+        }
+
+        for (int k = 0; k < m; ++k) {
+            const GGML_F32_VEC vk = GGML_F32_VEC_SET1(v[k]);
+            for (int j = 0; j < GGML_F32_ARR; j++) {
+                ay[j] = GGML_F32_VEC_FMA(ay[j], GGML_F32_VEC_LOAD(x + k*ldx + i + j*GGML_F32_EPR), vk);
+            }
+        }
+
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            GGML_F32_VEC_STORE(y + i + j*GGML_F32_EPR, ay[j]);
+        }
+    }
+
+    // leftovers
+    for (int k = 0; k < m; ++k) {
+        for (int i = np; i < n; ++i) {
+            y[i] += x[k*ldx + i]*v[k];
+        }
+    }
+#else
+    // scalar
+    for (int k = 0; k < m; ++k) {
+        for (int i = 0; i < n; ++i) {
+            y[i] += x[k*ldx + i]*v[k];
+        }
+    }
+#endif
+}
+
 inline static void ggml_vec_mad_f16(const int n, ggml_fp16_t * restrict y, const ggml_fp16_t * restrict x, const float v) {
 #if defined(GGML_SIMD)
     const int np = (n & ~(GGML_F16_STEP - 1));
@@ -1766,29 +1810,6 @@ inline static void ggml_vec_gelu_f16(const int n, ggml_fp16_t * y, const ggml_fp
     }
 }
 
-#ifdef GGML_GELU_FP16
-inline static void ggml_vec_gelu_f32(const int n, float * y, const float * x) {
-    uint16_t t;
-    for (int i = 0; i < n; ++i) {
-        if (x[i] <= -10.0f) {
-            y[i] = 0.0f;
-        } else if (x[i] >= 10.0f) {
-            y[i] = x[i];
-        } else {
-            ggml_fp16_t fp16 = GGML_FP32_TO_FP16(x[i]);
-            memcpy(&t, &fp16, sizeof(uint16_t));
-            y[i] = GGML_FP16_TO_FP32(ggml_table_gelu_f16[t]);
-        }
-    }
-}
-#else
-inline static void ggml_vec_gelu_f32(const int n, float * y, const float * x) {
-    for (int i = 0; i < n; ++i) {
-        y[i] = ggml_gelu_f32(x[i]);
-    }
-}
-#endif
-
 inline static float ggml_gelu_quick_f32(float x) {
     return x*(1.0f/(1.0f+expf(GELU_QUICK_COEF*x)));
 }
@@ -1866,6 +1887,15 @@ inline static float32x4_t ggml_v_silu(float32x4_t x) {
     return vdivq_f32(x, one_plus_exp_neg_x);
 }
 
+// computes gelu 0.5*x*(1 + tanh(u)) = x/(1 + exp(-2*u)) in single precision vector
+inline static float32x4_t ggml_v_gelu(float32x4_t x) {
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float32x4_t c0 = vdupq_n_f32(-2.0f*SQRT_2_OVER_PI);
+    const float32x4_t c1 = vdupq_n_f32(-2.0f*SQRT_2_OVER_PI*GELU_COEF_A);
+    const float32x4_t neg_2u = vmulq_f32(x, vfmaq_f32(c0, c1, vmulq_f32(x, x)));
+    return vdivq_f32(x, vaddq_f32(one, ggml_v_expf(neg_2u)));
+}
+
 #elif defined(__AVX512F__) && defined(__AVX512DQ__)
 
 // adapted from arm limited optimized routine
@@ -1909,6 +1939,15 @@ inline static __m512 ggml_v_silu(__m512 x) {
     return _mm512_div_ps(x, one_plus_exp_neg_x);
 }
 
+// computes gelu 0.5*x*(1 + tanh(u)) = x/(1 + exp(-2*u)) in single precision vector
+inline static __m512 ggml_v_gelu(__m512 x) {
+    const __m512 one = _mm512_set1_ps(1);
+    const __m512 c0 = _mm512_set1_ps(-2.0f*SQRT_2_OVER_PI);
+    const __m512 c1 = _mm512_set1_ps(-2.0f*SQRT_2_OVER_PI*GELU_COEF_A);
+    const __m512 neg_2u = _mm512_mul_ps(x, _mm512_fmadd_ps(c1, _mm512_mul_ps(x, x), c0));
+    return _mm512_div_ps(x, _mm512_add_ps(one, ggml_v_expf(neg_2u)));
+}
+
 #elif defined(__AVX2__) && defined(__FMA__)
 
 // adapted from arm limited optimized routine
@@ -1964,6 +2003,15 @@ inline static __m256 ggml_v_silu(__m256 x) {
     return _mm256_div_ps(x, one_plus_exp_neg_x);
 }
 
+// computes gelu 0.5*x*(1 + tanh(u)) = x/(1 + exp(-2*u)) in single precision vector
+inline static __m256 ggml_v_gelu(__m256 x) {
+    const __m256 one = _mm256_set1_ps(1);
+    const __m256 c0 = _mm256_set1_ps(-2.0f*SQRT_2_OVER_PI);
+    const __m256 c1 = _mm256_set1_ps(-2.0f*SQRT_2_OVER_PI*GELU_COEF_A);
+    const __m256 neg_2u = _mm256_mul_ps(x, _mm256_fmadd_ps(c1, _mm256_mul_ps(x, x), c0));
+    return _mm256_div_ps(x, _mm256_add_ps(one, ggml_v_expf(neg_2u)));
+}
+
 #elif defined(__SSE2__) // __AVX2__ / __ARM_NEON
 
 #if defined(__FMA__)
@@ -2018,6 +2066,15 @@ inline static __m128 ggml_v_silu(__m128 x) {
     return _mm_div_ps(x, one_plus_exp_neg_x);
 }
 
+// computes gelu 0.5*x*(1 + tanh(u)) = x/(1 + exp(-2*u)) in single precision vector
+inline static __m128 ggml_v_gelu(__m128 x) {
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 c0 = _mm_set1_ps(-2.0f*SQRT_2_OVER_PI);
+    const __m128 c1 = _mm_set1_ps(-2.0f*SQRT_2_OVER_PI*GELU_COEF_A);
+    const __m128 neg_2u = _mm_mul_ps(x, MADD128(c1, _mm_mul_ps(x, x), c0));
+    return _mm_div_ps(x, _mm_add_ps(one, ggml_v_expf(neg_2u)));
+}
+
 #endif // __ARM_NEON / __AVX2__ / __SSE2__
 
 static void ggml_vec_silu_f32(const int n, float * y, const float * x) {
@@ -2044,6 +2101,44 @@ static void ggml_vec_silu_f32(const int n, float * y, const float * x) {
     }
 }
 
+// the vector paths stay in F32 - the FP16 lookup table is only used by the targets without a vectorized expf
+static void ggml_vec_gelu_f32(const int n, float * y, const float * x) {
+    int i = 0;
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+    for (; i + 15 < n; i += 16) {
+        _mm512_storeu_ps(y + i, ggml_v_gelu(_mm512_loadu_ps(x + i)));
+    }
+#elif defined(__AVX2__) && defined(__FMA__)
+    for (; i + 7 < n; i += 8) {
+        _mm256_storeu_ps(y + i, ggml_v_gelu(_mm256_loadu_ps(x + i)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 3 < n; i += 4) {
+        _mm_storeu_ps(y + i, ggml_v_gelu(_mm_loadu_ps(x + i)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 3 < n; i += 4) {
+        vst1q_f32(y + i, ggml_v_gelu(vld1q_f32(x + i)));
+    }
+#elif defined(GGML_GELU_FP16)
+    uint16_t t;
+    for (; i < n; ++i) {
+        if (x[i] <= -10.0f) {
+            y[i] = 0.0f;
+        } else if (x[i] >= 10.0f) {
+            y[i] = x[i];
+        } else {
+            ggml_fp16_t fp16 = GGML_FP32_TO_FP16(x[i]);
+            memcpy(&t, &fp16, sizeof(uint16_t));
+            y[i] = GGML_FP16_TO_FP32(ggml_table_gelu_f16[t]);
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] = ggml_gelu_f32(x[i]);
+    }
+}
+
 static ggml_float ggml_vec_soft_max_f32(const int n, float * y, const float * x, float max) {
     int i = 0;
     ggml_float sum = 0;
@@ -9678,6 +9773,234 @@ static void ggml_compute_forward_rope_back(
     }
 }
 
+// ggml_compute_forward_conv_1d
+
+// output channels x output columns computed at once by ggml_compute_forward_conv_1d
+// a tile of columns of all input channels stays in L2 while the blocks of output channels are processed
+#define GGML_CONV_1D_OC 4
+#define GGML_CONV_1D_OL 256
+
+// SIMD registers per output channel in the accumulator tile - 4 x 4 needs the 32 registers of AVX512/AArch64
+#if defined(__AVX512F__) || defined(__aarch64__)
+#define GGML_CONV_1D_NV 4
+#else
+#define GGML_CONV_1D_NV 2
+#endif
+
+// size of the shared input buffer, in floats - the padded input rows split into s0 phases
+static size_t ggml_conv_1d_input_wsize(const struct ggml_tensor * dst) {
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    const int32_t s0 = ((const int32_t *) dst->op_params)[0];
+    const int32_t p0 = ((const int32_t *) dst->op_params)[1];
+
+    const int64_t ls = (src1->ne[0] + 2*p0 + s0 - 1)/s0;
+
+    return src1->ne[2]*src1->ne[1]*s0*ls;
+}
+
+// size of the shared kernel buffer, in floats - F32, interleaved by blocks of GGML_CONV_1D_OC output channels
+static size_t ggml_conv_1d_kernel_wsize(const struct ggml_tensor * dst) {
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    const int64_t nob = (src0->ne[2] + GGML_CONV_1D_OC - 1)/GGML_CONV_1D_OC;
+
+    return nob*GGML_CONV_1D_OC*src0->ne[1]*src0->ne[0];
+}
+
+static void ggml_compute_forward_conv_1d(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+    const struct ggml_tensor * src2 = dst->src[2];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int32_t s0   = ((const int32_t *) dst->op_params)[0];
+    const int32_t p0   = ((const int32_t *) dst->op_params)[1];
+    const int32_t d0   = ((const int32_t *) dst->op_params)[2];
+    const int32_t gelu = ((const int32_t *) dst->op_params)[3];
+
+    const int64_t K  = ne00;
+    const int64_t IC = ne01;
+    const int64_t OC = ne02;
+    const int64_t L  = ne10;
+    const int64_t N  = ne12;
+    const int64_t OL = ne0;
+
+    GGML_ASSERT(nb00 == ggml_type_size(src0->type));
+    GGML_ASSERT(nb10 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    // the padded input row xp[i] = x[i - p0] is split into the phases xs[ph][j] = xp[j*s0 + ph], so that
+    // y[ol] = sum_k w[k]*xp[ol*s0 + k*d0] reads each phase contiguously at xs[(k*d0) % s0][ol + (k*d0)/s0]
+    const int64_t ls = (L + 2*p0 + s0 - 1)/s0;
+
+    // kernel blocks w[ob][(ic*K + k)*GGML_CONV_1D_OC + o] for the output channel ob*GGML_CONV_1D_OC + o
+    const int64_t nob = (OC + GGML_CONV_1D_OC - 1)/GGML_CONV_1D_OC;
+
+    float * const xs = (float *) params->wdata;
+    float * const wb = xs + ggml_conv_1d_input_wsize(dst);
+
+    {
+        const int64_t dr  = (nob + nth - 1)/nth;
+        const int64_t ir0 = dr*ith;
+        const int64_t ir1 = MIN(ir0 + dr, nob);
+
+        for (int64_t ob = ir0; ob < ir1; ++ob) {
+            float * w = wb + ob*GGML_CONV_1D_OC*IC*K;
+
+            for (int64_t o = 0; o < GGML_CONV_1D_OC; ++o) {
+                const int64_t oc = ob*GGML_CONV_1D_OC + o;
+
+                for (int64_t ic = 0; ic < IC; ++ic) {
+                    const char * wr = (const char *) src0->data + oc*nb02 + ic*nb01;
+                    for (int64_t k = 0; k < K; ++k) {
+                        float v = 0.0f;
+                        if (oc < OC) {
+                            v = src0->type == GGML_TYPE_F16 ? GGML_FP16_TO_FP32(((const ggml_fp16_t *) wr)[k]) : ((const float *) wr)[k];
+                        }
+                        w[(ic*K + k)*GGML_CONV_1D_OC + o] = v;
+                    }
+                }
+            }
+        }
+    }
+
+    {
+        const int64_t nr  = N*IC;
+        const int64_t dr  = (nr + nth - 1)/nth;
+        const int64_t ir0 = dr*ith;
+        const int64_t ir1 = MIN(ir0 + dr, nr);
+
+        for (int64_t ir = ir0; ir < ir1; ++ir) {
+            const int64_t i12 = ir/IC;
+            const int64_t i11 = ir - i12*IC;
+
+            const float * x = (const float *) ((const char *) src1->data + i11*nb11 + i12*nb12);
+
+            for (int64_t ph = 0; ph < s0; ++ph) {
+                float * xs_ph = xs + (ir*s0 + ph)*ls;
+                for (int64_t j = 0; j < ls; ++j) {
+                    const int64_t i = j*s0 + ph - p0;
+                    xs_ph[j] = i >= 0 && i < L ? x[i] : 0.0f;
+                }
+            }
+        }
+    }
+
+    ggml_barrier(params->threadpool);
+
+    // blocks of output channels x tiles of output columns, with the channels innermost
+    const int64_t nt  = (OL + GGML_CONV_1D_OL - 1)/GGML_CONV_1D_OL;
+    const int64_t nb  = N*nt*nob;
+    const int64_t db  = (nb + nth - 1)/nth;
+    const int64_t ib0 = db*ith;
+    const int64_t ib1 = MIN(ib0 + db, nb);
+
+    float b[GGML_CONV_1D_OC];
+
+    for (int64_t ib = ib0; ib < ib1; ++ib) {
+        const int64_t i2  = ib/(nt*nob);
+        const int64_t it  = (ib - i2*nt*nob)/nob;
+        const int64_t ob  = ib - i2*nt*nob - it*nob;
+        const int64_t oc0 = ob*GGML_CONV_1D_OC;
+        const int64_t noc = MIN(GGML_CONV_1D_OC, OC - oc0);
+
+        const int64_t i00 = it*GGML_CONV_1D_OL;
+        const int64_t i01 = MIN(i00 + GGML_CONV_1D_OL, OL);
+
+        const float * w = wb + ob*GGML_CONV_1D_OC*IC*K;
+
+        for (int64_t o = 0; o < GGML_CONV_1D_OC; ++o) {
+            b[o] = src2 && o < noc ? ((const float *) src2->data)[oc0 + o] : 0.0f;
+        }
+
+        const float * xb = xs + i2*IC*s0*ls;
+
+        float * y[GGML_CONV_1D_OC];
+        for (int64_t o = 0; o < GGML_CONV_1D_OC; ++o) {
+            y[o] = (float *) ((char *) dst->data + MIN(oc0 + o, OC - 1)*nb1 + i2*nb2);
+        }
+
+        int64_t i0 = i00;
+
+#if defined(GGML_SIMD)
+        // GGML_CONV_1D_OC x GGML_CONV_1D_NV accumulators, the input is loaded once for all output channels
+        for (; i0 + GGML_CONV_1D_NV*GGML_F32_EPR <= i01; i0 += GGML_CONV_1D_NV*GGML_F32_EPR) {
+            GGML_F32_VEC acc[GGML_CONV_1D_OC][GGML_CONV_1D_NV];
+
+            for (int o = 0; o < GGML_CONV_1D_OC; ++o) {
+                for (int v = 0; v < GGML_CONV_1D_NV; ++v) {
+                    acc[o][v] = GGML_F32_VEC_SET1(b[o]);
+                }
+            }
+
+            for (int64_t k = 0; k < K; ++k) {
+                const int64_t xk = ((k*d0) % s0)*ls + (k*d0)/s0 + i0;
+
+                for (int64_t ic = 0; ic < IC; ++ic) {
+                    const float * x  = xb + ic*s0*ls + xk;
+                    const float * wk = w + (ic*K + k)*GGML_CONV_1D_OC;
+
+                    GGML_F32_VEC xv[GGML_CONV_1D_NV];
+                    for (int v = 0; v < GGML_CONV_1D_NV; ++v) {
+                        xv[v] = GGML_F32_VEC_LOAD(x + v*GGML_F32_EPR);
+                    }
+
+                    for (int o = 0; o < GGML_CONV_1D_OC; ++o) {
+                        const GGML_F32_VEC wo = GGML_F32_VEC_SET1(wk[o]);
+                        for (int v = 0; v < GGML_CONV_1D_NV; ++v) {
+                            acc[o][v] = GGML_F32_VEC_FMA(acc[o][v], xv[v], wo);
+                        }
+                    }
+                }
+            }
+
+            for (int64_t o = 0; o < noc; ++o) {
+                for (int v = 0; v < GGML_CONV_1D_NV; ++v) {
+                    GGML_F32_VEC_STORE(y[o] + i0 + v*GGML_F32_EPR, acc[o][v]);
+                }
+            }
+        }
+#endif
+
+        // leftovers
+        for (; i0 < i01; ++i0) {
+            float acc[GGML_CONV_1D_OC];
+            for (int o = 0; o < GGML_CONV_1D_OC; ++o) {
+                acc[o] = b[o];
+            }
+
+            for (int64_t k = 0; k < K; ++k) {
+                const int64_t xk = ((k*d0) % s0)*ls + (k*d0)/s0 + i0;
+
+                for (int64_t ic = 0; ic < IC; ++ic) {
+                    const float x = xb[ic*s0*ls + xk];
+                    for (int o = 0; o < GGML_CONV_1D_OC; ++o) {
+                        acc[o] += x*w[(ic*K + k)*GGML_CONV_1D_OC + o];
+                    }
+                }
+            }
+
+            for (int64_t o = 0; o < noc; ++o) {
+                y[o][i0] = acc[o];
+            }
+        }
+
+        if (gelu) {
+            for (int64_t o = 0; o < noc; ++o) {
+                ggml_vec_gelu_f32(i01 - i00, y[o] + i00, y[o] + i00);
+            }
+        }
+    }
+}
+
 // ggml_compute_forward_conv_transpose_1d
 
 static void ggml_compute_forward_conv_transpose_1d_f16_f32(
@@ -11027,6 +11350,193 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     }
 }
 
+// tiled variant for long, unmasked sequences (e.g. the Whisper encoder)
+//
+// each task processes a tile of GGML_FA_TILE_Q query rows of one head. The keys and values are
+// converted to F32 once per block of GGML_FA_TILE_K rows and reused by all rows of the tile, so
+// the block stays in L1 while the scores and the output are accumulated in registers.
+
+static bool ggml_compute_forward_flash_attn_ext_use_tiled(
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        const struct ggml_tensor * dst) {
+    float max_bias      = 0.0f;
+    float logit_softcap = 0.0f;
+
+    memcpy(&max_bias,      (const float *) dst->op_params + 1, sizeof(float));
+    memcpy(&logit_softcap, (const float *) dst->op_params + 2, sizeof(float));
+
+    return mask == NULL && max_bias == 0.0f && logit_softcap == 0.0f &&
+        (k->type == GGML_TYPE_F16 || k->type == GGML_TYPE_F32) &&
+        (v->type == GGML_TYPE_F16 || v->type == GGML_TYPE_F32) &&
+        q->ne[1] >= GGML_FA_TILE_Q && k->ne[1] >= GGML_FA_TILE_K;
+}
+
+// per-thread work buffer of the tiled variant, in floats
+static size_t ggml_flash_attn_ext_tiled_wsize(int64_t D) {
+    return GGML_FA_TILE_Q*D              // Q
+         + D*GGML_FA_TILE_K              // K block (transposed)
+         + GGML_FA_TILE_K*D              // V block
+         + GGML_FA_TILE_Q*GGML_FA_TILE_K // KQ
+         + GGML_FA_TILE_Q*D              // VKQ
+         + 2*GGML_FA_TILE_Q              // M, S
+         + CACHE_LINE_SIZE_F32;
+}
+
+static void ggml_compute_forward_flash_attn_ext_f16_tiled(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        struct ggml_tensor * dst) {
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D = neq0;
+    const int64_t N = neq1;
+
+    GGML_ASSERT(ne0 == D);
+    GGML_ASSERT(ne2 == N);
+
+    GGML_ASSERT(nbq0 == sizeof(float));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
+
+    GGML_ASSERT(nek0 == D);
+    GGML_ASSERT(nev0 == D);
+    GGML_ASSERT(nek1 == nev1);
+
+    GGML_ASSERT(nb0 == sizeof(float));
+
+    const int64_t TQ = GGML_FA_TILE_Q;
+    const int64_t TK = GGML_FA_TILE_K;
+
+    // broadcast factors
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rk3 = neq3/nek3;
+
+    const int64_t rv2 = neq2/nev2;
+    const int64_t rv3 = neq3/nev3;
+
+    float scale = 1.0f;
+    memcpy(&scale, (float *) dst->op_params + 0, sizeof(float));
+
+    // tiles are ordered by head, so the threads share the K/V of as few heads as possible
+    const int64_t nq = (N + TQ - 1)/TQ;
+    const int64_t nt = nq*neq2*neq3;
+
+    const int64_t dt  = (nt + nth - 1)/nth;
+    const int64_t it0 = dt*ith;
+    const int64_t it1 = MIN(it0 + dt, nt);
+
+    float * Q  = (float *) params->wdata + ith*ggml_flash_attn_ext_tiled_wsize(D);
+    float * Kt = Q  + TQ*D;
+    float * Vb = Kt + D*TK;
+    float * KQ = Vb + TK*D;
+    float * O  = KQ + TQ*TK;
+    float * M  = O  + TQ*D;
+    float * S  = M  + TQ;
+
+    for (int64_t it = it0; it < it1; ++it) {
+        const int64_t iq3 = it/(neq2*nq);
+        const int64_t iq2 = (it - iq3*neq2*nq)/nq;
+        const int64_t iq1 = (it - iq3*neq2*nq - iq2*nq)*TQ;
+
+        const int64_t nr = MIN(TQ, N - iq1);
+
+        const int64_t ik2 = iq2/rk2;
+        const int64_t ik3 = iq3/rk3;
+
+        const int64_t iv2 = iq2/rv2;
+        const int64_t iv3 = iq3/rv3;
+
+        for (int64_t r = 0; r < nr; ++r) {
+            const float * pq = (const float *) ((const char *) q->data + ((iq1 + r)*nbq1 + iq2*nbq2 + iq3*nbq3));
+            for (int64_t d = 0; d < D; ++d) {
+                Q[r*D + d] = pq[d]*scale;
+            }
+
+            M[r] = -INFINITY;
+            S[r] = 0.0f;
+        }
+
+        memset(O, 0, nr*D*sizeof(float));
+
+        // online softmax over blocks of keys
+        // ref: https://arxiv.org/pdf/2112.05682.pdf
+        for (int64_t ic0 = 0; ic0 < nek1; ic0 += TK) {
+            const int64_t nc = MIN(TK, nek1 - ic0);
+
+            for (int64_t ic = 0; ic < nc; ++ic) {
+                const char * k_data = (const char *) k->data + ((ic0 + ic)*nbk1 + ik2*nbk2 + ik3*nbk3);
+                const char * v_data = (const char *) v->data + ((ic0 + ic)*nbv1 + iv2*nbv2 + iv3*nbv3);
+
+                if (k->type == GGML_TYPE_F16) {
+                    for (int64_t d = 0; d < D; ++d) {
+                        Kt[d*TK + ic] = GGML_FP16_TO_FP32(((const ggml_fp16_t *) k_data)[d]);
+                    }
+                } else {
+                    for (int64_t d = 0; d < D; ++d) {
+                        Kt[d*TK + ic] = ((const float *) k_data)[d];
+                    }
+                }
+
+                if (v->type == GGML_TYPE_F16) {
+                    ggml_fp16_to_fp32_row((const ggml_fp16_t *) v_data, Vb + ic*D, D);
+                } else {
+                    memcpy(Vb + ic*D, v_data, D*sizeof(float));
+                }
+            }
+
+            for (int64_t r = 0; r < nr; ++r) {
+                float * s = KQ + r*TK;
+
+                // s = K*q
+                memset(s, 0, nc*sizeof(float));
+                ggml_vec_mad_rows_f32(nc, D, s, Kt, TK, Q + r*D);
+
+                float Mnew = M[r];
+                ggml_vec_max_f32(nc, &Mnew, s);
+                Mnew = MAX(Mnew, M[r]);
+
+                // s = expf(s - Mnew)
+                const float sum = (float) ggml_vec_soft_max_f32(nc, s, s, Mnew);
+
+                // rescale the previous blocks to the new maximum
+                const float ms = expf(M[r] - Mnew);
+                if (ms != 1.0f) {
+                    ggml_vec_scale_f32(D, O + r*D, ms);
+                }
+
+                M[r] = Mnew;
+                S[r] = S[r]*ms + sum;
+
+                // o += V^T*s
+                ggml_vec_mad_rows_f32(D, nc, O + r*D, Vb, D, s);
+            }
+        }
+
+        for (int64_t r = 0; r < nr; ++r) {
+            ggml_vec_scale_f32(D, O + r*D, 1.0f/S[r]);
+
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (iq3*ne2*ne1 + iq2 + (iq1 + r)*ne1)*nb1, O + r*D, nb1);
+        }
+    }
+}
+
 static void ggml_compute_forward_flash_attn_ext(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
@@ -11039,7 +11549,11 @@ static void ggml_compute_forward_flash_attn_ext(
         case GGML_PREC_F32:
             {
                 // uses F32 accumulators
-                ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+                if (ggml_compute_forward_flash_attn_ext_use_tiled(q, k, v, mask, dst)) {
+                    ggml_compute_forward_flash_attn_ext_f16_tiled(params, q, k, v, dst);
+                } else {
+                    ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+                }
             } break;
         default:
             {
@@ -12913,6 +13427,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_clamp(params, tensor);
             } break;
+        case GGML_OP_CONV_1D:
+            {
+                ggml_compute_forward_conv_1d(params, tensor);
+            } break;
         case GGML_OP_CONV_TRANSPOSE_1D:
             {
                 ggml_compute_forward_conv_transpose_1d(params, tensor);
@@ -13286,6 +13804,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
             } break;
         case GGML_OP_IM2COL:
         case GGML_OP_IM2COL_BACK:
+        case GGML_OP_CONV_1D:
         case GGML_OP_CONV_TRANSPOSE_1D:
         case GGML_OP_CONV_TRANSPOSE_2D:
             {
@@ -13744,6 +14263,10 @@ struct ggml_cplan ggml_graph_plan(
                     {
                         cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
                     } break;
+                case GGML_OP_CONV_1D:
+                    {
+                        cur = sizeof(float)*(ggml_conv_1d_input_wsize(node) + ggml_conv_1d_kernel_wsize(node));
+                    } break;
                 case GGML_OP_CONV_TRANSPOSE_1D:
                     {
                         GGML_ASSERT(node->src[0]->ne[3] == 1);
@@ -13788,6 +14311,10 @@ struct ggml_cplan ggml_graph_plan(
                         const int64_t ne00 = node->src[0]->ne[0]; // D
 
                         cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size/thread
+
+                        if (ggml_compute_forward_flash_attn_ext_use_tiled(node->src[0], node->src[1], node->src[2], node->src[3], node)) {
+                            cur = MAX(cur, sizeof(float)*ggml_flash_attn_ext_tiled_wsize(ne00)*n_tasks);
+                        }
                     } break;
                 case GGML_OP_FLASH_ATTN_BACK:
                     {
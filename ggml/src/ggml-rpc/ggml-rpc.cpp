@@ -2,7 +2,9 @@
 #include "ggml-impl.h"
 #include "ggml-backend-impl.h"
 
+#include <algorithm>
 #include <cinttypes>
+#include <cstdio>
 #include <string>
 #include <vector>
 #include <memory>
@@ -24,6 +26,7 @@
 #  include <netinet/tcp.h>
 #  include <netdb.h>
 #  include <unistd.h>
+#  include <sys/uio.h>
 #endif
 #include <cstring>
 
@@ -37,6 +40,8 @@ typedef int sockfd_t;
 // cross-platform socket
 struct socket_t {
     sockfd_t fd;
+    bool cache = false; // client side: the server keeps a weight cache (from RPC_CMD_HELLO)
+    std::mutex mutex;   // client side: the backends of an endpoint share the socket, one command at a time
     socket_t(sockfd_t fd) : fd(fd) {}
     ~socket_t() {
         GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
@@ -86,9 +91,25 @@ enum rpc_cmd {
     RPC_CMD_GET_DEVICE_MEMORY,
     RPC_CMD_INIT_TENSOR,
     RPC_CMD_GET_ALLOC_SIZE,
+    RPC_CMD_SET_TENSOR_HASH,
+    RPC_CMD_HELLO,
     RPC_CMD_COUNT,
 };
 
+// weight data larger than this is first offered by content hash (RPC_CMD_SET_TENSOR_HASH)
+// and only sent if the server does not have it in its cache
+#define GGML_RPC_HASH_THRESHOLD (1024*1024)
+
+// SHA-256
+#define GGML_RPC_HASH_SIZE 32
+
+struct rpc_msg_hello_rsp {
+    uint8_t major;
+    uint8_t minor;
+    uint8_t patch;
+    uint8_t cache; // the server keeps a weight cache and accepts RPC_CMD_SET_TENSOR_HASH
+};
+
 struct rpc_msg_get_alloc_size_req {
     rpc_tensor tensor;
 };
@@ -135,6 +156,23 @@ struct rpc_msg_buffer_clear_req {
     uint8_t value;
 };
 
+// followed by the tensor data
+struct rpc_msg_set_tensor_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+};
+
+struct rpc_msg_set_tensor_hash_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+    uint64_t size;
+    uint8_t hash[GGML_RPC_HASH_SIZE];
+};
+
+struct rpc_msg_set_tensor_hash_rsp {
+    uint8_t result;
+};
+
 struct rpc_msg_get_tensor_req {
     rpc_tensor tensor;
     uint64_t offset;
@@ -291,6 +329,52 @@ static bool send_data(sockfd_t sockfd, const void * data, size_t size) {
     return true;
 }
 
+// send several buffers without staging them in a single one
+// on POSIX systems they are gathered by the kernel, so a small header and the data leave in the same segments
+struct rpc_iovec {
+    const void * data;
+    size_t       size;
+};
+
+static bool send_data_v(sockfd_t sockfd, const rpc_iovec * bufs, size_t n_bufs) {
+#ifdef _WIN32
+    for (size_t i = 0; i < n_bufs; i++) {
+        if (!send_data(sockfd, bufs[i].data, bufs[i].size)) {
+            return false;
+        }
+    }
+    return true;
+#else
+    std::vector<struct iovec> iov(n_bufs);
+    for (size_t i = 0; i < n_bufs; i++) {
+        iov[i].iov_base = const_cast<void *>(bufs[i].data);
+        iov[i].iov_len  = bufs[i].size;
+    }
+    size_t i0 = 0;
+    while (i0 < iov.size()) {
+        if (iov[i0].iov_len == 0) {
+            i0++;
+            continue;
+        }
+        ssize_t n = writev(sockfd, iov.data() + i0, (int) (iov.size() - i0));
+        if (n < 0) {
+            return false;
+        }
+        // skip what was sent, the last buffer may be partially sent
+        while (n > 0 && i0 < iov.size()) {
+            const size_t k = std::min<size_t>(n, iov[i0].iov_len);
+            iov[i0].iov_base = (char *) iov[i0].iov_base + k;
+            iov[i0].iov_len -= k;
+            n -= k;
+            if (iov[i0].iov_len == 0) {
+                i0++;
+            }
+        }
+    }
+    return true;
+#endif
+}
+
 static bool recv_data(sockfd_t sockfd, void * data, size_t size) {
     size_t bytes_recv = 0;
     while (bytes_recv < size) {
@@ -304,10 +388,12 @@ static bool recv_data(sockfd_t sockfd, void * data, size_t size) {
 }
 
 static bool send_msg(sockfd_t sockfd, const void * msg, size_t msg_size) {
-    if (!send_data(sockfd, &msg_size, sizeof(msg_size))) {
-        return false;
-    }
-    return send_data(sockfd, msg, msg_size);
+    uint64_t size = msg_size;
+    rpc_iovec bufs[2] = {
+        { &size, sizeof(size) },
+        { msg,   msg_size     },
+    };
+    return send_data_v(sockfd, bufs, 2);
 }
 
 static bool recv_msg(sockfd_t sockfd, void * msg, size_t msg_size) {
@@ -345,17 +431,93 @@ static bool parse_endpoint(const std::string & endpoint, std::string & host, int
     return true;
 }
 
+// SHA-256 (FIPS 180-4)
+// the cached weight data is addressed by its hash alone, so the hash must be collision resistant
+static void rpc_sha256_block(uint32_t * state, const uint8_t * p) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) p[4*i] << 24 | (uint32_t) p[4*i + 1] << 16 | (uint32_t) p[4*i + 2] << 8 | (uint32_t) p[4*i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2],  19) ^ (w[i - 2]  >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        const uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void rpc_hash(const void * data, size_t size, uint8_t * hash) {
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    const uint8_t * p = (const uint8_t *) data;
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        rpc_sha256_block(state, p + i);
+    }
+
+    // the remaining bytes, a 1 bit, zero padding and the length in bits fill one or two blocks
+    uint8_t tail[128] = {0};
+    const size_t n_tail = size - i;
+    memcpy(tail, p + i, n_tail);
+    tail[n_tail] = 0x80;
+    const size_t n_pad = n_tail + 9 <= 64 ? 64 : 128;
+    const uint64_t n_bits = (uint64_t) size*8;
+    for (int j = 0; j < 8; j++) {
+        tail[n_pad - 1 - j] = (uint8_t) (n_bits >> (8*j));
+    }
+    for (size_t j = 0; j < n_pad; j += 64) {
+        rpc_sha256_block(state, tail + j);
+    }
+
+    for (int j = 0; j < 8; j++) {
+        hash[4*j + 0] = (uint8_t) (state[j] >> 24);
+        hash[4*j + 1] = (uint8_t) (state[j] >> 16);
+        hash[4*j + 2] = (uint8_t) (state[j] >> 8);
+        hash[4*j + 3] = (uint8_t) (state[j]);
+    }
+}
+
 // RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
 // RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
-static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+// the request data can be given in several parts, e.g. a header followed by the tensor data
+static bool send_rpc_cmd_v(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const rpc_iovec * parts, size_t n_parts, void * output, size_t output_size) {
+    std::lock_guard<std::mutex> lock(sock->mutex);
     uint8_t cmd_byte = cmd;
-    if (!send_data(sock->fd, &cmd_byte, sizeof(cmd_byte))) {
-        return false;
-    }
-    if (!send_data(sock->fd, &input_size, sizeof(input_size))) {
-        return false;
-    }
-    if (!send_data(sock->fd, input, input_size)) {
+    uint64_t input_size = 0;
+    for (size_t i = 0; i < n_parts; i++) {
+        input_size += parts[i].size;
+    }
+    std::vector<rpc_iovec> bufs;
+    bufs.reserve(n_parts + 2);
+    bufs.push_back({ &cmd_byte,   sizeof(cmd_byte)   });
+    bufs.push_back({ &input_size, sizeof(input_size) });
+    bufs.insert(bufs.end(), parts, parts + n_parts);
+    if (!send_data_v(sock->fd, bufs.data(), bufs.size())) {
         return false;
     }
     // TODO: currently the output_size is always known, do we need support for commands with variable output size?
@@ -373,8 +535,31 @@ static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cm
     return true;
 }
 
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    rpc_iovec part = { input, input_size };
+    return send_rpc_cmd_v(sock, cmd, &part, 1, output, output_size);
+}
+
 // RPC client-side implementation
 
+static bool check_server_version(const std::shared_ptr<socket_t> & sock) {
+    rpc_msg_hello_rsp response;
+    bool status = send_rpc_cmd(sock, RPC_CMD_HELLO, nullptr, 0, &response, sizeof(response));
+    if (!status) {
+        fprintf(stderr, "RPC server did not answer HELLO - it uses an older protocol\n");
+        return false;
+    }
+    if (response.major != RPC_PROTO_MAJOR_VERSION || response.minor > RPC_PROTO_MINOR_VERSION) {
+        fprintf(stderr, "RPC server version mismatch: %d.%d.%d\n", response.major, response.minor, response.patch);
+        return false;
+    }
+    if (response.minor != RPC_PROTO_MINOR_VERSION || response.patch != RPC_PROTO_PATCH_VERSION) {
+        GGML_LOG_INFO("WARNING: RPC server version mismatch: %d.%d.%d\n", response.major, response.minor, response.patch);
+    }
+    sock->cache = response.cache != 0;
+    return true;
+}
+
 static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     static std::mutex mutex;
     std::lock_guard<std::mutex> lock(mutex);
@@ -408,6 +593,9 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     if (sock == nullptr) {
         return nullptr;
     }
+    if (!check_server_version(sock)) {
+        return nullptr;
+    }
     GGML_PRINT_DEBUG("[%s] connected to %s, sockfd=%d\n", __func__, endpoint.c_str(), sock->fd);
     sockets[endpoint] = sock;
     return sock;
@@ -482,14 +670,29 @@ static void ggml_backend_rpc_buffer_init_tensor(ggml_backend_buffer_t buffer, gg
 
 static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+    if (ctx->sock->cache && ggml_backend_buffer_get_usage(buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS && size > GGML_RPC_HASH_THRESHOLD) {
+        // offer the hash first - if the server has the data in its cache, it does not have to be sent
+        rpc_msg_set_tensor_hash_req request;
+        request.tensor = serialize_tensor(tensor);
+        request.offset = offset;
+        request.size   = size;
+        rpc_hash(data, size, request.hash);
+        rpc_msg_set_tensor_hash_rsp response;
+        bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR_HASH, &request, sizeof(request), &response, sizeof(response));
+        GGML_ASSERT(status);
+        if (response.result) {
+            return;
+        }
+    }
     // input serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
-    size_t input_size = sizeof(rpc_tensor) + sizeof(uint64_t) + size;
-    std::vector<uint8_t> input(input_size, 0);
-    rpc_tensor rpc_tensor = serialize_tensor(tensor);
-    memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
-    memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
-    memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), data, size);
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR, input.data(), input.size(), nullptr, 0);
+    rpc_msg_set_tensor_req request;
+    request.tensor = serialize_tensor(tensor);
+    request.offset = offset;
+    rpc_iovec parts[2] = {
+        { &request, sizeof(request) },
+        { data,     size            },
+    };
+    bool status = send_rpc_cmd_v(ctx->sock, RPC_CMD_SET_TENSOR, parts, 2, nullptr, 0);
     GGML_ASSERT(status);
 }
 
@@ -771,17 +974,19 @@ void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, si
 
 class rpc_server {
 public:
-    rpc_server(ggml_backend_t backend) : backend(backend) {}
+    rpc_server(ggml_backend_t backend, const char * cache_dir) : backend(backend), cache_dir(cache_dir ? cache_dir : "") {}
     ~rpc_server();
 
+    void hello(rpc_msg_hello_rsp & response);
     void alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response);
     void get_alignment(rpc_msg_get_alignment_rsp & response);
     void get_max_size(rpc_msg_get_max_size_rsp & response);
     bool buffer_get_base(const rpc_msg_buffer_get_base_req & request, rpc_msg_buffer_get_base_rsp & response);
     bool free_buffer(const rpc_msg_free_buffer_req & request);
     bool buffer_clear(const rpc_msg_buffer_clear_req & request);
-    bool set_tensor(const std::vector<uint8_t> & input);
-    bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response);
+    bool set_tensor(sockfd_t sockfd);
+    bool set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response);
+    bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & staging, const void ** data);
     bool copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response);
     bool graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response);
     bool init_tensor(const rpc_msg_init_tensor_req & request);
@@ -793,12 +998,23 @@ private:
                               struct ggml_context * ctx,
                               const std::unordered_map<uint64_t, const rpc_tensor*> & tensor_ptrs,
                               std::unordered_map<uint64_t, struct ggml_tensor*> & tensor_map);
+    bool check_tensor_range(const ggml_tensor * tensor, uint64_t data, uint64_t offset, uint64_t size);
+    std::string cache_path(const uint8_t * hash) const;
+    void cache_store(const void * data, size_t size);
 
 
     ggml_backend_t backend;
+    std::string cache_dir; // weight data cache addressed by content hash (empty - disabled)
     std::unordered_set<ggml_backend_buffer_t> buffers;
 };
 
+void rpc_server::hello(rpc_msg_hello_rsp & response) {
+    response.major = RPC_PROTO_MAJOR_VERSION;
+    response.minor = RPC_PROTO_MINOR_VERSION;
+    response.patch = RPC_PROTO_PATCH_VERSION;
+    response.cache = !cache_dir.empty();
+}
+
 bool rpc_server::get_alloc_size(const rpc_msg_get_alloc_size_req & request, rpc_msg_get_alloc_size_rsp & response) {
     ggml_backend_buffer_type_t buft;
     struct ggml_init_params params {
@@ -924,15 +1140,60 @@ ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rp
 }
 
 
-bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
-    // serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
-    if (input.size() < sizeof(rpc_tensor) + sizeof(uint64_t)) {
+bool rpc_server::check_tensor_range(const ggml_tensor * tensor, uint64_t data, uint64_t offset, uint64_t size) {
+    const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
+    const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+
+    return data + offset >= p0 && data + offset < p1 && size <= (p1 - data - offset);
+}
+
+std::string rpc_server::cache_path(const uint8_t * hash) const {
+    char name[2*GGML_RPC_HASH_SIZE + 1];
+    for (int i = 0; i < GGML_RPC_HASH_SIZE; i++) {
+        snprintf(name + 2*i, 3, "%02x", hash[i]);
+    }
+    return cache_dir + "/" + name;
+}
+
+void rpc_server::cache_store(const void * data, size_t size) {
+    uint8_t hash[GGML_RPC_HASH_SIZE];
+    rpc_hash(data, size, hash);
+
+    const std::string path = cache_path(hash);
+
+    FILE * f = fopen(path.c_str(), "rb");
+    if (f) {
+        fclose(f);
+        return;
+    }
+
+    // write to a temporary file first, so that a partial file is never found by its hash
+    const std::string path_tmp = path + ".tmp";
+    f = fopen(path_tmp.c_str(), "wb");
+    if (!f) {
+        GGML_LOG_WARN("[%s] failed to create %s\n", __func__, path_tmp.c_str());
+        return;
+    }
+    const bool ok = fwrite(data, 1, size, f) == size;
+    fclose(f);
+    if (!ok || rename(path_tmp.c_str(), path.c_str()) != 0) {
+        GGML_LOG_WARN("[%s] failed to write %s\n", __func__, path.c_str());
+        remove(path_tmp.c_str());
+    }
+}
+
+// request format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
+// the data is received directly into host buffers, without a staging copy
+bool rpc_server::set_tensor(sockfd_t sockfd) {
+    uint64_t input_size;
+    if (!recv_data(sockfd, &input_size, sizeof(input_size))) {
         return false;
     }
-    const rpc_tensor * in_tensor = (const rpc_tensor *)input.data();
-    uint64_t offset;
-    memcpy(&offset, input.data() + sizeof(rpc_tensor), sizeof(offset));
-    const size_t size = input.size() - sizeof(rpc_tensor) - sizeof(offset);
+    rpc_msg_set_tensor_req request;
+    if (input_size < sizeof(request) || !recv_data(sockfd, &request, sizeof(request))) {
+        return false;
+    }
+    const size_t size = input_size - sizeof(request);
 
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
@@ -940,26 +1201,119 @@ bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
         /*.no_alloc   =*/ true,
     };
     struct ggml_context * ctx = ggml_init(params);
-    ggml_tensor * tensor = deserialize_tensor(ctx, in_tensor);
+    ggml_tensor * tensor = deserialize_tensor(ctx, &request.tensor);
     if (tensor == nullptr) {
         GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
         ggml_free(ctx);
         return false;
     }
-    GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %zu\n", __func__, (void*)tensor->buffer, tensor->data, offset, size);
+    GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %zu\n", __func__, (void*)tensor->buffer, tensor->data, request.offset, size);
 
     // sanitize tensor->data
-    {
-        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
-        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+    if (!check_tensor_range(tensor, request.tensor.data, request.offset, size)) {
+        GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
+    }
 
-        if (in_tensor->data + offset < p0 || in_tensor->data + offset >= p1 || size > (p1 - in_tensor->data - offset)) {
-            GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
+    const void * data = nullptr;
+    std::vector<uint8_t> staging;
+    if (ggml_backend_buffer_is_host(tensor->buffer)) {
+        uint8_t * dst = (uint8_t *) tensor->data + request.offset;
+        if (!recv_data(sockfd, dst, size)) {
+            ggml_free(ctx);
+            return false;
         }
+        data = dst;
+    } else {
+        try {
+            staging.resize(size);
+        } catch (const std::bad_alloc & e) {
+            fprintf(stderr, "Failed to allocate input buffer of size %zu\n", size);
+            ggml_free(ctx);
+            return false;
+        }
+        if (!recv_data(sockfd, staging.data(), size)) {
+            ggml_free(ctx);
+            return false;
+        }
+        ggml_backend_tensor_set(tensor, staging.data(), request.offset, size);
+        data = staging.data();
+    }
+
+    // only the weights are cached - the buffer is marked by RPC_CMD_SET_TENSOR_HASH, which clients send for weight buffers
+    if (!cache_dir.empty() && ggml_backend_buffer_get_usage(tensor->buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS && size > GGML_RPC_HASH_THRESHOLD) {
+        cache_store(data, size);
     }
 
-    const void * data = input.data() + sizeof(rpc_tensor) + sizeof(offset);
-    ggml_backend_tensor_set(tensor, data, offset, size);
+    ggml_free(ctx);
+    return true;
+}
+
+bool rpc_server::set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response) {
+    response.result = 0;
+    if (cache_dir.empty()) {
+        return true;
+    }
+
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+    ggml_tensor * tensor = deserialize_tensor(ctx, &request.tensor);
+    if (tensor == nullptr) {
+        GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
+        ggml_free(ctx);
+        return false;
+    }
+
+    // sanitize tensor->data
+    if (!check_tensor_range(tensor, request.tensor.data, request.offset, request.size)) {
+        GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
+    }
+
+    // hashes are only offered for weights - on a miss, the data that follows is cached
+    ggml_backend_buffer_set_usage(tensor->buffer, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+
+    const std::string path = cache_path(request.hash);
+    FILE * f = fopen(path.c_str(), "rb");
+    if (!f) {
+        ggml_free(ctx);
+        return true;
+    }
+
+    // read directly into host buffers - the client sends the data if the cached file turns out to be bad
+    const bool is_host = ggml_backend_buffer_is_host(tensor->buffer);
+    std::vector<uint8_t> staging;
+    uint8_t * dst = nullptr;
+    if (is_host) {
+        dst = (uint8_t *) tensor->data + request.offset;
+    } else {
+        staging.resize(request.size);
+        dst = staging.data();
+    }
+
+    bool ok = fseek(f, 0, SEEK_END) == 0 && (uint64_t) ftell(f) == request.size && fseek(f, 0, SEEK_SET) == 0;
+    ok = ok && fread(dst, 1, request.size, f) == request.size;
+    fclose(f);
+
+    uint8_t hash[GGML_RPC_HASH_SIZE];
+    if (ok) {
+        rpc_hash(dst, request.size, hash);
+        ok = memcmp(hash, request.hash, GGML_RPC_HASH_SIZE) == 0;
+    }
+    if (!ok) {
+        GGML_LOG_WARN("[%s] ignoring bad cache file %s\n", __func__, path.c_str());
+        remove(path.c_str());
+        ggml_free(ctx);
+        return true;
+    }
+
+    if (!is_host) {
+        ggml_backend_tensor_set(tensor, dst, request.offset, request.size);
+    }
+
+    response.result = 1;
     ggml_free(ctx);
     return true;
 }
@@ -998,7 +1352,8 @@ bool rpc_server::init_tensor(const rpc_msg_init_tensor_req & request) {
     return true;
 }
 
-bool rpc_server::get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response) {
+// host buffers are sent directly from the tensor data, other buffers through the staging vector
+bool rpc_server::get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & staging, const void ** data) {
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
         /*.mem_buffer =*/ NULL,
@@ -1014,19 +1369,17 @@ bool rpc_server::get_tensor(const rpc_msg_get_tensor_req & request, std::vector<
     GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %" PRIu64 "\n", __func__, (void*)tensor->buffer, tensor->data, request.offset, request.size);
 
     // sanitize tensor->data
-    {
-        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
-        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
-
-        if (request.tensor.data + request.offset < p0 ||
-            request.tensor.data + request.offset >= p1 ||
-            request.size > (p1 - request.tensor.data - request.offset)) {
-                GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
-        }
+    if (!check_tensor_range(tensor, request.tensor.data, request.offset, request.size)) {
+        GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
     }
 
-    response.resize(request.size, 0);
-    ggml_backend_tensor_get(tensor, response.data(), request.offset, request.size);
+    if (ggml_backend_buffer_is_host(tensor->buffer)) {
+        *data = (const uint8_t *) tensor->data + request.offset;
+    } else {
+        staging.resize(request.size, 0);
+        ggml_backend_tensor_get(tensor, staging.data(), request.offset, request.size);
+        *data = staging.data();
+    }
     ggml_free(ctx);
     return true;
 }
@@ -1126,8 +1479,27 @@ rpc_server::~rpc_server() {
     }
 }
 
-static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t free_mem, size_t total_mem) {
-    rpc_server server(backend);
+static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir, sockfd_t sockfd, size_t free_mem, size_t total_mem) {
+    rpc_server server(backend, cache_dir);
+    // the first command must be HELLO, so that clients with another protocol version fail on connect
+    {
+        uint8_t cmd;
+        if (!recv_data(sockfd, &cmd, 1)) {
+            return;
+        }
+        if (cmd != RPC_CMD_HELLO) {
+            fprintf(stderr, "Expected HELLO command, update client\n");
+            return;
+        }
+        if (!recv_msg(sockfd, nullptr, 0)) {
+            return;
+        }
+        rpc_msg_hello_rsp response;
+        server.hello(response);
+        if (!send_msg(sockfd, &response, sizeof(response))) {
+            return;
+        }
+    }
     while (true) {
         uint8_t cmd;
         if (!recv_data(sockfd, &cmd, 1)) {
@@ -1139,6 +1511,10 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
             break;
         }
         switch (cmd) {
+            case RPC_CMD_HELLO: {
+                // HELLO command is handled above
+                return;
+            }
             case RPC_CMD_ALLOC_BUFFER: {
                 rpc_msg_alloc_buffer_req request;
                 if (!recv_msg(sockfd, &request, sizeof(request))) {
@@ -1226,14 +1602,24 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
                 break;
             }
             case RPC_CMD_SET_TENSOR: {
-                std::vector<uint8_t> input;
-                if (!recv_msg(sockfd, input)) {
+                if (!server.set_tensor(sockfd)) {
                     return;
                 }
-                if (!server.set_tensor(input)) {
+                if (!send_msg(sockfd, nullptr, 0)) {
                     return;
                 }
-                if (!send_msg(sockfd, nullptr, 0)) {
+                break;
+            }
+            case RPC_CMD_SET_TENSOR_HASH: {
+                rpc_msg_set_tensor_hash_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                rpc_msg_set_tensor_hash_rsp response;
+                if (!server.set_tensor_hash(request, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, &response, sizeof(response))) {
                     return;
                 }
                 break;
@@ -1256,11 +1642,12 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
                 if (!recv_msg(sockfd, &request, sizeof(request))) {
                     return;
                 }
-                std::vector<uint8_t> response;
-                if (!server.get_tensor(request, response)) {
+                std::vector<uint8_t> staging;
+                const void * data = nullptr;
+                if (!server.get_tensor(request, staging, &data)) {
                     return;
                 }
-                if (!send_msg(sockfd, response.data(), response.size())) {
+                if (!send_msg(sockfd, data, request.size)) {
                     return;
                 }
                 break;
@@ -1313,7 +1700,7 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
     }
 }
 
-void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem) {
+void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, const char * cache_dir, size_t free_mem, size_t total_mem) {
     std::string host;
     int port;
     if (!parse_endpoint(endpoint, host, port)) {
@@ -1342,7 +1729,7 @@ void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint
         }
         printf("Accepted client connection, free_mem=%zu, total_mem=%zu\n", free_mem, total_mem);
         fflush(stdout);
-        rpc_serve_client(backend, client_socket->fd, free_mem, total_mem);
+        rpc_serve_client(backend, cache_dir, client_socket->fd, free_mem, total_mem);
         printf("Client connection closed\n");
         fflush(stdout);
     }
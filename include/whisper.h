@@ -35,6 +35,10 @@
 #define WHISPER_HOP_LENGTH  160
 #define WHISPER_CHUNK_SIZE  30
 
+// ftype of models with per-tensor types written by examples/quantize
+// the vocab is followed by the base ftype and a table with the type of each tensor
+#define WHISPER_FTYPE_MIXED 999
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -125,7 +129,32 @@ extern "C" {
         int dtw_n_top;
         struct whisper_aheads dtw_aheads;
 
-        size_t dtw_mem_size; // TODO: remove
+        size_t dtw_mem_size; // TODO: remove (unused)
+
+        // data types of the self- and cross-attention KV caches (GGML_TYPE_F16 by default)
+        // quantized types (e.g. GGML_TYPE_Q8_0, GGML_TYPE_Q4_0) reduce the memory per state
+        // a quantized V cache requires flash_attn
+        enum ggml_type type_k;
+        enum ggml_type type_v;
+
+        // NUMA strategy of the CPU backend (GGML_NUMA_STRATEGY_DISABLED by default)
+        // applied once per process by the first context that enables it
+        // with GGML_NUMA_STRATEGY_DISTRIBUTE the pages of the CPU weight buffers are also interleaved across the nodes
+        enum ggml_numa_strategy numa;
+
+        // comma-separated list of ggml-rpc servers (host:port), NULL or empty - none (requires GGML_RPC)
+        // the weights are uploaded to every server once, while the model is loaded
+        // each state then runs all of its graphs on one of the servers, assigned round-robin
+        const char * rpc_servers;
+
+        // Sakoe-Chiba band: max distance in audio frames (20 ms) of the alignment from the diagonal (0 - unconstrained)
+        // the band is widened when needed so that an alignment always exists
+        // must be in [0, n_audio_ctx] - other values fail the context initialization
+        int dtw_band;
+
+        // place eligible matmul weights in the CPU extra buffer types (weight repacking, AMX)
+        // tensors that cannot use them fall back to the regular buffer type
+        bool use_extra_bufts;
     };
 
     typedef struct whisper_token_data {
@@ -397,6 +426,15 @@ extern "C" {
     WHISPER_API int whisper_model_ftype        (struct whisper_context * ctx);
     WHISPER_API int whisper_model_type         (struct whisper_context * ctx);
 
+    // Size of the backend buffers that hold the model weights in bytes
+    WHISPER_API size_t whisper_model_size(struct whisper_context * ctx);
+
+    // Save the loaded model in GGUF format
+    // The alignment heads of the dtw_aheads_preset context param are stored in the file. With WHISPER_AHEADS_NONE,
+    // they are derived from the model hparams when possible and used by default when loading the GGUF model with DTW.
+    // Returns 0 on success
+    WHISPER_API int whisper_model_save_gguf(struct whisper_context * ctx, const char * fname);
+
     // Token logits obtained from the last call to whisper_decode()
     // The logits for the last token are stored in the last row
     // Rows: n_tokens
@@ -435,6 +473,50 @@ extern "C" {
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_reset_timings(struct whisper_context * ctx);
 
+    // Cumulative performance counters and memory usage of a state.
+    // The counters only grow (except for whisper_reset_timings on the default state), so the
+    // difference of two snapshots gives the cost of the work done in between.
+    struct whisper_stats {
+        int64_t t_mel_us;
+        int64_t t_sample_us;
+        int64_t t_encode_us;
+        int64_t t_decode_us;
+        int64_t t_batchd_us;
+        int64_t t_prompt_us;
+
+        int32_t n_sample;
+        int32_t n_encode;
+        int32_t n_decode;
+        int32_t n_batchd;
+        int32_t n_prompt;
+        int32_t n_fail_p; // logprob threshold failures
+        int32_t n_fail_h; // entropy threshold failures
+
+        size_t mem_kv;      // self-attention, cross-attention and padding KV caches
+        size_t mem_compute; // compute buffers of the conv, encoder, cross and decoder graphs
+    };
+
+    WHISPER_API struct whisper_stats whisper_get_stats(struct whisper_context * ctx);
+    WHISPER_API struct whisper_stats whisper_get_stats_from_state(struct whisper_state * state);
+
+    // Per-operator profiling of the default state (opt-in)
+    // When enabled, each node of the conv/encoder/cross/decoder graphs is timed through the ggml_backend_sched eval
+    // callback and attributed to its op type and layer. The graphs are computed node by node in this mode, so the
+    // total time increases and the results should only be compared with each other
+    WHISPER_API void whisper_profile_enable(struct whisper_context * ctx, bool enable);
+    WHISPER_API void whisper_profile_reset (struct whisper_context * ctx);
+    WHISPER_API void whisper_profile_print (struct whisper_context * ctx);
+
+    // Same as above, for a state created with whisper_init_state()
+    WHISPER_API void whisper_profile_enable_with_state(struct whisper_context * ctx, struct whisper_state * state, bool enable);
+    WHISPER_API void whisper_profile_reset_with_state (struct whisper_state * state);
+    WHISPER_API void whisper_profile_print_with_state (struct whisper_state * state);
+
+    // Write the profiled ops in the Chrome trace event format (chrome://tracing, Perfetto)
+    // Returns 0 on success
+    WHISPER_API int  whisper_profile_dump_trace(struct whisper_context * ctx, const char * fname);
+    WHISPER_API int  whisper_profile_dump_trace_with_state(struct whisper_state * state, const char * fname);
+
     // Print system information
     WHISPER_API const char * whisper_print_system_info(void);
 
@@ -477,6 +559,7 @@ extern "C" {
         enum whisper_sampling_strategy strategy;
 
         int n_threads;
+
         int n_max_text_ctx;     // max tokens to use from past text as prompt for the decoder
         int offset_ms;          // start offset in ms
         int duration_ms;        // audio duration to process in ms
@@ -570,6 +653,11 @@ extern "C" {
         size_t                           n_grammar_rules;
         size_t                           i_start_rule;
         float                            grammar_penalty;
+
+        // placement of the CPU threads: cpumask, priority, polling level (n_threads is overridden)
+        // each state keeps a persistent threadpool that is recreated only when these change
+        // NULL - ggml_threadpool_params_default(n_threads)
+        const struct ggml_threadpool_params * threadpool_params;
     };
 
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_context_params & whisper_free_params()
@@ -654,6 +742,69 @@ extern "C" {
 
     ////////////////////////////////////////////////////////////////////////////
 
+    // Incremental streaming with stable-prefix commit (LocalAgreement-2)
+    //
+    // A stream owns a whisper_state and a buffer of not yet committed audio. Every call to
+    // whisper_stream_process() transcribes the buffer and commits the longest token prefix on which
+    // the current and the previous hypotheses agree. The rest of the hypothesis stays tentative.
+    // Audio behind the last committed segment is dropped and the committed text that is no longer
+    // covered by the buffer is used as the prompt for the next pass.
+    //
+    // Token timestamps are absolute from the start of the stream, in units of 10 ms.
+
+    struct whisper_stream;
+
+    struct whisper_stream_params {
+        int min_buffer_ms;   // skip passes while less audio than this is buffered (at least 1000)
+        int max_buffer_ms;   // force a commit when the buffer grows past this length (at most 30000)
+        int n_prompt_tokens; // max number of committed tokens used as the prompt (0 - no prompt)
+    };
+
+    WHISPER_API struct whisper_stream_params whisper_stream_default_params(void);
+
+    // fparams are used for every pass. The stream overrides no_context, token_timestamps,
+    // offset_ms, duration_ms and prompt_tokens.
+    // Returns NULL on failure.
+    WHISPER_API struct whisper_stream * whisper_stream_init(
+                struct whisper_context * ctx,
+           struct whisper_stream_params   sparams,
+             struct whisper_full_params   fparams);
+
+    // Same as above, but the stream borrows the provided state instead of creating one
+    // The state must outlive the stream and must not be used by anything else in the meantime
+    WHISPER_API struct whisper_stream * whisper_stream_init_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+           struct whisper_stream_params   sparams,
+             struct whisper_full_params   fparams);
+
+    WHISPER_API void whisper_stream_free(struct whisper_stream * stream);
+
+    // Append 16 kHz mono PCM samples to the stream
+    WHISPER_API void whisper_stream_push(struct whisper_stream * stream, const float * samples, int n_samples);
+
+    // Transcribe the buffered audio
+    // Returns the number of newly committed tokens, or a negative value on failure
+    WHISPER_API int whisper_stream_process(struct whisper_stream * stream);
+
+    // Transcribe the remaining audio and commit the full hypothesis (e.g. at the end of the input)
+    // A remainder shorter than min_buffer_ms is padded with silence
+    // Returns the number of newly committed tokens, or a negative value on failure
+    WHISPER_API int whisper_stream_flush(struct whisper_stream * stream);
+
+    // Committed tokens never change; tentative tokens are replaced on every pass
+    WHISPER_API int                       whisper_stream_n_committed  (struct whisper_stream * stream);
+    WHISPER_API int                       whisper_stream_n_tentative  (struct whisper_stream * stream);
+    WHISPER_API whisper_token_data        whisper_stream_get_committed(struct whisper_stream * stream, int i_token);
+    WHISPER_API whisper_token_data        whisper_stream_get_tentative(struct whisper_stream * stream, int i_token);
+
+    // Text of the committed tokens starting at i_token, and of all tentative tokens
+    // The returned pointer is valid until the next call on the stream
+    WHISPER_API const char * whisper_stream_get_committed_text(struct whisper_stream * stream, int i_token);
+    WHISPER_API const char * whisper_stream_get_tentative_text(struct whisper_stream * stream);
+
+    ////////////////////////////////////////////////////////////////////////////
+
     // Temporary helpers needed for exposing ggml interface
 
     WHISPER_API int          whisper_bench_memcpy          (int n_threads);
@@ -5,6 +5,7 @@
 #include "ggml.h"
 #include "ggml-alloc.h"
 #include "ggml-backend.h"
+#include "gguf.h"
 
 #ifdef WHISPER_USE_COREML
 #include "coreml/whisper-encoder.h"
@@ -24,6 +25,8 @@
 #include <cstring>
 #include <fstream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <thread>
@@ -33,6 +36,20 @@
 #include <functional>
 #include <codecvt>
 
+#if defined(__linux__)
+#include <cerrno>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define WHISPER_VEC_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define WHISPER_VEC_NEON
+#include <arm_neon.h>
+#endif
+
 // dummy
 
 #if defined(_MSC_VER)
@@ -143,6 +160,9 @@ static void whisper_log_callback_default(ggml_log_level level, const char * text
 #define WHISPER_MAX_DECODERS 8
 #define WHISPER_MAX_NODES 4096
 
+// "GGUF" read as a little-endian uint32
+#define WHISPER_GGUF_MAGIC 0x46554747
+
 //
 // ggml helpers
 //
@@ -166,10 +186,72 @@ static bool ggml_graph_compute_helper(
     return ggml_graph_compute(graph, &plan);
 }
 
+// per-operator profiler
+// the eval callback of ggml_backend_sched is called after each observed node has been computed,
+// so the time since the previous callback is the compute time of that node
+struct whisper_profile_event {
+    const char * graph;
+    const char * op;
+    int          layer;
+    int64_t      t_start_us;
+    int64_t      t_end_us;
+};
+
+struct whisper_profiler {
+    bool enabled = false;
+
+    // state of the graph that is being computed
+    const char * graph      = nullptr;
+    int          layer      = -1;
+    int64_t      t_last_us  = 0;
+
+    // layer index of each weight tensor, used to attribute the nodes to layers
+    std::map<const ggml_tensor *, int> layers;
+
+    std::vector<whisper_profile_event> events;
+};
+
+static bool whisper_profile_eval_callback(struct ggml_tensor * t, bool ask, void * user_data) {
+    auto * prof = (whisper_profiler *) user_data;
+
+    if (ask) {
+        // views and reshapes do not compute anything - merge them with the next node
+        return t->op != GGML_OP_NONE && t->op != GGML_OP_VIEW && t->op != GGML_OP_RESHAPE &&
+               t->op != GGML_OP_PERMUTE && t->op != GGML_OP_TRANSPOSE;
+    }
+
+    const int64_t t_now_us = ggml_time_us();
+
+    for (int i = 0; i < GGML_MAX_SRC && t->src[i]; ++i) {
+        const auto it = prof->layers.find(t->src[i]);
+        if (it != prof->layers.end()) {
+            prof->layer = it->second;
+            break;
+        }
+    }
+
+    prof->events.push_back({ prof->graph, ggml_op_desc(t), prof->layer, prof->t_last_us, t_now_us });
+    prof->t_last_us = t_now_us;
+
+    return true;
+}
+
 static bool ggml_graph_compute_helper(
       ggml_backend_sched_t   sched,
         struct ggml_cgraph * graph,
-                       int   n_threads) {
+                       int   n_threads,
+         ggml_threadpool_t   threadpool,
+          whisper_profiler & prof,
+                const char * name) {
+    if (prof.enabled) {
+        prof.graph     = name;
+        prof.layer     = -1;
+        prof.t_last_us = ggml_time_us();
+
+        ggml_backend_sched_set_eval_callback(sched, whisper_profile_eval_callback, &prof);
+    } else {
+        ggml_backend_sched_set_eval_callback(sched, nullptr, nullptr);
+    }
 
     for (int i = 0; i < ggml_backend_sched_get_n_backends(sched); ++i) {
         ggml_backend_t backend = ggml_backend_sched_get_backend(sched, i);
@@ -180,6 +262,10 @@ static bool ggml_graph_compute_helper(
         if (fn_set_n_threads) {
             fn_set_n_threads(backend, n_threads);
         }
+
+        if (threadpool && ggml_backend_is_cpu(backend)) {
+            ggml_backend_cpu_set_threadpool(backend, threadpool);
+        }
     }
 
     bool t = ggml_backend_sched_graph_compute(sched, graph) == GGML_STATUS_SUCCESS;
@@ -722,11 +808,23 @@ struct whisper_model {
     struct ggml_context * ctx = nullptr;
 
     // the model backend data is read-only and can be shared between processors
-    ggml_backend_buffer_t buffer = nullptr;
+    // one buffer per buffer type used by the weights
+    std::vector<ggml_backend_buffer_t> buffers;
 
     // tensors
     int n_loaded;
+    int n_extra = 0; // tensors in the CPU extra buffer types - their data is repacked and cannot be read back
     std::map<std::string, struct ggml_tensor *> tensors;
+
+    // alignment heads stored in the model file (GGUF only)
+    std::vector<whisper_ahead> aheads;
+};
+
+// copy of the model weights on an RPC server
+struct whisper_replica {
+    std::string        endpoint;
+    ggml_backend_dev_t dev = nullptr;
+    whisper_model      model;
 };
 
 struct whisper_partial_utf8 {
@@ -734,14 +832,45 @@ struct whisper_partial_utf8 {
     int      n_remain; // num bytes remaining; -1 indicates invalid sequence
 };
 
+using whisper_grammar_rules  = std::vector<std::vector<whisper_grammar_element>>;
+using whisper_grammar_stacks = std::vector<std::vector<const whisper_grammar_element *>>;
+
+// tokens rejected by the grammar, keyed on the parse stacks (flattened, separated by nullptr)
+// the element pointers are only meaningful for a single copy of the rules, so the cache is owned together with them
+struct whisper_grammar_cache {
+    std::mutex mutex;
+
+    std::map<std::vector<const whisper_grammar_element *>, std::shared_ptr<const std::vector<uint64_t>>> rejects;
+};
+
+// the rules and the stacks are immutable once built, so copying a grammar state (e.g. when a beam
+// inherits the state of another beam) only bumps reference counts - accepting a token creates new stacks
 struct whisper_grammar {
-    /*const*/ std::vector<std::vector<whisper_grammar_element>> rules;
-    std::vector<std::vector<const whisper_grammar_element *>>   stacks;
+    std::shared_ptr<const whisper_grammar_rules>  rules;
+    std::shared_ptr<const whisper_grammar_stacks> stacks;
+    std::shared_ptr<whisper_grammar_cache>        cache;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     whisper_partial_utf8 partial_utf8;
 };
 
+// the code points of the text tokens, decoded once per context and stored as a prefix tree
+// so that the grammar checks the shared prefixes of the vocabulary only once
+struct whisper_grammar_vocab {
+    struct node {
+        int32_t edge_begin;  // children: [edge_begin, edge_end) in edges
+        int32_t edge_end;
+        int32_t token_begin; // tokens whose code points end at this node: [token_begin, token_end) in tokens
+        int32_t token_end;
+    };
+
+    std::vector<node>                                            nodes; // nodes[0] is the root
+    std::vector<std::pair<uint32_t, int32_t>>                    edges; // (code point, child node)
+    std::vector<std::pair<whisper_token, whisper_partial_utf8>>  tokens;
+
+    std::vector<uint64_t> candidates; // bitmask of the tokens checked against the grammar
+};
+
 struct whisper_grammar_candidate {
     whisper_token          id;
     const uint32_t       * code_points;
@@ -761,6 +890,20 @@ struct whisper_sequence {
     double score;            // likelihood rank score
 };
 
+// beam search hypotheses are stored as nodes of a prefix tree, so that a beam that continues from another
+// beam only needs a reference to its parent node instead of a copy of the entire sequence of tokens
+struct whisper_beam_node {
+    int32_t parent; // index of the parent node, -1 for the first token of the sequence
+    int32_t depth;  // number of tokens in the sequence ending at this node
+
+    whisper_token_data token;
+};
+
+struct whisper_beam_tree {
+    // nodes are only appended during the decoding of a segment - reset with clear() before each new decode
+    std::vector<whisper_beam_node> nodes;
+};
+
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
     // the currently generated sequence of tokens
@@ -769,6 +912,9 @@ struct whisper_decoder {
     // grammar parse state of generated sequence of tokens
     whisper_grammar  grammar;
 
+    // the last token of the sequence in the beam search tree (-1 if the sequence is empty)
+    int32_t beam_node;
+
     int i_batch;    // the index of the token in the current batch
     int seek_delta; // the window shift found so far based on the decoded timestamp tokens
 
@@ -788,6 +934,22 @@ struct whisper_decoder {
 };
 
 // [EXPERIMENTAL] Token-level timestamps with DTW
+// buffers reused across calls of whisper_exp_compute_token_level_timestamps_dtw()
+struct whisper_dtw_workspace {
+    std::vector<float> w; // normalized and filtered alignment head weights: [n_heads][n_tokens][n_frames]
+    std::vector<float> x; // DTW input stored by anti-diagonal, only the cells inside the band
+
+    std::vector<float>   cost;  // the last 3 anti-diagonals of the cost matrix: [3][n_tokens + 1]
+    std::vector<int32_t> trace; // stored like x
+
+    // first token index and offset into x/trace of each anti-diagonal
+    std::vector<int32_t> diag_lo;
+    std::vector<int32_t> diag_hi;
+    std::vector<int32_t> diag_off;
+
+    std::vector<std::pair<int32_t, int32_t>> path; // (token, frame) pairs of the alignment
+};
+
 struct whisper_aheads_masks {
     std::vector<struct ggml_tensor *> m;    // One mask per text layer.
     struct ggml_context * ctx = nullptr;
@@ -831,12 +993,22 @@ struct whisper_state {
 
     std::vector<ggml_backend_t> backends;
 
+    // index of the RPC server replica the state runs on (-1 - local model)
+    int replica = -1;
+
+    // persistent threadpool of the CPU backend, see whisper_state_threadpool()
+    ggml_threadpool_t      threadpool = nullptr;
+    ggml_threadpool_params threadpool_params;      // requested by the last whisper_full call
+    ggml_threadpool_params threadpool_params_live; // the threadpool was created with these
+
     // - stores meta info about the intermediate tensors into the `meta` buffers
     whisper_sched sched_conv;
     whisper_sched sched_encode;
     whisper_sched sched_cross;
     whisper_sched sched_decode;
 
+    whisper_profiler profiler;
+
     // result of the encoder
     struct ggml_tensor * embd_conv = nullptr;
     struct ggml_tensor * embd_enc  = nullptr;
@@ -876,9 +1048,14 @@ struct whisper_state {
     whisper_aheads_masks aheads_masks;
     ggml_tensor * aheads_cross_QKs = nullptr;
     std::vector<float> aheads_cross_QKs_data;
+    whisper_dtw_workspace dtw_workspace;
 
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
+
+    // grammar rules of the last whisper_full call - reused, together with the token mask cache, while they do not change
+    std::shared_ptr<const whisper_grammar_rules> grammar_rules;
+    std::shared_ptr<whisper_grammar_cache>       grammar_cache;
 };
 
 struct whisper_context {
@@ -893,6 +1070,14 @@ struct whisper_context {
     whisper_model model;
     whisper_vocab vocab;
 
+    // copies of the model on the RPC servers, the states are assigned to them round-robin
+    std::vector<whisper_replica> replicas;
+    std::atomic<int>             n_replica_states { 0 };
+
+    // built on first use of a grammar
+    std::once_flag        grammar_vocab_once;
+    whisper_grammar_vocab grammar_vocab;
+
     whisper_state * state = nullptr;
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
@@ -906,6 +1091,11 @@ struct whisper_global {
 
 static whisper_global g_state;
 
+// the weights used by the graphs of the state
+static const whisper_model & whisper_state_model(const whisper_context & wctx, const whisper_state & wstate) {
+    return wstate.replica >= 0 ? wctx.replicas[wstate.replica].model : wctx.model;
+}
+
 template<typename T>
 static void read_safe(whisper_model_loader * loader, T & dest) {
     loader->read(loader->context, &dest, sizeof(T));
@@ -915,7 +1105,8 @@ static void read_safe(whisper_model_loader * loader, T & dest) {
 static bool whisper_kv_cache_init(
              struct whisper_kv_cache & cache,
                       ggml_backend_t   backend,
-                           ggml_type   wtype,
+                           ggml_type   type_k,
+                           ggml_type   type_v,
                              int64_t   n_text_state,
                              int64_t   n_text_layer,
                                  int   n_ctx) {
@@ -943,8 +1134,8 @@ static bool whisper_kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(ctx, type_k, n_elements);
+    cache.v = ggml_new_tensor_1d(ctx, type_v, n_elements);
 
     cache.buffer = ggml_backend_alloc_ctx_tensors(ctx, backend);
     if (!cache.buffer) {
@@ -1269,9 +1460,23 @@ static ggml_backend_t whisper_backend_init_gpu(const whisper_context_params & pa
     return result;
 }
 
-static std::vector<ggml_backend_t> whisper_backend_init(const whisper_context_params & params) {
+static std::vector<ggml_backend_t> whisper_backend_init(const whisper_context_params & params, const whisper_replica * replica) {
     std::vector<ggml_backend_t> result;
 
+    // the states of a replica run on its RPC server, with the CPU for the weights that did not fit there
+    if (replica) {
+        WHISPER_LOG_INFO("%s: using RPC server %s\n", __func__, replica->endpoint.c_str());
+        ggml_backend_t backend = ggml_backend_dev_init(replica->dev, nullptr);
+        if (!backend) {
+            WHISPER_LOG_ERROR("%s: failed to initialize the RPC backend for %s\n", __func__, replica->endpoint.c_str());
+            return result;
+        }
+        result.push_back(backend);
+        result.push_back(ggml_backend_cpu_init());
+
+        return result;
+    }
+
     ggml_backend_t backend_gpu = whisper_backend_init_gpu(params);
 
     if (backend_gpu) {
@@ -1299,235 +1504,345 @@ static std::vector<ggml_backend_t> whisper_backend_init(const whisper_context_pa
     return result;
 }
 
-static ggml_backend_buffer_type_t whisper_default_buffer_type(const whisper_context_params & params) {
-    ggml_backend_buffer_type_t result = ggml_backend_cpu_buffer_type();
+using buft_list_t = std::vector<std::pair<ggml_backend_dev_t, ggml_backend_buffer_type_t>>;
 
-    if (!params.use_gpu) {
-        return result;
-    }
+// buffer types for the weights in order of preference: GPU, CPU extra (repacked weights, AMX), CPU
+static buft_list_t make_buft_list(const whisper_context_params & params) {
+    buft_list_t buft_list;
 
-    int cnt = 0;
-    for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
-        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
-        if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU) {
-            if (cnt == 0 || cnt == params.gpu_device) {
-                result = ggml_backend_dev_buffer_type(dev);
+    if (params.use_gpu) {
+        ggml_backend_dev_t gpu_dev = nullptr;
+
+        int cnt = 0;
+        for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
+            ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+            if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU) {
+                if (cnt == 0 || cnt == params.gpu_device) {
+                    gpu_dev = dev;
+                }
+
+                if (++cnt > params.gpu_device) {
+                    break;
+                }
             }
+        }
 
-            if (++cnt > params.gpu_device) {
-                break;
+        if (gpu_dev) {
+            buft_list.emplace_back(gpu_dev, ggml_backend_dev_buffer_type(gpu_dev));
+        }
+    }
+
+    ggml_backend_dev_t cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+
+    if (params.use_extra_bufts && cpu_dev) {
+        ggml_backend_reg_t cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
+
+        auto * get_extra_bufts_fn = (ggml_backend_dev_get_extra_bufts_t) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_dev_get_extra_bufts");
+        if (get_extra_bufts_fn) {
+            ggml_backend_buffer_type_t * extra_bufts = get_extra_bufts_fn(cpu_dev);
+            while (extra_bufts && *extra_bufts) {
+                buft_list.emplace_back(cpu_dev, *extra_bufts);
+                ++extra_bufts;
             }
         }
     }
 
-    return result;
+    buft_list.emplace_back(cpu_dev, ggml_backend_cpu_buffer_type());
+
+    return buft_list;
 }
 
-// load the model from a ggml file
-//
-// file format:
-//
-//   - hparams
-//   - pre-computed mel filters
-//   - vocab
-//   - weights
-//
-// see the convert-pt-to-ggml.py script for details
-//
-static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
-    WHISPER_LOG_INFO("%s: loading model\n", __func__);
+// the op that consumes the weight in the graphs
+// the 2D weights of the transformer blocks are only used by the linear layers - everything else is GGML_OP_NONE
+static ggml_op whisper_weight_op(const std::string & name, const ggml_tensor * w) {
+    if ((name.rfind("encoder.blocks.", 0) == 0 || name.rfind("decoder.blocks.", 0) == 0) && ggml_n_dims(w) == 2) {
+        return GGML_OP_MUL_MAT;
+    }
 
-    const int64_t t_start_us = ggml_time_us();
+    return GGML_OP_NONE;
+}
 
-    wctx.t_start_us = t_start_us;
+static bool weight_buft_supported(const whisper_hparams & hparams, ggml_tensor * w, ggml_op op, ggml_backend_buffer_type_t buft, ggml_backend_dev_t dev) {
+    // the GPU and the regular CPU buffer types support all ops
+    if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU || buft == ggml_backend_cpu_buffer_type()) {
+        return true;
+    }
 
-    auto & model = wctx.model;
-    auto & vocab = wctx.vocab;
+    // the extra buffer types only implement matrix multiplication
+    if (op != GGML_OP_MUL_MAT) {
+        return false;
+    }
 
-    // verify magic
-    {
-        uint32_t magic;
-        read_safe(loader, magic);
-        if (magic != GGML_FILE_MAGIC) {
-            WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
-            return false;
-        }
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 2*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+    if (!ctx) {
+        return false;
     }
 
-    //load hparams
-    {
-        auto & hparams = model.hparams;
+    // the largest activation the weight is multiplied with
+    ggml_tensor * b = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, w->ne[0], hparams.n_audio_ctx, w->ne[2], w->ne[3]);
+    ggml_tensor * op_tensor = ggml_mul_mat(ctx, w, b);
 
-        read_safe(loader, hparams.n_vocab);
-        read_safe(loader, hparams.n_audio_ctx);
-        read_safe(loader, hparams.n_audio_state);
-        read_safe(loader, hparams.n_audio_head);
-        read_safe(loader, hparams.n_audio_layer);
-        read_safe(loader, hparams.n_text_ctx);
-        read_safe(loader, hparams.n_text_state);
-        read_safe(loader, hparams.n_text_head);
-        read_safe(loader, hparams.n_text_layer);
-        read_safe(loader, hparams.n_mels);
-        read_safe(loader, hparams.ftype);
+    // supports_op looks at the buffer type of the weight - use a dummy buffer
+    GGML_ASSERT(w->buffer == nullptr);
+    w->buffer = ggml_backend_buft_alloc_buffer(buft, 0);
+
+    const bool supported = w->buffer && ggml_backend_dev_supports_op(dev, op_tensor);
 
-        assert(hparams.n_text_state == hparams.n_audio_state);
+    ggml_backend_buffer_free(w->buffer);
+    w->buffer = nullptr;
+
+    ggml_free(ctx);
 
-        std::string mver = "";
+    return supported;
+}
 
-        if (hparams.n_audio_layer == 4) {
-            model.type = e_model::MODEL_TINY;
+static ggml_backend_buffer_type_t select_weight_buft(const whisper_hparams & hparams, ggml_tensor * w, ggml_op op, const buft_list_t & buft_list) {
+    for (const auto & p : buft_list) {
+        if (weight_buft_supported(hparams, w, op, p.second, p.first)) {
+            return p.second;
         }
+    }
+
+    return nullptr;
+}
 
-        if (hparams.n_audio_layer == 6) {
-            model.type = e_model::MODEL_BASE;
+// interleave the pages of a host buffer across the NUMA nodes, so that the threads on every node
+// read the weights with the same mix of local and remote accesses
+// the policy applies to the pages allocated on first touch, so it must be set before the weights are loaded
+static void whisper_numa_interleave(ggml_backend_buffer_t buffer) {
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long nodemask = 0;
+    int n_nodes = 0;
+    for (; n_nodes < (int) (8*sizeof(nodemask)); ++n_nodes) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n_nodes);
+        if (access(path, F_OK) != 0) {
+            break;
         }
+        nodemask |= 1UL << n_nodes;
+    }
+
+    if (n_nodes < 2) {
+        return;
+    }
+
+    const uintptr_t page  = (uintptr_t) sysconf(_SC_PAGESIZE);
+    const uintptr_t base  = (uintptr_t) ggml_backend_buffer_get_base(buffer);
+    const uintptr_t begin = (base + page - 1) & ~(page - 1);
+    const uintptr_t end   = (base + ggml_backend_buffer_get_size(buffer)) & ~(page - 1);
+
+    if (end <= begin) {
+        return;
+    }
+
+    const int mpol_interleave = 3; // MPOL_INTERLEAVE from <linux/mempolicy.h>
+
+    if (syscall(SYS_mbind, (void *) begin, end - begin, mpol_interleave, &nodemask, 8*sizeof(nodemask), 0) != 0) {
+        WHISPER_LOG_WARN("%s: failed to interleave %s across %d NUMA nodes: %s\n", __func__, ggml_backend_buffer_name(buffer), n_nodes, strerror(errno));
+        return;
+    }
+
+    WHISPER_LOG_INFO("%s: %s interleaved across %d NUMA nodes\n", __func__, ggml_backend_buffer_name(buffer), n_nodes);
+#else
+    GGML_UNUSED(buffer);
+#endif
+}
+
+// allocate each weight in the first buffer type that supports its op
+static bool whisper_model_alloc_tensors(whisper_model & model, const buft_list_t & buft_list, bool numa_interleave) {
+    std::vector<std::pair<ggml_backend_buffer_type_t, std::vector<ggml_tensor *>>> tensors_by_buft;
+
+    for (const auto & kv : model.tensors) {
+        ggml_tensor * w = kv.second;
 
-        if (hparams.n_audio_layer == 12) {
-            model.type = e_model::MODEL_SMALL;
+        ggml_backend_buffer_type_t buft = select_weight_buft(model.hparams, w, whisper_weight_op(kv.first, w), buft_list);
+        if (!buft) {
+            WHISPER_LOG_ERROR("%s: no buffer type for tensor '%s'\n", __func__, kv.first.c_str());
+            return false;
         }
 
-        if (hparams.n_audio_layer == 24) {
-            model.type = e_model::MODEL_MEDIUM;
+        auto it = std::find_if(tensors_by_buft.begin(), tensors_by_buft.end(), [&](const decltype(tensors_by_buft)::value_type & e) { return e.first == buft; });
+        if (it == tensors_by_buft.end()) {
+            tensors_by_buft.emplace_back(buft, std::vector<ggml_tensor *>());
+            it = tensors_by_buft.end() - 1;
         }
 
-        if (hparams.n_audio_layer == 32) {
-            model.type = e_model::MODEL_LARGE;
+        it->second.push_back(w);
 
-            if (hparams.n_vocab == 51866) {
-                mver = " v3";
-            }
+        if (buft != buft_list.back().second && ggml_backend_dev_type(ggml_backend_buft_get_device(buft)) == GGML_BACKEND_DEVICE_TYPE_CPU) {
+            model.n_extra++;
         }
+    }
 
-        const int32_t qntvr = hparams.ftype / GGML_QNT_VERSION_FACTOR;
+    for (const auto & it : tensors_by_buft) {
+        ggml_backend_buffer_type_t buft = it.first;
 
-        hparams.ftype %= GGML_QNT_VERSION_FACTOR;
+        const size_t alignment = ggml_backend_buft_get_alignment(buft);
 
-        // for the big tensors, we have the option to store the data in 16-bit floats or quantized
-        // in order to save memory and also to speed up the computation
-        wctx.wtype = ggml_ftype_to_ggml_type((ggml_ftype) (model.hparams.ftype));
-        if (wctx.wtype == GGML_TYPE_COUNT) {
-            WHISPER_LOG_ERROR("%s: invalid model (bad ftype value %d)\n", __func__, model.hparams.ftype);
+        size_t size = alignment;
+        for (auto * t : it.second) {
+            size += GGML_PAD(ggml_backend_buft_get_alloc_size(buft, t), alignment);
+        }
+
+        ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(buft, size);
+        if (!buffer) {
+            WHISPER_LOG_ERROR("%s: failed to allocate %s buffer of %.2f MB\n", __func__, ggml_backend_buft_name(buft), size/1e6);
             return false;
         }
 
-        WHISPER_LOG_INFO("%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
-        WHISPER_LOG_INFO("%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
-        WHISPER_LOG_INFO("%s: n_audio_state = %d\n", __func__, hparams.n_audio_state);
-        WHISPER_LOG_INFO("%s: n_audio_head  = %d\n", __func__, hparams.n_audio_head);
-        WHISPER_LOG_INFO("%s: n_audio_layer = %d\n", __func__, hparams.n_audio_layer);
-        WHISPER_LOG_INFO("%s: n_text_ctx    = %d\n", __func__, hparams.n_text_ctx);
-        WHISPER_LOG_INFO("%s: n_text_state  = %d\n", __func__, hparams.n_text_state);
-        WHISPER_LOG_INFO("%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
-        WHISPER_LOG_INFO("%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
-        WHISPER_LOG_INFO("%s: n_mels        = %d\n", __func__, hparams.n_mels);
-        WHISPER_LOG_INFO("%s: ftype         = %d\n", __func__, model.hparams.ftype);
-        WHISPER_LOG_INFO("%s: qntvr         = %d\n", __func__, qntvr);
-        WHISPER_LOG_INFO("%s: type          = %d (%s%s)\n", __func__, model.type, g_model_name.at(model.type).c_str(), mver.c_str());
-    }
+        ggml_backend_buffer_set_usage(buffer, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
 
-    // load mel filters
-    {
-        auto & filters = wctx.model.filters;
+        if (numa_interleave && ggml_is_numa() && ggml_backend_buffer_is_host(buffer)) {
+            whisper_numa_interleave(buffer);
+        }
 
-        read_safe(loader, filters.n_mel);
-        read_safe(loader, filters.n_fft);
+        model.buffers.push_back(buffer);
 
-        filters.data.resize(filters.n_mel * filters.n_fft);
-        loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
-        BYTESWAP_FILTERS(filters);
+        ggml_tallocr talloc = ggml_tallocr_new(buffer);
+        for (auto * t : it.second) {
+            ggml_tallocr_alloc(&talloc, t);
+        }
+
+        WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB (%d tensors)\n", __func__, ggml_backend_buffer_name(buffer), size/1e6, (int) it.second.size());
     }
 
-    // load vocab
-    {
-        int32_t n_vocab = 0;
-        read_safe(loader, n_vocab);
+    return true;
+}
 
-        //if (n_vocab != model.hparams.n_vocab) {
-        //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
-        //            __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
-        //    return false;
-        //}
+// derive the model type and the weight type from the hparams
+static bool whisper_model_init_hparams(whisper_context & wctx) {
+    auto & model   = wctx.model;
+    auto & hparams = model.hparams;
 
-        std::string word;
-        std::vector<char> tmp;
+    assert(hparams.n_text_state == hparams.n_audio_state);
 
-        tmp.reserve(128);
+    std::string mver = "";
 
-        for (int i = 0; i < n_vocab; i++) {
-            uint32_t len;
-            read_safe(loader, len);
+    if (hparams.n_audio_layer == 4) {
+        model.type = e_model::MODEL_TINY;
+    }
 
-            if (len > 0) {
-                tmp.resize(len);
-                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-                word.assign(&tmp[0], tmp.size());
-            } else {
-                // seems like we have an empty-string token in multi-language models (i = 50256)
-                //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
-                word = "";
-            }
+    if (hparams.n_audio_layer == 6) {
+        model.type = e_model::MODEL_BASE;
+    }
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+    if (hparams.n_audio_layer == 12) {
+        model.type = e_model::MODEL_SMALL;
+    }
 
-            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+    if (hparams.n_audio_layer == 24) {
+        model.type = e_model::MODEL_MEDIUM;
+    }
+
+    if (hparams.n_audio_layer == 32) {
+        model.type = e_model::MODEL_LARGE;
+
+        if (hparams.n_vocab == 51866) {
+            mver = " v3";
         }
+    }
 
-        vocab.n_vocab = model.hparams.n_vocab;
-        if (vocab.is_multilingual()) {
-            vocab.token_eot++;
-            vocab.token_sot++;
-
-            // account for variable number of language tokens
-            const int dt = vocab.num_languages() - 98;
-
-            vocab.token_translate  += dt;
-            vocab.token_transcribe += dt;
-            vocab.token_solm       += dt;
-            vocab.token_prev       += dt;
-            vocab.token_nosp       += dt;
-            vocab.token_not        += dt;
-            vocab.token_beg        += dt;
-        }
-
-        if (n_vocab < model.hparams.n_vocab) {
-            WHISPER_LOG_INFO("%s: adding %d extra tokens\n", __func__, model.hparams.n_vocab - n_vocab);
-            for (int i = n_vocab; i < model.hparams.n_vocab; i++) {
-                if (i > vocab.token_beg) {
-                    word = "[_TT_" + std::to_string(i - vocab.token_beg) + "]";
-                } else if (i == vocab.token_eot) {
-                    word = "[_EOT_]";
-                } else if (i == vocab.token_sot) {
-                    word = "[_SOT_]";
-                } else if (i == vocab.token_translate) {
-                    word = "[_TRANSLATE_]";
-                } else if (i == vocab.token_transcribe) {
-                    word = "[_TRANSCRIBE_]";
-                } else if (i == vocab.token_solm) {
-                    word = "[_SOLM_]";
-                } else if (i == vocab.token_prev) {
-                    word = "[_PREV_]";
-                } else if (i == vocab.token_nosp) {
-                    word = "[_NOSP_]";
-                } else if (i == vocab.token_not) {
-                    word = "[_NOT_]";
-                } else if (i == vocab.token_beg) {
-                    word = "[_BEG_]";
-                } else if (i > vocab.token_sot && i <= vocab.token_sot + vocab.num_languages()) {
-                    word = "[_LANG_" + std::string(whisper_lang_str(i - vocab.token_sot - 1)) + "]";
-                } else {
-                    word = "[_extra_token_" + std::to_string(i) + "]";
-                }
-                vocab.token_to_id[word] = i;
-                vocab.id_to_token[i] = word;
+    const int32_t qntvr = hparams.ftype / GGML_QNT_VERSION_FACTOR;
+
+    hparams.ftype %= GGML_QNT_VERSION_FACTOR;
+
+    // for the big tensors, we have the option to store the data in 16-bit floats or quantized
+    // in order to save memory and also to speed up the computation
+    // for mixed models, the base type is read together with the per-tensor types after the vocab
+    wctx.wtype = hparams.ftype == WHISPER_FTYPE_MIXED ? GGML_TYPE_F16 : ggml_ftype_to_ggml_type((ggml_ftype) (model.hparams.ftype));
+    if (wctx.wtype == GGML_TYPE_COUNT) {
+        WHISPER_LOG_ERROR("%s: invalid model (bad ftype value %d)\n", __func__, model.hparams.ftype);
+        return false;
+    }
+
+    WHISPER_LOG_INFO("%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
+    WHISPER_LOG_INFO("%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
+    WHISPER_LOG_INFO("%s: n_audio_state = %d\n", __func__, hparams.n_audio_state);
+    WHISPER_LOG_INFO("%s: n_audio_head  = %d\n", __func__, hparams.n_audio_head);
+    WHISPER_LOG_INFO("%s: n_audio_layer = %d\n", __func__, hparams.n_audio_layer);
+    WHISPER_LOG_INFO("%s: n_text_ctx    = %d\n", __func__, hparams.n_text_ctx);
+    WHISPER_LOG_INFO("%s: n_text_state  = %d\n", __func__, hparams.n_text_state);
+    WHISPER_LOG_INFO("%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
+    WHISPER_LOG_INFO("%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
+    WHISPER_LOG_INFO("%s: n_mels        = %d\n", __func__, hparams.n_mels);
+    WHISPER_LOG_INFO("%s: ftype         = %d\n", __func__, model.hparams.ftype);
+    WHISPER_LOG_INFO("%s: qntvr         = %d\n", __func__, qntvr);
+    WHISPER_LOG_INFO("%s: type          = %d (%s%s)\n", __func__, model.type, g_model_name.at(model.type).c_str(), mver.c_str());
+
+    return true;
+}
+
+// set up the special tokens and add the tokens that are missing from the model file
+static void whisper_vocab_init_special(whisper_context & wctx, int n_vocab) {
+    auto & model = wctx.model;
+    auto & vocab = wctx.vocab;
+
+    std::string word;
+
+    vocab.n_vocab = model.hparams.n_vocab;
+    if (vocab.is_multilingual()) {
+        vocab.token_eot++;
+        vocab.token_sot++;
+
+        // account for variable number of language tokens
+        const int dt = vocab.num_languages() - 98;
+
+        vocab.token_translate  += dt;
+        vocab.token_transcribe += dt;
+        vocab.token_solm       += dt;
+        vocab.token_prev       += dt;
+        vocab.token_nosp       += dt;
+        vocab.token_not        += dt;
+        vocab.token_beg        += dt;
+    }
+
+    if (n_vocab < model.hparams.n_vocab) {
+        WHISPER_LOG_INFO("%s: adding %d extra tokens\n", __func__, model.hparams.n_vocab - n_vocab);
+        for (int i = n_vocab; i < model.hparams.n_vocab; i++) {
+            if (i > vocab.token_beg) {
+                word = "[_TT_" + std::to_string(i - vocab.token_beg) + "]";
+            } else if (i == vocab.token_eot) {
+                word = "[_EOT_]";
+            } else if (i == vocab.token_sot) {
+                word = "[_SOT_]";
+            } else if (i == vocab.token_translate) {
+                word = "[_TRANSLATE_]";
+            } else if (i == vocab.token_transcribe) {
+                word = "[_TRANSCRIBE_]";
+            } else if (i == vocab.token_solm) {
+                word = "[_SOLM_]";
+            } else if (i == vocab.token_prev) {
+                word = "[_PREV_]";
+            } else if (i == vocab.token_nosp) {
+                word = "[_NOSP_]";
+            } else if (i == vocab.token_not) {
+                word = "[_NOT_]";
+            } else if (i == vocab.token_beg) {
+                word = "[_BEG_]";
+            } else if (i > vocab.token_sot && i <= vocab.token_sot + vocab.num_languages()) {
+                word = "[_LANG_" + std::string(whisper_lang_str(i - vocab.token_sot - 1)) + "]";
+            } else {
+                word = "[_extra_token_" + std::to_string(i) + "]";
             }
+            vocab.token_to_id[word] = i;
+            vocab.id_to_token[i] = word;
         }
-
-        WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
     }
 
-    const ggml_type wtype = wctx.wtype;
-    const ggml_type vtype = wctx.wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16; // conv type
+    WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
+}
+
+// create the weight tensors and allocate them in the backend buffer
+// ttypes overrides the type of individual tensors (mixed-precision models)
+// create the context and the tensor meta data of the weights from the hparams
+static bool whisper_model_create_tensors(whisper_model & model, ggml_type wtype) {
+    const ggml_type vtype = wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16; // conv type
 
     // create the ggml context
     {
@@ -1747,17 +2062,299 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
     }
 
-    // allocate tensors in the backend buffers
-    model.buffer = ggml_backend_alloc_ctx_tensors_from_buft(model.ctx, whisper_default_buffer_type(wctx.params));
-    if (!model.buffer) {
-        WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
+    return true;
+}
+
+typedef ggml_backend_dev_t (*whisper_rpc_add_device_t)(const char * endpoint);
+
+// allocate a copy of the model on each RPC server in params.rpc_servers
+// the weights are uploaded by whisper_model_set_replicas() while the model is loaded
+static bool whisper_model_init_replicas(whisper_context & wctx) {
+    const char * rpc_servers = wctx.params.rpc_servers;
+    if (rpc_servers == nullptr || rpc_servers[0] == '\0') {
+        return true;
+    }
+
+    ggml_backend_reg_t rpc_reg = ggml_backend_reg_by_name("RPC");
+    if (!rpc_reg) {
+        WHISPER_LOG_ERROR("%s: RPC servers requested, but ggml was built without the RPC backend (GGML_RPC)\n", __func__);
         return false;
     }
 
-    size_t size_main = ggml_backend_buffer_get_size(model.buffer);
-    WHISPER_LOG_INFO("%s: %8s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(model.buffer), size_main / 1e6);
+    auto * fn_add_device = (whisper_rpc_add_device_t) ggml_backend_reg_get_proc_address(rpc_reg, "ggml_backend_rpc_add_device");
+    if (!fn_add_device) {
+        WHISPER_LOG_ERROR("%s: the RPC backend does not provide ggml_backend_rpc_add_device\n", __func__);
+        return false;
+    }
 
-    // load weights
+    ggml_backend_dev_t cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+
+    std::vector<std::string> endpoints;
+    {
+        std::string cur;
+        for (const char * c = rpc_servers; ; ++c) {
+            if (*c == ',' || *c == '\0') {
+                if (!cur.empty()) {
+                    endpoints.push_back(cur);
+                }
+                cur.clear();
+                if (*c == '\0') {
+                    break;
+                }
+            } else if (*c != ' ') {
+                cur += *c;
+            }
+        }
+    }
+
+    const auto & model = wctx.model;
+
+    wctx.replicas.resize(endpoints.size());
+
+    for (size_t i = 0; i < endpoints.size(); ++i) {
+        auto & replica = wctx.replicas[i];
+
+        replica.endpoint = endpoints[i];
+        replica.dev      = fn_add_device(replica.endpoint.c_str());
+
+        ggml_backend_buffer_type_t buft = replica.dev ? ggml_backend_dev_buffer_type(replica.dev) : nullptr;
+        if (!buft) {
+            WHISPER_LOG_ERROR("%s: failed to connect to the RPC server '%s'\n", __func__, replica.endpoint.c_str());
+            return false;
+        }
+
+        replica.model.type    = model.type;
+        replica.model.hparams = model.hparams;
+
+        if (!whisper_model_create_tensors(replica.model, wctx.wtype)) {
+            return false;
+        }
+
+        // same types as the local weights (mixed models)
+        for (auto & kv : replica.model.tensors) {
+            const ggml_tensor * src = model.tensors.at(kv.first);
+
+            kv.second->type = src->type;
+            for (int j = 0; j < GGML_MAX_DIMS; ++j) {
+                kv.second->nb[j] = src->nb[j];
+            }
+        }
+
+        // the weights the server cannot use fall back to local memory
+        buft_list_t buft_list;
+        buft_list.emplace_back(replica.dev, buft);
+        buft_list.emplace_back(cpu_dev, ggml_backend_cpu_buffer_type());
+
+        if (!whisper_model_alloc_tensors(replica.model, buft_list, false)) {
+            WHISPER_LOG_ERROR("%s: failed to allocate the model on the RPC server '%s'\n", __func__, replica.endpoint.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// upload the data of a weight to the RPC servers - once, while the model is loaded
+static void whisper_model_set_replicas(whisper_context & wctx, const std::string & name, const void * data, size_t nbytes) {
+    for (auto & replica : wctx.replicas) {
+        ggml_backend_tensor_set(replica.model.tensors.at(name), data, 0, nbytes);
+    }
+}
+
+static bool whisper_model_init_tensors(whisper_context & wctx, const std::map<std::string, ggml_type> & ttypes) {
+    auto & model = wctx.model;
+
+    if (!whisper_model_create_tensors(model, wctx.wtype)) {
+        return false;
+    }
+
+    // apply the per-tensor types of mixed models
+    for (const auto & kv : ttypes) {
+        const auto it = model.tensors.find(kv.first);
+        if (it == model.tensors.end()) {
+            WHISPER_LOG_ERROR("%s: unknown tensor '%s' in type table\n", __func__, kv.first.c_str());
+            return false;
+        }
+
+        ggml_tensor * tensor = it->second;
+        if (tensor->ne[0] % ggml_blck_size(kv.second) != 0) {
+            WHISPER_LOG_ERROR("%s: tensor '%s' cannot be stored as %s\n", __func__, kv.first.c_str(), ggml_type_name(kv.second));
+            return false;
+        }
+
+        tensor->type  = kv.second;
+        tensor->nb[0] = ggml_type_size(tensor->type);
+        tensor->nb[1] = ggml_row_size(tensor->type, tensor->ne[0]);
+        for (int i = 2; i < GGML_MAX_DIMS; ++i) {
+            tensor->nb[i] = tensor->nb[i - 1]*tensor->ne[i - 1];
+        }
+    }
+
+    // allocate tensors in the backend buffers
+    if (!whisper_model_alloc_tensors(model, make_buft_list(wctx.params), wctx.params.numa == GGML_NUMA_STRATEGY_DISTRIBUTE)) {
+        WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
+        return false;
+    }
+
+    // the copies of the model on the RPC servers
+    if (!whisper_model_init_replicas(wctx)) {
+        return false;
+    }
+
+    return true;
+}
+
+// load the model from a ggml file
+//
+// file format:
+//
+//   - hparams
+//   - pre-computed mel filters
+//   - vocab
+//   - weights
+//
+// see the convert-pt-to-ggml.py script for details
+// GGUF models are loaded with whisper_model_load_gguf()
+//
+static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
+    WHISPER_LOG_INFO("%s: loading model\n", __func__);
+
+    const int64_t t_start_us = ggml_time_us();
+
+    wctx.t_start_us = t_start_us;
+
+    auto & model = wctx.model;
+    auto & vocab = wctx.vocab;
+
+    // verify magic
+    {
+        uint32_t magic;
+        read_safe(loader, magic);
+        if (magic == WHISPER_GGUF_MAGIC) {
+            WHISPER_LOG_ERROR("%s: GGUF models can only be loaded from a file\n", __func__);
+            return false;
+        }
+        if (magic != GGML_FILE_MAGIC) {
+            WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
+            return false;
+        }
+    }
+
+    //load hparams
+    {
+        auto & hparams = model.hparams;
+
+        read_safe(loader, hparams.n_vocab);
+        read_safe(loader, hparams.n_audio_ctx);
+        read_safe(loader, hparams.n_audio_state);
+        read_safe(loader, hparams.n_audio_head);
+        read_safe(loader, hparams.n_audio_layer);
+        read_safe(loader, hparams.n_text_ctx);
+        read_safe(loader, hparams.n_text_state);
+        read_safe(loader, hparams.n_text_head);
+        read_safe(loader, hparams.n_text_layer);
+        read_safe(loader, hparams.n_mels);
+        read_safe(loader, hparams.ftype);
+
+        if (!whisper_model_init_hparams(wctx)) {
+            return false;
+        }
+    }
+
+    // load mel filters
+    {
+        auto & filters = wctx.model.filters;
+
+        read_safe(loader, filters.n_mel);
+        read_safe(loader, filters.n_fft);
+
+        filters.data.resize(filters.n_mel * filters.n_fft);
+        loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
+        BYTESWAP_FILTERS(filters);
+    }
+
+    // load vocab
+    {
+        int32_t n_vocab = 0;
+        read_safe(loader, n_vocab);
+
+        //if (n_vocab != model.hparams.n_vocab) {
+        //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
+        //            __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
+        //    return false;
+        //}
+
+        std::string word;
+        std::vector<char> tmp;
+
+        tmp.reserve(128);
+
+        for (int i = 0; i < n_vocab; i++) {
+            uint32_t len;
+            read_safe(loader, len);
+
+            if (len > 0) {
+                tmp.resize(len);
+                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+                word.assign(&tmp[0], tmp.size());
+            } else {
+                // seems like we have an empty-string token in multi-language models (i = 50256)
+                //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
+                word = "";
+            }
+
+            vocab.token_to_id[word] = i;
+            vocab.id_to_token[i] = word;
+
+            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+        }
+
+        whisper_vocab_init_special(wctx, n_vocab);
+    }
+
+    // load per-tensor types
+    std::map<std::string, ggml_type> ttypes;
+    if (model.hparams.ftype == WHISPER_FTYPE_MIXED) {
+        int32_t ftype_base = 0;
+        int32_t n_tensors  = 0;
+
+        read_safe(loader, ftype_base);
+        read_safe(loader, n_tensors);
+
+        wctx.wtype = ggml_ftype_to_ggml_type((ggml_ftype) ftype_base);
+        if (wctx.wtype == GGML_TYPE_COUNT) {
+            WHISPER_LOG_ERROR("%s: invalid model (bad base ftype value %d)\n", __func__, ftype_base);
+            return false;
+        }
+
+        model.hparams.ftype = ftype_base;
+
+        std::vector<char> tmp;
+        for (int i = 0; i < n_tensors; ++i) {
+            int32_t length;
+            int32_t ttype;
+
+            read_safe(loader, length);
+            tmp.resize(length);
+            loader->read(loader->context, tmp.data(), tmp.size());
+            read_safe(loader, ttype);
+
+            if (ttype < 0 || ttype >= GGML_TYPE_COUNT || ggml_type_size((ggml_type) ttype) == 0) {
+                WHISPER_LOG_ERROR("%s: invalid model (bad type %d for tensor '%.*s')\n", __func__, ttype, length, tmp.data());
+                return false;
+            }
+
+            ttypes[std::string(tmp.data(), tmp.size())] = (ggml_type) ttype;
+        }
+
+        WHISPER_LOG_INFO("%s: mixed types   = %d tensors, base ftype = %d\n", __func__, n_tensors, ftype_base);
+    }
+
+    if (!whisper_model_init_tensors(wctx, ttypes)) {
+        return false;
+    }
+
+    // load weights
     {
         size_t total_size = 0;
 
@@ -1774,69 +2371,349 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             read_safe(loader, length);
             read_safe(loader, ttype);
 
-            if (loader->eof(loader->context)) {
-                break;
-            }
+            if (loader->eof(loader->context)) {
+                break;
+            }
+
+            int32_t nelements = 1;
+            int32_t ne[4] = { 1, 1, 1, 1 };
+            for (int i = 0; i < n_dims; ++i) {
+                read_safe(loader, ne[i]);
+                nelements *= ne[i];
+            }
+
+            std::string name;
+            std::vector<char> tmp(length); // create a buffer
+            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+            name.assign(&tmp[0], tmp.size());
+
+            if (model.tensors.find(name) == model.tensors.end()) {
+                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
+                return false;
+            }
+
+            auto tensor = model.tensors[name.data()];
+
+            if (ggml_nelements(tensor) != nelements) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
+                WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
+                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                return false;
+            }
+
+            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+                return false;
+            }
+
+            const size_t bpe = ggml_type_size(ggml_type(ttype));
+
+            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                return false;
+            }
+
+            //ggml_backend_t backend = wctx.backend;
+
+            //printf("%s: [%5.5s] %s\n", __func__, ggml_backend_name(backend), name.c_str());
+
+            if (ggml_backend_buffer_is_host(tensor->buffer)) {
+                // for the CPU and Metal backend, we can read directly into the tensor
+                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                BYTESWAP_TENSOR(tensor);
+
+                whisper_model_set_replicas(wctx, name, tensor->data, ggml_nbytes(tensor));
+            } else {
+                // read into a temporary buffer first, then copy to device memory
+                read_buf.resize(ggml_nbytes(tensor));
+
+                loader->read(loader->context, read_buf.data(), read_buf.size());
+
+                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+
+                whisper_model_set_replicas(wctx, name, read_buf.data(), ggml_nbytes(tensor));
+            }
+
+            //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype), ggml_nbytes(tensor)/1e6);
+            total_size += ggml_nbytes(tensor);
+            model.n_loaded++;
+        }
+
+        WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
+
+        if (model.n_loaded == 0) {
+            WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
+        } else if (model.n_loaded != (int) model.tensors.size()) {
+            WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
+            return false;
+        }
+    }
+
+    wctx.t_load_us = ggml_time_us() - t_start_us;
+
+    return true;
+}
+
+// load the model from a GGUF file
+//
+// the hparams, mel filters, vocab and alignment heads are stored as key/value metadata and the tensor data is
+// aligned to gguf_get_alignment(), so the weights can be read with a single seek per tensor
+//
+// use whisper_model_save_gguf() to convert a model from the ggml format
+//
+static bool whisper_model_load_gguf(const char * fname, whisper_context & wctx) {
+    WHISPER_LOG_INFO("%s: loading model\n", __func__);
+
+    const int64_t t_start_us = ggml_time_us();
+
+    wctx.t_start_us = t_start_us;
+
+    auto & model = wctx.model;
+    auto & vocab = wctx.vocab;
+
+    ggml_context * ctx_meta = nullptr;
+
+    struct gguf_init_params gparams = {
+        /*.no_alloc =*/ true,
+        /*.ctx      =*/ &ctx_meta,
+    };
+
+    gguf_context * ctx_gguf = gguf_init_from_file(fname, gparams);
+    if (!ctx_gguf) {
+        WHISPER_LOG_ERROR("%s: failed to read GGUF file '%s'\n", __func__, fname);
+        return false;
+    }
+
+    struct gguf_guard {
+        gguf_context * ctx_gguf;
+        ggml_context * ctx_meta;
+
+        ~gguf_guard() {
+            gguf_free(ctx_gguf);
+            ggml_free(ctx_meta);
+        }
+    } guard = { ctx_gguf, ctx_meta };
+
+    const auto get_i32 = [&](const char * key, int32_t & dst) {
+        const int64_t id = gguf_find_key(ctx_gguf, key);
+        if (id < 0) {
+            WHISPER_LOG_ERROR("%s: key '%s' not found in model file\n", __func__, key);
+            return false;
+        }
+        switch (gguf_get_kv_type(ctx_gguf, id)) {
+            case GGUF_TYPE_UINT32: dst = gguf_get_val_u32(ctx_gguf, id); break;
+            case GGUF_TYPE_INT32:  dst = gguf_get_val_i32(ctx_gguf, id); break;
+            default:
+                WHISPER_LOG_ERROR("%s: key '%s' has unexpected type %s\n", __func__, key, gguf_type_name(gguf_get_kv_type(ctx_gguf, id)));
+                return false;
+        }
+        return true;
+    };
+
+    // verify the architecture
+    {
+        const int64_t id = gguf_find_key(ctx_gguf, "general.architecture");
+        if (id < 0 || gguf_get_kv_type(ctx_gguf, id) != GGUF_TYPE_STRING || strcmp(gguf_get_val_str(ctx_gguf, id), "whisper") != 0) {
+            WHISPER_LOG_ERROR("%s: invalid model file '%s' (not a whisper model)\n", __func__, fname);
+            return false;
+        }
+    }
+
+    // load hparams
+    {
+        auto & hparams = model.hparams;
+
+        int32_t ftype = 0;
+        int32_t qntvr = 0;
+
+        if (!get_i32("whisper.vocab_size",                     hparams.n_vocab)       ||
+            !get_i32("whisper.audio.context_length",           hparams.n_audio_ctx)   ||
+            !get_i32("whisper.audio.embedding_length",         hparams.n_audio_state) ||
+            !get_i32("whisper.audio.attention.head_count",     hparams.n_audio_head)  ||
+            !get_i32("whisper.audio.block_count",              hparams.n_audio_layer) ||
+            !get_i32("whisper.text.context_length",            hparams.n_text_ctx)    ||
+            !get_i32("whisper.text.embedding_length",          hparams.n_text_state)  ||
+            !get_i32("whisper.text.attention.head_count",      hparams.n_text_head)   ||
+            !get_i32("whisper.text.block_count",               hparams.n_text_layer)  ||
+            !get_i32("whisper.n_mels",                         hparams.n_mels)        ||
+            !get_i32("general.file_type",                      ftype)                 ||
+            !get_i32("general.quantization_version",           qntvr)) {
+            return false;
+        }
+
+        hparams.ftype = qntvr*GGML_QNT_VERSION_FACTOR + ftype;
+
+        if (!whisper_model_init_hparams(wctx)) {
+            return false;
+        }
+    }
+
+    // load mel filters
+    {
+        auto & filters = model.filters;
+
+        if (!get_i32("whisper.mel_filters.n_mel", filters.n_mel) ||
+            !get_i32("whisper.mel_filters.n_fft", filters.n_fft)) {
+            return false;
+        }
+
+        const int64_t id = gguf_find_key(ctx_gguf, "whisper.mel_filters");
+        if (id < 0 || gguf_get_arr_type(ctx_gguf, id) != GGUF_TYPE_FLOAT32 ||
+            gguf_get_arr_n(ctx_gguf, id) != (size_t) filters.n_mel*filters.n_fft) {
+            WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad mel filters)\n", __func__, fname);
+            return false;
+        }
+
+        const float * data = (const float *) gguf_get_arr_data(ctx_gguf, id);
+        filters.data.assign(data, data + filters.n_mel*filters.n_fft);
+    }
+
+    // load vocab
+    {
+        const int64_t id_bytes   = gguf_find_key(ctx_gguf, "whisper.vocab.bytes");
+        const int64_t id_lengths = gguf_find_key(ctx_gguf, "whisper.vocab.lengths");
+        const int64_t id_tokens  = gguf_find_key(ctx_gguf, "tokenizer.ggml.tokens");
+
+        int n_vocab = 0;
+
+        if (id_bytes >= 0 && id_lengths >= 0) {
+            if (gguf_get_arr_type(ctx_gguf, id_bytes) != GGUF_TYPE_UINT8 || gguf_get_arr_type(ctx_gguf, id_lengths) != GGUF_TYPE_UINT32) {
+                WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab)\n", __func__, fname);
+                return false;
+            }
+
+            const char     * bytes   = (const char *)     gguf_get_arr_data(ctx_gguf, id_bytes);
+            const uint32_t * lengths = (const uint32_t *) gguf_get_arr_data(ctx_gguf, id_lengths);
+
+            const size_t n_bytes = gguf_get_arr_n(ctx_gguf, id_bytes);
+
+            n_vocab = gguf_get_arr_n(ctx_gguf, id_lengths);
+
+            size_t offset = 0;
+            for (int i = 0; i < n_vocab; i++) {
+                if (lengths[i] > n_bytes - offset) {
+                    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab)\n", __func__, fname);
+                    return false;
+                }
+
+                const std::string word(bytes + offset, lengths[i]);
+                offset += lengths[i];
+
+                vocab.token_to_id[word] = i;
+                vocab.id_to_token[i] = word;
+            }
+        } else if (id_tokens >= 0 && gguf_get_arr_type(ctx_gguf, id_tokens) == GGUF_TYPE_STRING) {
+            // older files - the tokens are C strings, the byte token 0x00 is empty
+            n_vocab = gguf_get_arr_n(ctx_gguf, id_tokens);
+
+            for (int i = 0; i < n_vocab; i++) {
+                const std::string word = gguf_get_arr_str(ctx_gguf, id_tokens, i);
+
+                vocab.token_to_id[word] = i;
+                vocab.id_to_token[i] = word;
+            }
+        } else {
+            WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab)\n", __func__, fname);
+            return false;
+        }
+
+        whisper_vocab_init_special(wctx, n_vocab);
+    }
+
+    // load alignment heads
+    {
+        const int64_t id = gguf_find_key(ctx_gguf, "whisper.alignment_heads");
+        if (id >= 0) {
+            if (gguf_get_arr_type(ctx_gguf, id) != GGUF_TYPE_INT32 || gguf_get_arr_n(ctx_gguf, id) % 2 != 0) {
+                WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad alignment heads)\n", __func__, fname);
+                return false;
+            }
+
+            const int32_t * data = (const int32_t *) gguf_get_arr_data(ctx_gguf, id);
+            for (size_t i = 0; i < gguf_get_arr_n(ctx_gguf, id); i += 2) {
+                model.aheads.push_back({ data[i], data[i + 1] });
+            }
+
+            WHISPER_LOG_INFO("%s: aheads        = %zu\n", __func__, model.aheads.size());
+        }
+    }
+
+    // the type of each tensor is stored in the file
+    std::map<std::string, ggml_type> ttypes;
+
+    const int64_t n_tensors = gguf_get_n_tensors(ctx_gguf);
+    for (int64_t i = 0; i < n_tensors; ++i) {
+        ttypes[gguf_get_tensor_name(ctx_gguf, i)] = gguf_get_tensor_type(ctx_gguf, i);
+    }
+
+    if (!whisper_model_init_tensors(wctx, ttypes)) {
+        return false;
+    }
+
+    // load weights
+    {
+#ifdef _MSC_VER
+        std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
+        auto fin = std::ifstream(converter.from_bytes(fname), std::ios::binary);
+#else
+        auto fin = std::ifstream(fname, std::ios::binary);
+#endif
+        if (!fin) {
+            WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, fname);
+            return false;
+        }
+
+        const size_t data_offset = gguf_get_data_offset(ctx_gguf);
 
-            int32_t nelements = 1;
-            int32_t ne[4] = { 1, 1, 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
-                read_safe(loader, ne[i]);
-                nelements *= ne[i];
-            }
+        size_t total_size = 0;
 
-            std::string name;
-            std::vector<char> tmp(length); // create a buffer
-            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-            name.assign(&tmp[0], tmp.size());
+        model.n_loaded = 0;
 
-            if (model.tensors.find(name) == model.tensors.end()) {
-                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
-                return false;
-            }
+        std::vector<char> read_buf;
 
-            auto tensor = model.tensors[name.data()];
+        for (int64_t i = 0; i < n_tensors; ++i) {
+            const char * name = gguf_get_tensor_name(ctx_gguf, i);
 
-            if (ggml_nelements(tensor) != nelements) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
-                WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
-                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
-                return false;
-            }
+            ggml_tensor * tensor = model.tensors.at(name);
+            ggml_tensor * meta   = ggml_get_tensor(ctx_meta, name);
 
-            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
+            if (!ggml_are_same_shape(tensor, meta)) {
                 WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
-                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+                        __func__, name, (int) meta->ne[0], (int) meta->ne[1], (int) meta->ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
                 return false;
             }
 
-            const size_t bpe = ggml_type_size(ggml_type(ttype));
+            const size_t nbytes = ggml_nbytes(tensor);
 
-            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
+            if (gguf_get_tensor_size(ctx_gguf, i) != nbytes) {
                 WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                        __func__, name, gguf_get_tensor_size(ctx_gguf, i), nbytes);
                 return false;
             }
 
-            //ggml_backend_t backend = wctx.backend;
+            fin.seekg(data_offset + gguf_get_tensor_offset(ctx_gguf, i));
 
-            //printf("%s: [%5.5s] %s\n", __func__, ggml_backend_name(backend), name.c_str());
+            if (ggml_backend_buffer_is_host(tensor->buffer)) {
+                fin.read((char *) tensor->data, nbytes);
 
-            if (ggml_backend_buffer_is_host(model.buffer)) {
-                // for the CPU and Metal backend, we can read directly into the tensor
-                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-                BYTESWAP_TENSOR(tensor);
+                whisper_model_set_replicas(wctx, name, tensor->data, nbytes);
             } else {
-                // read into a temporary buffer first, then copy to device memory
-                read_buf.resize(ggml_nbytes(tensor));
+                read_buf.resize(nbytes);
+                fin.read(read_buf.data(), nbytes);
 
-                loader->read(loader->context, read_buf.data(), read_buf.size());
+                ggml_backend_tensor_set(tensor, read_buf.data(), 0, nbytes);
 
-                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+                whisper_model_set_replicas(wctx, name, read_buf.data(), nbytes);
             }
 
-            //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype), ggml_nbytes(tensor)/1e6);
-            total_size += ggml_nbytes(tensor);
+            if (!fin) {
+                WHISPER_LOG_ERROR("%s: failed to read tensor '%s' from model file\n", __func__, name);
+                return false;
+            }
+
+            total_size += nbytes;
             model.n_loaded++;
         }
 
@@ -1850,8 +2727,6 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
     }
 
-    ggml_backend_buffer_set_usage(model.buffer, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
-
     wctx.t_load_us = ggml_time_us() - t_start_us;
 
     return true;
@@ -1875,10 +2750,39 @@ static bool whisper_encode_external(const whisper_state & wstate) {
     return use_coreml || use_openvino;
 }
 
+// true if the graphs of the state run on the CPU backend alone - no GPU, BLAS or RPC backend that would
+// prefer the matrix multiplication form of an op
+static bool whisper_state_cpu_only(const whisper_state & wstate) {
+    return wstate.backends.size() == 1 && ggml_backend_is_cpu(wstate.backends[0]);
+}
+
+// conv + bias + gelu
+// on the CPU, the direct convolution fuses the bias and GELU and needs no im2col buffer, but it converts the whole
+// kernel to F32 and reads it again for every tile of columns - once the kernel no longer fits in the cache (conv2 of
+// the medium and large models), im2col + the matrix multiplication is faster
+static struct ggml_tensor * whisper_build_conv_gelu(
+        struct ggml_context * ctx0,
+         struct ggml_tensor * w,
+         struct ggml_tensor * b,
+         struct ggml_tensor * cur,
+                        int   s0,
+                       bool   cpu_only) {
+    const int64_t n_direct_max = 3*768*768;
+
+    if (cpu_only && ggml_nelements(w) <= n_direct_max) {
+        return ggml_conv_1d_direct(ctx0, w, cur, b, s0, 1, 1, true);
+    }
+
+    cur = ggml_conv_1d_ph(ctx0, w, cur, s0, 1);
+    cur = ggml_add(ctx0, cur, b);
+
+    return ggml_gelu(ctx0, cur);
+}
+
 static struct ggml_cgraph * whisper_build_graph_conv(
         whisper_context & wctx,
           whisper_state & wstate) {
-    const auto & model   = wctx.model;
+    const auto & model   = whisper_state_model(wctx, wstate);
     const auto & hparams = model.hparams;
 
     const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
@@ -1904,17 +2808,10 @@ static struct ggml_cgraph * whisper_build_graph_conv(
 
     if (!whisper_encode_external(wstate)) {
         // convolution + gelu
-        {
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_1_b);
-
-            cur = ggml_gelu(ctx0, cur);
-
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_2_b);
+        const bool cpu_only = whisper_state_cpu_only(wstate);
 
-            cur = ggml_gelu(ctx0, cur);
-        }
+        cur = whisper_build_conv_gelu(ctx0, model.e_conv_1_w, model.e_conv_1_b, mel, 1, cpu_only);
+        cur = whisper_build_conv_gelu(ctx0, model.e_conv_2_w, model.e_conv_2_b, cur, 2, cpu_only);
 
         ggml_set_name(cur, "embd_conv");
         wstate.embd_conv = cur;
@@ -1940,7 +2837,7 @@ static struct ggml_cgraph * whisper_build_graph_conv(
 static struct ggml_cgraph * whisper_build_graph_encoder(
         whisper_context & wctx,
           whisper_state & wstate) {
-    const auto & model   = wctx.model;
+    const auto & model   = whisper_state_model(wctx, wstate);
     const auto & hparams = model.hparams;
 
     const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
@@ -1952,6 +2849,10 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
     auto & kv_pad = wstate.kv_pad;
 
+    // the fused CPU kernel of ggml_flash_attn_ext beats the two matrix multiplications of the reference
+    // attention - it never materializes the n_ctx x n_ctx scores
+    const bool fused_attn = whisper_state_cpu_only(wstate);
+
     WHISPER_ASSERT(!!kv_pad.buffer);
 
     const int n_ctx_pad = GGML_PAD(n_ctx, 256);
@@ -2060,6 +2961,24 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
                 cur = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
 
+                cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx);
+            } else if (fused_attn) {
+                struct ggml_tensor * K =
+                    ggml_permute(ctx0,
+                            ggml_cast(ctx0,
+                                ggml_reshape_3d(ctx0, Kcur, n_state_head, n_head, n_ctx),
+                                wctx.itype),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * V =
+                    ggml_permute(ctx0,
+                            ggml_cast(ctx0,
+                                ggml_reshape_3d(ctx0, Vcur, n_state_head, n_head, n_ctx),
+                                wctx.itype),
+                            0, 2, 1, 3);
+
+                cur = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
+
                 cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx);
             } else {
                 struct ggml_tensor * K =
@@ -2174,7 +3093,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 static struct ggml_cgraph * whisper_build_graph_cross(
         whisper_context & wctx,
           whisper_state & wstate) {
-    const auto & model   = wctx.model;
+    const auto & model   = whisper_state_model(wctx, wstate);
     const auto & hparams = model.hparams;
 
     const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
@@ -2221,15 +3140,15 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 
         if (wctx.params.flash_attn) {
             k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx_pad));
+                    ggml_row_size(wstate.kv_cross.k->type, n_state)*(il*n_ctx_pad));
 
             v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.v)*n_state)*(il*n_ctx_pad));
+                    ggml_row_size(wstate.kv_cross.v->type, n_state)*(il*n_ctx_pad));
         } else {
             Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
 
             k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
+                    ggml_row_size(wstate.kv_cross.k->type, n_state)*(il*n_ctx));
 
             v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
                     (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
@@ -2247,6 +3166,34 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     return gf;
 }
 
+// the threadpool of the state for n_threads
+// the worker threads are kept between the graph computations and recreated when the number of threads or the
+// placement requested through whisper_full_params differs from the live pool
+static ggml_threadpool_t whisper_state_threadpool(whisper_state & wstate, int n_threads) {
+    ggml_threadpool_params tpp = wstate.threadpool_params;
+    tpp.n_threads = n_threads;
+    tpp.paused    = false;
+
+    if (wstate.threadpool) {
+        if (ggml_threadpool_params_match(&wstate.threadpool_params_live, &tpp)) {
+            return wstate.threadpool;
+        }
+
+        ggml_threadpool_free(wstate.threadpool);
+        wstate.threadpool = nullptr;
+    }
+
+    wstate.threadpool = ggml_threadpool_new(&tpp);
+    if (!wstate.threadpool) {
+        WHISPER_LOG_WARN("%s: failed to create a threadpool with %d threads - using the default threading\n", __func__, n_threads);
+        return nullptr;
+    }
+
+    wstate.threadpool_params_live = tpp;
+
+    return wstate.threadpool;
+}
+
 // evaluate the encoder with the given state
 //
 // given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
@@ -2305,7 +3252,7 @@ static bool whisper_encode_internal(
         }
 
         if (!whisper_encode_external(wstate)) {
-            if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+            if (!ggml_graph_compute_helper(sched, gf, n_threads, whisper_state_threadpool(wstate, n_threads), wstate.profiler, "conv")) {
                 return false;
             }
         } else {
@@ -2328,7 +3275,7 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, whisper_state_threadpool(wstate, n_threads), wstate.profiler, "encode")) {
             return false;
         }
     }
@@ -2344,7 +3291,7 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, whisper_state_threadpool(wstate, n_threads), wstate.profiler, "cross")) {
             return false;
         }
     }
@@ -2361,7 +3308,7 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
      const whisper_batch & batch,
                     bool   save_alignment_heads_QKs,
                     bool   worst_case) {
-    const auto & model   = wctx.model;
+    const auto & model   = whisper_state_model(wctx, wstate);
     const auto & hparams = model.hparams;
 
     auto & kv_self = wstate.kv_self;
@@ -2471,15 +3418,15 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
                 if (wctx.params.flash_attn) {
                     k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                            ggml_row_size(kv_self.k->type, n_state)*(il*n_ctx + kv_head));
 
                     v = ggml_view_1d(ctx0, kv_self.v, n_tokens*n_state,
-                            (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + kv_head));
+                            ggml_row_size(kv_self.v->type, n_state)*(il*n_ctx + kv_head));
                 } else {
                     Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
 
                     k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                            ggml_row_size(kv_self.k->type, n_state)*(il*n_ctx + kv_head));
 
                     v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
                             (   n_ctx)*ggml_element_size(kv_self.v),
@@ -2500,17 +3447,17 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
             struct ggml_tensor * K =
                 ggml_view_3d(ctx0, kv_self.k,
                         n_state_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+                        ggml_row_size(kv_self.k->type, n_state),
+                        ggml_row_size(kv_self.k->type, n_state_head),
+                        ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
 
             if (wctx.params.flash_attn) {
                 struct ggml_tensor * V =
                     ggml_view_3d(ctx0, kv_self.v,
                             n_state_head, n_kv, n_head,
-                            ggml_element_size(kv_self.v)*n_state,
-                            ggml_element_size(kv_self.v)*n_state_head,
-                            ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+                            ggml_row_size(kv_self.v->type, n_state),
+                            ggml_row_size(kv_self.v->type, n_state_head),
+                            ggml_row_size(kv_self.v->type, n_state)*n_ctx*il);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16, 1.0f, 0.0f, 0.0f);
 
@@ -2581,16 +3528,16 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 struct ggml_tensor * Kcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.k,
                             n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx_pad*il);
 
                 struct ggml_tensor * Vcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.v,
                             n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state,
-                            ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
+                            ggml_row_size(wstate.kv_cross.v->type, n_state),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state)*n_audio_ctx_pad*il);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
 
@@ -2599,9 +3546,9 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 struct ggml_tensor * Kcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.k,
                             n_state_head, n_audio_ctx, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx*il);
 
                 struct ggml_tensor * Vcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.v,
@@ -2755,7 +3702,7 @@ static bool whisper_decode_internal(
                    void * abort_callback_data) {
     const int64_t t_start_us = ggml_time_us();
 
-    const auto & model   = wctx.model;
+    const auto & model   = whisper_state_model(wctx, wstate);
     const auto & hparams = model.hparams;
 
     const int n_vocab  = hparams.n_vocab;
@@ -2841,7 +3788,7 @@ static bool whisper_decode_internal(
 
         logits = ggml_graph_node(gf, -1);
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, whisper_state_threadpool(wstate, n_threads), wstate.profiler, "decode")) {
             return false;
         }
     }
@@ -3274,7 +4221,13 @@ static std::string whisper_openvino_get_path_cache(std::string path_bin) {
 struct whisper_state * whisper_init_state(whisper_context * ctx) {
     whisper_state * state = new whisper_state;
 
-    state->backends = whisper_backend_init(ctx->params);
+    state->threadpool_params = ggml_threadpool_params_default(GGML_DEFAULT_N_THREADS);
+
+    if (!ctx->replicas.empty()) {
+        state->replica = ctx->n_replica_states++ % (int) ctx->replicas.size();
+    }
+
+    state->backends = whisper_backend_init(ctx->params, state->replica >= 0 ? &ctx->replicas[state->replica] : nullptr);
     if (state->backends.empty()) {
         WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
         whisper_free_state(state);
@@ -3284,7 +4237,7 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     // at this point, we don't know yet how many decoders will be used
     // later during decoding, if more decoders are used, we will recreate the KV cache respectively
     state->kv_self_n_dec = 1;
-    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->params.type_k, ctx->params.type_v,
                 ctx->model.hparams.n_text_state,
                 ctx->model.hparams.n_text_layer,
                 GGML_PAD(ctx->model.hparams.n_text_ctx, 256))) {
@@ -3295,10 +4248,10 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
     {
         const size_t memory_size = ggml_nbytes(state->kv_self.k) + ggml_nbytes(state->kv_self.v);
-        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
+        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB (K %s, V %s)\n", __func__, memory_size / 1e6, ggml_type_name(state->kv_self.k->type), ggml_type_name(state->kv_self.v->type));
     }
 
-    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], ctx->itype,
+    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], ctx->params.type_k, ctx->params.type_v,
                 ctx->model.hparams.n_text_state,
                 ctx->model.hparams.n_text_layer,
                 GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
@@ -3309,10 +4262,10 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
     {
         const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
-        WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1e6);
+        WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB (K %s, V %s)\n", __func__, memory_size / 1e6, ggml_type_name(state->kv_cross.k->type), ggml_type_name(state->kv_cross.v->type));
     }
 
-    if (!whisper_kv_cache_init(state->kv_pad, state->backends[0], ctx->itype,
+    if (!whisper_kv_cache_init(state->kv_pad, state->backends[0], ctx->itype, ctx->itype,
                 ctx->model.hparams.n_audio_state,
                 1,
                 GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
@@ -3517,10 +4470,95 @@ struct whisper_context_params whisper_context_default_params() {
             /*.heads            =*/ NULL,
         },
         /*.dtw_mem_size         =*/ 1024*1024*128,
+
+        /*.type_k               =*/ GGML_TYPE_F16,
+        /*.type_v               =*/ GGML_TYPE_F16,
+
+        /*.numa                 =*/ GGML_NUMA_STRATEGY_DISABLED,
+        /*.rpc_servers          =*/ nullptr,
+        /*.dtw_band             =*/ 0,
+        /*.use_extra_bufts      =*/ true,
     };
     return result;
 }
 
+static whisper_context * whisper_init_context(whisper_context_params params) {
+    ggml_time_init();
+
+    if (params.flash_attn && params.dtw_token_timestamps) {
+        WHISPER_LOG_WARN("%s: dtw_token_timestamps is not supported with flash_attn - disabling\n", __func__);
+        params.dtw_token_timestamps = false;
+    }
+
+    WHISPER_LOG_INFO("%s: use gpu    = %d\n", __func__, params.use_gpu);
+    WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
+    WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
+    WHISPER_LOG_INFO("%s: extra bufts = %d\n", __func__, params.use_extra_bufts);
+    WHISPER_LOG_INFO("%s: numa       = %d\n", __func__, params.numa);
+    WHISPER_LOG_INFO("%s: rpc        = %s\n", __func__, params.rpc_servers ? params.rpc_servers : "");
+
+    if (params.numa != GGML_NUMA_STRATEGY_DISABLED) {
+        static std::once_flag numa_once;
+        std::call_once(numa_once, [&]() {
+            ggml_numa_init(params.numa);
+        });
+
+        if (!ggml_is_numa()) {
+            WHISPER_LOG_INFO("%s: the system has a single NUMA node\n", __func__);
+        }
+    }
+    WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
+    WHISPER_LOG_INFO("%s: type_k     = %s\n", __func__, ggml_type_name(params.type_k));
+    WHISPER_LOG_INFO("%s: type_v     = %s\n", __func__, ggml_type_name(params.type_v));
+    WHISPER_LOG_INFO("%s: devices    = %zu\n", __func__, ggml_backend_dev_count());
+    WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, ggml_backend_reg_count());
+
+    whisper_context * ctx = new whisper_context;
+    ctx->params = params;
+
+    return ctx;
+}
+
+// adjust the context params to the loaded model
+// returns false for params that cannot be used with the model
+static bool whisper_init_validate(whisper_context & wctx) {
+    auto & cparams = wctx.params;
+
+    // the band is counted in audio frames - larger values than the audio context are meaningless
+    if (cparams.dtw_band < 0 || cparams.dtw_band > wctx.model.hparams.n_audio_ctx) {
+        WHISPER_LOG_ERROR("%s: invalid dtw_band = %d, must be in [0, %d]\n", __func__, cparams.dtw_band, wctx.model.hparams.n_audio_ctx);
+        return false;
+    }
+
+    // validate the KV cache types against the model
+    {
+        const int n_state_head = wctx.model.hparams.n_text_state/wctx.model.hparams.n_text_head;
+
+        if (ggml_is_quantized(cparams.type_v) && !cparams.flash_attn) {
+            WHISPER_LOG_WARN("%s: quantized V cache requires flash_attn - using %s\n", __func__, ggml_type_name(wctx.itype));
+            cparams.type_v = wctx.itype;
+        }
+
+        if (n_state_head % ggml_blck_size(cparams.type_k) != 0) {
+            WHISPER_LOG_WARN("%s: K cache type %s is incompatible with head size %d - using %s\n", __func__, ggml_type_name(cparams.type_k), n_state_head, ggml_type_name(wctx.itype));
+            cparams.type_k = wctx.itype;
+        }
+
+        if (n_state_head % ggml_blck_size(cparams.type_v) != 0) {
+            WHISPER_LOG_WARN("%s: V cache type %s is incompatible with head size %d - using %s\n", __func__, ggml_type_name(cparams.type_v), n_state_head, ggml_type_name(wctx.itype));
+            cparams.type_v = wctx.itype;
+        }
+    }
+
+    // use the alignment heads from the model file if no preset was selected
+    if (cparams.dtw_token_timestamps && cparams.dtw_aheads_preset == WHISPER_AHEADS_NONE && !wctx.model.aheads.empty()) {
+        cparams.dtw_aheads_preset = WHISPER_AHEADS_CUSTOM;
+        cparams.dtw_aheads        = { wctx.model.aheads.size(), wctx.model.aheads.data() };
+    }
+
+    return true;
+}
+
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
 #ifdef _MSC_VER
@@ -3536,6 +4574,35 @@ struct whisper_context * whisper_init_from_file_with_params_no_state(const char
         return nullptr;
     }
 
+    // GGUF models are read directly from the file
+    {
+        uint32_t magic = 0;
+        fin.read((char *) &magic, sizeof(magic));
+        fin.clear();
+        fin.seekg(0);
+
+        if (magic == WHISPER_GGUF_MAGIC) {
+            fin.close();
+
+            whisper_context * ctx = whisper_init_context(params);
+
+            if (!whisper_model_load_gguf(path_model, *ctx)) {
+                WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
+                delete ctx;
+                return nullptr;
+            }
+
+            if (!whisper_init_validate(*ctx)) {
+                whisper_free(ctx);
+                return nullptr;
+            }
+
+            ctx->path_model = path_model;
+
+            return ctx;
+        }
+    }
+
     whisper_model_loader loader = {};
 
     loader.context = &fin;
@@ -3603,22 +4670,7 @@ struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * bu
 }
 
 struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
-    ggml_time_init();
-
-    if (params.flash_attn && params.dtw_token_timestamps) {
-        WHISPER_LOG_WARN("%s: dtw_token_timestamps is not supported with flash_attn - disabling\n", __func__);
-        params.dtw_token_timestamps = false;
-    }
-
-    WHISPER_LOG_INFO("%s: use gpu    = %d\n", __func__, params.use_gpu);
-    WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
-    WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
-    WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
-    WHISPER_LOG_INFO("%s: devices    = %zu\n", __func__, ggml_backend_dev_count());
-    WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, ggml_backend_reg_count());
-
-    whisper_context * ctx = new whisper_context;
-    ctx->params = params;
+    whisper_context * ctx = whisper_init_context(params);
 
     if (!whisper_model_load(loader, *ctx)) {
         loader->close(loader->context);
@@ -3629,6 +4681,11 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
 
     loader->close(loader->context);
 
+    if (!whisper_init_validate(*ctx)) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
     return ctx;
 }
 
@@ -3732,6 +4789,10 @@ void whisper_free_state(struct whisper_state * state) {
             ggml_backend_free(backend);
         }
 
+        if (state->threadpool) {
+            ggml_threadpool_free(state->threadpool);
+        }
+
         // [EXPERIMENTAL] Token-level timestamps with DTW
         aheads_masks_free(state->aheads_masks);
 
@@ -3743,7 +4804,17 @@ void whisper_free(struct whisper_context * ctx) {
     if (ctx) {
         ggml_free(ctx->model.ctx);
 
-        ggml_backend_buffer_free(ctx->model.buffer);
+        for (auto * buffer : ctx->model.buffers) {
+            ggml_backend_buffer_free(buffer);
+        }
+
+        for (auto & replica : ctx->replicas) {
+            ggml_free(replica.model.ctx);
+
+            for (auto * buffer : replica.model.buffers) {
+                ggml_backend_buffer_free(buffer);
+            }
+        }
 
         whisper_free_state(ctx->state);
 
@@ -3992,54 +5063,198 @@ int whisper_lang_auto_detect(
     return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
 }
 
-int whisper_model_n_vocab(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_vocab;
-}
+int whisper_model_n_vocab(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_vocab;
+}
+
+int whisper_model_n_audio_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_ctx;
+}
+
+int whisper_model_n_audio_state(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_state;
+}
+
+int whisper_model_n_audio_head(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_head;
+}
+
+int whisper_model_n_audio_layer(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_layer;
+}
+
+int whisper_model_n_text_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_ctx;
+}
+
+int whisper_model_n_text_state(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_state;
+}
+
+int whisper_model_n_text_head(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_head;
+}
+
+int whisper_model_n_text_layer(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_layer;
+}
+
+int whisper_model_n_mels(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_mels;
+}
+
+int whisper_model_ftype(struct whisper_context * ctx) {
+    return ctx->model.hparams.ftype;
+}
+
+// guess the alignment heads preset from the hparams (large v1 and v2 cannot be distinguished)
+static whisper_alignment_heads_preset whisper_aheads_preset_from_hparams(const whisper_hparams & hparams) {
+    const bool en = hparams.n_vocab < 51865;
+
+    switch (hparams.n_audio_layer) {
+        case  4: return en ? WHISPER_AHEADS_TINY_EN   : WHISPER_AHEADS_TINY;
+        case  6: return en ? WHISPER_AHEADS_BASE_EN   : WHISPER_AHEADS_BASE;
+        case 12: return en ? WHISPER_AHEADS_SMALL_EN  : WHISPER_AHEADS_SMALL;
+        case 24: return en ? WHISPER_AHEADS_MEDIUM_EN : WHISPER_AHEADS_MEDIUM;
+        case 32:
+            if (hparams.n_text_layer == 4) {
+                return WHISPER_AHEADS_LARGE_V3_TURBO;
+            }
+            if (hparams.n_vocab == 51866) {
+                return WHISPER_AHEADS_LARGE_V3;
+            }
+            break;
+    }
+
+    return WHISPER_AHEADS_NONE;
+}
+
+int whisper_model_save_gguf(struct whisper_context * ctx, const char * fname) {
+    const auto & model   = ctx->model;
+    const auto & hparams = model.hparams;
+    const auto & vocab   = ctx->vocab;
+    const auto & cparams = ctx->params;
+
+    if (model.n_extra > 0) {
+        WHISPER_LOG_ERROR("%s: %d weights are repacked - load the model with use_extra_bufts = false to save it\n", __func__, model.n_extra);
+        return -1;
+    }
+
+    gguf_context * ctx_gguf = gguf_init_empty();
+
+    gguf_set_val_str(ctx_gguf, "general.architecture",         "whisper");
+    gguf_set_val_str(ctx_gguf, "general.name",                 whisper_model_type_readable(ctx));
+    gguf_set_val_u32(ctx_gguf, "general.file_type",            hparams.ftype);
+    gguf_set_val_u32(ctx_gguf, "general.quantization_version", GGML_QNT_VERSION);
+
+    gguf_set_val_u32(ctx_gguf, "whisper.vocab_size",                 hparams.n_vocab);
+    gguf_set_val_u32(ctx_gguf, "whisper.audio.context_length",       hparams.n_audio_ctx);
+    gguf_set_val_u32(ctx_gguf, "whisper.audio.embedding_length",     hparams.n_audio_state);
+    gguf_set_val_u32(ctx_gguf, "whisper.audio.attention.head_count", hparams.n_audio_head);
+    gguf_set_val_u32(ctx_gguf, "whisper.audio.block_count",          hparams.n_audio_layer);
+    gguf_set_val_u32(ctx_gguf, "whisper.text.context_length",        hparams.n_text_ctx);
+    gguf_set_val_u32(ctx_gguf, "whisper.text.embedding_length",      hparams.n_text_state);
+    gguf_set_val_u32(ctx_gguf, "whisper.text.attention.head_count",  hparams.n_text_head);
+    gguf_set_val_u32(ctx_gguf, "whisper.text.block_count",           hparams.n_text_layer);
+    gguf_set_val_u32(ctx_gguf, "whisper.n_mels",                     hparams.n_mels);
+
+    gguf_set_val_u32 (ctx_gguf, "whisper.mel_filters.n_mel", model.filters.n_mel);
+    gguf_set_val_u32 (ctx_gguf, "whisper.mel_filters.n_fft", model.filters.n_fft);
+    gguf_set_arr_data(ctx_gguf, "whisper.mel_filters", GGUF_TYPE_FLOAT32, model.filters.data.data(), model.filters.data.size());
+
+    // tokens are stored as bytes with explicit lengths - GGUF strings are set as C strings, which would
+    // truncate the byte token 0x00
+    {
+        std::vector<uint8_t>  bytes;
+        std::vector<uint32_t> lengths(vocab.n_vocab);
+        for (int i = 0; i < vocab.n_vocab; ++i) {
+            const std::string & word = vocab.id_to_token.at(i);
+
+            bytes.insert(bytes.end(), word.begin(), word.end());
+            lengths[i] = word.size();
+        }
+
+        gguf_set_arr_data(ctx_gguf, "whisper.vocab.bytes",   GGUF_TYPE_UINT8,  bytes.data(),   bytes.size());
+        gguf_set_arr_data(ctx_gguf, "whisper.vocab.lengths", GGUF_TYPE_UINT32, lengths.data(), lengths.size());
+    }
+
+    // alignment heads
+    {
+        std::vector<int32_t> aheads;
+
+        whisper_alignment_heads_preset preset = cparams.dtw_aheads_preset;
+        if (preset == WHISPER_AHEADS_NONE && model.aheads.empty()) {
+            preset = whisper_aheads_preset_from_hparams(hparams);
+        }
+
+        if (preset == WHISPER_AHEADS_NONE || (preset == WHISPER_AHEADS_CUSTOM && cparams.dtw_aheads.heads == model.aheads.data())) {
+            for (const auto & head : model.aheads) {
+                aheads.push_back(head.n_text_layer);
+                aheads.push_back(head.n_head);
+            }
+        } else if (preset != WHISPER_AHEADS_N_TOP_MOST) {
+            const auto heads = preset == WHISPER_AHEADS_CUSTOM ? cparams.dtw_aheads : g_aheads.at(preset);
+            for (size_t i = 0; i < heads.n_heads; ++i) {
+                aheads.push_back(heads.heads[i].n_text_layer);
+                aheads.push_back(heads.heads[i].n_head);
+            }
+        }
+
+        if (!aheads.empty()) {
+            gguf_set_arr_data(ctx_gguf, "whisper.alignment_heads", GGUF_TYPE_INT32, aheads.data(), aheads.size());
+        }
+    }
+
+    // the tensor data is read when writing the file - the weights in device buffers are copied to host memory first
+    // empty models for testing are saved without tensors
+    std::vector<std::vector<uint8_t>> staging;
 
-int whisper_model_n_audio_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_ctx;
-}
+    for (const auto & kv : model.tensors) {
+        if (model.n_loaded == 0) {
+            break;
+        }
 
-int whisper_model_n_audio_state(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_state;
-}
+        ggml_tensor tensor = *kv.second;
+        ggml_set_name(&tensor, kv.first.c_str());
 
-int whisper_model_n_audio_head(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_head;
-}
+        if (tensor.buffer && !ggml_backend_buffer_is_host(tensor.buffer)) {
+            staging.emplace_back(ggml_nbytes(kv.second));
+            ggml_backend_tensor_get(kv.second, staging.back().data(), 0, staging.back().size());
 
-int whisper_model_n_audio_layer(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_layer;
-}
+            tensor.data = staging.back().data();
+        }
 
-int whisper_model_n_text_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_ctx;
-}
+        gguf_add_tensor(ctx_gguf, &tensor);
+    }
 
-int whisper_model_n_text_state(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_state;
-}
+    const bool    ok        = gguf_write_to_file(ctx_gguf, fname, false);
+    const int64_t n_tensors = gguf_get_n_tensors(ctx_gguf);
 
-int whisper_model_n_text_head(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_head;
-}
+    gguf_free(ctx_gguf);
 
-int whisper_model_n_text_layer(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_layer;
-}
+    if (!ok) {
+        WHISPER_LOG_ERROR("%s: failed to write '%s'\n", __func__, fname);
+        return -1;
+    }
 
-int whisper_model_n_mels(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_mels;
-}
+    WHISPER_LOG_INFO("%s: saved %d tensors to '%s'\n", __func__, (int) n_tensors, fname);
 
-int whisper_model_ftype(struct whisper_context * ctx) {
-    return ctx->model.hparams.ftype;
+    return 0;
 }
 
 int whisper_model_type(struct whisper_context * ctx) {
     return ctx->model.type;
 }
 
+size_t whisper_model_size(struct whisper_context * ctx) {
+    size_t size = 0;
+    for (auto & buf : ctx->model.buffers) {
+        size += ggml_backend_buffer_get_size(buf);
+    }
+
+    return size;
+}
+
 const char *whisper_model_type_readable(struct whisper_context * ctx) {
     switch (ctx->model.type) {
     case e_model::MODEL_TINY:
@@ -4187,6 +5402,204 @@ void whisper_reset_timings(struct whisper_context * ctx) {
     }
 }
 
+struct whisper_stats whisper_get_stats_from_state(struct whisper_state * state) {
+    whisper_stats stats = {};
+
+    stats.t_mel_us    = state->t_mel_us;
+    stats.t_sample_us = state->t_sample_us;
+    stats.t_encode_us = state->t_encode_us;
+    stats.t_decode_us = state->t_decode_us;
+    stats.t_batchd_us = state->t_batchd_us;
+    stats.t_prompt_us = state->t_prompt_us;
+
+    stats.n_sample = state->n_sample;
+    stats.n_encode = state->n_encode;
+    stats.n_decode = state->n_decode;
+    stats.n_batchd = state->n_batchd;
+    stats.n_prompt = state->n_prompt;
+    stats.n_fail_p = state->n_fail_p;
+    stats.n_fail_h = state->n_fail_h;
+
+    for (const whisper_kv_cache * kv : { &state->kv_self, &state->kv_cross, &state->kv_pad }) {
+        if (kv->buffer) {
+            stats.mem_kv += ggml_nbytes(kv->k) + ggml_nbytes(kv->v);
+        }
+    }
+
+    for (whisper_sched * sched : { &state->sched_conv, &state->sched_encode, &state->sched_cross, &state->sched_decode }) {
+        if (sched->sched) {
+            stats.mem_compute += whisper_sched_size(*sched);
+        }
+    }
+
+    return stats;
+}
+
+struct whisper_stats whisper_get_stats(struct whisper_context * ctx) {
+    if (ctx->state == nullptr) {
+        return whisper_stats {};
+    }
+
+    return whisper_get_stats_from_state(ctx->state);
+}
+
+void whisper_profile_enable_with_state(struct whisper_context * ctx, struct whisper_state * state, bool enable) {
+    auto & prof = state->profiler;
+
+    prof.enabled = enable;
+
+    if (enable && prof.layers.empty()) {
+        // weights outside of the blocks (conv, ln_post, token embedding, ...) map to layer -1
+        for (const auto & kv : whisper_state_model(*ctx, *state).tensors) {
+            int il = -1;
+            if (sscanf(kv.first.c_str(), "encoder.blocks.%d.", &il) != 1 &&
+                sscanf(kv.first.c_str(), "decoder.blocks.%d.", &il) != 1) {
+                il = -1;
+            }
+            prof.layers[kv.second] = il;
+        }
+    }
+}
+
+void whisper_profile_enable(struct whisper_context * ctx, bool enable) {
+    if (ctx->state != nullptr) {
+        whisper_profile_enable_with_state(ctx, ctx->state, enable);
+    }
+}
+
+void whisper_profile_reset_with_state(struct whisper_state * state) {
+    state->profiler.events.clear();
+}
+
+void whisper_profile_reset(struct whisper_context * ctx) {
+    if (ctx->state != nullptr) {
+        whisper_profile_reset_with_state(ctx->state);
+    }
+}
+
+void whisper_profile_print_with_state(struct whisper_state * state) {
+    const auto & events = state->profiler.events;
+
+    struct stats {
+        int64_t t_us = 0;
+        int     n    = 0;
+    };
+
+    // aggregate per graph and op, and per graph and layer
+    std::map<std::string, int64_t> t_graph;
+    std::map<std::pair<std::string, std::string>, stats> per_op;
+    std::map<std::pair<std::string, int>,         stats> per_layer;
+
+    for (const auto & e : events) {
+        const int64_t dt = e.t_end_us - e.t_start_us;
+
+        t_graph[e.graph] += dt;
+
+        auto & so = per_op[{ e.graph, e.op }];
+        so.t_us += dt;
+        so.n++;
+
+        auto & sl = per_layer[{ e.graph, e.layer }];
+        sl.t_us += dt;
+        sl.n++;
+    }
+
+    WHISPER_LOG_INFO("\n");
+    WHISPER_LOG_INFO("%s: %zu ops profiled\n", __func__, events.size());
+
+    for (const char * name : { "conv", "encode", "cross", "decode" }) {
+        const auto g = t_graph.find(name);
+        if (g == t_graph.end()) {
+            continue;
+        }
+
+        std::vector<std::pair<std::string, stats>> ops;
+        for (const auto & kv : per_op) {
+            if (kv.first.first == g->first) {
+                ops.emplace_back(kv.first.second, kv.second);
+            }
+        }
+
+        std::sort(ops.begin(), ops.end(), [](const std::pair<std::string, stats> & a, const std::pair<std::string, stats> & b) {
+            return a.second.t_us > b.second.t_us;
+        });
+
+        WHISPER_LOG_INFO("\n");
+        WHISPER_LOG_INFO("%s: %-8s total = %10.2f ms\n", __func__, g->first.c_str(), g->second/1000.0);
+
+        for (const auto & op : ops) {
+            WHISPER_LOG_INFO("%s:   %-16s %8d calls %10.2f ms %8.2f us/call %6.2f %%\n", __func__,
+                    op.first.c_str(), op.second.n, op.second.t_us/1000.0, (double) op.second.t_us/op.second.n,
+                    100.0*op.second.t_us/std::max<int64_t>(1, g->second));
+        }
+
+        for (const auto & kv : per_layer) {
+            if (kv.first.first != g->first) {
+                continue;
+            }
+
+            if (kv.first.second < 0) {
+                WHISPER_LOG_INFO("%s:   layer  -  %8d ops   %10.2f ms\n", __func__, kv.second.n, kv.second.t_us/1000.0);
+            } else {
+                WHISPER_LOG_INFO("%s:   layer %2d  %8d ops   %10.2f ms\n", __func__, kv.first.second, kv.second.n, kv.second.t_us/1000.0);
+            }
+        }
+    }
+}
+
+void whisper_profile_print(struct whisper_context * ctx) {
+    if (ctx->state != nullptr) {
+        whisper_profile_print_with_state(ctx->state);
+    }
+}
+
+int whisper_profile_dump_trace_with_state(struct whisper_state * state, const char * fname) {
+    std::ofstream fout(fname);
+    if (!fout) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s' for writing\n", __func__, fname);
+        return -1;
+    }
+
+    const auto & events = state->profiler.events;
+
+    const int64_t t0_us = events.empty() ? 0 : events.front().t_start_us;
+
+    // one trace row per graph
+    const auto tid = [](const char * graph) {
+        static const char * names[] = { "conv", "encode", "cross", "decode" };
+        for (int i = 0; i < 4; ++i) {
+            if (strcmp(graph, names[i]) == 0) {
+                return i;
+            }
+        }
+        return 4;
+    };
+
+    fout << "{\"traceEvents\": [\n";
+    for (size_t i = 0; i < events.size(); ++i) {
+        const auto & e = events[i];
+
+        fout << "  {\"name\": \"" << e.op << "\", \"cat\": \"" << e.graph << "\", \"ph\": \"X\""
+             << ", \"ts\": " << (e.t_start_us - t0_us) << ", \"dur\": " << (e.t_end_us - e.t_start_us)
+             << ", \"pid\": 0, \"tid\": " << tid(e.graph)
+             << ", \"args\": {\"layer\": " << e.layer << "}}"
+             << (i + 1 < events.size() ? ",\n" : "\n");
+    }
+    fout << "]}\n";
+
+    WHISPER_LOG_INFO("%s: wrote %zu events to '%s'\n", __func__, events.size(), fname);
+
+    return 0;
+}
+
+int whisper_profile_dump_trace(struct whisper_context * ctx, const char * fname) {
+    if (ctx->state == nullptr) {
+        return -1;
+    }
+
+    return whisper_profile_dump_trace_with_state(ctx->state, fname);
+}
+
 static int whisper_has_coreml(void) {
 #ifdef WHISPER_USE_COREML
     return 1;
@@ -4495,102 +5908,307 @@ static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates_
         } else {
             rejects.push_back(tok);
         }
-    }
+    }
+
+    const auto * stack_pos_after = whisper_grammar_match_char(stack_pos, 0).second;
+
+    // update top of stack to next element, if any
+    std::vector<const whisper_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
+    if (!whisper_grammar_is_end_of_sequence(stack_pos_after)) {
+        stack_after.push_back(stack_pos_after);
+    }
+    std::vector<std::vector<const whisper_grammar_element *>> next_stacks;
+    whisper_grammar_advance_stack(rules, stack_after, next_stacks);
+
+    auto next_rejects = whisper_grammar_reject_candidates(rules, next_stacks, next_candidates);
+    for (auto tok : next_rejects) {
+        rejects.push_back({ tok.id, tok.code_points - 1, tok.partial_utf8 });
+    }
+
+    return rejects;
+}
+
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const std::vector<whisper_grammar_candidate>                    & candidates) {
+    if (candidates.empty() || stacks.empty()) {
+        return std::vector<whisper_grammar_candidate>();
+    }
+
+    auto rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+
+    for (size_t i = 1, size = stacks.size(); i < size; ++i) {
+        rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
+    }
+    return rejects;
+}
+
+static whisper_grammar_rules whisper_grammar_rules_init(
+            const whisper_grammar_element ** rules,
+                                 size_t      n_rules) {
+    // copy rule definitions into vectors
+    whisper_grammar_rules vec_rules(n_rules);
+    for (size_t i = 0; i < n_rules; i++) {
+        for (const whisper_grammar_element * pos = rules[i]; pos->type != WHISPER_GRETYPE_END; pos++) {
+            vec_rules[i].push_back(*pos);
+        }
+        vec_rules[i].push_back({WHISPER_GRETYPE_END, 0});
+    }
+
+    return vec_rules;
+}
+
+static bool whisper_grammar_rules_equal(const whisper_grammar_rules & a, const whisper_grammar_rules & b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].size() != b[i].size()) {
+            return false;
+        }
+        for (size_t j = 0; j < a[i].size(); j++) {
+            if (a[i][j].type != b[i][j].type || a[i][j].value != b[i][j].value) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// all stacks point into the shared rules, so that parse states can be used as keys of the token mask cache
+static struct whisper_grammar whisper_grammar_init(
+    const std::shared_ptr<const whisper_grammar_rules> & rules,
+    const std::shared_ptr<whisper_grammar_cache>       & cache,
+                                              size_t     i_start_rule) {
+    const auto & vec_rules = *rules;
+
+    // loop over alternates of start rule to build initial stacks
+    std::vector<std::vector<const whisper_grammar_element *>> stacks;
+    const whisper_grammar_element * pos = vec_rules[i_start_rule].data();
+    do {
+        std::vector<const whisper_grammar_element *> stack;
+        if (!whisper_grammar_is_end_of_sequence(pos)) {
+            // if alternate is nonempty, add to stack
+            stack.push_back(pos);
+        }
+        whisper_grammar_advance_stack(vec_rules, stack, stacks);
+        while (!whisper_grammar_is_end_of_sequence(pos)) {
+            // scan to end of alternate def
+            pos++;
+        }
+        if (pos->type == WHISPER_GRETYPE_ALT) {
+            // there's another alternate def of this rule to process
+            pos++;
+        } else {
+            break;
+        }
+    } while (true);
+
+    return {
+        rules,
+        std::make_shared<const whisper_grammar_stacks>(std::move(stacks)),
+        cache,
+        {},
+    };
+}
+
+static const whisper_grammar_vocab & whisper_grammar_vocab_get(whisper_context & ctx) {
+    std::call_once(ctx.grammar_vocab_once, [&ctx]() {
+        auto & gvocab = ctx.grammar_vocab;
+
+        const whisper_token eot = whisper_token_eot(&ctx);
+
+        // build the tree with maps, then flatten it - node indices are preserved
+        struct trie_node {
+            std::map<uint32_t, int32_t> children;
+            std::vector<std::pair<whisper_token, whisper_partial_utf8>> tokens;
+        };
+
+        std::vector<trie_node> trie(1);
+
+        gvocab.candidates.assign((eot + 63)/64, 0);
+
+        for (whisper_token id = 0; id < eot; ++id) {
+            const std::string & text = ctx.vocab.id_to_token[id];
+            if (text.empty()) {
+                continue;
+            }
+
+            gvocab.candidates[id/64] |= uint64_t(1) << (id%64);
+
+            // note terminating 0 in decoded string
+            const auto decoded = decode_utf8(text.c_str(), { 0, 0 });
+
+            int32_t cur = 0;
+            for (size_t i = 0; i + 1 < decoded.first.size(); ++i) {
+                const auto it = trie[cur].children.find(decoded.first[i]);
+                if (it != trie[cur].children.end()) {
+                    cur = it->second;
+                } else {
+                    trie[cur].children[decoded.first[i]] = (int32_t) trie.size();
+                    cur = (int32_t) trie.size();
+                    trie.emplace_back();
+                }
+            }
+            trie[cur].tokens.push_back({ id, decoded.second });
+        }
+
+        gvocab.nodes.resize(trie.size());
+        for (size_t i = 0; i < trie.size(); ++i) {
+            auto & node = gvocab.nodes[i];
+
+            node.edge_begin = (int32_t) gvocab.edges.size();
+            gvocab.edges.insert(gvocab.edges.end(), trie[i].children.begin(), trie[i].children.end());
+            node.edge_end = (int32_t) gvocab.edges.size();
+
+            node.token_begin = (int32_t) gvocab.tokens.size();
+            gvocab.tokens.insert(gvocab.tokens.end(), trie[i].tokens.begin(), trie[i].tokens.end());
+            node.token_end = (int32_t) gvocab.tokens.size();
+        }
+
+        WHISPER_LOG_DEBUG("%s: %zu tokens, %zu nodes\n", __func__, gvocab.tokens.size(), gvocab.nodes.size());
+    });
+
+    return ctx.grammar_vocab;
+}
+
+// marks the tokens accepted by a single stack, starting at the given node of the vocab tree
+// equivalent to whisper_grammar_reject_candidates_for_stack() for all tokens below the node
+static void whisper_grammar_accept_trie(
+              const whisper_grammar_rules                  & rules,
+              const whisper_grammar_vocab                  & gvocab,
+        const std::vector<const whisper_grammar_element *> & stack,
+                                                  int32_t    i_node,
+                                    std::vector<uint64_t>  & accepted) {
+    const auto & node = gvocab.nodes[i_node];
+
+    if (stack.empty()) {
+        // the grammar is complete - only tokens that end here without a partial sequence are accepted
+        for (int32_t i = node.token_begin; i < node.token_end; ++i) {
+            const auto & tok = gvocab.tokens[i];
+            if (tok.second.n_remain == 0) {
+                accepted[tok.first/64] |= uint64_t(1) << (tok.first%64);
+            }
+        }
+        return;
+    }
+
+    const whisper_grammar_element * stack_pos = stack.back();
+
+    for (int32_t i = node.token_begin; i < node.token_end; ++i) {
+        const auto & tok = gvocab.tokens[i];
+        if (tok.second.n_remain == 0 || whisper_grammar_match_partial_char(stack_pos, tok.second)) {
+            accepted[tok.first/64] |= uint64_t(1) << (tok.first%64);
+        }
+    }
+
+    // the stacks after this position are the same for any matching code point
+    bool computed = false;
+    std::vector<std::vector<const whisper_grammar_element *>> next_stacks;
+
+    for (int32_t i = node.edge_begin; i < node.edge_end; ++i) {
+        const auto & edge = gvocab.edges[i];
+
+        if (!whisper_grammar_match_char(stack_pos, edge.first).first) {
+            continue;
+        }
 
-    const auto * stack_pos_after = whisper_grammar_match_char(stack_pos, 0).second;
+        if (!computed) {
+            const auto * stack_pos_after = whisper_grammar_match_char(stack_pos, 0).second;
 
-    // update top of stack to next element, if any
-    std::vector<const whisper_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
-    if (!whisper_grammar_is_end_of_sequence(stack_pos_after)) {
-        stack_after.push_back(stack_pos_after);
-    }
-    std::vector<std::vector<const whisper_grammar_element *>> next_stacks;
-    whisper_grammar_advance_stack(rules, stack_after, next_stacks);
+            std::vector<const whisper_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
+            if (!whisper_grammar_is_end_of_sequence(stack_pos_after)) {
+                stack_after.push_back(stack_pos_after);
+            }
+            whisper_grammar_advance_stack(rules, stack_after, next_stacks);
 
-    auto next_rejects = whisper_grammar_reject_candidates(rules, next_stacks, next_candidates);
-    for (auto tok : next_rejects) {
-        rejects.push_back({ tok.id, tok.code_points - 1, tok.partial_utf8 });
-    }
+            computed = true;
+        }
 
-    return rejects;
+        for (const auto & next_stack : next_stacks) {
+            whisper_grammar_accept_trie(rules, gvocab, next_stack, edge.second, accepted);
+        }
+    }
 }
 
-static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
-        const std::vector<std::vector<whisper_grammar_element>>         & rules,
-        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
-        const std::vector<whisper_grammar_candidate>                    & candidates) {
-    if (candidates.empty() || stacks.empty()) {
-        return std::vector<whisper_grammar_candidate>();
+static std::shared_ptr<const std::vector<uint64_t>> whisper_grammar_rejects(
+           whisper_context & ctx,
+     const whisper_grammar & grammar) {
+    std::vector<const whisper_grammar_element *> key;
+    for (const auto & stack : *grammar.stacks) {
+        key.insert(key.end(), stack.begin(), stack.end());
+        key.push_back(nullptr);
     }
 
-    auto rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+    {
+        std::lock_guard<std::mutex> lock(grammar.cache->mutex);
 
-    for (size_t i = 1, size = stacks.size(); i < size; ++i) {
-        rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
+        const auto it = grammar.cache->rejects.find(key);
+        if (it != grammar.cache->rejects.end()) {
+            return it->second;
+        }
     }
-    return rejects;
-}
 
-static struct whisper_grammar whisper_grammar_init(
-            const whisper_grammar_element ** rules,
-                                 size_t      n_rules,
-                                 size_t      i_start_rule) {
-    const whisper_grammar_element * pos;
+    const auto & gvocab = whisper_grammar_vocab_get(ctx);
 
-    // copy rule definitions into vectors
-    std::vector<std::vector<whisper_grammar_element>> vec_rules(n_rules);
-    for (size_t i = 0; i < n_rules; i++) {
-        for (pos = rules[i]; pos->type != WHISPER_GRETYPE_END; pos++) {
-            vec_rules[i].push_back(*pos);
-        }
-        vec_rules[i].push_back({WHISPER_GRETYPE_END, 0});
+    std::vector<uint64_t> accepted(gvocab.candidates.size(), 0);
+    for (const auto & stack : *grammar.stacks) {
+        whisper_grammar_accept_trie(*grammar.rules, gvocab, stack, 0, accepted);
     }
 
-    // loop over alternates of start rule to build initial stacks
-    std::vector<std::vector<const whisper_grammar_element *>> stacks;
-    pos = rules[i_start_rule];
-    do {
-        std::vector<const whisper_grammar_element *> stack;
-        if (!whisper_grammar_is_end_of_sequence(pos)) {
-            // if alternate is nonempty, add to stack
-            stack.push_back(pos);
-        }
-        whisper_grammar_advance_stack(vec_rules, stack, stacks);
-        while (!whisper_grammar_is_end_of_sequence(pos)) {
-            // scan to end of alternate def
-            pos++;
-        }
-        if (pos->type == WHISPER_GRETYPE_ALT) {
-            // there's another alternate def of this rule to process
-            pos++;
-        } else {
-            break;
+    auto rejects = std::make_shared<std::vector<uint64_t>>(gvocab.candidates.size());
+    for (size_t i = 0; i < accepted.size(); ++i) {
+        (*rejects)[i] = gvocab.candidates[i] & ~accepted[i];
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(grammar.cache->mutex);
+
+        // each entry is n_vocab bits - bound the memory used by grammars with many parse states
+        if (grammar.cache->rejects.size() >= 1024) {
+            grammar.cache->rejects.clear();
         }
-    } while (true);
+        grammar.cache->rejects[std::move(key)] = rejects;
+    }
 
-    return { std::move(vec_rules), std::move(stacks), {} };
+    return rejects;
 }
 
+
 static void whisper_suppress_invalid_grammar(
              whisper_context  & ctx,
     const whisper_full_params & params,
            std::vector<float> & logits,
     const     whisper_grammar & grammar) {
 
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
+    if (!grammar.rules || grammar.stacks->empty()) {
+        return;
+    }
+
+    const whisper_token eot = whisper_token_eot(&ctx);
+
+    // the token masks are precomputed for parse states at a code point boundary
+    if (grammar.cache && grammar.partial_utf8.n_remain == 0) {
+        const auto rejects = whisper_grammar_rejects(ctx, grammar);
+
+        for (whisper_token id = 0; id < eot; ++id) {
+            if (((*rejects)[id/64] >> (id%64)) & 1) {
+                logits[id] -= params.grammar_penalty;
+            }
+        }
+
         return;
     }
 
     //bool allow_eot = false;
-    //for (const auto & stack : grammar.stacks) {
+    //for (const auto & stack : *grammar.stacks) {
     //    if (stack.empty()) {
     //        allow_eot = true;
     //        break;
     //    }
     //}
 
-    const whisper_token eot = whisper_token_eot(&ctx);
-
     std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
     std::vector<whisper_grammar_candidate>                              candidates_grammar;
 
@@ -4602,7 +6220,7 @@ static void whisper_suppress_invalid_grammar(
         }
     }
 
-    const auto rejects = whisper_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    const auto rejects = whisper_grammar_reject_candidates(*grammar.rules, *grammar.stacks, candidates_grammar);
 
     for (const auto & reject : rejects) {
         logits[reject.id] -= params.grammar_penalty;
@@ -4616,7 +6234,7 @@ static void whisper_suppress_invalid_grammar(
 }
 
 static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
+    if (!grammar.rules || grammar.stacks->empty()) {
         return;
     }
 
@@ -4633,8 +6251,12 @@ static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar
     // Note terminating 0 in decoded string
     const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
     const auto & code_points = decoded.first;
-    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        grammar.stacks = whisper_grammar_accept(grammar.rules, grammar.stacks, *it);
+    if (code_points.size() > 1) {
+        auto stacks = whisper_grammar_accept(*grammar.rules, *grammar.stacks, code_points[0]);
+        for (auto it = code_points.begin() + 1, end = code_points.end() - 1; it != end; ++it) {
+            stacks = whisper_grammar_accept(*grammar.rules, stacks, *it);
+        }
+        grammar.stacks = std::make_shared<const whisper_grammar_stacks>(std::move(stacks));
     }
     grammar.partial_utf8 = decoded.second;
 }
@@ -4741,6 +6363,8 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.n_grammar_rules =*/ 0,
         /*.i_start_rule    =*/ 0,
         /*.grammar_penalty =*/ 100.0f,
+
+        /*.threadpool_params =*/ nullptr,
     };
 
     switch (strategy) {
@@ -4851,38 +6475,326 @@ static const std::vector<std::string> non_speech_tokens = {
     "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
 };
 
-static void whisper_compute_logprobs(
-                const std::vector<float> & logits,
-                              const int    n_logits,
-                      std::vector<float> & logprobs) {
-    const float logit_max = *std::max_element(logits.begin(), logits.end());
-    float logsumexp = 0.0f;
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logsumexp += expf(logits[i] - logit_max);
-        }
+//
+// sampling kernels
+//
+// the logits are processed over the full vocabulary on every step of every decoder, so these
+// are vectorized - on x86 the AVX2/AVX-512 variants are selected at runtime, because the
+// library itself is not built with -march flags
+//
+// exp(x) is computed as 2^n * p(r) with x = n*ln(2) + r and |r| <= ln(2)/2 (Cephes expf)
+// inputs below -87.3 (including -inf) produce 0
+//
+
+#if defined(WHISPER_VEC_X86)
+
+static bool whisper_cpu_has_avx2() {
+    static const bool res = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return res;
+}
+
+static bool whisper_cpu_has_avx512() {
+    static const bool res = __builtin_cpu_supports("avx512f");
+    return res;
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 whisper_v_expf_avx2(__m256 x) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 min  = _mm256_set1_ps(-87.3f);
+
+    const __m256 mask = _mm256_cmp_ps(x, min, _CMP_LT_OQ);
+
+    x = _mm256_min_ps(_mm256_max_ps(x, min), _mm256_set1_ps(88.3f));
+
+    const __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+    const __m256i e = _mm256_slli_epi32(_mm256_cvtps_epi32(n), 23);
+
+    return _mm256_blendv_ps(_mm256_castsi256_ps(_mm256_add_epi32(_mm256_castps_si256(p), e)), zero, mask);
+}
+
+__attribute__((target("avx2,fma")))
+static float whisper_vec_max_f32_avx2(int n, const float * x) {
+    __m256 vmax = _mm256_set1_ps(-INFINITY);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(x + i));
     }
-    logsumexp = logf(logsumexp) + logit_max;
 
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logprobs[i] = logits[i] - logsumexp;
-        } else {
-            logprobs[i] = -INFINITY;
+    float tmp[8];
+    _mm256_storeu_ps(tmp, vmax);
+
+    float res = -INFINITY;
+    for (int j = 0; j < 8; ++j) {
+        res = std::max(res, tmp[j]);
+    }
+    for (; i < n; ++i) {
+        res = std::max(res, x[i]);
+    }
+
+    return res;
+}
+
+__attribute__((target("avx2,fma")))
+static float whisper_vec_sum_exp_f32_avx2(int n, const float * x, float m) {
+    const __m256 vm = _mm256_set1_ps(m);
+
+    __m256 vsum = _mm256_setzero_ps();
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        vsum = _mm256_add_ps(vsum, whisper_v_expf_avx2(_mm256_sub_ps(_mm256_loadu_ps(x + i), vm)));
+    }
+
+    float tmp[8];
+    _mm256_storeu_ps(tmp, vsum);
+
+    double res = 0.0;
+    for (int j = 0; j < 8; ++j) {
+        res += tmp[j];
+    }
+    for (; i < n; ++i) {
+        res += expf(x[i] - m);
+    }
+
+    return res;
+}
+
+__attribute__((target("avx2,fma")))
+static void whisper_vec_log_softmax_f32_avx2(int n, const float * x, float lse, float * logprobs, float * probs) {
+    const __m256 vlse = _mm256_set1_ps(lse);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 lp = _mm256_sub_ps(_mm256_loadu_ps(x + i), vlse);
+
+        _mm256_storeu_ps(logprobs + i, lp);
+        _mm256_storeu_ps(probs    + i, whisper_v_expf_avx2(lp));
+    }
+    for (; i < n; ++i) {
+        logprobs[i] = x[i] - lse;
+        probs[i]    = expf(logprobs[i]);
+    }
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 whisper_v_expf_avx512(__m512 x) {
+    const __m512 min = _mm512_set1_ps(-87.3f);
+
+    const __mmask16 mask = _mm512_cmp_ps_mask(x, min, _CMP_GE_OQ);
+
+    x = _mm512_min_ps(_mm512_max_ps(x, min), _mm512_set1_ps(88.3f));
+
+    const __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+
+    __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), x);
+    r = _mm512_fnmadd_ps(n, _mm512_set1_ps(-2.12194440e-4f), r);
+
+    __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+    p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+
+    const __m512i e = _mm512_slli_epi32(_mm512_cvtps_epi32(n), 23);
+
+    return _mm512_maskz_mov_ps(mask, _mm512_castsi512_ps(_mm512_add_epi32(_mm512_castps_si512(p), e)));
+}
+
+__attribute__((target("avx512f")))
+static float whisper_vec_max_f32_avx512(int n, const float * x) {
+    __m512 vmax = _mm512_set1_ps(-INFINITY);
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        vmax = _mm512_max_ps(vmax, _mm512_loadu_ps(x + i));
+    }
+
+    float res = _mm512_reduce_max_ps(vmax);
+    for (; i < n; ++i) {
+        res = std::max(res, x[i]);
+    }
+
+    return res;
+}
+
+__attribute__((target("avx512f")))
+static float whisper_vec_sum_exp_f32_avx512(int n, const float * x, float m) {
+    const __m512 vm = _mm512_set1_ps(m);
+
+    __m512 vsum = _mm512_setzero_ps();
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        vsum = _mm512_add_ps(vsum, whisper_v_expf_avx512(_mm512_sub_ps(_mm512_loadu_ps(x + i), vm)));
+    }
+
+    double res = _mm512_reduce_add_ps(vsum);
+    for (; i < n; ++i) {
+        res += expf(x[i] - m);
+    }
+
+    return res;
+}
+
+__attribute__((target("avx512f")))
+static void whisper_vec_log_softmax_f32_avx512(int n, const float * x, float lse, float * logprobs, float * probs) {
+    const __m512 vlse = _mm512_set1_ps(lse);
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m512 lp = _mm512_sub_ps(_mm512_loadu_ps(x + i), vlse);
+
+        _mm512_storeu_ps(logprobs + i, lp);
+        _mm512_storeu_ps(probs    + i, whisper_v_expf_avx512(lp));
+    }
+    for (; i < n; ++i) {
+        logprobs[i] = x[i] - lse;
+        probs[i]    = expf(logprobs[i]);
+    }
+}
+
+#elif defined(WHISPER_VEC_NEON)
+
+static inline float32x4_t whisper_v_expf_neon(float32x4_t x) {
+    const float32x4_t min = vdupq_n_f32(-87.3f);
+
+    const uint32x4_t mask = vcgeq_f32(x, min);
+
+    x = vminq_f32(vmaxq_f32(x, min), vdupq_n_f32(88.3f));
+
+    const float32x4_t n = vrndnq_f32(vmulq_n_f32(x, 1.44269504088896341f));
+
+    float32x4_t r = vfmsq_f32(x, n, vdupq_n_f32(0.693359375f));
+    r = vfmsq_f32(r, n, vdupq_n_f32(-2.12194440e-4f));
+
+    float32x4_t p = vdupq_n_f32(1.9875691500e-4f);
+    p = vfmaq_f32(vdupq_n_f32(1.3981999507e-3f), p, r);
+    p = vfmaq_f32(vdupq_n_f32(8.3334519073e-3f), p, r);
+    p = vfmaq_f32(vdupq_n_f32(4.1665795894e-2f), p, r);
+    p = vfmaq_f32(vdupq_n_f32(1.6666665459e-1f), p, r);
+    p = vfmaq_f32(vdupq_n_f32(5.0000001201e-1f), p, r);
+    p = vfmaq_f32(vaddq_f32(r, vdupq_n_f32(1.0f)), p, vmulq_f32(r, r));
+
+    const int32x4_t e = vshlq_n_s32(vcvtq_s32_f32(n), 23);
+
+    return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_s32(vaddq_s32(vreinterpretq_s32_f32(p), e)), mask));
+}
+
+#endif
+
+static float whisper_vec_max_f32(int n, const float * x) {
+#if defined(WHISPER_VEC_X86)
+    if (whisper_cpu_has_avx512()) {
+        return whisper_vec_max_f32_avx512(n, x);
+    }
+    if (whisper_cpu_has_avx2()) {
+        return whisper_vec_max_f32_avx2(n, x);
+    }
+#endif
+
+    int i = 0;
+
+    float res = -INFINITY;
+
+#if defined(WHISPER_VEC_NEON)
+    float32x4_t vmax = vdupq_n_f32(-INFINITY);
+    for (; i + 4 <= n; i += 4) {
+        vmax = vmaxq_f32(vmax, vld1q_f32(x + i));
+    }
+    res = vmaxvq_f32(vmax);
+#endif
+
+    for (; i < n; ++i) {
+        res = std::max(res, x[i]);
+    }
+
+    return res;
+}
+
+// sum of exp(x[i] - m) - terms with x[i] == -inf are 0
+static float whisper_vec_sum_exp_f32(int n, const float * x, float m) {
+    if (m == -INFINITY) {
+        return 0.0f;
+    }
+
+#if defined(WHISPER_VEC_X86)
+    if (whisper_cpu_has_avx512()) {
+        return whisper_vec_sum_exp_f32_avx512(n, x, m);
+    }
+    if (whisper_cpu_has_avx2()) {
+        return whisper_vec_sum_exp_f32_avx2(n, x, m);
+    }
+#endif
+
+    int i = 0;
+
+    double res = 0.0;
+
+#if defined(WHISPER_VEC_NEON)
+    const float32x4_t vm = vdupq_n_f32(m);
+
+    float32x4_t vsum = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        vsum = vaddq_f32(vsum, whisper_v_expf_neon(vsubq_f32(vld1q_f32(x + i), vm)));
+    }
+    res = vaddvq_f32(vsum);
+#endif
+
+    for (; i < n; ++i) {
+        if (x[i] > -INFINITY) {
+            res += expf(x[i] - m);
         }
     }
+
+    return res;
 }
 
-static void whisper_compute_probs(
-    const std::vector<float> & logits,
-                  const int    n_logits,
-    const std::vector<float> & logprobs,
-          std::vector<float> & probs)     {
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] == -INFINITY) {
-            probs[i] = 0.0f;
+// logprobs[i] = x[i] - lse, probs[i] = exp(logprobs[i])
+static void whisper_vec_log_softmax_f32(int n, const float * x, float lse, float * logprobs, float * probs) {
+#if defined(WHISPER_VEC_X86)
+    if (whisper_cpu_has_avx512()) {
+        return whisper_vec_log_softmax_f32_avx512(n, x, lse, logprobs, probs);
+    }
+    if (whisper_cpu_has_avx2()) {
+        return whisper_vec_log_softmax_f32_avx2(n, x, lse, logprobs, probs);
+    }
+#endif
+
+    int i = 0;
+
+#if defined(WHISPER_VEC_NEON)
+    const float32x4_t vlse = vdupq_n_f32(lse);
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t lp = vsubq_f32(vld1q_f32(x + i), vlse);
+
+        vst1q_f32(logprobs + i, lp);
+        vst1q_f32(probs    + i, whisper_v_expf_neon(lp));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        if (x[i] > -INFINITY) {
+            logprobs[i] = x[i] - lse;
+            probs[i]    = expf(logprobs[i]);
         } else {
-            probs[i] = expf(logprobs[i]);
+            logprobs[i] = -INFINITY;
+            probs[i]    = 0.0f;
         }
     }
 }
@@ -5046,66 +6958,49 @@ static void whisper_process_logits(
             }
         }
 
-        // populate the logprobs array (log_softmax)
-        whisper_compute_logprobs(logits, n_logits, logprobs);
+        // log_softmax over the text and the timestamp tokens separately, so that the probability mass of
+        // the timestamps is known without another pass over the logprobs
+        const int n_text = vocab.token_beg;
+        const int n_ts   = n_logits - vocab.token_beg;
+
+        const float logit_max_text = whisper_vec_max_f32(n_text, logits.data());
+        const float logit_max_ts   = whisper_vec_max_f32(n_ts,   logits.data() + n_text);
+
+        float logit_max = std::max(logit_max_text, logit_max_ts);
+
+        const float sum_text = whisper_vec_sum_exp_f32(n_text, logits.data(),          logit_max);
+        const float sum_ts   = whisper_vec_sum_exp_f32(n_ts,   logits.data() + n_text, logit_max);
+
+        float logsumexp = logf(sum_text + sum_ts) + logit_max;
 
         // if sum of probability over timestamps is above any other token, sample timestamp
         // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
         {
             // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
+            const float timestamp_logprob = sum_ts > 0.0f ? logf(sum_ts) + logit_max - logsumexp : -INFINITY;
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+            const float max_text_token_logprob = logit_max_text - logsumexp;
 
             //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
             if (timestamp_logprob > max_text_token_logprob) {
+                // the timestamp logprobs are not renormalized
                 for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
+                    logits[i] = -INFINITY;
                 }
             } else {
                 if (params.n_grammar_rules > 0) {
                     whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
 
-                    // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
-
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
+                    logit_max = whisper_vec_max_f32(n_logits, logits.data());
+                    logsumexp = logf(whisper_vec_sum_exp_f32(n_logits, logits.data(), logit_max)) + logit_max;
                 }
             }
         }
-    }
 
-    // compute probs
-    whisper_compute_probs(logits, n_logits, logprobs, probs);
+        // populate the logprobs and the probs arrays
+        whisper_vec_log_softmax_f32(n_logits, logits.data(), logsumexp, logprobs.data(), probs.data());
+    }
 
 #if 0
     // print first 100 logits - token string : logit
@@ -5161,19 +7056,59 @@ static void whisper_process_logits(
 #endif
 }
 
-static bool whisper_sequence_tokens_equal(const whisper_sequence & a, const whisper_sequence & b) {
-    if (a.tokens.size() != b.tokens.size()) {
+static int32_t whisper_beam_tree_add(whisper_beam_tree & tree, int32_t parent, const whisper_token_data & token) {
+    const int32_t depth = parent < 0 ? 1 : tree.nodes[parent].depth + 1;
+
+    tree.nodes.push_back({ parent, depth, token });
+
+    return (int32_t) tree.nodes.size() - 1;
+}
+
+// compare the sequences ending at nodes a and b
+// sequences are more likely to diverge at the end and the walk stops at the first shared node
+static bool whisper_beam_tree_equal(const whisper_beam_tree & tree, int32_t a, int32_t b) {
+    const int32_t depth_a = a < 0 ? 0 : tree.nodes[a].depth;
+    const int32_t depth_b = b < 0 ? 0 : tree.nodes[b].depth;
+
+    if (depth_a != depth_b) {
         return false;
     }
-    // sequences are more likely to diverge at the end
-    for (int i = a.tokens.size() - 1; i >= 0; i--) {
-        if (a.tokens[i].id != b.tokens[i].id) {
+
+    while (a != b) {
+        if (tree.nodes[a].token.id != tree.nodes[b].token.id) {
             return false;
         }
+        a = tree.nodes[a].parent;
+        b = tree.nodes[b].parent;
     }
+
     return true;
 }
 
+// update the tokens of a sequence that currently ends at node_old to the sequence ending at node_new
+// only the tokens after the deepest common ancestor of the two nodes are written
+static void whisper_beam_tree_update(
+        const whisper_beam_tree & tree,
+                        int32_t   node_old,
+                        int32_t   node_new,
+  std::vector<whisper_token_data> & tokens) {
+    tokens.resize(node_new < 0 ? 0 : tree.nodes[node_new].depth);
+
+    int32_t a = node_old;
+    int32_t b = node_new;
+
+    while (b >= 0) {
+        while (a >= 0 && tree.nodes[a].depth > tree.nodes[b].depth) {
+            a = tree.nodes[a].parent;
+        }
+        if (a == b) {
+            break;
+        }
+        tokens[tree.nodes[b].depth - 1] = tree.nodes[b].token;
+        b = tree.nodes[b].parent;
+    }
+}
+
 static whisper_token_data whisper_sample_token(
             whisper_context & ctx,
       const whisper_decoder & decoder,
@@ -5210,12 +7145,12 @@ static whisper_token_data whisper_sample_token(
     }
 
     if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
-            }
+        const float p_max = whisper_vec_max_f32(n_logits, probs.data());
+
+        if (result.p < p_max) {
+            result.id   = std::find(probs.begin(), probs.end(), p_max) - probs.begin();
+            result.p    = probs[result.id];
+            result.plog = logprobs[result.id];
         }
     } else {
         std::discrete_distribution<> dist(probs.begin(), probs.end());
@@ -5240,29 +7175,10 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
     const auto & vocab = ctx.vocab;
 
     const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
     const auto & logprobs = decoder.logprobs;
 
     const int n_logits = vocab.n_vocab;
 
-    auto & logits_id = decoder.logits_id;
-
-    logits_id.resize(n_logits);
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id[i].first = logits[i];
-        logits_id[i].second = i;
-    }
-
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::partial_sort(
-                logits_id.begin(),
-                logits_id.begin() + k, logits_id.end(),
-                [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
-
     std::vector<whisper_token_data> result;
     result.reserve(k);
 
@@ -5368,6 +7284,8 @@ int whisper_full_with_state(
 
     result_all.clear();
 
+    state->threadpool_params = params.threadpool_params ? *params.threadpool_params : ggml_threadpool_params_default(params.n_threads);
+
     if (n_samples > 0) {
         // compute log mel spectrogram
         if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
@@ -5532,19 +7450,38 @@ int whisper_full_with_state(
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
+    // a candidate extends the hypothesis of decoder_idx (ending at the tree node parent) with a single token
+    // the grammar state is shared with the source decoder - it is only advanced after the candidate is selected
     struct beam_candidate {
         int decoder_idx;
         int seek_delta;
+        int result_len;
 
         bool has_ts;
 
-        whisper_sequence sequence;
+        int32_t parent;
+
+        whisper_token_data token;
+        double sum_logprobs_all;
+
         whisper_grammar grammar;
     };
 
     std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
     std::vector<beam_candidate> beam_candidates;
 
+    whisper_beam_tree beam_tree;
+
+    // reuse the token mask cache of the previous call when the grammar is the same
+    if (params.grammar_rules != nullptr) {
+        auto rules = whisper_grammar_rules_init(params.grammar_rules, params.n_grammar_rules);
+
+        if (!state->grammar_rules || !whisper_grammar_rules_equal(*state->grammar_rules, rules)) {
+            state->grammar_rules = std::make_shared<const whisper_grammar_rules>(std::move(rules));
+            state->grammar_cache = std::make_shared<whisper_grammar_cache>();
+        }
+    }
+
     // main loop
     while (true) {
         if (params.progress_callback) {
@@ -5606,6 +7543,13 @@ int whisper_full_with_state(
 
             WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
 
+            // all decoders start from the same grammar state
+            const whisper_grammar grammar_init = params.grammar_rules != nullptr
+                ? whisper_grammar_init(state->grammar_rules, state->grammar_cache, params.i_start_rule)
+                : whisper_grammar{};
+
+            beam_tree.nodes.clear();
+
             // TAGS: WHISPER_DECODER_INIT
             for (int j = 0; j < n_decoders_cur; ++j) {
                 auto & decoder = state->decoders[j];
@@ -5624,11 +7568,8 @@ int whisper_full_with_state(
                 decoder.completed = false;
                 decoder.has_ts    = false;
 
-                if (params.grammar_rules != nullptr) {
-                    decoder.grammar = whisper_grammar_init(params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
-                } else {
-                    decoder.grammar = {};
-                }
+                decoder.grammar   = grammar_init;
+                decoder.beam_node = -1;
             }
 
             // init prompt and kv cache for the current iteration
@@ -5663,7 +7604,7 @@ int whisper_full_with_state(
                     // overallocate to workaround KV cache fragmentation issues
                     const int factor = n_decoders_cur > 1 ? n_decoders_cur + 2 : 1;
 
-                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->params.type_k, ctx->params.type_v,
                                 ctx->model.hparams.n_text_state,
                                 ctx->model.hparams.n_text_layer,
                                 GGML_PAD(ctx->model.hparams.n_text_ctx, 256)*factor)) {
@@ -5687,13 +7628,13 @@ int whisper_full_with_state(
                 // Calculate no_speech probability after first decode.
                 // This has to be done before any logit filtering. Hence we cannot use the probs from the whisper_process_logits.
                 {
-                    const int n_logits = ctx->vocab.id_to_token.size();
-                    std::vector<float> logprobs(n_logits);
-                    std::vector<float> probs(n_logits);
+                    const int     n_logits = ctx->vocab.id_to_token.size();
+                    const float * logits   = state->logits.data();
 
-                    whisper_compute_logprobs(state->logits, n_logits, logprobs);
-                    whisper_compute_probs(state->logits, n_logits, logprobs, probs);
-                    state->no_speech_prob = probs[whisper_token_nosp(ctx)];
+                    const float logit_max = whisper_vec_max_f32(n_logits, logits);
+                    const float logsumexp = logf(whisper_vec_sum_exp_f32(n_logits, logits, logit_max)) + logit_max;
+
+                    state->no_speech_prob = expf(logits[whisper_token_nosp(ctx)] - logsumexp);
                 }
 
                 {
@@ -5761,9 +7702,11 @@ int whisper_full_with_state(
                                         const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
 
                                         for (const auto & token : tokens_new) {
-                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
-                                            bc_per_dec[j].back().sequence.tokens.push_back(token);
-                                            bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
+                                            bc_per_dec[j].push_back({
+                                                j, decoder.seek_delta, decoder.sequence.result_len, decoder.has_ts,
+                                                decoder.beam_node, token, decoder.sequence.sum_logprobs_all + token.plog,
+                                                decoder.grammar,
+                                            });
                                         }
                                     } break;
                             };
@@ -5804,8 +7747,8 @@ int whisper_full_with_state(
                             beam_candidates.begin(),
                             beam_candidates.end(),
                             [](const beam_candidate & a, const beam_candidate & b) {
-                        if (a.sequence.sum_logprobs_all != b.sequence.sum_logprobs_all) {
-                            return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+                        if (a.sum_logprobs_all != b.sum_logprobs_all) {
+                            return a.sum_logprobs_all > b.sum_logprobs_all;
                         }
                         return a.decoder_idx < b.decoder_idx;
                     });
@@ -5825,14 +7768,22 @@ int whisper_full_with_state(
 
                         auto & cur = beam_candidates[cur_c++];
 
-                        while (beam_candidates.size() > cur_c && whisper_sequence_tokens_equal(beam_candidates[cur_c].sequence, cur.sequence) && i > 0) {
+                        while (beam_candidates.size() > cur_c && i > 0 &&
+                               beam_candidates[cur_c].token.id == cur.token.id &&
+                               whisper_beam_tree_equal(beam_tree, beam_candidates[cur_c].parent, cur.parent)) {
                             ++cur_c;
                         }
 
-                        decoder.seek_delta = cur.seek_delta;
-                        decoder.has_ts     = cur.has_ts;
-                        decoder.sequence   = cur.sequence;
-                        decoder.grammar    = cur.grammar;
+                        const int32_t node = whisper_beam_tree_add(beam_tree, cur.parent, cur.token);
+
+                        whisper_beam_tree_update(beam_tree, decoder.beam_node, node, decoder.sequence.tokens);
+
+                        decoder.beam_node                 = node;
+                        decoder.seek_delta                = cur.seek_delta;
+                        decoder.has_ts                    = cur.has_ts;
+                        decoder.sequence.result_len       = cur.result_len;
+                        decoder.sequence.sum_logprobs_all = cur.sum_logprobs_all;
+                        decoder.grammar                   = cur.grammar;
 
                         whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
 
@@ -6492,6 +8443,325 @@ float whisper_full_get_segment_no_speech_prob_from_state(struct whisper_state *
     return state->result_all[i_segment].no_speech_prob;
 }
 
+//
+// streaming
+//
+
+struct whisper_stream {
+    whisper_context * ctx   = nullptr;
+    whisper_state   * state = nullptr;
+
+    bool own_state = false;
+
+    whisper_stream_params sparams;
+    whisper_full_params   fparams;
+
+    std::vector<float> pcm;      // audio that has not been trimmed yet
+    int64_t            t_pcm = 0; // stream time of pcm[0]
+
+    std::vector<whisper_token_data> committed;
+    std::vector<whisper_token_data> tentative;
+
+    int64_t t_committed = 0; // end time of the last committed token
+
+    std::vector<whisper_token> prompt;
+    std::string                text;
+};
+
+struct whisper_stream_params whisper_stream_default_params() {
+    struct whisper_stream_params result = {
+        /*.min_buffer_ms   =*/ 1000,
+        /*.max_buffer_ms   =*/ 20000,
+        /*.n_prompt_tokens =*/ 64,
+    };
+
+    return result;
+}
+
+struct whisper_stream * whisper_stream_init(
+        struct whisper_context * ctx,
+   struct whisper_stream_params   sparams,
+     struct whisper_full_params   fparams) {
+    whisper_state * state = whisper_init_state(ctx);
+    if (!state) {
+        WHISPER_LOG_ERROR("%s: failed to initialize whisper state\n", __func__);
+        return nullptr;
+    }
+
+    whisper_stream * stream = whisper_stream_init_with_state(ctx, state, sparams, fparams);
+
+    stream->own_state = true;
+
+    return stream;
+}
+
+struct whisper_stream * whisper_stream_init_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+   struct whisper_stream_params   sparams,
+     struct whisper_full_params   fparams) {
+    whisper_stream * stream = new whisper_stream;
+
+    sparams.min_buffer_ms = std::max(sparams.min_buffer_ms, 1000);
+    sparams.max_buffer_ms = std::min(std::max(sparams.max_buffer_ms, sparams.min_buffer_ms), WHISPER_CHUNK_SIZE*1000);
+
+    stream->ctx     = ctx;
+    stream->state   = state;
+    stream->sparams = sparams;
+    stream->fparams = fparams;
+
+    stream->fparams.no_context       = true;
+    stream->fparams.token_timestamps = true;
+    stream->fparams.offset_ms        = 0;
+    stream->fparams.duration_ms      = 0;
+
+    return stream;
+}
+
+void whisper_stream_free(struct whisper_stream * stream) {
+    if (stream) {
+        if (stream->own_state) {
+            whisper_free_state(stream->state);
+        }
+        delete stream;
+    }
+}
+
+void whisper_stream_push(struct whisper_stream * stream, const float * samples, int n_samples) {
+    stream->pcm.insert(stream->pcm.end(), samples, samples + n_samples);
+}
+
+static int64_t whisper_stream_buffer_t(const whisper_stream & stream) {
+    return (100*(int64_t) stream.pcm.size())/WHISPER_SAMPLE_RATE;
+}
+
+// whisper_full needs at least 100 mel frames, which takes one hop more than 1 s of audio
+static bool whisper_stream_ready(const whisper_stream & stream) {
+    return (int64_t) stream.pcm.size() >= (int64_t) stream.sparams.min_buffer_ms*WHISPER_SAMPLE_RATE/1000 + WHISPER_HOP_LENGTH;
+}
+
+// transcribe the buffer and collect the text tokens that have not been committed yet
+// seg_t1 receives the absolute end time of every segment of the hypothesis
+static int whisper_stream_run(
+        whisper_stream & stream,
+        std::vector<whisper_token_data> & hyp,
+        std::vector<int64_t> & seg_t1) {
+    hyp.clear();
+    seg_t1.clear();
+
+    // the prompt is the committed text that is no longer covered by the buffer
+    stream.prompt.clear();
+    for (int i = (int) stream.committed.size() - 1; i >= 0 && (int) stream.prompt.size() < stream.sparams.n_prompt_tokens; --i) {
+        if (stream.committed[i].t1 <= stream.t_pcm) {
+            stream.prompt.push_back(stream.committed[i].id);
+        }
+    }
+    std::reverse(stream.prompt.begin(), stream.prompt.end());
+
+    whisper_full_params fparams = stream.fparams;
+
+    if (!stream.prompt.empty()) {
+        fparams.prompt_tokens   = stream.prompt.data();
+        fparams.prompt_n_tokens = stream.prompt.size();
+    }
+
+    const int ret = whisper_full_with_state(stream.ctx, stream.state, fparams, stream.pcm.data(), stream.pcm.size());
+    if (ret != 0) {
+        WHISPER_LOG_ERROR("%s: failed to process audio, ret = %d\n", __func__, ret);
+        return ret;
+    }
+
+    const whisper_token token_eot = whisper_token_eot(stream.ctx);
+
+    for (const auto & seg : stream.state->result_all) {
+        for (const auto & token : seg.tokens) {
+            if (token.id >= token_eot) {
+                continue;
+            }
+
+            whisper_token_data data = token;
+
+            data.t0 += stream.t_pcm;
+            data.t1 += stream.t_pcm;
+            if (data.t_dtw >= 0) {
+                data.t_dtw += stream.t_pcm;
+            }
+
+            // skip what has already been committed from the audio that is still buffered
+            if (data.t0 < stream.t_committed - 10) {
+                continue;
+            }
+
+            hyp.push_back(data);
+        }
+
+        seg_t1.push_back(seg.t1 + stream.t_pcm);
+    }
+
+    // the timestamps are not precise - remove the longest n-gram that repeats the committed tail
+    if (!hyp.empty() && !stream.committed.empty() && std::abs(hyp[0].t0 - stream.t_committed) < 100) {
+        const int n_max = std::min<int>({ 5, (int) hyp.size(), (int) stream.committed.size() });
+
+        for (int n = n_max; n > 0; --n) {
+            bool match = true;
+            for (int i = 0; i < n && match; ++i) {
+                match = stream.committed[stream.committed.size() - n + i].id == hyp[i].id;
+            }
+
+            if (match) {
+                hyp.erase(hyp.begin(), hyp.begin() + n);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// drop the buffered audio before t (absolute)
+static void whisper_stream_trim(whisper_stream & stream, int64_t t) {
+    const int64_t n = std::min<int64_t>(((t - stream.t_pcm)*WHISPER_SAMPLE_RATE)/100, stream.pcm.size());
+    if (n <= 0) {
+        return;
+    }
+
+    stream.pcm.erase(stream.pcm.begin(), stream.pcm.begin() + n);
+    stream.t_pcm += (100*n)/WHISPER_SAMPLE_RATE;
+}
+
+static void whisper_stream_commit(whisper_stream & stream, const whisper_token_data & token) {
+    stream.committed.push_back(token);
+    stream.t_committed = std::max(stream.t_committed, token.t1);
+}
+
+int whisper_stream_process(struct whisper_stream * stream) {
+    if (!whisper_stream_ready(*stream)) {
+        return 0;
+    }
+
+    std::vector<whisper_token_data> hyp;
+    std::vector<int64_t> seg_t1;
+
+    const int ret = whisper_stream_run(*stream, hyp, seg_t1);
+    if (ret != 0) {
+        return ret;
+    }
+
+    const int n_committed = stream->committed.size();
+
+    // LocalAgreement-2: commit the common prefix of the last two hypotheses
+    size_t n_agree = 0;
+    while (n_agree < hyp.size() && n_agree < stream->tentative.size() && hyp[n_agree].id == stream->tentative[n_agree].id) {
+        whisper_stream_commit(*stream, hyp[n_agree]);
+        ++n_agree;
+    }
+
+    stream->tentative.assign(hyp.begin() + n_agree, hyp.end());
+
+    // trim the audio at the end of the last committed segment - the last segment may still change
+    if (seg_t1.size() > 1) {
+        int64_t t_trim = stream->t_pcm;
+        for (size_t i = 0; i + 1 < seg_t1.size(); ++i) {
+            if (seg_t1[i] <= stream->t_committed) {
+                t_trim = seg_t1[i];
+            }
+        }
+
+        whisper_stream_trim(*stream, t_trim);
+    }
+
+    // the hypotheses keep disagreeing - commit all but the last segment to bound the buffer
+    if (whisper_stream_buffer_t(*stream) > stream->sparams.max_buffer_ms/10) {
+        const int64_t t_force = seg_t1.size() > 1 ? seg_t1[seg_t1.size() - 2] : stream->t_pcm + whisper_stream_buffer_t(*stream);
+
+        size_t n_force = 0;
+        while (n_force < stream->tentative.size() && stream->tentative[n_force].t1 <= t_force) {
+            whisper_stream_commit(*stream, stream->tentative[n_force]);
+            ++n_force;
+        }
+
+        stream->tentative.erase(stream->tentative.begin(), stream->tentative.begin() + n_force);
+
+        whisper_stream_trim(*stream, t_force);
+    }
+
+    return stream->committed.size() - n_committed;
+}
+
+int whisper_stream_flush(struct whisper_stream * stream) {
+    const int n_committed = stream->committed.size();
+
+    if (!stream->pcm.empty()) {
+        const int64_t t_end = stream->t_pcm + whisper_stream_buffer_t(*stream);
+
+        // a remainder shorter than a pass is padded with silence, so that it is transcribed as well
+        const size_t n_min = (size_t) stream->sparams.min_buffer_ms*WHISPER_SAMPLE_RATE/1000 + WHISPER_HOP_LENGTH;
+        if (stream->pcm.size() < n_min) {
+            stream->pcm.resize(n_min, 0.0f);
+        }
+
+        std::vector<whisper_token_data> hyp;
+        std::vector<int64_t> seg_t1;
+
+        const int ret = whisper_stream_run(*stream, hyp, seg_t1);
+        if (ret != 0) {
+            return ret;
+        }
+
+        // nothing can be said in the padding
+        while (!hyp.empty() && hyp.back().t0 >= t_end) {
+            hyp.pop_back();
+        }
+
+        stream->tentative = std::move(hyp);
+
+        stream->t_pcm = t_end;
+        stream->pcm.clear();
+    }
+
+    for (const auto & token : stream->tentative) {
+        whisper_stream_commit(*stream, token);
+    }
+
+    stream->tentative.clear();
+
+    return stream->committed.size() - n_committed;
+}
+
+int whisper_stream_n_committed(struct whisper_stream * stream) {
+    return stream->committed.size();
+}
+
+int whisper_stream_n_tentative(struct whisper_stream * stream) {
+    return stream->tentative.size();
+}
+
+whisper_token_data whisper_stream_get_committed(struct whisper_stream * stream, int i_token) {
+    return stream->committed[i_token];
+}
+
+whisper_token_data whisper_stream_get_tentative(struct whisper_stream * stream, int i_token) {
+    return stream->tentative[i_token];
+}
+
+const char * whisper_stream_get_committed_text(struct whisper_stream * stream, int i_token) {
+    stream->text.clear();
+    for (size_t i = std::max(0, i_token); i < stream->committed.size(); ++i) {
+        stream->text += whisper_token_to_str(stream->ctx, stream->committed[i].id);
+    }
+
+    return stream->text.c_str();
+}
+
+const char * whisper_stream_get_tentative_text(struct whisper_stream * stream) {
+    stream->text.clear();
+    for (const auto & token : stream->tentative) {
+        stream->text += whisper_token_to_str(stream->ctx, token.id);
+    }
+
+    return stream->text.c_str();
+}
+
 // =================================================================================================
 
 //
@@ -6822,17 +9092,23 @@ static float voice_length(const std::string & text) {
 }
 
 // average the fabs of the signal
+// the window sum is updated as it slides, so each sample is visited twice regardless of the window size
 static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window) {
     const int hw = n_samples_per_half_window;
 
     std::vector<float> result(n_samples);
 
+    double sum = 0.0;
+    for (int j = 0; j < std::min(hw, n_samples); j++) {
+        sum += fabs(signal[j]);
+    }
+
     for (int i = 0; i < n_samples; i++) {
-        float sum = 0;
-        for (int j = -hw; j <= hw; j++) {
-            if (i + j >= 0 && i + j < n_samples) {
-                sum += fabs(signal[i + j]);
-            }
+        if (i + hw < n_samples) {
+            sum += fabs(signal[i + hw]);
+        }
+        if (i - hw - 1 >= 0) {
+            sum -= fabs(signal[i - hw - 1]);
         }
         result[i] = sum/(2*hw + 1);
     }
@@ -7100,67 +9376,177 @@ static std::vector<uint32_t> get_alignment_heads_by_layer(const whisper_context_
     return ret;
 }
 
-// dtw + backtrace to return found path
+// computes the cells [lo, hi] of one anti-diagonal of the DTW cost matrix, indexed by token
+// c2 and c1 are the previous two anti-diagonals, x and t are the input and trace of the cells
+// tie-breaking follows https://github.com/openai/whisper/blob/main/whisper/timing.py#L83
+#if defined(WHISPER_VEC_X86)
+__attribute__((target("avx2,fma")))
+static int whisper_dtw_diag_avx2(int lo, int hi, const float * c2, const float * c1, float * c, const float * x, int32_t * t) {
+    int i = lo;
+    for (; i + 8 <= hi + 1; i += 8) {
+        const __m256 v0 = _mm256_loadu_ps(c2 + i - 1); // (i - 1, j - 1)
+        const __m256 v1 = _mm256_loadu_ps(c1 + i - 1); // (i - 1, j)
+        const __m256 v2 = _mm256_loadu_ps(c1 + i);     // (i, j - 1)
+
+        const __m256 b0 = _mm256_and_ps(_mm256_cmp_ps(v0, v1, _CMP_LT_OQ), _mm256_cmp_ps(v0, v2, _CMP_LT_OQ));
+        const __m256 b1 = _mm256_and_ps(_mm256_cmp_ps(v1, v0, _CMP_LT_OQ), _mm256_cmp_ps(v1, v2, _CMP_LT_OQ));
+
+        const __m256 vc = _mm256_blendv_ps(_mm256_blendv_ps(v2, v1, b1), v0, b0);
+
+        _mm256_storeu_ps(c + i, _mm256_add_ps(vc, _mm256_loadu_ps(x + i - lo)));
+
+        // b0 and b1 are exclusive: t = 2 - 2*b0 - b1
+        const __m256i vt = _mm256_add_epi32(_mm256_set1_epi32(2),
+                _mm256_add_epi32(_mm256_and_si256(_mm256_castps_si256(b0), _mm256_set1_epi32(-2)), _mm256_castps_si256(b1)));
+
+        _mm256_storeu_si256((__m256i *)(t + i - lo), vt);
+    }
+    return i;
+}
+#endif
+
+static void whisper_dtw_diag(int lo, int hi, const float * c2, const float * c1, float * c, const float * x, int32_t * t) {
+    int i = lo;
+
+#if defined(WHISPER_VEC_X86)
+    if (whisper_cpu_has_avx2()) {
+        i = whisper_dtw_diag_avx2(lo, hi, c2, c1, c, x, t);
+    }
+#elif defined(WHISPER_VEC_NEON)
+    for (; i + 4 <= hi + 1; i += 4) {
+        const float32x4_t v0 = vld1q_f32(c2 + i - 1);
+        const float32x4_t v1 = vld1q_f32(c1 + i - 1);
+        const float32x4_t v2 = vld1q_f32(c1 + i);
+
+        const uint32x4_t b0 = vandq_u32(vcltq_f32(v0, v1), vcltq_f32(v0, v2));
+        const uint32x4_t b1 = vandq_u32(vcltq_f32(v1, v0), vcltq_f32(v1, v2));
+
+        const float32x4_t vc = vbslq_f32(b0, v0, vbslq_f32(b1, v1, v2));
+
+        vst1q_f32(c + i, vaddq_f32(vc, vld1q_f32(x + i - lo)));
+
+        const int32x4_t vt = vaddq_s32(vdupq_n_s32(2),
+                vaddq_s32(vandq_s32(vreinterpretq_s32_u32(b0), vdupq_n_s32(-2)), vreinterpretq_s32_u32(b1)));
+
+        vst1q_s32(t + i - lo, vt);
+    }
+#endif
+
+    for (; i <= hi; ++i) {
+        const float v0 = c2[i - 1];
+        const float v1 = c1[i - 1];
+        const float v2 = c1[i];
+
+        if (v0 < v1 && v0 < v2) {
+            c[i] = v0; t[i - lo] = 0;
+        } else if (v1 < v0 && v1 < v2) {
+            c[i] = v1; t[i - lo] = 1;
+        } else {
+            c[i] = v2; t[i - lo] = 2;
+        }
+        c[i] += x[i - lo];
+    }
+}
+
+// prepare the anti-diagonal layout of a DTW over n_tokens x n_frames cells
+// cell (i, j) of the cost matrix (1-based, i - token, j - frame) lies on anti-diagonal d = i + j
+// with band > 0, only the cells within band frames of the line from (0, 0) to (n_tokens, n_frames) are evaluated
+static void whisper_dtw_init(whisper_dtw_workspace & ws, int n_tokens, int n_frames, int band) {
+    const int N = n_tokens;
+    const int M = n_frames;
+
+    const int n_diag = N + M + 1;
+
+    ws.diag_lo.resize(n_diag);
+    ws.diag_hi.resize(n_diag);
+    ws.diag_off.resize(n_diag + 1);
+
+    WHISPER_ASSERT(band >= 0);
+
+    // a band of M frames or more contains every cell
+    if (band >= M) {
+        band = 0;
+    }
+
+    if (band > 0) {
+        // the band has to contain the first cell (1, 1) and at least one cell of each anti-diagonal
+        band = std::max(band, (std::abs(M - N) + N - 1)/N + 1);
+        band = std::max(band, (N + M + 2*N - 1)/(2*N) + 1);
+    }
+
+    ws.diag_off[0] = 0;
+    for (int d = 0; d < n_diag; ++d) {
+        int lo = std::max(1, d - M);
+        int hi = std::min(N, d - 1);
+
+        if (band > 0) {
+            // |j*N - i*M| <= band*N with j = d - i
+            lo = std::max(lo, (int) ((int64_t(d - band)*N + N + M - 1)/(N + M)));
+            hi = std::min(hi, (int) ((int64_t(d + band)*N)/(N + M)));
+        }
+
+        ws.diag_lo[d] = lo;
+        ws.diag_hi[d] = hi;
+
+        ws.diag_off[d + 1] = ws.diag_off[d] + std::max(0, hi - lo + 1);
+    }
+
+    ws.x    .resize(ws.diag_off[n_diag]);
+    ws.trace.resize(ws.diag_off[n_diag]);
+    ws.cost .resize(3*(N + 1));
+}
+
+// dtw + backtrace to return found path, evaluated one anti-diagonal at a time
+// x must have been filled for the cells set up by whisper_dtw_init()
 // based on
 // https://github.com/openai/whisper/blob/main/whisper/timing.py#L83
-static ggml_tensor * dtw_and_backtrace(ggml_context * ctx, ggml_tensor * x) {
-    WHISPER_ASSERT(ggml_n_dims(x) == 2);
-
-    int64_t N = x->ne[0];
-    int64_t M = x->ne[1];
-    struct ggml_tensor * cost = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, N + 1, M + 1);
-    struct ggml_tensor * trace = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, N + 1, M + 1);
-
-    cost = ggml_set_f32(cost, INFINITY);
-    trace = ggml_set_f32(trace, -1);
-    ggml_set_f32_nd(cost, 0, 0, 0, 0, 0.0);
-
-    // dtw
-    // supposedly can be optmized by computing diagonals in parallel ?
-    // Not sure it is worth it since x will be GENERATED_TOKENS*1500 size at most.
-    for (int64_t j = 1; j < M + 1; ++j) {
-        for (int64_t i = 1; i < N + 1; ++i) {
-            float c0 = ggml_get_f32_nd(cost, i - 1, j - 1, 0, 0);
-            float c1 = ggml_get_f32_nd(cost, i - 1, j, 0, 0);
-            float c2 = ggml_get_f32_nd(cost, i, j - 1, 0, 0);
-
-            float c;
-            int32_t t;
-            if (c0 < c1 && c0 < c2) {
-                c = c0;
-                t = 0;
-            } else if (c1 < c0 && c1 < c2) {
-                c = c1;
-                t = 1;
-            } else {
-                c = c2;
-                t = 2;
-            }
+static void whisper_dtw_and_backtrace(whisper_dtw_workspace & ws, int n_tokens, int n_frames) {
+    const int N = n_tokens;
+    const int M = n_frames;
+
+    std::fill(ws.cost.begin(), ws.cost.end(), INFINITY);
+
+    // cost[0][0] = 0 on anti-diagonal 0
+    ws.cost[0] = 0.0f;
+
+    for (int d = 2; d <= N + M; ++d) {
+        const int lo = ws.diag_lo[d];
+        const int hi = ws.diag_hi[d];
+
+        const float * c2 = ws.cost.data() + ((d - 2)%3)*(N + 1);
+        const float * c1 = ws.cost.data() + ((d - 1)%3)*(N + 1);
+              float * c  = ws.cost.data() + ((d    )%3)*(N + 1);
 
-            c = ggml_get_f32_nd(x, i - 1, j - 1, 0, 0) + c;
-            ggml_set_f32_nd(cost, i, j, 0, 0, c);
-            ggml_set_i32_nd(trace, i, j, 0, 0, t);
+        // the cells next to the evaluated ones are read by the next two anti-diagonals
+        if (lo > 0) {
+            c[lo - 1] = INFINITY;
         }
+        if (hi + 1 <= N) {
+            c[hi + 1] = INFINITY;
+        }
+
+        whisper_dtw_diag(lo, hi, c2, c1, c, ws.x.data() + ws.diag_off[d], ws.trace.data() + ws.diag_off[d]);
     }
 
-    // Backtrace
-    const int64_t BT_MAX_ROWS = N + M - 1;
-    struct ggml_tensor * bt = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, BT_MAX_ROWS, 2);
-    // trace[0, :] = 2;
-    for (int64_t i = 0; i < M + 1; ++i)
-        ggml_set_i32_nd(trace, 0, i, 0, 0, 2);
-    //trace[:, 0] = 1;
-    for (int64_t i = 0; i < N + 1; ++i)
-        ggml_set_i32_nd(trace, i, 0, 0, 0, 1);
-    int bt_row_idx = BT_MAX_ROWS - 1;
-    int64_t i = N;
-    int64_t j = M;
+    // backtrace - trace[0, :] = 2, trace[:, 0] = 1
+    ws.path.clear();
+
+    int i = N;
+    int j = M;
     while (i > 0 || j > 0) {
-        ggml_set_i32_nd(bt, bt_row_idx, 0, 0, 0, i - 1);
-        ggml_set_i32_nd(bt, bt_row_idx, 1, 0, 0, j - 1);
-        --bt_row_idx;
+        ws.path.push_back({ i - 1, j - 1 });
+
+        int32_t t;
+        if (i == 0) {
+            t = 2;
+        } else if (j == 0) {
+            t = 1;
+        } else {
+            const int d = i + j;
+            WHISPER_ASSERT(ws.diag_lo[d] <= i && i <= ws.diag_hi[d]);
+            t = ws.trace[ws.diag_off[d] + i - ws.diag_lo[d]];
+        }
 
-        int32_t t = ggml_get_i32_nd(trace, i, j, 0, 0);
         if (t == 0) {
             --i;
             --j;
@@ -7173,57 +9559,30 @@ static ggml_tensor * dtw_and_backtrace(ggml_context * ctx, ggml_tensor * x) {
         }
     }
 
-    // FIXME: manual clip/transpose might not be the most efficient way? (e.g. use ggml funcs)
-    // Clip + transpose
-    // This might not be entirely necessary for our case, but leaving it for now so output matrix
-    // is identical to dtw on openAI timing.py
-    const int64_t result_n_cols = BT_MAX_ROWS-bt_row_idx-1;
-    ggml_tensor * r = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, 2, result_n_cols);
-    for (int64_t i = 0; i < 2; ++i) {
-        for (int64_t j = 0; j < result_n_cols; ++j) {
-            int32_t v = ggml_get_i32_nd(bt, j+bt_row_idx+1, i, 0, 0);
-            ggml_set_i32_nd(r, i, j, 0, 0, v);
-        }
-    }
-
-    return r;
+    std::reverse(ws.path.begin(), ws.path.end());
 }
 
-struct median_filter_user_data {
-    int filter_width;
-};
+// median filter over the frames of the rows [i0, i1) of a [n_rows][n_frames] array - "reflect" padding
+static void whisper_dtw_median_filter(const float * src, float * dst, int i0, int i1, int n_frames, int filter_width, std::vector<float> & filter) {
+    filter.resize(filter_width);
 
-static void median_filter(struct ggml_tensor * dst , const struct ggml_tensor * a, int ith, int /*nth*/, void * userdata) {
-    if (ith != 0) {
-        return;
-    }
-    int filter_width = ((median_filter_user_data *) userdata)->filter_width;
-    WHISPER_ASSERT(filter_width < a->ne[2]);
-    WHISPER_ASSERT(filter_width % 2);
-    WHISPER_ASSERT(ggml_n_dims(a) == 3);
-    WHISPER_ASSERT(a->type == GGML_TYPE_F32);
-
-    std::vector<float> filter;
-    filter.reserve(filter_width);
-    for (int64_t i = 0; i < a->ne[0]; ++i) {
-        for (int64_t j = 0; j < a->ne[1]; ++j) {
-            for (int64_t k = 0; k < a->ne[2]; ++k) {
-                for (int64_t off = -filter_width/2; off <= filter_width/2; ++off) {
-                    // "reflect" padding
-                    int64_t idx = k + off;
-                    if (idx < 0) {
-                        idx = -idx;
-                    } else if (idx >= a->ne[2]) {
-                        idx = 2*(a->ne[2] - 1) - idx;
-                    }
+    for (int i = i0; i < i1; ++i) {
+        const float * row = src + (size_t) i*n_frames;
+              float * out = dst + (size_t) i*n_frames;
 
-                    filter.push_back(ggml_get_f32_nd(a, i, j, idx, 0));
+        for (int k = 0; k < n_frames; ++k) {
+            for (int off = -filter_width/2; off <= filter_width/2; ++off) {
+                int idx = k + off;
+                if (idx < 0) {
+                    idx = -idx;
+                } else if (idx >= n_frames) {
+                    idx = 2*(n_frames - 1) - idx;
                 }
-                std::sort(filter.begin(), filter.end());
-                const float v = filter[filter.size()/2];
-                ggml_set_f32_nd(dst, i, j, k, 0, v);
-                filter.clear();
+
+                filter[off + filter_width/2] = row[idx];
             }
+            std::nth_element(filter.begin(), filter.begin() + filter_width/2, filter.end());
+            out[k] = filter[filter_width/2];
         }
     }
 }
@@ -7244,16 +9603,6 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
     WHISPER_ASSERT(n_frames <= n_audio_ctx * 2);
     WHISPER_ASSERT(ctx->params.dtw_aheads_preset != WHISPER_AHEADS_NONE);
 
-    // FIXME: Allocating mem everytime we call this func
-    // Our ggml buffer should be pre-allocated somewhere during init and reused
-    // when we call this function
-    struct ggml_init_params gparams = {
-        /*.mem_size   =*/ ctx->params.dtw_mem_size,
-        /*.mem_buffer =*/ NULL,
-        /*.no_alloc   =*/ false,
-    };
-    struct ggml_context * gctx = ggml_init(gparams);
-
     // Build token sequence that will be passed to decoder
     // sot + [lang] + text result + eot
     std::vector<whisper_token> tokens = { whisper_token_sot(ctx), };
@@ -7294,67 +9643,96 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
     const auto n_tokens = state->aheads_cross_QKs->ne[0];
     const auto n_heads = state->aheads_cross_QKs->ne[2];
 
-    // Copy data from decoder buffer to a local CPU tensor, discarding unused audio
-    // tokens (i.e. discarding rows at the end of tensor)
-    // IN: Tensor with N_TOKENS*audio_ctx*N_ALIGNMENT_HEADS dims
-    // OUT: Tensor with N_TOKENS*N_AUDIO_TOKENS*N_ALIGNMENT_HEADS dims
     WHISPER_ASSERT(state->aheads_cross_QKs->type == GGML_TYPE_F32);
     WHISPER_ASSERT(ggml_is_contiguous(state->aheads_cross_QKs));
-    ggml_tensor * w = ggml_new_tensor_3d(gctx, GGML_TYPE_F32, n_tokens, n_audio_tokens, n_heads);
     auto & data = state->aheads_cross_QKs_data;
     data.resize(n_tokens * n_audio_ctx * n_heads);
     ggml_backend_tensor_get(state->aheads_cross_QKs, data.data(), 0, sizeof(float) * n_tokens * n_audio_ctx * n_heads);
+
+    auto & ws = state->dtw_workspace;
+
+    // Normalize over the tokens (in original OpenAI code, this is done over dim=-2), discarding unused
+    // audio tokens, and transpose to a layout that has the audio tokens in rows for the median filter
+    // IN: Tensor with N_ALIGNMENT_HEADS*N_AUDIO_CTX*N_TOKENS dims
+    // OUT: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
+    ws.w.resize(2 * n_heads * n_tokens * n_audio_tokens);
+
+    float * w_norm = ws.w.data();
+    float * w_filt = ws.w.data() + n_heads * n_tokens * n_audio_tokens;
+
     for (int k = 0; k < n_heads; ++k) {
         for (int j = 0; j < n_audio_tokens; ++j) {
-            memcpy(
-                (char *) w->data + j * w->nb[1] + k * w->nb[2],
-                data.data() + j * n_tokens + k * n_tokens * n_audio_ctx,
-                n_tokens * sizeof(float)
-            );
+            const float * src = data.data() + j * n_tokens + k * n_tokens * n_audio_ctx;
+
+            double sum = 0.0;
+            for (int i = 0; i < n_tokens; ++i) {
+                sum += src[i];
+            }
+            const float mean = sum/n_tokens;
+
+            double sum2 = 0.0;
+            for (int i = 0; i < n_tokens; ++i) {
+                sum2 += (double)(src[i] - mean)*(src[i] - mean);
+            }
+            const float scale = 1.0f/sqrtf(sum2/n_tokens + 1e-9f);
+
+            for (int i = 0; i < n_tokens; ++i) {
+                w_norm[(k * n_tokens + i) * n_audio_tokens + j] = (src[i] - mean)*scale;
+            }
         }
     }
 
-    // Normalize - in original OpenAI code, this is done over dim=-2. In this case,
-    // we already permuted N_TOKENS dimension to columns on last loop, becase ggml_norm
-    // operates over columns. Afterwards, permute to a shape that facilitates mean
-    // operation (after median filter)
-    // IN: Tensor with N_TOKENS*N_AUDIO_TOKENS*N_ALIGNMENT_HEADS dims
-    // OUT: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
-    w = ggml_norm(gctx, w, 1e-9f);
-    w = ggml_permute(gctx, ggml_permute(gctx, w, 2, 1, 0 ,3), 0, 2, 1, 3);
-
-    // Pass median filter - this is done over AUDIO_TOKENS dimension.
-    // IN: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
-    // OUT: Same dims
-    median_filter_user_data mf_user_data = {medfilt_width};
-    w = ggml_map_custom1(gctx, w, median_filter, 1, &mf_user_data);
-
-    // Take mean over columns, scale by -1, reshape to 2D tensor, remove SOT sequence and EOT
-    // IN: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
-    // OUT: Tensor with N_TOKENS*N_AUDIO_TOKENS dims
-    w = ggml_mean(gctx, w);
-    w = ggml_scale(gctx, w, -1.0);
-    w = ggml_reshape_2d(gctx, w, w->ne[1], w->ne[2]);
-
-    // Remove SOT sequence and EOT
+    // Pass median filter - this is done over AUDIO_TOKENS dimension, with the rows split across the threads
+    WHISPER_ASSERT(medfilt_width < n_audio_tokens);
+    {
+        const int n_rows = n_heads * n_tokens;
+
+        auto filter = [&](int ith, int nth) {
+            std::vector<float> buf;
+            whisper_dtw_median_filter(w_norm, w_filt, (n_rows*ith)/nth, (n_rows*(ith + 1))/nth, n_audio_tokens, medfilt_width, buf);
+        };
+
+        const int nth = std::max(1, std::min(n_threads, n_rows/8));
+
+        std::vector<std::thread> workers;
+        for (int ith = 1; ith < nth; ++ith) {
+            workers.emplace_back(filter, ith, nth);
+        }
+        filter(0, nth);
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Take mean over heads, scale by -1, remove SOT sequence and EOT and store by anti-diagonal for the DTW
     // Out dimension is (N_TOKENS-sot_sequence_length-1)*N_AUDIO_TOKENS
-    w = ggml_view_2d(gctx, w, w->ne[0] - sot_sequence_length - 1, w->ne[1], w->nb[1], sot_sequence_length * w->nb[0]);
+    const int n_text = n_tokens - sot_sequence_length - 1;
+
+    whisper_dtw_init(ws, n_text, n_audio_tokens, ctx->params.dtw_band);
 
-    // Compute
-    struct ggml_cgraph * gf = ggml_new_graph(gctx);
-    ggml_build_forward_expand(gf, w);
-    ggml_graph_compute_with_ctx(gctx, gf, n_threads);
+    for (int d = 2; d <= n_text + n_audio_tokens; ++d) {
+        for (int i = ws.diag_lo[d]; i <= ws.diag_hi[d]; ++i) {
+            const int it = sot_sequence_length + i - 1;
+            const int ia = d - i - 1;
+
+            float sum = 0.0f;
+            for (int k = 0; k < n_heads; ++k) {
+                sum += w_filt[(k * n_tokens + it) * n_audio_tokens + ia];
+            }
+            ws.x[ws.diag_off[d] + i - ws.diag_lo[d]] = -sum/n_heads;
+        }
+    }
 
-    ggml_tensor * alignment = dtw_and_backtrace(gctx, w);
+    whisper_dtw_and_backtrace(ws, n_text, n_audio_tokens);
 
     // Place timestamps on segments
     int32_t last_v = 0;
     auto seg_i = state->result_all.begin() + i_segment;
     auto tok_i = seg_i->tokens.begin();
-    for (int i = 0; i < alignment->ne[1]; ++i) {
-        int32_t v = ggml_get_i32_nd(alignment, 0, i, 0, 0);
+    for (const auto & p : ws.path) {
+        int32_t v = p.first;
         if (v != last_v) {
-            int32_t time_index = ggml_get_i32_nd(alignment, 1, i, 0, 0);
+            int32_t time_index = p.second;
             int64_t timestamp = (time_index * 2) + seek; // Each index on DTW result = 20mS audio
             last_v = v;
 
@@ -7385,8 +9763,6 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
         }
         fprintf(stderr, "\n");
     }*/
-
-    ggml_free(gctx);
 }
 
 void whisper_log_set(ggml_log_callback log_callback, void * user_data) {
@@ -13,7 +13,12 @@
 #
 # Usage:
 #
-#   ./tests/run-tests.sh <model_name> [threads]
+#   ./tests/run-tests.sh <model_name> [threads] [extra whisper-cli args]
+#
+# The extra arguments can be used to validate the accuracy of non-default configurations against the references,
+# for example a quantized KV cache:
+#
+#   ./tests/run-tests.sh base.en 4 -fa -ctk q8_0 -ctv q8_0
 #
 
 cd `dirname $0`
@@ -32,7 +37,7 @@ function list_models {
 }
 
 if [ $# -eq 0 ]; then
-    printf "Usage: $0 [model] [threads]\n\n"
+    printf "Usage: $0 [model] [threads] [extra args]\n\n"
     printf "No model specified. Aborting\n"
     list_models
     exit 1
@@ -42,10 +47,15 @@ model=$1
 main="../build/bin/whisper-cli"
 
 threads=""
-if [ $# -eq 2 ]; then
+if [ $# -ge 2 ]; then
     threads="-t $2"
 fi
 
+extra=""
+if [ $# -ge 3 ]; then
+    extra="${@:3}"
+fi
+
 if [ ! -f ../models/ggml-$model.bin ]; then
     printf "Model $model not found. Aborting\n"
     list_models
@@ -110,7 +120,7 @@ function run_lang() {
             fi
         fi
 
-        $main -m ../models/ggml-$model.bin $threads -f $fname_dst -l $lang -otxt 2> /dev/null
+        $main -m ../models/ggml-$model.bin $threads $extra -f $fname_dst -l $lang -otxt 2> /dev/null
 
         git diff --no-index --word-diff=color --word-diff-regex=. $lang-$i-ref.txt $fname_dst.txt
 
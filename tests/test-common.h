@@ -0,0 +1,15 @@
+// helpers shared by the unit tests
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+// unlike assert(), also checked in release builds
+#define TEST_ASSERT(x) \
+    do { \
+        if (!(x)) { \
+            fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #x); \
+            exit(1); \
+        } \
+    } while (0)
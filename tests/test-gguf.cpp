@@ -0,0 +1,98 @@
+// whisper_model_save_gguf: the vocab survives a save/load round trip byte for byte, including the byte token 0x00
+
+#include "whisper.h"
+#include "gguf.h"
+#include "test-common.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+static void cb_log_disable(enum ggml_log_level, const char *, void *) { }
+
+static std::vector<char> read_file(const std::string & fname) {
+    std::ifstream fin(fname, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+}
+
+int main(int argc, char ** argv) {
+    const char *      fname_model = argc > 1 ? argv[1] : "models/for-tests-ggml-tiny.bin";
+    const std::string prefix      = argc > 2 ? argv[2] : "test-gguf";
+
+    const std::string fname_a = prefix + ".a.gguf";
+    const std::string fname_b = prefix + ".b.gguf";
+
+    whisper_log_set(cb_log_disable, nullptr);
+
+    whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_extra_bufts = false;
+
+    whisper_context * ctx0 = whisper_init_from_file_with_params_no_state(fname_model, cparams);
+    TEST_ASSERT(ctx0 != nullptr);
+    TEST_ASSERT(whisper_model_save_gguf(ctx0, fname_a.c_str()) == 0);
+
+    const int n_vocab = whisper_n_vocab(ctx0);
+
+    // the tokens are stored with explicit lengths
+    {
+        gguf_init_params gparams = { /*.no_alloc =*/ true, /*.ctx =*/ nullptr };
+
+        gguf_context * ctx_gguf = gguf_init_from_file(fname_a.c_str(), gparams);
+        TEST_ASSERT(ctx_gguf != nullptr);
+
+        const int64_t id_bytes   = gguf_find_key(ctx_gguf, "whisper.vocab.bytes");
+        const int64_t id_lengths = gguf_find_key(ctx_gguf, "whisper.vocab.lengths");
+        TEST_ASSERT(id_bytes >= 0 && id_lengths >= 0);
+        TEST_ASSERT((int) gguf_get_arr_n(ctx_gguf, id_lengths) == n_vocab);
+
+        const char     * bytes   = (const char *)     gguf_get_arr_data(ctx_gguf, id_bytes);
+        const uint32_t * lengths = (const uint32_t *) gguf_get_arr_data(ctx_gguf, id_lengths);
+
+        int    n_zero = 0;
+        size_t offset = 0;
+        for (int i = 0; i < n_vocab; ++i) {
+            const std::string word(bytes + offset, lengths[i]);
+            offset += lengths[i];
+
+            if (word == std::string(1, '\0')) {
+                n_zero++;
+            } else {
+                TEST_ASSERT(word == whisper_token_to_str(ctx0, i));
+            }
+        }
+
+        TEST_ASSERT(offset == gguf_get_arr_n(ctx_gguf, id_bytes));
+        TEST_ASSERT(n_zero == 1);
+
+        gguf_free(ctx_gguf);
+    }
+
+    // loading the file and saving it again gives the same file
+    {
+        whisper_context * ctx1 = whisper_init_from_file_with_params_no_state(fname_a.c_str(), cparams);
+        TEST_ASSERT(ctx1 != nullptr);
+        TEST_ASSERT(whisper_n_vocab(ctx1) == n_vocab);
+
+        for (int i = 0; i < n_vocab; ++i) {
+            TEST_ASSERT(strcmp(whisper_token_to_str(ctx0, i), whisper_token_to_str(ctx1, i)) == 0);
+        }
+
+        TEST_ASSERT(whisper_model_save_gguf(ctx1, fname_b.c_str()) == 0);
+        TEST_ASSERT(read_file(fname_a) == read_file(fname_b));
+
+        whisper_free(ctx1);
+    }
+
+    whisper_free(ctx0);
+
+    remove(fname_a.c_str());
+    remove(fname_b.c_str());
+
+    printf("OK\n");
+
+    return 0;
+}
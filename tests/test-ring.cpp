@@ -0,0 +1,112 @@
+// audio_ring (examples/common-ring.h): wraparound, reads with a stale cursor and overrun detection
+
+#include "common-ring.h"
+#include "test-common.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// write the samples [pos, pos + n) with value == absolute position
+static void write_seq(audio_ring & ring, uint64_t pos, size_t n) {
+    std::vector<float> samples(n);
+    for (size_t i = 0; i < n; ++i) {
+        samples[i] = (float) (pos + i);
+    }
+    ring.write(samples.data(), samples.size());
+}
+
+static void check_seq(const audio_ring::view & v, uint64_t pos, size_t n) {
+    TEST_ASSERT(v.pos == pos);
+    TEST_ASSERT(v.size() == n);
+
+    std::vector<float> dst;
+    v.copy_to(dst);
+
+    for (size_t i = 0; i < n; ++i) {
+        TEST_ASSERT(v[i]   == (float) (pos + i));
+        TEST_ASSERT(dst[i] == (float) (pos + i));
+    }
+}
+
+static void test_wraparound() {
+    audio_ring ring(8);
+
+    write_seq(ring, 0, 5);
+    check_seq(ring.read_since(0), 0, 5);
+
+    // 6 more samples wrap around the end of the buffer - only the newest 8 are kept
+    write_seq(ring, 5, 6);
+    TEST_ASSERT(ring.head() == 11);
+
+    const auto v = ring.read_since(3);
+    check_seq(v, 3, 8);
+    TEST_ASSERT(v.n0 == 5 && v.n1 == 3);
+
+    check_seq(ring.read_last(4), 7, 4);
+    check_seq(ring.read(4, 6), 4, 2);
+
+    // a single write larger than the buffer keeps its last samples
+    write_seq(ring, 11, 20);
+    TEST_ASSERT(ring.head() == 31);
+    check_seq(ring.read_since(0), 23, 8);
+}
+
+static void test_stale_cursor() {
+    audio_ring ring(8);
+
+    write_seq(ring, 0, 4);
+
+    uint64_t cursor = 0;
+    {
+        const auto v = ring.read_since(cursor);
+        check_seq(v, 0, 4);
+        cursor = v.end();
+    }
+
+    // nothing new
+    TEST_ASSERT(ring.read_since(cursor).size() == 0);
+
+    // the producer laps the consumer - the read starts at the oldest sample still in the buffer
+    write_seq(ring, 4, 12);
+    {
+        const auto v = ring.read_since(cursor);
+        check_seq(v, 8, 8);
+        TEST_ASSERT(v.pos > cursor);
+        cursor = v.end();
+    }
+
+    TEST_ASSERT(cursor == ring.head());
+}
+
+static void test_overrun() {
+    audio_ring ring(8);
+
+    write_seq(ring, 0, 8);
+
+    const auto v = ring.read_since(0);
+    check_seq(v, 0, 8);
+    TEST_ASSERT(!ring.overrun(v));
+
+    // each new sample overwrites the oldest sample of the view
+    write_seq(ring, 8, 3);
+    TEST_ASSERT(ring.overrun(v));
+    TEST_ASSERT(ring.n_overrun(v) == 3);
+
+    // a view that starts after the overwritten samples is intact
+    const auto w = ring.read_since(5);
+    check_seq(w, 5, 6);
+    TEST_ASSERT(!ring.overrun(w));
+
+    write_seq(ring, 11, 20);
+    TEST_ASSERT(ring.n_overrun(v) == v.size());
+    TEST_ASSERT(ring.n_overrun(w) == w.size());
+}
+
+int main() {
+    test_wraparound();
+    test_stale_cursor();
+    test_overrun();
+
+    return 0;
+}
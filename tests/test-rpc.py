@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+#
+# Test for whisper contexts created with rpc_servers (whisper-cli --rpc)
+#
+# Starts a whisper-rpc-server on the loopback interface and transcribes a WAV file through it. The
+# server list is passed with spaces and empty entries - they must be skipped, so that both processors
+# get a replica on the same server and run on it concurrently. A list with only separators must keep the
+# model local. An unreachable server must fail the context initialization.
+#
+# usage:
+#
+#   python3 tests/test-rpc.py ./build/bin/whisper-rpc-server ./build/bin/whisper-cli models/for-tests-ggml-tiny.bin samples/jfk.wav
+#
+
+import socket
+import subprocess
+import sys
+import time
+
+
+def free_port():
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def check(cond, msg):
+    if not cond:
+        print("FAIL: %s" % msg, file=sys.stderr)
+        sys.exit(1)
+
+
+def transcribe(cli, model, audio, rpc):
+    args = [cli, "-m", model, "-f", audio, "-l", "en", "-t", "1", "-p", "2", "-nt"]
+    if rpc is not None:
+        args += ["--rpc", rpc]
+    res = subprocess.run(args, stdout=subprocess.PIPE, stderr=subprocess.PIPE, timeout=300)
+    return res.returncode, res.stdout.decode("utf-8", "replace"), res.stderr.decode("utf-8", "replace")
+
+
+def main():
+    if len(sys.argv) != 5:
+        print("usage: %s whisper-rpc-server whisper-cli model.bin audio.wav" % sys.argv[0], file=sys.stderr)
+        return 1
+
+    server, cli, model, audio = sys.argv[1:]
+
+    rc, ref, err = transcribe(cli, model, audio, None)
+    check(rc == 0, "local run failed:\n%s" % err)
+
+    port = free_port()
+
+    proc = subprocess.Popen([server, "-H", "127.0.0.1", "-p", str(port), "-t", "1"],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        t_start = time.time()
+        while True:
+            check(proc.poll() is None, "server exited during startup")
+            check(time.time() - t_start < 60, "server did not start")
+            try:
+                socket.create_connection(("127.0.0.1", port), timeout=1).close()
+                break
+            except OSError:
+                time.sleep(0.1)
+
+        endpoint = "127.0.0.1:%d" % port
+
+        rc, out, err = transcribe(cli, model, audio, " %s, ,%s ," % (endpoint, endpoint))
+        check(rc == 0, "rpc run failed:\n%s" % err)
+        check(err.count("using RPC server " + endpoint) >= 2, "the states do not use the server:\n%s" % err)
+
+        # only separators - no servers, the model stays local
+        rc, out, err = transcribe(cli, model, audio, " , ,")
+        check(rc == 0, "empty list failed:\n%s" % err)
+        check("using RPC server" not in err, "a state uses an RPC server:\n%s" % err)
+        check(out == ref, "empty list transcript differs:\n%s\nvs local:\n%s" % (out, ref))
+
+        check(proc.poll() is None, "server exited")
+    finally:
+        proc.terminate()
+        proc.wait()
+
+    # nothing listens on the port anymore
+    rc, out, err = transcribe(cli, model, audio, endpoint)
+    check(rc != 0, "unreachable server did not fail")
+
+    print("OK")
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
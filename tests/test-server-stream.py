@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+#
+# Test for the whisper-server /stream endpoints
+#
+# Starts the server, opens a session and sends a WAV file to it in chunks. It covers:
+#
+#   - the /stream session protocol: open, chunks with tentative results, /end with the final result
+#     and the total audio duration, and the error for a closed session
+#   - the model reference held by each session: halfway through, the default model is replaced with
+#     /load - the open session must keep working on the model it was opened with, and the replaced
+#     model must be released once the session is closed
+#
+# usage:
+#
+#   python3 tests/test-server-stream.py ./build/bin/whisper-server models/for-tests-ggml-tiny.bin samples/jfk.wav
+#
+
+import json
+import socket
+import subprocess
+import sys
+import time
+import urllib.request
+import uuid
+import wave
+
+
+def post(url, data=None, headers=None):
+    req = urllib.request.Request(url, data=data, headers=headers or {}, method="POST")
+    with urllib.request.urlopen(req) as res:
+        body = res.read().decode("utf-8")
+        try:
+            return json.loads(body)
+        except ValueError:
+            return body
+
+
+def post_form(url, fields):
+    boundary = uuid.uuid4().hex
+    body = b""
+    for name, value in fields.items():
+        body += ("--%s\r\nContent-Disposition: form-data; name=\"%s\"\r\n\r\n%s\r\n" % (boundary, name, value)).encode("utf-8")
+    body += ("--%s--\r\n" % boundary).encode("utf-8")
+    return post(url, body, {"Content-Type": "multipart/form-data; boundary=" + boundary})
+
+
+def get(url):
+    with urllib.request.urlopen(url) as res:
+        return json.loads(res.read().decode("utf-8"))
+
+
+def free_port():
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def check(cond, msg):
+    if not cond:
+        print("FAIL: %s" % msg, file=sys.stderr)
+        sys.exit(1)
+
+
+def main():
+    if len(sys.argv) != 4:
+        print("usage: %s whisper-server model.bin audio.wav" % sys.argv[0], file=sys.stderr)
+        return 1
+
+    server, model, audio = sys.argv[1:]
+
+    with wave.open(audio, "rb") as w:
+        pcm = w.readframes(w.getnframes())
+
+    port = free_port()
+    url  = "http://127.0.0.1:%d" % port
+
+    proc = subprocess.Popen([server, "-m", model, "--port", str(port), "-t", "2"],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        t_start = time.time()
+        while True:
+            check(proc.poll() is None, "server exited during startup")
+            check(time.time() - t_start < 60, "server did not start")
+            try:
+                get(url + "/models")
+                break
+            except OSError:
+                time.sleep(0.1)
+
+        res = post(url + "/stream")
+        check("session" in res, "no session id in %s" % res)
+        session = res["session"]
+
+        chunk_bytes = 2*16000
+        n_chunks = 0
+        for i in range(0, len(pcm), chunk_bytes):
+            res = post(url + "/stream/" + session, pcm[i:i + chunk_bytes], {"Content-Type": "application/octet-stream"})
+            check("error" not in res, "chunk %d: %s" % (n_chunks, res))
+            check(res["final"] is False, "chunk %d is final" % n_chunks)
+            n_chunks += 1
+
+            # replace the model under the open session
+            if n_chunks == 2:
+                res = post_form(url + "/load", {"model": model})
+                check(res == "Load was successful!", "load: %s" % res)
+
+        res = post(url + "/stream/" + session + "/end")
+        check("error" not in res, "end: %s" % res)
+        check(res["final"] is True, "end is not final")
+        check(res["audio_ms"] == 1e3*(len(pcm)//2)/16000, "audio_ms = %s" % res["audio_ms"])
+
+        # the session is closed
+        res = post(url + "/stream/" + session, b"\0\0", {"Content-Type": "application/octet-stream"})
+        check(res.get("error") == "unknown stream session", "closed session: %s" % res)
+
+        # the replaced model is released once the session is closed
+        res = get(url + "/models")
+        check(len(res["models"]) == 1, "models: %s" % res)
+        check(res["models"][0]["in_use"] == 0, "model still in use: %s" % res)
+
+        check(proc.poll() is None, "server exited")
+    finally:
+        proc.terminate()
+        proc.wait()
+
+    print("OK: %d chunks" % n_chunks)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
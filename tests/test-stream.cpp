@@ -0,0 +1,63 @@
+// whisper_stream: the audio left at the end of the input is transcribed by whisper_stream_flush(),
+// also when it is too short for a regular pass
+
+#include "whisper.h"
+#include "test-common.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static void cb_log_disable(enum ggml_log_level, const char *, void *) { }
+
+int main(int argc, char ** argv) {
+    const char * fname_model = argc > 1 ? argv[1] : "models/for-tests-ggml-tiny.bin";
+
+    whisper_log_set(cb_log_disable, nullptr);
+
+    whisper_context * ctx = whisper_init_from_file_with_params_no_state(fname_model, whisper_context_default_params());
+    TEST_ASSERT(ctx != nullptr);
+
+    whisper_state * state = whisper_init_state(ctx);
+    TEST_ASSERT(state != nullptr);
+
+    whisper_full_params fparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    fparams.n_threads      = 1;
+    fparams.print_progress = false;
+
+    whisper_stream * stream = whisper_stream_init_with_state(ctx, state, whisper_stream_default_params(), fparams);
+    TEST_ASSERT(stream != nullptr);
+
+    // 0.5 s of audio - less than the minimum buffer of a pass
+    std::vector<float> pcm(WHISPER_SAMPLE_RATE/2);
+    for (size_t i = 0; i < pcm.size(); ++i) {
+        pcm[i] = 0.1f*sinf(2.0f*3.14159265f*220.0f*i/WHISPER_SAMPLE_RATE);
+    }
+
+    whisper_stream_push(stream, pcm.data(), pcm.size());
+
+    TEST_ASSERT(whisper_stream_process(stream) == 0);
+    TEST_ASSERT(whisper_n_len_from_state(state) == 0);
+
+    // the remainder is transcribed, padded to the minimum length, and nothing is left tentative
+    TEST_ASSERT(whisper_stream_flush(stream) >= 0);
+    TEST_ASSERT(whisper_n_len_from_state(state) > 0);
+    TEST_ASSERT(whisper_stream_n_tentative(stream) == 0);
+
+    // no token can start in the padding
+    for (int i = 0; i < whisper_stream_n_committed(stream); ++i) {
+        TEST_ASSERT(whisper_stream_get_committed(stream, i).t0 < 50);
+    }
+
+    // the stream continues after the flushed audio
+    const int n_committed = whisper_stream_n_committed(stream);
+    TEST_ASSERT(whisper_stream_flush(stream) == 0);
+    TEST_ASSERT(whisper_stream_n_committed(stream) == n_committed);
+
+    whisper_stream_free(stream);
+    whisper_free_state(state);
+    whisper_free(ctx);
+
+    return 0;
+}